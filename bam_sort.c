@@ -0,0 +1,514 @@
+/*  bam_sort.c -- external-memory sorting and merging of alignment files.
+
+    Copyright (C) 2026 The htslib contributors.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "htslib/bam_sort.h"
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+#include "htslib/ksort.h"
+#include "cram/thread_pool.h"
+
+typedef struct {
+    uint64_t key;   // (uint32_t)tid<<32 | (pos+1), for coordinate order
+    bam1_t *b;
+} sort_ent_t;
+
+static inline uint64_t coord_key(const bam1_t *b)
+{
+    return (uint64_t)(uint32_t)b->core.tid << 32 | (uint32_t)(b->core.pos + 1);
+}
+
+// Compare read names, treating runs of digits as numbers
+static int strnum_cmp(const char *_a, const char *_b)
+{
+    const unsigned char *a = (const unsigned char*)_a, *b = (const unsigned char*)_b;
+    while (*a && *b) {
+        if (isdigit(*a) && isdigit(*b)) {
+            const unsigned char *sa, *sb;
+            int c;
+            while (*a == '0') ++a;
+            while (*b == '0') ++b;
+            for (sa = a; isdigit(*a); ++a);
+            for (sb = b; isdigit(*b); ++b);
+            if (a - sa != b - sb) return a - sa < b - sb ? -1 : 1;
+            if ((c = memcmp(sa, sb, a - sa)) != 0) return c;
+        } else {
+            if (*a != *b) return (int)*a - (int)*b;
+            ++a; ++b;
+        }
+    }
+    return *a ? 1 : *b ? -1 : 0;
+}
+
+static inline int name_cmp(const bam1_t *a, const bam1_t *b)
+{
+    int c = strnum_cmp(bam_get_qname(a), bam_get_qname(b));
+    if (c) return c;
+    return (int)(a->core.flag & (BAM_FREAD1|BAM_FREAD2)) - (int)(b->core.flag & (BAM_FREAD1|BAM_FREAD2));
+}
+
+#define ent_name_lt(x, y) (name_cmp((x).b, (y).b) < 0)
+KSORT_INIT_STATIC(bam_sort_name, sort_ent_t, ent_name_lt)
+
+// Merge heap entries; ksort's heap keeps the "largest" on top, so these
+// compare in reverse to give a min-heap, with ties going to the lower run
+typedef struct {
+    int run;
+    uint64_t key;
+    bam1_t *b;
+} heap1_t;
+
+#define heap_coord_lt(x, y) ((x).key > (y).key || ((x).key == (y).key && (x).run > (y).run))
+KSORT_INIT_STATIC(bam_sort_heap_coord, heap1_t, heap_coord_lt)
+
+static inline int heap_name_gt(const heap1_t *a, const heap1_t *b)
+{
+    int c = name_cmp(a->b, b->b);
+    return c > 0 || (c == 0 && a->run > b->run);
+}
+#define heap_name_lt(x, y) heap_name_gt(&(x), &(y))
+KSORT_INIT_STATIC(bam_sort_heap_name, heap1_t, heap_name_lt)
+
+// Stable LSD radix sort on the 64-bit key, a byte at a time, skipping the
+// bytes (typically the high tid bytes) that are the same in every key
+static void radix_sort(sort_ent_t *a, sort_ent_t *tmp, size_t n)
+{
+    size_t hist[8][256], i;
+    sort_ent_t *src = a, *dst = tmp, *t;
+    int d;
+    if (n < 2) return;
+    memset(hist, 0, sizeof hist);
+    for (i = 0; i < n; ++i) {
+        uint64_t k = a[i].key;
+        for (d = 0; d < 8; ++d) hist[d][(k >> (d*8)) & 0xff]++;
+    }
+    for (d = 0; d < 8; ++d) {
+        size_t off = 0, c, *h = hist[d];
+        if (h[(a[0].key >> (d*8)) & 0xff] == n) continue;
+        for (i = 0; i < 256; ++i) c = h[i], h[i] = off, off += c;
+        for (i = 0; i < n; ++i) dst[h[(src[i].key >> (d*8)) & 0xff]++] = src[i];
+        t = src; src = dst; dst = t;
+    }
+    if (src != a) memcpy(a, src, n * sizeof(sort_ent_t));
+}
+
+struct _bam_sort_t {
+    bam_sort_opts_t opts;
+    char *out_fn, *prefix;
+    bam_hdr_t *hdr;
+    // buffered records; the bam1_t structures are reused between batches
+    bam1_t **buf;
+    sort_ent_t *ent, *tmp;
+    size_t n, m, n_alloc, mem;
+    // sorted runs spilled to temporary files
+    int n_runs, m_runs;
+    char **run_fn;
+    t_pool *pool;
+    t_results_queue *q;
+    int error;
+};
+
+typedef struct {
+    bam_sort_t *s;
+    sort_ent_t *ent, *tmp;
+    size_t n;
+    const char *fn;     // temporary file to write, or NULL to sort only
+    int ret;
+} sort_job_t;
+
+static void *sort_job(void *arg)
+{
+    sort_job_t *job = (sort_job_t*)arg;
+    size_t i;
+    BGZF *fp;
+
+    if (job->s->opts.order == BAM_SORT_COORD) radix_sort(job->ent, job->tmp, job->n);
+    else ks_mergesort(bam_sort_name, job->n, job->ent, job->tmp);
+    job->ret = 0;
+    if (!job->fn) return job;
+
+    if ((fp = bgzf_open(job->fn, "w1")) == NULL) {
+        fprintf(stderr, "[bam_sort] failed to create temporary file \"%s\"\n", job->fn);
+        job->ret = -1;
+        return job;
+    }
+    if (bam_hdr_write(fp, job->s->hdr) < 0) job->ret = -1;
+    for (i = 0; i < job->n && job->ret == 0; ++i)
+        if (bam_write1(fp, job->ent[i].b) < 0) job->ret = -1;
+    if (bgzf_close(fp) < 0) job->ret = -1;
+    return job;
+}
+
+void bam_sort_opts_init(bam_sort_opts_t *opts)
+{
+    memset(opts, 0, sizeof(bam_sort_opts_t));
+    opts->order = BAM_SORT_COORD;
+    opts->max_mem = 768 << 20;
+    opts->n_threads = 1;
+    opts->level = -1;
+}
+
+// Set (or add) the SO tag of the @HD line
+static int hdr_set_sort_order(bam_hdr_t *h, int order)
+{
+    const char *so = order == BAM_SORT_NAME ? "queryname" : "coordinate";
+    kstring_t str = { 0, 0, NULL };
+    const char *text = h->text, *end = h->text + h->l_text, *rest = text;
+
+    if (h->l_text >= 3 && strncmp(text, "@HD", 3) == 0) {
+        const char *eol = memchr(text, '\n', h->l_text), *p, *q;
+        if (!eol) eol = end;
+        kputsn("@HD", 3, &str);
+        for (p = text + 3; p < eol; p = q) {
+            for (q = p + 1; q < eol && *q != '\t'; ++q);
+            if (!(q - p >= 4 && strncmp(p, "\tSO:", 4) == 0)) kputsn(p, q - p, &str);
+        }
+        rest = eol < end ? eol + 1 : end;
+    } else kputs("@HD\tVN:1.4", &str);
+    kputs("\tSO:", &str); kputs(so, &str); kputc('\n', &str);
+    kputsn(rest, end - rest, &str);
+    if (!str.s) return -1;
+    free(h->text);
+    h->l_text = str.l;
+    h->text = ks_release(&str);
+    return 0;
+}
+
+bam_sort_t *bam_sort_init(const bam_hdr_t *h, const char *out_fn, const bam_sort_opts_t *opts)
+{
+    bam_sort_t *s = (bam_sort_t*)calloc(1, sizeof(bam_sort_t));
+    if (!s) return NULL;
+    if (opts) s->opts = *opts;
+    else bam_sort_opts_init(&s->opts);
+    if (s->opts.max_mem == 0) s->opts.max_mem = 768 << 20;
+    if (s->opts.n_threads < 1) s->opts.n_threads = 1;
+    s->opts.tmp_prefix = NULL; // copied into s->prefix
+    s->out_fn = strdup(out_fn);
+    s->prefix = strdup(opts && opts->tmp_prefix ? opts->tmp_prefix : out_fn);
+    s->hdr = bam_hdr_dup(h);
+    if (!s->out_fn || !s->prefix || !s->hdr || hdr_set_sort_order(s->hdr, s->opts.order) < 0) goto fail;
+    if (s->opts.n_threads > 1) {
+        if ((s->pool = t_pool_init(s->opts.n_threads * 2, s->opts.n_threads)) == NULL) goto fail;
+        if ((s->q = t_results_queue_init()) == NULL) goto fail;
+    }
+    return s;
+
+fail:
+    bam_sort_destroy(s);
+    return NULL;
+}
+
+// Sort the buffer as n_threads chunks, writing each to a temporary file if
+// spill is set.  On success *n_chunks chunks begin at ent[beg[k]].
+static int sort_buffer(bam_sort_t *s, int spill, size_t *beg, int *n_chunks)
+{
+    int k, nc = s->n < (size_t)s->opts.n_threads ? (int)s->n : s->opts.n_threads, ret = 0;
+    int n_dispatched = 0;
+    sort_job_t *jobs;
+    size_t i;
+
+    if (nc < 1) nc = 1;
+    if ((jobs = (sort_job_t*)calloc(nc, sizeof(sort_job_t))) == NULL) return -1;
+    if (spill && s->n_runs + nc > s->m_runs) {
+        char **tmp;
+        s->m_runs = s->n_runs + nc;
+        kroundup32(s->m_runs);
+        if ((tmp = (char**)realloc(s->run_fn, s->m_runs * sizeof(char*))) == NULL) { free(jobs); return -1; }
+        s->run_fn = tmp;
+    }
+    for (i = 0; i < s->n; ++i) {
+        s->ent[i].b = s->buf[i];
+        s->ent[i].key = coord_key(s->buf[i]);
+    }
+    for (k = 0; k < nc; ++k) {
+        size_t b = s->n * k / nc, e = s->n * (k + 1) / nc;
+        beg[k] = b;
+        jobs[k].s = s; jobs[k].ent = s->ent + b; jobs[k].tmp = s->tmp + b; jobs[k].n = e - b;
+        if (spill) {
+            kstring_t fn = { 0, 0, NULL };
+            ksprintf(&fn, "%s.%04d.bam", s->prefix, s->n_runs);
+            s->run_fn[s->n_runs++] = fn.s;
+            jobs[k].fn = fn.s;
+        }
+        if (s->pool) {
+            if (t_pool_dispatch(s->pool, s->q, sort_job, &jobs[k]) < 0) { jobs[k].ret = -1; ret = -1; }
+            else n_dispatched++;
+        } else sort_job(&jobs[k]);
+    }
+    // Collect every job dispatched, even after a failure, as they use jobs[];
+    // their ret fields are only safe to read once all are back
+    for (k = 0; k < n_dispatched; ++k) {
+        t_pool_result *r = t_pool_next_result_wait(s->q);
+        if (r) t_pool_delete_result(r, 0);
+    }
+    for (k = 0; k < nc; ++k)
+        if (jobs[k].ret < 0) ret = -1;
+    *n_chunks = nc;
+    free(jobs);
+    return ret;
+}
+
+int bam_sort_push(bam_sort_t *s, const bam1_t *b)
+{
+    if (s->error) return -1;
+    if (s->n == s->m) {
+        size_t m = s->m ? s->m * 2 : 65536;
+        bam1_t **buf = (bam1_t**)realloc(s->buf, m * sizeof(bam1_t*));
+        sort_ent_t *ent, *tmp;
+        if (!buf) goto error;
+        s->buf = buf;
+        if ((ent = (sort_ent_t*)realloc(s->ent, m * sizeof(sort_ent_t))) == NULL) goto error;
+        s->ent = ent;
+        if ((tmp = (sort_ent_t*)realloc(s->tmp, m * sizeof(sort_ent_t))) == NULL) goto error;
+        s->tmp = tmp;
+        s->m = m;
+    }
+    if (s->n == s->n_alloc) {
+        if ((s->buf[s->n] = bam_init1()) == NULL) goto error;
+        s->n_alloc++;
+    }
+    if (bam_copy1(s->buf[s->n], b) == NULL) goto error;
+    s->n++;
+
+    // Count the record itself, its structure and its two sort_ent_t slots
+    s->mem += b->l_data + sizeof(bam1_t) + 2*sizeof(sort_ent_t);
+    if (s->mem >= s->opts.max_mem) {
+        size_t *beg = (size_t*)malloc(s->opts.n_threads * sizeof(size_t));
+        int nc;
+        if (!beg || sort_buffer(s, 1, beg, &nc) < 0) { free(beg); goto error; }
+        free(beg);
+        s->n = 0;
+        s->mem = 0;
+    }
+    return 0;
+
+error:
+    s->error = 1;
+    return -1;
+}
+
+typedef struct {
+    samFile *fp;        // file run ...
+    bam_hdr_t *h;
+    sort_ent_t *ent;    // ... or memory run
+    size_t i, n;
+    bam1_t *b;          // the run's current record
+} run_t;
+
+static int run_next(run_t *r)
+{
+    if (r->fp) {
+        int ret = sam_read1(r->fp, r->h, r->b);
+        return ret >= 0 ? 1 : ret == -1 ? 0 : -1;
+    }
+    if (r->i == r->n) return 0;
+    r->b = r->ent[r->i++].b;
+    return 1;
+}
+
+static int merge_runs(int order, run_t *runs, int n, const bam_hdr_t *h, const char *out_fn, const bam_sort_opts_t *opts)
+{
+    heap1_t *heap;
+    size_t n_heap = 0;
+    char mode[8] = "w";
+    BGZF *out;
+    int i, ret = 0, r;
+
+    if ((heap = (heap1_t*)calloc(n, sizeof(heap1_t))) == NULL) return -1;
+    if (opts->level >= 0) sprintf(mode, "w%d", opts->level > 9 ? 9 : opts->level);
+    if ((out = bgzf_open(out_fn, mode)) == NULL) {
+        fprintf(stderr, "[bam_sort] failed to create \"%s\"\n", out_fn);
+        free(heap);
+        return -1;
+    }
+    if (opts->n_threads > 1) bgzf_mt(out, opts->n_threads, 256);
+    if (bam_hdr_write(out, h) < 0) ret = -1;
+
+    for (i = 0; i < n && ret == 0; ++i) {
+        if ((r = run_next(&runs[i])) < 0) ret = -1;
+        else if (r) {
+            heap[n_heap].run = i;
+            heap[n_heap].b = runs[i].b;
+            heap[n_heap].key = coord_key(runs[i].b);
+            n_heap++;
+        }
+    }
+    if (order == BAM_SORT_COORD) ks_heapmake(bam_sort_heap_coord, n_heap, heap);
+    else ks_heapmake(bam_sort_heap_name, n_heap, heap);
+
+    while (n_heap && ret == 0) {
+        run_t *top = &runs[heap[0].run];
+        if (bam_write1(out, heap[0].b) < 0) { ret = -1; break; }
+        if ((r = run_next(top)) < 0) { ret = -1; break; }
+        if (r) {
+            heap[0].b = top->b;
+            heap[0].key = coord_key(top->b);
+        } else heap[0] = heap[--n_heap];
+        if (order == BAM_SORT_COORD) ks_heapadjust(bam_sort_heap_coord, 0, n_heap, heap);
+        else ks_heapadjust(bam_sort_heap_name, 0, n_heap, heap);
+    }
+    if (bgzf_close(out) < 0) ret = -1;
+    free(heap);
+    return ret;
+}
+
+static void close_runs(run_t *runs, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (!runs[i].fp) continue;
+        bam_destroy1(runs[i].b);
+        bam_hdr_destroy(runs[i].h);
+        sam_close(runs[i].fp);
+    }
+    free(runs);
+}
+
+// Open the files as runs 0..n-1 of a merge
+static run_t *open_runs(int n, char **fns, int n_extra)
+{
+    run_t *runs = (run_t*)calloc(n + n_extra, sizeof(run_t));
+    int i;
+    if (!runs) return NULL;
+    for (i = 0; i < n; ++i) {
+        if ((runs[i].fp = sam_open(fns[i], "r")) == NULL
+            || (runs[i].h = sam_hdr_read(runs[i].fp)) == NULL
+            || (runs[i].b = bam_init1()) == NULL) {
+            fprintf(stderr, "[bam_sort] failed to read \"%s\"\n", fns[i]);
+            if (runs[i].h) bam_hdr_destroy(runs[i].h);
+            if (runs[i].fp) sam_close(runs[i].fp);
+            runs[i].fp = NULL;
+            close_runs(runs, i);
+            return NULL;
+        }
+    }
+    return runs;
+}
+
+int bam_sort_finish(bam_sort_t *s)
+{
+    size_t *beg;
+    int nc, k, ret;
+    run_t *runs;
+
+    if (s->error) return -1;
+    if ((beg = (size_t*)malloc(s->opts.n_threads * sizeof(size_t))) == NULL) goto error;
+    if (sort_buffer(s, 0, beg, &nc) < 0) { free(beg); goto error; }
+    if ((runs = open_runs(s->n_runs, s->run_fn, nc)) == NULL) { free(beg); goto error; }
+    for (k = 0; k < nc; ++k) {
+        runs[s->n_runs + k].ent = s->ent + beg[k];
+        runs[s->n_runs + k].n = (k + 1 < nc ? beg[k+1] : s->n) - beg[k];
+    }
+    free(beg);
+    ret = merge_runs(s->opts.order, runs, s->n_runs + nc, s->hdr, s->out_fn, &s->opts);
+    close_runs(runs, s->n_runs);
+    s->n = 0;
+    if (ret < 0) goto error;
+    return 0;
+
+error:
+    s->error = 1;
+    return -1;
+}
+
+void bam_sort_destroy(bam_sort_t *s)
+{
+    size_t i;
+    int k;
+    if (!s) return;
+    if (s->pool) {
+        t_pool_flush(s->pool);
+        t_pool_destroy(s->pool, 0);
+    }
+    if (s->q) t_results_queue_destroy(s->q);
+    for (k = 0; k < s->n_runs; ++k) {
+        unlink(s->run_fn[k]);
+        free(s->run_fn[k]);
+    }
+    free(s->run_fn);
+    for (i = 0; i < s->n_alloc; ++i) bam_destroy1(s->buf[i]);
+    free(s->buf); free(s->ent); free(s->tmp);
+    if (s->hdr) bam_hdr_destroy(s->hdr);
+    free(s->out_fn); free(s->prefix);
+    free(s);
+}
+
+int bam_sort_file(const char *in_fn, const char *out_fn, const bam_sort_opts_t *opts)
+{
+    samFile *in;
+    bam_hdr_t *h;
+    bam1_t *b;
+    bam_sort_t *s;
+    int ret = 0, r = -1;
+
+    if ((in = sam_open(in_fn, "r")) == NULL) return -1;
+    if ((h = sam_hdr_read(in)) == NULL) { sam_close(in); return -1; }
+    b = bam_init1();
+    s = bam_sort_init(h, out_fn, opts);
+    if (!b || !s) ret = -1;
+    while (ret == 0 && (r = sam_read1(in, h, b)) >= 0)
+        if (bam_sort_push(s, b) < 0) ret = -1;
+    if (ret == 0 && r < -1) ret = -1;
+    if (ret == 0) ret = bam_sort_finish(s);
+    bam_sort_destroy(s);
+    if (b) bam_destroy1(b);
+    bam_hdr_destroy(h);
+    sam_close(in);
+    return ret;
+}
+
+// Whether the tids of a and b name the same references
+static int same_refs(const bam_hdr_t *a, const bam_hdr_t *b)
+{
+    int i;
+    if (a->n_targets != b->n_targets) return 0;
+    for (i = 0; i < a->n_targets; ++i)
+        if (a->target_len[i] != b->target_len[i] || strcmp(a->target_name[i], b->target_name[i]) != 0)
+            return 0;
+    return 1;
+}
+
+int bam_merge_files(int n, const char **fns, const char *out_fn, const bam_sort_opts_t *opts)
+{
+    bam_sort_opts_t def;
+    bam_hdr_t *h = NULL;
+    run_t *runs;
+    int i, ret;
+
+    if (!opts) { bam_sort_opts_init(&def); opts = &def; }
+    if (n < 1 || (runs = open_runs(n, (char**)fns, 0)) == NULL) return -1;
+    for (i = 1; i < n; ++i)
+        if (!same_refs(runs[0].h, runs[i].h)) {
+            fprintf(stderr, "[bam_merge] \"%s\" and \"%s\" have different reference lists\n", fns[0], fns[i]);
+            close_runs(runs, n);
+            return -1;
+        }
+    if ((h = bam_hdr_dup(runs[0].h)) == NULL || hdr_set_sort_order(h, opts->order) < 0) ret = -1;
+    else ret = merge_runs(opts->order, runs, n, h, out_fn, opts);
+    if (h) bam_hdr_destroy(h);
+    close_runs(runs, n);
+    return ret;
+}
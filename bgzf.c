@@ -38,6 +38,9 @@
 #include "htslib/hts.h"
 #include "htslib/bgzf.h"
 #include "htslib/hfile.h"
+#ifdef BGZF_MT
+#include "cram/thread_pool.h"
+#endif
 
 #define BLOCK_HEADER_LENGTH 18
 #define BLOCK_FOOTER_LENGTH 8
@@ -64,9 +67,15 @@ typedef struct {
     int size;
     uint8_t *block;
     int64_t end_offset;
+    uint64_t last_use;  // the cache's clock when last loaded, for LRU eviction
 } cache_t;
 #include "htslib/khash.h"
 KHASH_MAP_INIT_INT64(cache, cache_t)
+
+typedef struct {
+    khash_t(cache) *h;
+    uint64_t clock;
+} bgzf_cache_t;
 #endif
 
 typedef struct
@@ -122,7 +131,8 @@ static BGZF *bgzf_read_init(hFILE *hfpr)
     fp->is_compressed = (n==18 && magic[0]==0x1f && magic[1]==0x8b) ? 1 : 0;
     fp->is_gzip = ( !fp->is_compressed || ((magic[3]&4) && memcmp(&magic[12], "BC\2\0",4)==0) ) ? 0 : 1;
 #ifdef BGZF_CACHE
-    fp->cache = kh_init(cache);
+    fp->cache = calloc(1, sizeof(bgzf_cache_t));
+    ((bgzf_cache_t*)fp->cache)->h = kh_init(cache);
 #endif
     return fp;
 }
@@ -285,33 +295,34 @@ static int deflate_block(BGZF *fp, int block_length)
     return comp_size;
 }
 
-// Inflate the block in fp->compressed_block into fp->uncompressed_block
-static int inflate_block(BGZF* fp, int block_length)
+// Inflate the BGZF block src of slen bytes into dst; returns the uncompressed length or -1
+static int bgzf_uncompress(void *dst, const void *src, int slen)
 {
     z_stream zs;
     zs.zalloc = NULL;
     zs.zfree = NULL;
-    zs.next_in = (Bytef*)fp->compressed_block + 18;
-    zs.avail_in = block_length - 16;
-    zs.next_out = (Bytef*)fp->uncompressed_block;
+    zs.next_in = (Bytef*)src + 18;
+    zs.avail_in = slen - 16;
+    zs.next_out = (Bytef*)dst;
     zs.avail_out = BGZF_MAX_BLOCK_SIZE;
 
-    if (inflateInit2(&zs, -15) != Z_OK) {
-        fp->errcode |= BGZF_ERR_ZLIB;
-        return -1;
-    }
+    if (inflateInit2(&zs, -15) != Z_OK) return -1;
     if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
         inflateEnd(&zs);
-        fp->errcode |= BGZF_ERR_ZLIB;
-        return -1;
-    }
-    if (inflateEnd(&zs) != Z_OK) {
-        fp->errcode |= BGZF_ERR_ZLIB;
         return -1;
     }
+    if (inflateEnd(&zs) != Z_OK) return -1;
     return zs.total_out;
 }
 
+// Inflate the block in fp->compressed_block into fp->uncompressed_block
+static int inflate_block(BGZF* fp, int block_length)
+{
+    int ret = bgzf_uncompress(fp->uncompressed_block, fp->compressed_block, block_length);
+    if (ret < 0) fp->errcode |= BGZF_ERR_ZLIB;
+    return ret;
+}
+
 static int inflate_gzip_block(BGZF *fp, int cached)
 {
     int ret = Z_OK;
@@ -355,25 +366,27 @@ static int check_header(const uint8_t *header)
 static void free_cache(BGZF *fp)
 {
     khint_t k;
-    khash_t(cache) *h = (khash_t(cache)*)fp->cache;
+    bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
     if (fp->is_write) return;
-    for (k = kh_begin(h); k < kh_end(h); ++k)
-        if (kh_exist(h, k)) free(kh_val(h, k).block);
-    kh_destroy(cache, h);
+    for (k = kh_begin(c->h); k < kh_end(c->h); ++k)
+        if (kh_exist(c->h, k)) free(kh_val(c->h, k).block);
+    kh_destroy(cache, c->h);
+    free(c);
 }
 
 static int load_block_from_cache(BGZF *fp, int64_t block_address)
 {
     khint_t k;
     cache_t *p;
-    khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-    k = kh_get(cache, h, block_address);
-    if (k == kh_end(h)) return 0;
-    p = &kh_val(h, k);
+    bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
+    k = kh_get(cache, c->h, block_address);
+    if (k == kh_end(c->h)) return 0;
+    p = &kh_val(c->h, k);
+    p->last_use = ++c->clock;
     if (fp->block_length != 0) fp->block_offset = 0;
     fp->block_address = block_address;
     fp->block_length = p->size;
-    memcpy(fp->uncompressed_block, p->block, BGZF_MAX_BLOCK_SIZE);
+    memcpy(fp->uncompressed_block, p->block, p->size);
     if ( hseek(fp->fp, p->end_offset, SEEK_SET) < 0 )
     {
         // todo: move the error up
@@ -388,26 +401,29 @@ static void cache_block(BGZF *fp, int size)
     int ret;
     khint_t k;
     cache_t *p;
-    khash_t(cache) *h = (khash_t(cache)*)fp->cache;
+    bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
+    khash_t(cache) *h = c->h;
+    uint8_t *block = NULL;
     if (BGZF_MAX_BLOCK_SIZE >= fp->cache_size) return;
     if ((kh_size(h) + 1) * BGZF_MAX_BLOCK_SIZE > (uint32_t)fp->cache_size) {
-        /* A better way would be to remove the oldest block in the
-         * cache, but here we remove a random one for simplicity. This
-         * should not have a big impact on performance. */
+        // Evict the least recently used block and reuse its buffer
+        khint_t lru = kh_end(h);
         for (k = kh_begin(h); k < kh_end(h); ++k)
-            if (kh_exist(h, k)) break;
-        if (k < kh_end(h)) {
-            free(kh_val(h, k).block);
-            kh_del(cache, h, k);
+            if (kh_exist(h, k) && (lru == kh_end(h) || kh_val(h, k).last_use < kh_val(h, lru).last_use))
+                lru = k;
+        if (lru < kh_end(h)) {
+            block = kh_val(h, lru).block;
+            kh_del(cache, h, lru);
         }
     }
     k = kh_put(cache, h, fp->block_address, &ret);
-    if (ret == 0) return; // if this happens, a bug!
+    if (ret == 0) { free(block); return; } // if this happens, a bug!
     p = &kh_val(h, k);
     p->size = fp->block_length;
     p->end_offset = fp->block_address + size;
-    p->block = (uint8_t*)malloc(BGZF_MAX_BLOCK_SIZE);
-    memcpy(kh_val(h, k).block, fp->uncompressed_block, BGZF_MAX_BLOCK_SIZE);
+    p->last_use = ++c->clock;
+    p->block = block ? block : (uint8_t*)malloc(BGZF_MAX_BLOCK_SIZE);
+    memcpy(p->block, fp->uncompressed_block, fp->block_length);
 }
 #else
 static void free_cache(BGZF *fp) {}
@@ -415,6 +431,20 @@ static int load_block_from_cache(BGZF *fp, int64_t block_address) {return 0;}
 static void cache_block(BGZF *fp, int size) {}
 #endif
 
+#ifdef BGZF_MT
+static int mt_read_block(BGZF *fp);
+static int64_t mt_next_address(BGZF *fp);
+#endif
+
+// The file offset of the block following the current one
+static inline int64_t next_block_address(BGZF *fp)
+{
+#ifdef BGZF_MT
+    if (fp->mt) return mt_next_address(fp);
+#endif
+    return htell(fp->fp);
+}
+
 int bgzf_read_block(BGZF *fp)
 {
     uint8_t header[BLOCK_HEADER_LENGTH], *compressed_block;
@@ -450,6 +480,9 @@ int bgzf_read_block(BGZF *fp)
         fp->block_address = block_address;
         return 0;
     }
+#ifdef BGZF_MT
+    if (fp->mt) return mt_read_block(fp);
+#endif
     if (fp->cache_size && load_block_from_cache(fp, block_address)) return 0;
     count = hread(fp->fp, header, sizeof(header));
     if (count == 0) { // no data read
@@ -565,7 +598,7 @@ ssize_t bgzf_read(BGZF *fp, void *data, size_t length)
         bytes_read += copy_length;
     }
     if (fp->block_offset == fp->block_length) {
-        fp->block_address = htell(fp->fp);
+        fp->block_address = next_block_address(fp);
         fp->block_offset = fp->block_length = 0;
     }
     fp->uncompressed_address += bytes_read;
@@ -579,141 +612,270 @@ ssize_t bgzf_raw_read(BGZF *fp, void *data, size_t length)
 
 #ifdef BGZF_MT
 
-typedef struct {
-    struct bgzf_mtaux_t *mt;
-    void *buf;
-    int i, errcode, toproc, compress_level;
-} worker_t;
+/*
+    Blocks are compressed by a thread pool as soon as they fill up, while the
+    caller goes on filling the next ones.  The compressed blocks are written
+    in their original order by whichever bgzf_write() or bgzf_flush() call
+    finds them finished, which also advances block_address and adds them to
+    the index being built on the fly.
+
+    When reading, up to max_pending blocks ahead of the current one are read
+    raw and handed to the pool to inflate, and bgzf_read_block() takes them
+    in order.  The file position is then ahead of the current block, so
+    block_address advances by next_addr instead of htell(); seeking discards
+    the blocks read ahead.
+*/
+typedef struct bgzf_job_t {
+    struct bgzf_job_t *next;    // free list
+    int ulen, clen, level, errcode;
+    int64_t addr;               // reading: file offset of the block
+    uint8_t ublock[BGZF_MAX_BLOCK_SIZE], cblock[BGZF_MAX_BLOCK_SIZE];
+} bgzf_job_t;
 
 typedef struct bgzf_mtaux_t {
-    int n_threads, n_blks, curr, done;
-    volatile int proc_cnt;
-    void **blk;
-    int *len;
-    worker_t *w;
-    pthread_t *tid;
-    pthread_mutex_t lock;
-    pthread_cond_t cv;
+    t_pool *pool;
+    t_results_queue *q;
+    int n_pending, max_pending;  // blocks dispatched and not yet written or read
+    bgzf_job_t *free_jobs;
+    int64_t next_addr;           // reading: offset of the block after the current one
+    int eof, errcode;            // reading: the read-ahead stopped, and why
 } mtaux_t;
 
-static int worker_aux(worker_t *w)
+static void *mt_compress(void *arg)
 {
-    int i, stop = 0;
-    // wait for condition: to process or all done
-    pthread_mutex_lock(&w->mt->lock);
-    while (!w->toproc && !w->mt->done)
-        pthread_cond_wait(&w->mt->cv, &w->mt->lock);
-    if (w->mt->done) stop = 1;
-    w->toproc = 0;
-    pthread_mutex_unlock(&w->mt->lock);
-    if (stop) return 1; // to quit the thread
-    w->errcode = 0;
-    for (i = w->i; i < w->mt->curr; i += w->mt->n_threads) {
-        int clen = BGZF_MAX_BLOCK_SIZE;
-        if (bgzf_compress(w->buf, &clen, w->mt->blk[i], w->mt->len[i], w->compress_level) != 0)
-            w->errcode |= BGZF_ERR_ZLIB;
-        memcpy(w->mt->blk[i], w->buf, clen);
-        w->mt->len[i] = clen;
-    }
-    __sync_fetch_and_add(&w->mt->proc_cnt, 1);
-    return 0;
+    bgzf_job_t *job = (bgzf_job_t*) arg;
+    job->clen = BGZF_MAX_BLOCK_SIZE;
+    job->errcode = bgzf_compress(job->cblock, &job->clen, job->ublock, job->ulen, job->level) != 0 ? BGZF_ERR_ZLIB : 0;
+    return job;
 }
 
-static void *mt_worker(void *data)
+static void *mt_uncompress(void *arg)
 {
-    while (worker_aux((worker_t*)data) == 0);
-    return 0;
+    bgzf_job_t *job = (bgzf_job_t*) arg;
+    job->ulen = bgzf_uncompress(job->ublock, job->cblock, job->clen);
+    job->errcode = job->ulen < 0 ? BGZF_ERR_ZLIB : 0;
+    return job;
 }
 
 int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks)
 {
-    int i;
     mtaux_t *mt;
-    pthread_attr_t attr;
-    if (!fp->is_write || fp->mt || n_threads <= 1) return -1;
+    if (fp->mt || n_threads <= 1) return -1;
+    if (!fp->is_write && (!fp->is_compressed || fp->is_gzip)) return -1;
+    if (n_sub_blks < 1) n_sub_blks = 1;
     mt = (mtaux_t*)calloc(1, sizeof(mtaux_t));
-    mt->n_threads = n_threads;
-    mt->n_blks = n_threads * n_sub_blks;
-    mt->len = (int*)calloc(mt->n_blks, sizeof(int));
-    mt->blk = (void**)calloc(mt->n_blks, sizeof(void*));
-    for (i = 0; i < mt->n_blks; ++i)
-        mt->blk[i] = malloc(BGZF_MAX_BLOCK_SIZE);
-    mt->tid = (pthread_t*)calloc(mt->n_threads, sizeof(pthread_t)); // tid[0] is not used, as the worker 0 is launched by the master
-    mt->w = (worker_t*)calloc(mt->n_threads, sizeof(worker_t));
-    for (i = 0; i < mt->n_threads; ++i) {
-        mt->w[i].i = i;
-        mt->w[i].mt = mt;
-        mt->w[i].compress_level = fp->compress_level;
-        mt->w[i].buf = malloc(BGZF_MAX_BLOCK_SIZE);
+    if (!mt) return -1;
+    mt->max_pending = n_threads * n_sub_blks;
+    mt->pool = t_pool_init(mt->max_pending, n_threads);
+    mt->q = t_results_queue_init();
+    if (!mt->pool || !mt->q) {
+        if (mt->pool) t_pool_destroy(mt->pool, 0);
+        if (mt->q) t_results_queue_destroy(mt->q);
+        free(mt);
+        return -1;
     }
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    pthread_mutex_init(&mt->lock, 0);
-    pthread_cond_init(&mt->cv, 0);
-    for (i = 1; i < mt->n_threads; ++i) // worker 0 is effectively launched by the master thread
-        pthread_create(&mt->tid[i], &attr, mt_worker, &mt->w[i]);
+    // a block may already have been read, e.g. the header's
+    if (!fp->is_write) mt->next_addr = htell(fp->fp);
     fp->mt = mt;
     return 0;
 }
 
 static void mt_destroy(mtaux_t *mt)
 {
-    int i;
-    // signal all workers to quit
-    pthread_mutex_lock(&mt->lock);
-    mt->done = 1; mt->proc_cnt = 0;
-    pthread_cond_broadcast(&mt->cv);
-    pthread_mutex_unlock(&mt->lock);
-    for (i = 1; i < mt->n_threads; ++i) pthread_join(mt->tid[i], 0); // worker 0 is effectively launched by the master thread
-    // free other data allocated on heap
-    for (i = 0; i < mt->n_blks; ++i) free(mt->blk[i]);
-    for (i = 0; i < mt->n_threads; ++i) free(mt->w[i].buf);
-    free(mt->blk); free(mt->len); free(mt->w); free(mt->tid);
-    pthread_cond_destroy(&mt->cv);
-    pthread_mutex_destroy(&mt->lock);
+    t_pool_flush(mt->pool);
+    t_pool_destroy(mt->pool, 0);
+    while (mt->n_pending) {
+        t_pool_result *r = t_pool_next_result_wait(mt->q);
+        if (!r) break;
+        free(r->data);
+        t_pool_delete_result(r, 0);
+        mt->n_pending--;
+    }
+    t_results_queue_destroy(mt->q);
+    while (mt->free_jobs) {
+        bgzf_job_t *job = mt->free_jobs;
+        mt->free_jobs = job->next;
+        free(job);
+    }
     free(mt);
 }
 
-static void mt_queue(BGZF *fp)
+static bgzf_job_t *mt_job_get(mtaux_t *mt)
+{
+    bgzf_job_t *job = mt->free_jobs;
+    if (job) mt->free_jobs = job->next;
+    else job = (bgzf_job_t*)malloc(sizeof(bgzf_job_t));
+    return job;
+}
+
+static void mt_job_put(mtaux_t *mt, bgzf_job_t *job)
+{
+    job->next = mt->free_jobs;
+    mt->free_jobs = job;
+}
+
+// Hand the current block to the pool
+static int mt_queue(BGZF *fp)
 {
     mtaux_t *mt = fp->mt;
-    assert(mt->curr < mt->n_blks); // guaranteed by the caller
-    memcpy(mt->blk[mt->curr], fp->uncompressed_block, fp->block_offset);
-    mt->len[mt->curr] = fp->block_offset;
+    bgzf_job_t *job = mt_job_get(mt);
+    if (!job) {
+        fp->errcode |= BGZF_ERR_IO;
+        return -1;
+    }
+    memcpy(job->ublock, fp->uncompressed_block, fp->block_offset);
+    job->ulen = fp->block_offset;
+    job->level = fp->compress_level;
+    if (t_pool_dispatch(mt->pool, mt->q, mt_compress, job) < 0) {
+        free(job);
+        fp->errcode |= BGZF_ERR_IO;
+        return -1;
+    }
+    mt->n_pending++;
     fp->block_offset = 0;
-    ++mt->curr;
+    return 0;
 }
 
-static int mt_flush_queue(BGZF *fp)
+// Write out the compressed blocks that are ready, in order.  With wait set,
+// or when too many blocks are outstanding, wait for them to be ready.
+static int mt_write_ready(BGZF *fp, int wait)
 {
-    int i;
     mtaux_t *mt = fp->mt;
-    // signal all the workers to compress
-    pthread_mutex_lock(&mt->lock);
-    for (i = 0; i < mt->n_threads; ++i) mt->w[i].toproc = 1;
-    mt->proc_cnt = 0;
-    pthread_cond_broadcast(&mt->cv);
-    pthread_mutex_unlock(&mt->lock);
-    // worker 0 is doing things here
-    worker_aux(&mt->w[0]);
-    // wait for all the threads to complete
-    while (mt->proc_cnt < mt->n_threads);
-    // dump data to disk
-    for (i = 0; i < mt->n_threads; ++i) fp->errcode |= mt->w[i].errcode;
-    for (i = 0; i < mt->curr; ++i)
-        if (hwrite(fp->fp, mt->blk[i], mt->len[i]) != mt->len[i]) {
-            fp->errcode |= BGZF_ERR_IO;
+    while (mt->n_pending) {
+        int must_wait = wait || mt->n_pending >= mt->max_pending;
+        t_pool_result *r = must_wait ? t_pool_next_result_wait(mt->q) : t_pool_next_result(mt->q);
+        if (!r) {
+            if (must_wait) fp->errcode |= BGZF_ERR_IO;  // the queue was shut down
             break;
         }
-    mt->curr = 0;
+        bgzf_job_t *job = (bgzf_job_t*) r->data;
+        t_pool_delete_result(r, 0);
+        mt->n_pending--;
+        fp->errcode |= job->errcode;
+        if (!job->errcode) {
+            if ( fp->idx_build_otf )
+            {
+                bgzf_index_add_block(fp);
+                fp->idx->ublock_addr += job->ulen;
+            }
+            if (hwrite(fp->fp, job->cblock, job->clen) != job->clen)
+                fp->errcode |= BGZF_ERR_IO;
+            fp->block_address += job->clen;
+        }
+        mt_job_put(mt, job);
+    }
     return (fp->errcode == 0)? 0 : -1;
 }
 
+// Read raw blocks and dispatch them until max_pending are in flight
+static void mt_read_ahead(BGZF *fp)
+{
+    mtaux_t *mt = fp->mt;
+    while (!mt->eof && mt->n_pending < mt->max_pending) {
+        bgzf_job_t *job = mt_job_get(mt);
+        int64_t addr = htell(fp->fp);
+        ssize_t count;
+        if (!job) { mt->errcode = BGZF_ERR_IO; mt->eof = 1; break; }
+        count = hread(fp->fp, job->cblock, BLOCK_HEADER_LENGTH);
+        if (count == 0) { // end of file
+            mt_job_put(mt, job);
+            mt->eof = 1;
+            break;
+        }
+        if (count != BLOCK_HEADER_LENGTH || check_header(job->cblock) != 0) {
+            mt_job_put(mt, job);
+            mt->errcode = BGZF_ERR_HEADER;
+            mt->eof = 1;
+            break;
+        }
+        job->clen = unpackInt16(&job->cblock[16]) + 1;
+        count = job->clen - BLOCK_HEADER_LENGTH;
+        if (count < 0 || hread(fp->fp, job->cblock + BLOCK_HEADER_LENGTH, count) != count) {
+            mt_job_put(mt, job);
+            mt->errcode = BGZF_ERR_IO;
+            mt->eof = 1;
+            break;
+        }
+        job->addr = addr;
+        if (t_pool_dispatch(mt->pool, mt->q, mt_uncompress, job) < 0) {
+            mt_job_put(mt, job);
+            mt->errcode = BGZF_ERR_IO;
+            mt->eof = 1;
+            break;
+        }
+        mt->n_pending++;
+    }
+}
+
+static int mt_read_block(BGZF *fp)
+{
+    mtaux_t *mt = fp->mt;
+    t_pool_result *r;
+    bgzf_job_t *job;
+    mt_read_ahead(fp);
+    if (!mt->n_pending) {
+        // errors surface only once the blocks before them have been read
+        if (mt->errcode) {
+            fp->errcode |= mt->errcode;
+            return -1;
+        }
+        fp->block_length = 0;
+        return 0;
+    }
+    if ((r = t_pool_next_result_wait(mt->q)) == NULL) {
+        fp->errcode |= BGZF_ERR_IO;
+        return -1;
+    }
+    job = (bgzf_job_t*) r->data;
+    t_pool_delete_result(r, 0);
+    mt->n_pending--;
+    if (job->errcode) {
+        fp->errcode |= job->errcode;
+        mt_job_put(mt, job);
+        return -1;
+    }
+    memcpy(fp->uncompressed_block, job->ublock, job->ulen);
+    if (fp->block_length != 0) fp->block_offset = 0; // Do not reset offset if this read follows a seek.
+    fp->block_address = job->addr;
+    fp->block_length = job->ulen;
+    mt->next_addr = job->addr + job->clen;
+    if ( fp->idx_build_otf )
+    {
+        bgzf_index_add_block(fp);
+        fp->idx->ublock_addr += job->ulen;
+    }
+    mt_job_put(mt, job);
+    mt_read_ahead(fp);
+    return 0;
+}
+
+static int64_t mt_next_address(BGZF *fp)
+{
+    return fp->mt->next_addr;
+}
+
+// Discard the blocks read ahead, before a seek
+static void mt_read_reset(BGZF *fp)
+{
+    mtaux_t *mt = fp->mt;
+    while (mt->n_pending) {
+        t_pool_result *r = t_pool_next_result_wait(mt->q);
+        if (!r) {
+            mt->n_pending = 0;
+            break;
+        }
+        mt_job_put(mt, (bgzf_job_t*) r->data);
+        t_pool_delete_result(r, 0);
+        mt->n_pending--;
+    }
+    mt->eof = mt->errcode = 0;
+}
+
 static int lazy_flush(BGZF *fp)
 {
     if (fp->mt) {
-        if (fp->block_offset) mt_queue(fp);
-        return (fp->mt->curr < fp->mt->n_blks)? 0 : mt_flush_queue(fp);
+        if (fp->block_offset && mt_queue(fp) != 0) return -1;
+        return mt_write_ready(fp, 0);
     }
     else return bgzf_flush(fp);
 }
@@ -737,8 +899,8 @@ int bgzf_flush(BGZF *fp)
     if (!fp->is_write) return 0;
 #ifdef BGZF_MT
     if (fp->mt) {
-        if (fp->block_offset) mt_queue(fp); // guaranteed that assertion does not fail
-        return mt_flush_queue(fp);
+        if (fp->block_offset && mt_queue(fp) != 0) return -1;
+        return mt_write_ready(fp, 1);
     }
 #endif
     while (fp->block_offset > 0) {
@@ -805,10 +967,10 @@ int bgzf_close(BGZF* fp)
             fp->errcode |= BGZF_ERR_IO;
             return -1;
         }
+    }
 #ifdef BGZF_MT
-        if (fp->mt) mt_destroy(fp->mt);
+    if (fp->mt) mt_destroy(fp->mt);
 #endif
-    }
     if ( fp->is_gzip )
     {
         if (!fp->is_write) (void)inflateEnd(fp->gz_stream);
@@ -854,6 +1016,9 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
     }
     block_offset = pos & 0xFFFF;
     block_address = pos >> 16;
+#ifdef BGZF_MT
+    if (fp->mt) mt_read_reset(fp);
+#endif
     if (hseek(fp->fp, block_address, SEEK_SET) < 0) {
         fp->errcode |= BGZF_ERR_IO;
         return -1;
@@ -885,7 +1050,7 @@ int bgzf_getc(BGZF *fp)
     }
     c = ((unsigned char*)fp->uncompressed_block)[fp->block_offset++];
     if (fp->block_offset == fp->block_length) {
-        fp->block_address = htell(fp->fp);
+        fp->block_address = next_block_address(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
@@ -900,14 +1065,15 @@ int bgzf_getc(BGZF *fp)
 int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 {
     int l, state = 0;
-    unsigned char *buf = (unsigned char*)fp->uncompressed_block;
+    unsigned char *buf = (unsigned char*)fp->uncompressed_block, *p;
     str->l = 0;
     do {
         if (fp->block_offset >= fp->block_length) {
             if (bgzf_read_block(fp) != 0) { state = -2; break; }
             if (fp->block_length == 0) { state = -1; break; }
         }
-        for (l = fp->block_offset; l < fp->block_length && buf[l] != delim; ++l);
+        p = (unsigned char*)memchr(buf + fp->block_offset, delim, fp->block_length - fp->block_offset);
+        l = p ? p - buf : fp->block_length;
         if (l < fp->block_length) state = 1;
         l -= fp->block_offset;
         if (str->l + l + 1 >= str->m) {
@@ -919,13 +1085,13 @@ int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
         str->l += l;
         fp->block_offset += l + 1;
         if (fp->block_offset >= fp->block_length) {
-            fp->block_address = htell(fp->fp);
+            fp->block_address = next_block_address(fp);
             fp->block_offset = 0;
             fp->block_length = 0;
         }
     } while (state == 0);
     if (str->l == 0 && state < 0) return state;
-    fp->uncompressed_address += str->l;
+    fp->uncompressed_address += str->l + (state > 0);    // the delimiter too
     if ( delim=='\n' && str->l>0 && str->s[str->l-1]=='\r' ) str->l--;
     str->s[str->l] = 0;
     return str->l;
@@ -1098,6 +1264,9 @@ int bgzf_useek(BGZF *fp, long uoffset, int where)
         else break;
     }
     int i = ilo-1;
+#ifdef BGZF_MT
+    if (fp->mt) mt_read_reset(fp);
+#endif
     if (hseek(fp->fp, fp->idx->offs[i].caddr, SEEK_SET) < 0)
     {
         fp->errcode |= BGZF_ERR_IO;
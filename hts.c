@@ -34,6 +34,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <sys/stat.h>
 #include "htslib/bgzf.h"
 #include "htslib/hts.h"
+#include "htslib/vcf.h"
 #include "cram/cram.h"
 #include "htslib/hfile.h"
 #include "version.h"
@@ -398,6 +399,7 @@ int hts_close(htsFile *fp)
     case sam:
     case vcf:
         if (!fp->is_write) {
+            if (fp->state) vcf_set_threads(fp, 0);
         #if KS_BGZF
             BGZF *gzfp = ((kstream_t*)fp->fp.voidp)->f;
             ret = bgzf_close(gzfp);
@@ -448,7 +450,9 @@ int hts_set_opt(htsFile *fp, enum cram_option opt, ...) {
 
 int hts_set_threads(htsFile *fp, int n)
 {
-    if (fp->format.compression == bgzf) {
+    if (fp->format.format == vcf && !fp->is_write) {
+        return vcf_set_threads(fp, n);
+    } else if (fp->format.compression == bgzf) {
         return bgzf_mt(fp->fp.bgzf, n, 256);
     } else if (fp->format.format == cram) {
         return hts_set_opt(fp, CRAM_OPT_NTHREADS, n);
@@ -1211,6 +1215,54 @@ uint64_t hts_idx_get_n_no_coor(const hts_idx_t* idx)
     return idx->n_no_coor;
 }
 
+// Approximate size of the data in a chunk: compressed bytes when it spans
+// BGZF blocks, otherwise uncompressed bytes
+static inline uint64_t chunk_size(const hts_pair64_t *c)
+{
+    uint64_t cbeg = c->u >> 16, cend = c->v >> 16;
+    if ( cend > cbeg ) return cend - cbeg;
+    return (c->v & 0xffff) > (c->u & 0xffff) ? (c->v & 0xffff) - (c->u & 0xffff) : 0;
+}
+
+int *hts_idx_split(const hts_idx_t *idx, int tid, int64_t size, int *nwin)
+{
+    *nwin = 0;
+    if ( tid < 0 || tid >= idx->n || !idx->bidx[tid] ) return NULL;
+
+    // Start coordinates and sizes of the finest-level bins. Records wider
+    // than a bin sit in coarser bins and are not counted.
+    bidx_t *h = idx->bidx[tid];
+    int leaf = ((1<<(3*idx->n_lvls)) - 1) / 7, nleaf = 0, n = 0, i;
+    hts_pair64_t *bins = (hts_pair64_t*) malloc((kh_size(h) + 1) * sizeof(hts_pair64_t));
+    khint_t k;
+    for (k = kh_begin(h); k != kh_end(h); ++k)
+    {
+        if ( !kh_exist(h, k) ) continue;
+        int bin = kh_key(h, k);
+        if ( bin < leaf || bin >= idx->n_bins ) continue;
+        uint64_t beg = (uint64_t)(bin - leaf) << idx->min_shift;
+        if ( beg > INT_MAX ) continue;
+        bins_t *b = &kh_val(h, k);
+        bins[nleaf].u = beg;
+        bins[nleaf].v = 0;
+        for (i = 0; i < b->n; ++i) bins[nleaf].v += chunk_size(&b->list[i]);
+        nleaf++;
+    }
+    ks_introsort(_off, nleaf, bins);
+
+    int *wins = (int*) malloc((nleaf + 1) * sizeof(int));
+    uint64_t acc = 0;
+    wins[n++] = 0;
+    for (i = 0; i < nleaf; ++i)
+    {
+        if ( i > 0 && acc >= (uint64_t)(size > 0 ? size : 0) ) { wins[n++] = bins[i].u; acc = 0; }
+        acc += bins[i].v;
+    }
+    free(bins);
+    *nwin = n;
+    return wins;
+}
+
 /****************
  *** Iterator ***
  ****************/
@@ -1233,9 +1285,29 @@ static inline int reg2bins(int64_t beg, int64_t end, hts_itr_t *itr, int min_shi
     return itr->bins.n;
 }
 
+// Sort the chunks and merge those which overlap or share a BGZF block; returns the new count
+static int merge_chunks(hts_pair64_t *off, int n_off)
+{
+    int i, l;
+    ks_introsort(_off, n_off, off);
+    // resolve completely contained adjacent blocks
+    for (i = 1, l = 0; i < n_off; ++i)
+        if (off[l].v < off[i].v) off[++l] = off[i];
+    n_off = l + 1;
+    // resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
+    for (i = 1; i < n_off; ++i)
+        if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
+    // merge adjacent blocks
+    for (i = 1, l = 0; i < n_off; ++i) {
+        if (off[l].v>>16 == off[i].u>>16) off[l].v = off[i].v;
+        else off[++l] = off[i];
+    }
+    return l + 1;
+}
+
 hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_readrec_func *readrec)
 {
-    int i, n_off, l, bin;
+    int i, n_off, bin;
     hts_pair64_t *off;
     khint_t k;
     bidx_t *bidx;
@@ -1328,27 +1400,92 @@ hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_re
     if (n_off == 0) {
         free(off); return iter;
     }
-    ks_introsort(_off, n_off, off);
-    // resolve completely contained adjacent blocks
-    for (i = 1, l = 0; i < n_off; ++i)
-        if (off[l].v < off[i].v) off[++l] = off[i];
-    n_off = l + 1;
-    // resolve overlaps between adjacent blocks; this may happen due to the merge in indexing
-    for (i = 1; i < n_off; ++i)
-        if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
-    // merge adjacent blocks
-    for (i = 1, l = 0; i < n_off; ++i) {
-        if (off[l].v>>16 == off[i].u>>16) off[l].v = off[i].v;
-        else off[++l] = off[i];
+    iter->n_off = merge_chunks(off, n_off); iter->off = off;
+    return iter;
+}
+
+#define pair32_lt(a,b) ((a).beg < (b).beg)
+KSORT_INIT_STATIC(_reg, hts_pair32_t, pair32_lt)
+
+// An iterator of hts_itr_query_regs(), marked by hts_itr_t.multi, with the
+// regions kept privately so that hts_itr_t keeps its layout
+typedef struct {
+    hts_itr_t itr;
+    int n_reg, i_reg;   // the merged regions, and the current one
+    hts_pair32_t *reg;
+} hts_itr_multi_t;
+
+hts_itr_t *hts_itr_query_regs(const hts_idx_t *idx, int tid, hts_pair32_t *regs, int *nregs, hts_readrec_func *readrec)
+{
+    int i, l, n = *nregs, n_off = 0, m_off = 0;
+    hts_pair64_t *off = NULL;
+    hts_itr_multi_t *multi;
+    hts_itr_t *iter;
+    if (tid < 0 || tid >= idx->n || idx->bidx[tid] == NULL) return 0;
+
+    // sort the regions and merge those which overlap or abut
+    for (i = l = 0; i < n; ++i) {
+        if (regs[i].beg < 0) regs[i].beg = 0;
+        if (regs[i].end > regs[i].beg) regs[l++] = regs[i];
     }
-    n_off = l + 1;
-    iter->n_off = n_off; iter->off = off;
+    n = l;
+    ks_introsort(_reg, n, regs);
+    for (i = 1, l = 0; i < n; ++i) {
+        if (regs[i].beg <= regs[l].end) {
+            if (regs[l].end < regs[i].end) regs[l].end = regs[i].end;
+        } else regs[++l] = regs[i];
+    }
+    *nregs = n = n ? l + 1 : 0;
+
+    multi = (hts_itr_multi_t*)calloc(1, sizeof(hts_itr_multi_t));
+    if (multi == NULL) return 0;
+    iter = &multi->itr;
+    iter->multi = 1;
+    iter->tid = tid; iter->i = -1;
+    iter->readrec = readrec;
+    if (n == 0) return iter;
+    iter->beg = regs[0].beg; iter->end = regs[n-1].end;
+    multi->n_reg = n;
+    multi->reg = (hts_pair32_t*)malloc(n * sizeof(hts_pair32_t));
+    if (multi->reg == NULL) goto fail;
+    memcpy(multi->reg, regs, n * sizeof(hts_pair32_t));
+
+    // pool the chunks of all the regions; shared chunks collapse in the merge
+    for (i = 0; i < n; ++i) {
+        hts_itr_t *sub = hts_itr_query(idx, tid, regs[i].beg, regs[i].end, readrec);
+        if (sub == NULL) goto fail;
+        if (sub->n_off) {
+            if (n_off + sub->n_off > m_off) {
+                hts_pair64_t *tmp;
+                m_off = n_off + sub->n_off;
+                kroundup32(m_off);
+                tmp = (hts_pair64_t*)realloc(off, m_off * sizeof(hts_pair64_t));
+                if (tmp == NULL) { hts_itr_destroy(sub); goto fail; }
+                off = tmp;
+            }
+            memcpy(off + n_off, sub->off, sub->n_off * sizeof(hts_pair64_t));
+            n_off += sub->n_off;
+        }
+        hts_itr_destroy(sub);
+    }
+    if (n_off == 0) {
+        free(off); return iter;
+    }
+    iter->n_off = merge_chunks(off, n_off); iter->off = off;
     return iter;
+
+fail:
+    free(off);
+    hts_itr_destroy(iter);
+    return 0;
 }
 
 void hts_itr_destroy(hts_itr_t *iter)
 {
-    if (iter) { free(iter->off); free(iter->bins.a); free(iter); }
+    if (iter) {
+        if (iter->multi) free(((hts_itr_multi_t*)iter)->reg);
+        free(iter->off); free(iter->bins.a); free(iter);
+    }
 }
 
 const char *hts_parse_reg(const char *s, int *beg, int *end)
@@ -1431,6 +1568,13 @@ int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
             if (tid != iter->tid || beg >= iter->end) { // no need to proceed
                 ret = -1; break;
             } else if (end > iter->beg && iter->end > beg) {
+                if (iter->multi) {
+                    // records come sorted by beg, so regions ending before this one are done with
+                    hts_itr_multi_t *multi = (hts_itr_multi_t*)iter;
+                    while (multi->reg[multi->i_reg].end <= beg)
+                        if (++multi->i_reg == multi->n_reg) { ret = -1; goto finish; }
+                    if (multi->reg[multi->i_reg].beg >= end) continue;
+                }
                 iter->curr_tid = tid;
                 iter->curr_beg = beg;
                 iter->curr_end = end;
@@ -1438,6 +1582,7 @@ int hts_itr_next(BGZF *fp, hts_itr_t *iter, void *r, void *data)
             }
         } else break; // end of file or error
     }
+finish:
     iter->finished = 1;
     return ret;
 }
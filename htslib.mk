@@ -49,6 +49,7 @@ include $(HTSDIR)/htslib_vars.mk
 #		$(HTSDIR)/tabix -p bed bar.bed.bgz
 
 HTSLIB_PUBLIC_HEADERS = \
+	$(HTSDIR)/htslib/bam_sort.h \
 	$(HTSDIR)/htslib/bgzf.h \
 	$(HTSDIR)/htslib/faidx.h \
 	$(HTSDIR)/htslib/hfile.h \
@@ -70,6 +71,7 @@ HTSLIB_PUBLIC_HEADERS = \
 
 HTSLIB_ALL = \
 	$(HTSLIB_PUBLIC_HEADERS) \
+	$(HTSDIR)/bam_sort.c \
 	$(HTSDIR)/bgzf.c \
 	$(HTSDIR)/faidx.c \
 	$(HTSDIR)/hfile_internal.h \
@@ -0,0 +1,93 @@
+/*  bam_sort.h -- external-memory sorting and merging of alignment files.
+
+    Copyright (C) 2026 The htslib contributors.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+    Records pushed into a bam_sort_t are buffered up to a memory budget; each
+    full buffer is cut into one chunk per thread, and the chunks are sorted
+    and written as level-1 BGZF temporary files concurrently.  Finishing
+    merges the temporary files and the final in-memory chunks through a heap
+    into a BAM file, compressed on n_threads threads.
+
+    Coordinate order is by reference (unmapped reads with no reference last),
+    then position; query name order compares names with embedded
+    numbers in numeric order, then READ1 before READ2.  Both sorts are stable:
+    records that compare equal keep their input order.
+*/
+
+#ifndef HTSLIB_BAM_SORT_H
+#define HTSLIB_BAM_SORT_H
+
+#include <stddef.h>
+#include "sam.h"
+
+#define BAM_SORT_COORD 0
+#define BAM_SORT_NAME  1
+
+typedef struct {
+    int order;              // BAM_SORT_COORD or BAM_SORT_NAME
+    size_t max_mem;         // bytes of records to buffer; 0 for 768MB
+    int n_threads;          // threads for sorting and compression; <=1 for none
+    int level;              // output compression level, -1 for the default
+    const char *tmp_prefix; // temporary files are <tmp_prefix>.NNNN.bam;
+                            // NULL to use the output file name
+} bam_sort_opts_t;
+
+typedef struct _bam_sort_t bam_sort_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /** Initialise bam_sort_opts_t with the defaults */
+    void bam_sort_opts_init(bam_sort_opts_t *opts);
+
+    /**
+     *  bam_sort_init() - start sorting records described by header @h into
+     *  the BAM file @out_fn.  The header is copied, with its @HD SO tag set
+     *  to match the order.  @opts may be NULL for the defaults.
+     */
+    bam_sort_t *bam_sort_init(const bam_hdr_t *h, const char *out_fn, const bam_sort_opts_t *opts);
+
+    /** Add a copy of @b; returns 0 on success, -1 on error */
+    int bam_sort_push(bam_sort_t *s, const bam1_t *b);
+
+    /** Merge everything pushed into the output file; returns 0 on success, -1 on error */
+    int bam_sort_finish(bam_sort_t *s);
+
+    /** Free @s, removing any temporary files left behind */
+    void bam_sort_destroy(bam_sort_t *s);
+
+    /** Sort the SAM/BAM/CRAM file @in_fn into the BAM file @out_fn */
+    int bam_sort_file(const char *in_fn, const char *out_fn, const bam_sort_opts_t *opts);
+
+    /**
+     *  bam_merge_files() - merge @n files, each already sorted in the order
+     *  given by @opts, into the BAM file @out_fn, using the header of the
+     *  first.  The inputs must share the first file's reference list.
+     */
+    int bam_merge_files(int n, const char **fns, const char *out_fn, const bam_sort_opts_t *opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
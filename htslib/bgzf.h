@@ -208,6 +208,8 @@ extern "C" {
 
     /**
      * Set the cache size. Only effective when compiled with -DBGZF_CACHE.
+     * Decoded blocks are kept by their file offset and the least recently
+     * used one is evicted when the cache is full.
      *
      * @param fp    BGZF file handler
      * @param size  size of cache in bytes; 0 to disable caching (default)
@@ -243,12 +245,26 @@ extern "C" {
     int bgzf_read_block(BGZF *fp);
 
     /**
-     * Enable multi-threading (only effective on writing and when the
-     * library was compiled with -DBGZF_MT)
+     * Enable multi-threading (only effective when the library was compiled
+     * with -DBGZF_MT)
      *
-     * @param fp          BGZF file handler; must be opened for writing
-     * @param n_threads   #threads used for writing
-     * @param n_sub_blks  #blocks processed by each thread; a value 64-256 is recommended
+     * On writing, blocks are compressed in the background while the caller
+     * fills the next ones, and are written in order.  block_address, and so
+     * bgzf_tell(), only accounts for the blocks written so far; it is exact
+     * after bgzf_flush().
+     *
+     * On reading, the blocks after the current one are read ahead and
+     * inflated in the background; bgzf_tell() and bgzf_seek() work as
+     * usual.  Only BGZF files can be read this way, not plain gzip.
+     *
+     * @param fp          BGZF file handler
+     * @param n_threads   #threads used for compressing or decompressing
+     * @param n_sub_blks  #blocks queued per thread; a value 64-256 is recommended
+     *
+     * Each queued block holds two BGZF_MAX_BLOCK_SIZE buffers, so up to
+     * 128 KiB * n_threads * n_sub_blks is allocated as blocks are queued.
+     * Finished buffers are reused rather than freed, and stay allocated
+     * until bgzf_close().
      */
     int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks);
 
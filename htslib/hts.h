@@ -118,6 +118,7 @@ typedef struct {
         void *voidp;
     } fp;
     htsFormat format;
+    void *state;  // format-specific reader state, e.g. from vcf_set_threads()
 } htsFile;
 
 // REQUIRED_FIELDS
@@ -280,6 +281,8 @@ char **hts_readlist(const char *fn, int is_file, int *_n);
   @param n   The number of worker threads to create
   @return    0 for success, or negative if an error occurred.
   @notes     THIS THREADING API IS LIKELY TO CHANGE IN FUTURE.
+             For VCF files opened for reading, the threads parse records;
+             see vcf_set_threads().
 */
 int hts_set_threads(htsFile *fp, int n);
 
@@ -327,10 +330,14 @@ typedef struct {
     uint64_t u, v;
 } hts_pair64_t;
 
+typedef struct {
+    int beg, end;
+} hts_pair32_t;
+
 typedef int hts_readrec_func(BGZF *fp, void *data, void *r, int *tid, int *beg, int *end);
 
 typedef struct {
-    uint32_t read_rest:1, finished:1, dummy:29;
+    uint32_t read_rest:1, finished:1, multi:1, dummy:28;
     int tid, beg, end, n_off, i;
     int curr_tid, curr_beg, curr_end;
     uint64_t curr_off;
@@ -363,8 +370,35 @@ extern "C" {
     int hts_idx_get_stat(const hts_idx_t* idx, int tid, uint64_t* mapped, uint64_t* unmapped);
     uint64_t hts_idx_get_n_no_coor(const hts_idx_t* idx);
 
+    /**
+     *  hts_idx_split() - cut a sequence into windows holding similar amounts of data
+     *  @idx:   the index
+     *  @tid:   the sequence
+     *  @size:  approximate number of bytes of data in each window
+     *  @nwin:  set to the number of windows
+     *
+     *  The windows are contiguous and start at the boundaries of the index's
+     *  finest bins; the first starts at 0 and the last is open-ended. Returns
+     *  the 0-based start coordinates of the windows in increasing order, to be
+     *  freed by the caller, or NULL if the sequence is not in the index.
+     */
+    int *hts_idx_split(const hts_idx_t *idx, int tid, int64_t size, int *nwin);
+
     const char *hts_parse_reg(const char *s, int *beg, int *end);
     hts_itr_t *hts_itr_query(const hts_idx_t *idx, int tid, int beg, int end, hts_readrec_func *readrec);
+
+    /**
+     *  hts_itr_query_regs() - iterate over several regions of one sequence in one pass
+     *  @regs:   0-based, half-open regions in any order, possibly overlapping;
+     *           sorted and merged in place
+     *  @nregs:  the number of regions, updated to the number after merging
+     *
+     *  The file chunks of all the regions are merged, so each BGZF block is
+     *  read and inflated once however many regions share it, and
+     *  hts_itr_next() returns each record overlapping any of the regions
+     *  exactly once, in file order. Returns NULL if @tid is not in the index.
+     */
+    hts_itr_t *hts_itr_query_regs(const hts_idx_t *idx, int tid, hts_pair32_t *regs, int *nregs, hts_readrec_func *readrec);
     void hts_itr_destroy(hts_itr_t *iter);
 
     typedef int (*hts_name2id_f)(void*, const char*);
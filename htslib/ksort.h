@@ -71,8 +71,8 @@ typedef struct {
 
 #define KSORT_SWAP(type_t, a, b) { register type_t t=(a); (a)=(b); (b)=t; }
 
-#define KSORT_INIT(name, type_t, __sort_lt)								\
-	void ks_mergesort_##name(size_t n, type_t array[], type_t temp[])	\
+#define KSORT_INIT_(name, SCOPE, type_t, __sort_lt)							\
+	SCOPE void ks_mergesort_##name(size_t n, type_t array[], type_t temp[])	\
 	{																	\
 		type_t *a2[2], *a, *b;											\
 		int curr, shift;												\
@@ -120,7 +120,7 @@ typedef struct {
 		}																\
 		if (temp == 0) free(a2[1]);										\
 	}																	\
-	void ks_heapadjust_##name(size_t i, size_t n, type_t l[])			\
+	SCOPE void ks_heapadjust_##name(size_t i, size_t n, type_t l[])			\
 	{																	\
 		size_t k = i;													\
 		type_t tmp = l[i];												\
@@ -131,13 +131,13 @@ typedef struct {
 		}																\
 		l[i] = tmp;														\
 	}																	\
-	void ks_heapmake_##name(size_t lsize, type_t l[])					\
+	SCOPE void ks_heapmake_##name(size_t lsize, type_t l[])					\
 	{																	\
 		size_t i;														\
 		for (i = (lsize >> 1) - 1; i != (size_t)(-1); --i)				\
 			ks_heapadjust_##name(i, lsize, l);							\
 	}																	\
-	void ks_heapsort_##name(size_t lsize, type_t l[])					\
+	SCOPE void ks_heapsort_##name(size_t lsize, type_t l[])					\
 	{																	\
 		size_t i;														\
 		for (i = lsize - 1; i > 0; --i) {								\
@@ -153,7 +153,7 @@ typedef struct {
 				swap_tmp = *j; *j = *(j-1); *(j-1) = swap_tmp;			\
 			}															\
 	}																	\
-	void ks_combsort_##name(size_t n, type_t a[])						\
+	SCOPE void ks_combsort_##name(size_t n, type_t a[])						\
 	{																	\
 		const double shrink_factor = 1.2473309501039786540366528676643; \
 		int do_swap;													\
@@ -175,7 +175,7 @@ typedef struct {
 		} while (do_swap || gap > 2);									\
 		if (gap != 1) __ks_insertsort_##name(a, a + n);					\
 	}																	\
-	void ks_introsort_##name(size_t n, type_t a[])						\
+	SCOPE void ks_introsort_##name(size_t n, type_t a[])						\
 	{																	\
 		int d;															\
 		ks_isort_stack_t *top, *stack;									\
@@ -228,7 +228,7 @@ typedef struct {
 	}																	\
 	/* This function is adapted from: http://ndevilla.free.fr/median/ */ \
 	/* 0 <= kk < n */													\
-	type_t ks_ksmall_##name(size_t n, type_t arr[], size_t kk)			\
+	SCOPE type_t ks_ksmall_##name(size_t n, type_t arr[], size_t kk)			\
 	{																	\
 		type_t *low, *high, *k, *ll, *hh, *mid;							\
 		low = arr; high = arr + n - 1; k = arr + kk;					\
@@ -255,7 +255,7 @@ typedef struct {
 			if (hh >= k) high = hh - 1;									\
 		}																\
 	}																	\
-	void ks_shuffle_##name(size_t n, type_t a[])						\
+	SCOPE void ks_shuffle_##name(size_t n, type_t a[])						\
 	{																	\
 		int i, j;														\
 		for (i = n; i > 1; --i) {										\
@@ -265,6 +265,17 @@ typedef struct {
 		}																\
 	}
 
+#if defined __GNUC__ || defined __clang__
+#define KSORT_UNUSED __attribute__ ((__unused__))
+#else
+#define KSORT_UNUSED
+#endif
+
+/* KSORT_INIT() defines external functions, KSORT_INIT_STATIC() static ones
+ * for use within a single file */
+#define KSORT_INIT(name, type_t, __sort_lt) KSORT_INIT_(name, , type_t, __sort_lt)
+#define KSORT_INIT_STATIC(name, type_t, __sort_lt) KSORT_INIT_(name, static KSORT_UNUSED, type_t, __sort_lt)
+
 #define ks_mergesort(name, n, a, t) ks_mergesort_##name(n, a, t)
 #define ks_introsort(name, n, a) ks_introsort_##name(n, a)
 #define ks_combsort(name, n, a) ks_combsort_##name(n, a)
@@ -82,6 +82,11 @@ extern "C" {
 	 * if sep is not changed. */
 	char *kstrtok(const char *str, const char *sep, ks_tokaux_t *aux);
 
+	/* kputd() appends d formatted exactly as ksprintf(s, "%g", d) would,
+	 * but without going through the printf machinery for ordinary values.
+	 * Returns the number of characters appended, or EOF on failure. */
+	int kputd(double d, kstring_t *s);
+
 #ifdef __cplusplus
 }
 #endif
@@ -191,35 +196,43 @@ static inline int kputsn_(const void *p, int l, kstring_t *s)
 	return l;
 }
 
-static inline int kputw(int c, kstring_t *s)
+/* "00" "01" ... "99", used for formatting integers two digits at a time; a
+ * copy per user so that the inline functions below need nothing from kstring.o */
+static const char ks_digit_pairs[201] =
+	"00010203040506070809" "10111213141516171819" "20212223242526272829"
+	"30313233343536373839" "40414243444546474849" "50515253545556575859"
+	"60616263646566676869" "70717273747576777879" "80818283848586878889"
+	"90919293949596979899";
+
+/* Write the decimal digits of x so that they end just before end, two digits
+ * at a time from the ks_digit_pairs table; returns a pointer to the first. */
+static inline char *ks_u32toa_r(uint32_t x, char *end)
 {
-	char buf[16];
-	int i, l = 0;
-	unsigned int x = c;
-	if (c < 0) x = -x;
-	do { buf[l++] = x%10 + '0'; x /= 10; } while (x > 0);
-	if (c < 0) buf[l++] = '-';
-	if (s->l + l + 1 >= s->m) {
-		char *tmp;
-		s->m = s->l + l + 2;
-		kroundup32(s->m);
-		if ((tmp = (char*)realloc(s->s, s->m)))
-			s->s = tmp;
-		else
-			return EOF;
+	const char *d;
+	while (x >= 100) {
+		d = ks_digit_pairs + (x % 100) * 2;
+		x /= 100;
+		*--end = d[1]; *--end = d[0];
 	}
-	for (i = l - 1; i >= 0; --i) s->s[s->l++] = buf[i];
-	s->s[s->l] = 0;
-	return 0;
+	if (x >= 10) {
+		d = ks_digit_pairs + x * 2;
+		*--end = d[1]; *--end = d[0];
+	} else *--end = '0' + x;
+	return end;
 }
 
-static inline int kputuw(unsigned c, kstring_t *s)
+static inline char *ks_u64toa_r(uint64_t x, char *end)
+{
+	while (x > 0xffffffffU) {
+		const char *d = ks_digit_pairs + (x % 100) * 2;
+		x /= 100;
+		*--end = d[1]; *--end = d[0];
+	}
+	return ks_u32toa_r((uint32_t)x, end);
+}
+
+static inline int ks_put_digits_(const char *p, int l, kstring_t *s)
 {
-	char buf[16];
-	int l, i;
-	unsigned x;
-	if (c == 0) return kputc('0', s);
-	for (l = 0, x = c; x > 0; x /= 10) buf[l++] = x%10 + '0';
 	if (s->l + l + 1 >= s->m) {
 		char *tmp;
 		s->m = s->l + l + 2;
@@ -229,31 +242,37 @@ static inline int kputuw(unsigned c, kstring_t *s)
 		else
 			return EOF;
 	}
-	for (i = l - 1; i >= 0; --i) s->s[s->l++] = buf[i];
+	memcpy(s->s + s->l, p, l);
+	s->l += l;
 	s->s[s->l] = 0;
 	return 0;
 }
 
+static inline int kputw(int c, kstring_t *s)
+{
+	char buf[16], *p;
+	unsigned int x = c;
+	if (c < 0) x = -x;
+	p = ks_u32toa_r(x, buf + sizeof buf);
+	if (c < 0) *--p = '-';
+	return ks_put_digits_(p, buf + sizeof buf - p, s);
+}
+
+static inline int kputuw(unsigned c, kstring_t *s)
+{
+	char buf[16], *p;
+	p = ks_u32toa_r(c, buf + sizeof buf);
+	return ks_put_digits_(p, buf + sizeof buf - p, s);
+}
+
 static inline int kputl(long c, kstring_t *s)
 {
-	char buf[32];
-	int i, l = 0;
+	char buf[32], *p;
 	unsigned long x = c;
 	if (c < 0) x = -x;
-	do { buf[l++] = x%10 + '0'; x /= 10; } while (x > 0);
-	if (c < 0) buf[l++] = '-';
-	if (s->l + l + 1 >= s->m) {
-		char *tmp;
-		s->m = s->l + l + 2;
-		kroundup32(s->m);
-		if ((tmp = (char*)realloc(s->s, s->m)))
-			s->s = tmp;
-		else
-			return EOF;
-	}
-	for (i = l - 1; i >= 0; --i) s->s[s->l++] = buf[i];
-	s->s[s->l] = 0;
-	return 0;
+	p = ks_u64toa_r(x, buf + sizeof buf);
+	if (c < 0) *--p = '-';
+	return ks_put_digits_(p, buf + sizeof buf - p, s);
 }
 
 /*
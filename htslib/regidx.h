@@ -65,13 +65,27 @@ typedef struct
     int i, n;
     reg_t *reg;
     void *payload;
+    void *seq;          // private
 }
 regitr_t;
 
+/*
+ *  The regions of a sequence are sorted by start; itr.reg and itr.payload
+ *  point to the first region of the sequence and itr.i indexes them, so the
+ *  first overlap found by regidx_overlap() is at itr.i, not necessarily 0,
+ *  and itr.n is the number of regions of the sequence. The regions after an
+ *  overlapping one need not overlap.
+ *
+ *  REGITR_OVERLAP is not side-effect free: unless the region at itr.i
+ *  overlaps [from,to], it calls regitr_overlap_next(), which moves itr.i
+ *  forward to the next region that does, skipping those which end before
+ *  from, or to itr.n if there is none. It evaluates to 0 when there are no
+ *  more overlaps. Its arguments may be evaluated more than once.
+ */
 #define REGITR_START(itr) (itr).reg[(itr).i].start
 #define REGITR_END(itr)   (itr).reg[(itr).i].end
 #define REGITR_PAYLOAD(itr,type_t) ((type_t*)(itr).payload)[(itr).i]
-#define REGITR_OVERLAP(itr,from,to) (itr.i < itr.n && REGITR_START(itr)<=to && REGITR_END(itr)>=from )
+#define REGITR_OVERLAP(itr,from,to) ((itr).i < (itr).n && REGITR_START(itr)<=(to) && (REGITR_END(itr)>=(from) || regitr_overlap_next(&(itr),(from),(to))))
 
 /*
  *  regidx_parse_f - Function to parse one input line, such as regidx_parse_bed
@@ -106,6 +120,25 @@ int regidx_parse_tab(const char*,char**,char**,reg_t*,void*,void*);   // CHROM,P
  */
 regidx_t *regidx_init(const char *fname, regidx_parse_f parsef, regidx_free_f freef, size_t payload_size, void *usr);
 
+/*
+ *  regidx_save() - write the index to a snapshot file
+ *  regidx_load() - open a snapshot written by regidx_save()
+ *
+ *  The snapshot holds the sorted regions, their index and the payloads in
+ *  the form used in memory, so loading it is a single mmap with no parsing
+ *  and concurrent processes share one copy of it in the page cache. Only
+ *  payloads which do not point to memory of their own, that is indexes
+ *  with no regidx_free_f, can be saved. A loaded index is read-only:
+ *  regidx_insert() fails on it. Snapshots are specific to the byte order
+ *  of the machine which wrote them.
+ *
+ *  regidx_save() returns 0 on success or -1 on error; regidx_load()
+ *  returns the index or NULL on error. The index is freed by
+ *  regidx_destroy() as usual.
+ */
+int regidx_save(regidx_t *idx, const char *fname);
+regidx_t *regidx_load(const char *fname);
+
 /*
  *  regidx_destroy() - free memory allocated by regidx_init
  */
@@ -121,11 +154,54 @@ void regidx_destroy(regidx_t *idx);
  */
 int regidx_overlap(regidx_t *idx, const char *chr, uint32_t start, uint32_t end, regitr_t *itr);
 
+/*
+ *  regitr_overlap_next() - advance the iterator to the next region
+ *  overlapping start,end, used by REGITR_OVERLAP. Returns 1 if there is
+ *  one, 0 otherwise. The cost is logarithmic in the number of regions
+ *  skipped.
+ */
+int regitr_overlap_next(regitr_t *itr, uint32_t start, uint32_t end);
+
+/*
+ *  regcur_t - cursor for streams of queries sorted by sequence and start,
+ *  such as the records of a sorted VCF. It remembers the sequence of the
+ *  previous query, which is looked up again only when the name changes,
+ *  and where the previous search ended, where the next one resumes; the
+ *  cost of a query then grows with the logarithm of the number of regions
+ *  passed since the previous one. Queries out of order are answered
+ *  correctly, only without the saving.
+ *
+ *  Example of usage:
+ *
+ *      regcur_t cur;
+ *      regcur_init(&cur, idx);
+ *      while ( bcf_read(fp,hdr,rec)==0 )
+ *          if ( regcur_overlap(&cur, bcf_seqname(hdr,rec), rec->pos, rec->pos+rec->rlen-1, &itr) ) ...
+ *
+ *  The index must not change while the cursor is in use.
+ */
+typedef struct
+{
+    regidx_t *idx;
+    int iseq, ireg;     // private: sequence and search position of the last query
+    uint32_t from;
+}
+regcur_t;
+
+/*
+ *  regcur_init() - initialize the cursor to query idx
+ *  regcur_overlap() - the same as regidx_overlap()
+ */
+void regcur_init(regcur_t *cur, regidx_t *idx);
+int regcur_overlap(regcur_t *cur, const char *chr, uint32_t start, uint32_t end, regitr_t *itr);
+
 /*
  *  regidx_insert() - add a new region. 
  *
  *  After last region has been added, call regidx_insert(idx,NULL) to
- *  build the index.
+ *  build the index. Regions can be added to a built index, but queries of
+ *  their sequence find no overlaps until regidx_insert(idx,NULL) is called
+ *  again.
  *
  *  Returns 0 on success or -1 on error.
  */
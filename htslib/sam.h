@@ -342,6 +342,45 @@ extern "C" {
     void bam_aux_append(bam1_t *b, const char tag[2], char type, int len, uint8_t *data);
     int bam_aux_del(bam1_t *b, uint8_t *s);
 
+    /*!
+      @abstract  Fetch several auxiliary fields in a single pass
+      @param  b     alignment record
+      @param  n     number of tags requested
+      @param  tags  the 2*n tag characters, e.g. "RGMDNM"
+      @param  vals  array of n pointers filled in as by bam_aux_get(), or NULL
+                    for tags not present
+      @return       number of requested tags that were found
+     */
+    int bam_aux_get_many(const bam1_t *b, int n, const char *tags, uint8_t **vals);
+
+    /*
+     *  Tag->offset tables for records that are queried for many tags.
+     *  bam_aux_idx_build() parses the aux block once; the lookups that
+     *  follow are then a scan of a short table rather than of the record.
+     *  The table stays valid only until the record is next read into or
+     *  modified, except through bam_aux_update() with the same table.
+     */
+    typedef struct __bam_aux_idx_t bam_aux_idx_t;
+
+    bam_aux_idx_t *bam_aux_idx_init(void);
+    void bam_aux_idx_destroy(bam_aux_idx_t *idx);
+    /** returns the number of fields indexed, or -1 if the aux block is malformed */
+    int bam_aux_idx_build(bam_aux_idx_t *idx, const bam1_t *b);
+    uint8_t *bam_aux_idx_get(const bam_aux_idx_t *idx, const bam1_t *b, const char tag[2]);
+    int bam_aux_idx_get_many(const bam_aux_idx_t *idx, const bam1_t *b, int n, const char *tags, uint8_t **vals);
+
+    /*!
+      @abstract  Set the value of an auxiliary field, adding it if absent
+      @param  idx   table built for b by bam_aux_idx_build(), kept up to date;
+                    may be NULL, in which case the field is located by scanning
+      @param  type  aux type character; len and data are as for bam_aux_append()
+      @return       0 on success, -1 on memory allocation failure
+      @discussion   A value of the same encoded length is overwritten in place;
+      otherwise the fields that follow are shifted once, rather than being
+      moved twice by bam_aux_del() and bam_aux_append().
+     */
+    int bam_aux_update(bam1_t *b, bam_aux_idx_t *idx, const char tag[2], char type, int len, const uint8_t *data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -377,6 +416,20 @@ typedef struct {
     uint32_t is_del:1, is_head:1, is_tail:1, is_refskip:1, aux:28;
 } bam_pileup1_t;
 
+/*! @typedef
+ @abstract Structure-of-arrays view of a pileup column; see bam_plp_set_soa().
+ @field  n       number of reads in the column; each array has n entries, in
+                 the same order as the bam_pileup1_t array for the column
+ @field  base    4-bit encoded base (as from bam_seqi), 0 at a deletion or skip
+ @field  qual    base quality, 0 at a deletion or skip
+ @field  strand  1 if the read is on the reverse strand, 0 otherwise
+ @field  is_del  1 iff the base on the padded read is a deletion or ref-skip
+ */
+typedef struct {
+    int n;
+    uint8_t *base, *qual, *strand, *is_del;
+} bam_pileup_soa_t;
+
 typedef int (*bam_plp_auto_f)(void *data, bam1_t *b);
 
 struct __bam_plp_t;
@@ -385,6 +438,9 @@ typedef struct __bam_plp_t *bam_plp_t;
 struct __bam_mplp_t;
 typedef struct __bam_mplp_t *bam_mplp_t;
 
+struct __bam_mplp_par_t;
+typedef struct __bam_mplp_par_t *bam_mplp_par_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -403,6 +459,23 @@ extern "C" {
     void bam_plp_set_maxcnt(bam_plp_t iter, int maxcnt);
     void bam_plp_reset(bam_plp_t iter);
 
+    /**
+     *  bam_plp_set_maxmem() - caps the memory used by buffered reads instead
+     *  of their number: once more than @bytes are held, further reads that
+     *  start at the current position are dropped, as with bam_plp_set_maxcnt().
+     *  A value of 0 restores the count-based limit.
+     */
+    void bam_plp_set_maxmem(bam_plp_t iter, size_t bytes);
+
+    /**
+     *  bam_plp_set_soa() - if enabled, each column returned by bam_plp_next()
+     *  or bam_plp_auto() is also decoded into the arrays returned by
+     *  bam_plp_soa(), valid until the next call.  Returns 0, or -1 on
+     *  memory allocation failure.
+     */
+    int bam_plp_set_soa(bam_plp_t iter, int enable);
+    const bam_pileup_soa_t *bam_plp_soa(bam_plp_t iter);
+
     bam_mplp_t bam_mplp_init(int n, bam_plp_auto_f func, void **data);
     /**
      *  bam_mplp_init_overlaps() - if called, mpileup will detect overlapping
@@ -415,8 +488,48 @@ extern "C" {
     void bam_mplp_init_overlaps(bam_mplp_t iter);
     void bam_mplp_destroy(bam_mplp_t iter);
     void bam_mplp_set_maxcnt(bam_mplp_t iter, int maxcnt);
+    void bam_mplp_set_maxmem(bam_mplp_t iter, size_t bytes);
+    int bam_mplp_set_soa(bam_mplp_t iter, int enable);
+    /** the SoA view of input i's column, for inputs with n_plp[i] > 0 */
+    const bam_pileup_soa_t *bam_mplp_soa(bam_mplp_t iter, int i);
     int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp);
 
+    /**
+     *  bam_mplp_par_init() - sets up a multi-threaded equivalent of
+     *  bam_mplp_auto() over indexed files.  The region is cut into windows
+     *  that are piled up concurrently, each from its own index iterators, and
+     *  the columns are returned in positional order.
+     *  @n:         number of input files, which must share a reference list
+     *  @fns:       input file names; each needs an index for sam_index_load()
+     *  @region:    region as for sam_itr_querys(), or NULL for every
+     *              reference; columns outside it are not returned
+     *  @n_threads: number of worker threads
+     *  @window:    window length in bp, or 0 for the default of 100kb.  Up to
+     *              2*n_threads windows of columns are queued at once, plus
+     *              the one being returned, each holding copies of its reads.
+     *
+     *  Reads spanning window boundaries, and overlapping read pairs (see
+     *  bam_mplp_par_init_overlaps()), are handled as in a single pass.  The
+     *  maxcnt/maxmem depth caps are applied per window and so may admit
+     *  slightly different reads than a single pass would near window starts.
+     *  Returns NULL on failure.
+     */
+    bam_mplp_par_t bam_mplp_par_init(int n, const char **fns, const char *region, int n_threads, int window);
+    /**
+     *  bam_mplp_par_set_filter() - sets a read filter, called on worker
+     *  threads (and so must be thread-safe) for each read of input @i; reads
+     *  for which it returns non-zero are skipped.
+     */
+    void bam_mplp_par_set_filter(bam_mplp_par_t iter, int (*filter)(void *data, int i, bam1_t *b), void *data);
+    void bam_mplp_par_init_overlaps(bam_mplp_par_t iter);
+    void bam_mplp_par_set_maxcnt(bam_mplp_par_t iter, int maxcnt);
+    void bam_mplp_par_set_maxmem(bam_mplp_par_t iter, size_t bytes);
+    /** header of the first input, for interpreting the returned tids */
+    const bam_hdr_t *bam_mplp_par_header(bam_mplp_par_t iter);
+    /** as bam_mplp_auto(); the configuration calls above must precede the first call */
+    int bam_mplp_par_auto(bam_mplp_par_t iter, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp);
+    void bam_mplp_par_destroy(bam_mplp_par_t iter);
+
 #ifdef __cplusplus
 }
 #endif
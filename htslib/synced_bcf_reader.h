@@ -142,6 +142,7 @@ typedef struct
     int targets_exclude;
     kstring_t tmps;
     int n_smpl;
+    void *aux;          // private state of bcf_sr_next_line()
 }
 bcf_srs_t;
 
@@ -171,6 +172,69 @@ char *bcf_sr_strerror(int errnum);
 int bcf_sr_add_reader(bcf_srs_t *readers, const char *fname);
 void bcf_sr_remove_reader(bcf_srs_t *files, int i);
 
+/**
+ *  bcf_sr_set_threads() - read ahead on a pool of threads
+ *  @readers:   holder of the open readers
+ *  @n_threads: number of threads; values below 1 leave reading serial
+ *
+ *  Each reader then reads and parses batches of records on the pool while
+ *  the previous batch is merged by bcf_sr_next_line(). The records returned
+ *  are the same as without threads. Must be called before the first
+ *  bcf_sr_next_line() call; the readers may be added before or after. While
+ *  reading, the readers' headers must not be modified and their files must
+ *  not be accessed directly.
+ *
+ *  Returns 0 if the call succeeded, or -1 on error.
+ */
+int bcf_sr_set_threads(bcf_srs_t *readers, int n_threads);
+
+/*
+ *  Region-parallel reading. The sequences are cut into windows holding
+ *  similar amounts of data, judging by the readers' indexes, and each window
+ *  is read with a private copy of the readers on a pool of threads. For
+ *  every line of a window, as bcf_sr_next_line() would return it, the
+ *  callback is called on the worker with the window's readers, and what it
+ *  appends to @out is handed back window by window in genomic order. A line
+ *  is seen only in the window containing its position, even if its records
+ *  reach into the next window, so the concatenated output is what calling
+ *  the callback on the lines of the original readers would produce.
+ *
+ *  The callback is called from several threads at once and must return a
+ *  negative value on error.
+ *
+ *  A window is read with an idle copy of the readers, or a newly opened one
+ *  if none is idle, which is kept for the windows that follow. Besides
+ *  @readers, up to n_threads copies of every file and of its index are thus
+ *  open and loaded in memory until bcf_sr_par_destroy().
+ */
+typedef struct _bcf_sr_par_t bcf_sr_par_t;
+typedef int (*bcf_sr_par_func)(bcf_srs_t *readers, void *data, kstring_t *out);
+
+/**
+ *  bcf_sr_par_init() - prepare region-parallel reading
+ *  @readers:     the files to read, with the collapse, apply_filters and
+ *                max_unpack settings to use. They must be indexed and stay
+ *                open until bcf_sr_par_destroy(); regions, targets and
+ *                samples are not supported.
+ *  @n_threads:   number of threads
+ *  @window_size: approximate bytes of data per window, 0 for the default
+ *  @func:        the callback
+ *  @data:        passed to the callback
+ *
+ *  Returns NULL on error.
+ */
+bcf_sr_par_t *bcf_sr_par_init(bcf_srs_t *readers, int n_threads, int64_t window_size, bcf_sr_par_func func, void *data);
+
+/**
+ *  bcf_sr_par_next() - output of the next window
+ *
+ *  Replaces the contents of @out with what the callback produced for the
+ *  next window. Returns 1 on success, 0 when all windows are done, or -1
+ *  if the callback failed or the files could not be opened.
+ */
+int bcf_sr_par_next(bcf_sr_par_t *par, kstring_t *out);
+void bcf_sr_par_destroy(bcf_sr_par_t *par);
+
 /**
  * bcf_sr_next_line() - the iterator
  * @readers:    holder of the open readers
@@ -98,14 +98,16 @@ typedef struct {
     const bcf_idinfo_t *val;
 } bcf_idpair_t;
 
+typedef struct bcf_translate_plan_t bcf_translate_plan_t;
+
 typedef struct {
     int32_t n[3];
     bcf_idpair_t *id[3];
     void *dict[3]; // ID dictionary, contig dict and sample dict
     char **samples;
     bcf_hrec_t **hrec;
-    int nhrec, dirty;
-    int ntransl, *transl[2];    // for bcf_translate()
+    int nhrec, dirty;           // dirty: see bcf_hdr_sync()
+    int ntransl, *transl[2];    // unused, bcf_translate() keeps its plan privately
     int nsamples_ori;           // for bcf_hdr_set_samples()
     uint8_t *keep_samples;
     kstring_t mem;
@@ -298,6 +300,12 @@ extern "C" {
      *  In this case, bcf_subset_format() must be called explicitly, because
      *  bcf_readrec() does not see the header.
      *
+     *  The kept samples are recorded as runs of adjacent columns, so that
+     *  subsetting a BCF record moves each run with a single copy.  When the
+     *  record's max_unpack excludes BCF_UN_FMT, the subsetting is skipped
+     *  and the FORMAT fields are dropped, as vcf_parse() drops them when
+     *  reading VCF; leave BCF_UN_FMT in max_unpack to keep them.
+     *
      *  Returns 0 on success, -1 on error or a positive integer if the list
      *  contains samples not present in the VCF header. In such a case, the
      *  return value is the index of the offending sample.
@@ -312,6 +320,16 @@ extern "C" {
     /** Parse VCF line contained in kstring and populate the bcf1_t struct */
     int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v);
 
+    /**
+     *  vcf_parse_nohdr() - vcf_parse() for use while other threads read @h.
+     *  The header is left untouched and @mem is used as scratch space in
+     *  place of h->mem.  A line which needs a contig, FILTER or tag missing
+     *  from the header is not parsed and -2 is returned; it must be parsed
+     *  again with vcf_parse() once no other thread is using @h.  The contents
+     *  of @s may be modified.
+     */
+    int vcf_parse_nohdr(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, kstring_t *mem);
+
     /** The opposite of vcf_parse. It should rarely be called directly, see vcf_write */
     int vcf_format(const bcf_hdr_t *h, const bcf1_t *v, kstring_t *s);
 
@@ -325,6 +343,21 @@ extern "C" {
      */
     int bcf_read(htsFile *fp, const bcf_hdr_t *h, bcf1_t *v);
 
+    /**
+     *  vcf_set_threads() - parse VCF records on @n_threads worker threads
+     *
+     *  Once set, bcf_read() and vcf_read() on @fp read lines ahead in
+     *  batches, parse them in parallel and return the records in file order.
+     *  Contigs and tags missing from the header are handled as when reading
+     *  serially, but the header must not be modified by the caller while
+     *  reading.  Do not mix with hts_getline() or iterators on the same file.
+     *  @n_threads of 0 stops the workers, discarding any lines read ahead.
+     *  Also reached through hts_set_threads().
+     *
+     *  Returns 0 on success, -1 on error or if @fp is not a VCF being read.
+     */
+    int vcf_set_threads(htsFile *fp, int n_threads);
+
     /**
      *  bcf_unpack() - unpack/decode a BCF record (fills the bcf1_t::d field)
      *
@@ -391,6 +424,20 @@ extern "C" {
      */
     int bcf_hdr_add_sample(bcf_hdr_t *hdr, const char *sample);
 
+    /**
+     *  bcf_hdr_reserve() - make room for more dictionary entries
+     *  @param type:  BCF_DT_ID, BCF_DT_CTG or BCF_DT_SAMPLE
+     *  @param n:     number of entries about to be added
+     *
+     *  Sizes the dictionary, and the header lines or sample names that go
+     *  with it, so that a header with hundreds of thousands of contigs or
+     *  samples can be built with bcf_hdr_append() and bcf_hdr_add_sample()
+     *  without repeated reallocation and rehashing. bcf_hdr_parse() does
+     *  this itself. As after adding lines, bcf_hdr_sync() must be called
+     *  before the header is used for records.
+     */
+    void bcf_hdr_reserve(bcf_hdr_t *hdr, int type, int n);
+
     /** Read VCF header from a file and update the header */
     int bcf_hdr_set(bcf_hdr_t *hdr, const char *fname);
 
@@ -437,6 +484,11 @@ extern "C" {
 
     /** The following functions are for internal use and should rarely be called directly */
     int bcf_hdr_parse(bcf_hdr_t *hdr, char *htxt);
+    /**
+     *  bcf_hdr_sync() - rebuild the id-to-name tables from the dictionaries.
+     *  Only the dictionaries flagged in h->dirty as having gained entries
+     *  are walked; a dirty value of 0 or with bit 0 set rebuilds all three.
+     */
     int bcf_hdr_sync(bcf_hdr_t *h);
     bcf_hrec_t *bcf_hdr_parse_line(const bcf_hdr_t *h, const char *line, int *len);
     void bcf_hrec_format(const bcf_hrec_t *hrec, kstring_t *str);
@@ -475,6 +527,25 @@ extern "C" {
      */
     int bcf_translate(const bcf_hdr_t *dst_hdr, bcf_hdr_t *src_hdr, bcf1_t *src_line);
 
+    /**
+     *  bcf_translate_plan_init() - precompute the translation of contig and tag
+     *                              ids from @src_hdr to @dst_hdr
+     *  bcf_translate_plan_apply() - translate @line with the plan
+     *  bcf_translate_plan_destroy() - free the plan
+     *
+     *  Applying a plan costs a table lookup per contig, FILTER, INFO and
+     *  FORMAT id.  The line is not unpacked when only its contig changes;
+     *  when no id changes its integer width, the ids are rewritten in
+     *  place in the BCF data and the line is not unpacked at all.
+     *  A plan must be rebuilt when either header changes.  bcf_translate()
+     *  keeps one with @src_hdr and does this itself.
+     *
+     *  bcf_translate_plan_init() returns NULL on error.
+     */
+    bcf_translate_plan_t *bcf_translate_plan_init(const bcf_hdr_t *dst_hdr, const bcf_hdr_t *src_hdr);
+    int bcf_translate_plan_apply(const bcf_translate_plan_t *plan, bcf1_t *line);
+    void bcf_translate_plan_destroy(bcf_translate_plan_t *plan);
+
     /**
      *  bcf_get_variant_type[s]()  - returns one of VCF_REF, VCF_SNP, etc
      */
@@ -621,6 +692,12 @@ extern "C" {
      *      -1 .. no such INFO tag defined in the header
      *      -2 .. clash between types defined in the header and encountered in the VCF record
      *      -3 .. tag is not present in the VCF record
+     *
+     *  A record that has not been unpacked or modified since it was read is
+     *  searched in its packed form and is left packed; these functions no
+     *  longer unpack it as a side effect.  Call bcf_unpack() before reading
+     *  line->d.info or line->d.fmt directly.  bcf_get_info() and
+     *  bcf_get_fmt() still unpack the record themselves.
      */
     #define bcf_get_info_int32(hdr,line,tag,dst,ndst)  bcf_get_info_values(hdr,line,tag,(void**)(dst),ndst,BCF_HT_INT)
     #define bcf_get_info_float(hdr,line,tag,dst,ndst)  bcf_get_info_values(hdr,line,tag,(void**)(dst),ndst,BCF_HT_REAL)
@@ -656,6 +733,27 @@ extern "C" {
     int bcf_get_format_string(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, char ***dst, int *ndst);
     int bcf_get_format_values(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, void **dst, int *ndst, int type);
 
+    /**
+     *  bcf_get_format_view() - access FORMAT values in place, without copying
+     *
+     *  Fills @view with a pointer to the tag's values inside the record and
+     *  their native BCF type.  The values of sample i start at
+     *  view->p + i*view->size and are view->n values of type view->type,
+     *  padded with the type's vector_end value; those of all samples are
+     *  contiguous.  The view is valid until the record is modified or read
+     *  into again.  See vcfutils.h for reductions that work on views.
+     *
+     *  Returns the number of samples on success, -1 if the tag is not in the
+     *  header or -3 if it is not present in the record.
+     */
+    typedef struct {
+        int type;           // BCF_BT_INT8, BCF_BT_INT16, BCF_BT_INT32, BCF_BT_FLOAT or BCF_BT_CHAR
+        int n, size;        // values and bytes per sample
+        int n_sample;
+        const uint8_t *p;
+    } bcf_fmt_view_t;
+    int bcf_get_format_view(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, bcf_fmt_view_t *view);
+
 
 
     /**************************************************************************
@@ -722,6 +820,7 @@ extern "C" {
     #define bcf_itr_destroy(iter) hts_itr_destroy(iter)
     #define bcf_itr_queryi(idx, tid, beg, end) hts_itr_query((idx), (tid), (beg), (end), bcf_readrec)
     #define bcf_itr_querys(idx, hdr, s) hts_itr_querys((idx), (s), (hts_name2id_f)(bcf_hdr_name2id), (hdr), hts_itr_query, bcf_readrec)
+    #define bcf_itr_queryregs(idx, tid, regs, nregs) hts_itr_query_regs((idx), (tid), (regs), (nregs), bcf_readrec)
     #define bcf_itr_next(htsfp, itr, r) hts_itr_next((htsfp)->fp.bgzf, (itr), (r), 0)
     #define bcf_index_load(fn) hts_idx_load(fn, HTS_FMT_CSI)
     #define bcf_index_seqnames(idx, hdr, nptr) hts_idx_seqnames((idx),(nptr),(hts_id2name_f)(bcf_hdr_id2name),(hdr))
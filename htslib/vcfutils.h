@@ -90,6 +90,107 @@ int bcf_calc_ac(const bcf_hdr_t *header, bcf1_t *line, int *ac, int which);
 #define GT_UNKN   6
 int bcf_gt_type(bcf_fmt_t *fmt_ptr, int isample, int *ial, int *jal);
 
+/**
+ *  Reductions over the values of a FORMAT view (see bcf_get_format_view()),
+ *  computed on the native BCF types without widening them first.  Missing
+ *  and vector_end values are skipped.
+ *
+ *  bcf_fmt_view_count_missing() - number of missing values
+ *  bcf_fmt_view_minmax()        - smallest and largest value
+ *  bcf_fmt_view_sum()           - sum of the values
+ *
+ *  bcf_fmt_view_minmax() and bcf_fmt_view_sum() return the number of values
+ *  included; all three return -1 if the view is not of an integer or float
+ *  type.
+ */
+int bcf_fmt_view_count_missing(const bcf_fmt_view_t *view);
+int bcf_fmt_view_minmax(const bcf_fmt_view_t *view, double *min, double *max);
+int bcf_fmt_view_sum(const bcf_fmt_view_t *view, double *sum);
+
+/**
+ *  bcf_fmt_view_dosage() - number of non-reference alleles in each genotype
+ *  @view:    view of the GT field
+ *  @dosage:  array of view->n_sample values to fill in; -1 for genotypes
+ *            with a missing allele
+ *
+ *  Returns the number of samples, or -1 if the view is not of an integer type.
+ */
+int bcf_fmt_view_dosage(const bcf_fmt_view_t *view, int8_t *dosage);
+
+/**
+ *  Genotype matrices
+ *
+ *  A bcf_gt_matrix_t holds the genotypes of up to m_variant variants of
+ *  n_sample samples in three planes.  Each plane stores one row per
+ *  variant, and every row starts on a 64-byte boundary:
+ *
+ *  dosage   BCF_GT_INT8: one int8_t per sample, the number of non-reference
+ *           alleles or -1 if an allele is missing.
+ *           BCF_GT_2BIT: four samples per byte, sample i in bits 2*(i%4)
+ *           of byte i/4, holding the dosage capped at 2, or 3 if missing.
+ *  phased   one bit per sample, sample i in bit i%8 of byte i/8, set when
+ *           every allele after the first is phased (never for haploids).
+ *  missing  one bit per sample, laid out as phased, set when the dosage is
+ *           missing.  Samples without GT, or all samples of a record
+ *           without GT, are missing.
+ *
+ *  rid and pos give the CHROM and POS of each row.  Bits and values past
+ *  n_sample in a row are zero.
+ */
+#define BCF_GT_2BIT 2
+#define BCF_GT_INT8 8
+typedef struct {
+    int n_sample, n_variant, m_variant;   // samples, rows filled, rows available
+    int bits;                             // BCF_GT_2BIT or BCF_GT_INT8
+    size_t dosage_stride, mask_stride;    // bytes from one row to the next
+    uint8_t *dosage, *phased, *missing;
+    int32_t *rid, *pos;
+    int8_t *tmp;                          // scratch row for BCF_GT_2BIT
+    void *mem;                            // allocated by bcf_gt_matrix_init()
+} bcf_gt_matrix_t;
+
+/**
+ *  bcf_gt_matrix_size() - bytes needed for a matrix of the given shape
+ *  bcf_gt_matrix_init() - lay out a matrix in @buf, which must be aligned
+ *                         to 64 bytes and at least bcf_gt_matrix_size()
+ *                         long, or in newly allocated memory if @buf is NULL
+ *  bcf_gt_matrix_destroy() - free memory allocated by bcf_gt_matrix_init()
+ *
+ *  bcf_gt_matrix_init() returns 0 on success or -1 on error.
+ */
+size_t bcf_gt_matrix_size(int n_sample, int m_variant, int bits);
+int bcf_gt_matrix_init(bcf_gt_matrix_t *mat, int n_sample, int m_variant, int bits, void *buf);
+void bcf_gt_matrix_destroy(bcf_gt_matrix_t *mat);
+
+/**
+ *  bcf_gt_matrix_add() - append the genotypes of @rec as the next row
+ *
+ *  Returns the index of the row, or -1 if the matrix is full or @rec
+ *  does not have mat->n_sample samples.
+ */
+int bcf_gt_matrix_add(bcf_gt_matrix_t *mat, const bcf_hdr_t *hdr, bcf1_t *rec);
+
+/**
+ *  bcf_gt_reader_open() - stream the genotypes of a VCF/BCF file into matrices
+ *  @region:    "chr", "chr:beg" or "chr:beg-end" to read from an indexed
+ *              file, or NULL for the whole file
+ *  @samples:   comma-separated samples to keep as for bcf_hdr_set_samples(),
+ *              or NULL for all
+ *  @n_threads: number of threads parsing VCF text, when reading a whole
+ *              VCF file
+ *
+ *  bcf_gt_reader_next() clears @mat and fills it with the genotypes of the
+ *  next mat->m_variant records, fewer at the end; it returns the number of
+ *  rows filled, 0 at the end of the file or region, or -1 on error.
+ *  The matrix must be made for bcf_hdr_nsamples(bcf_gt_reader_header(r))
+ *  samples.
+ */
+typedef struct _bcf_gt_reader_t bcf_gt_reader_t;
+bcf_gt_reader_t *bcf_gt_reader_open(const char *fname, const char *region, const char *samples, int n_threads);
+const bcf_hdr_t *bcf_gt_reader_header(bcf_gt_reader_t *r);
+int bcf_gt_reader_next(bcf_gt_reader_t *r, bcf_gt_matrix_t *mat);
+void bcf_gt_reader_close(bcf_gt_reader_t *r);
+
 static inline int bcf_acgt2int(char c)
 {
     if ( (int)c>96 ) c -= 32;
@@ -25,6 +25,7 @@
 # These variables can be used to express dependencies on htslib headers.
 # See htslib.mk for details.
 
+htslib_bam_sort_h = $(HTSPREFIX)htslib/bam_sort.h $(htslib_sam_h)
 htslib_bgzf_h = $(HTSPREFIX)htslib/bgzf.h
 htslib_faidx_h = $(HTSPREFIX)htslib/faidx.h
 htslib_hfile_h = $(HTSPREFIX)htslib/hfile.h $(htslib_hts_defs_h)
@@ -59,6 +59,85 @@ int ksprintf(kstring_t *s, const char *fmt, ...)
 	return l;
 }
 
+/* Powers of ten that are exactly representable as doubles */
+static const double ks_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Scale |d| so that, for decimal exponent e, its six significant digits are
+ * the integer part.  A single correctly rounded multiply or divide by an
+ * exact power of ten keeps the result within 2^-53 relative of the truth. */
+static inline double ks_scale6(double a, int e)
+{
+	return e <= 5 ? a * ks_pow10[5 - e] : a / ks_pow10[e - 5];
+}
+
+int kputd(double d, kstring_t *s)
+{
+	char buf[32], digits[6], *p = buf;
+	double a, x, frac;
+	uint64_t bits;
+	uint32_t n;
+	int e, nd, i;
+
+	memcpy(&bits, &d, sizeof bits);
+	if ((bits << 1) == 0) { // +0 or -0
+		if (bits) return kputsn("-0", 2, s) < 0 ? EOF : 2;
+		return kputc('0', s) < 0 ? EOF : 1;
+	}
+	if (((bits >> 52) & 0x7ff) == 0x7ff) return ksprintf(s, "%g", d); // inf, nan
+	a = d < 0 ? -d : d;
+
+	// Estimate the decimal exponent from the binary one and then correct it
+	// from the rounded six-digit mantissa.  Values outside the range where
+	// the scale factor is exact, and values lying so close to a rounding
+	// boundary that the scaled product cannot decide it, go to printf.
+	e = ((int)((bits >> 52) & 0x7ff) - 1023) * 78913 >> 18;
+	for (i = 0; ; ++i) {
+		if (e < -17 || e > 27 || i > 2) return ksprintf(s, "%g", d);
+		x = ks_scale6(a, e);
+		if (x >= 4294967295.0) { ++e; continue; }
+		n = (uint32_t)x;
+		frac = x - n;
+		if (frac > 0.5 - 1e-9 && frac < 0.5 + 1e-9) return ksprintf(s, "%g", d);
+		n += frac > 0.5;
+		if (n >= 1000000) ++e;
+		else if (n < 100000) --e;
+		else break;
+	}
+
+	for (i = 5; i >= 0; --i) digits[i] = '0' + n % 10, n /= 10;
+	for (nd = 6; nd > 1 && digits[nd - 1] == '0'; --nd);
+
+	if (d < 0) *p++ = '-';
+	if (e >= -4 && e < 6) {
+		if (e >= 0) {
+			for (i = 0; i <= e; ++i) *p++ = i < nd ? digits[i] : '0';
+			if (nd > e + 1) {
+				*p++ = '.';
+				for (; i < nd; ++i) *p++ = digits[i];
+			}
+		} else {
+			*p++ = '0'; *p++ = '.';
+			for (i = -1; i > e; --i) *p++ = '0';
+			for (i = 0; i < nd; ++i) *p++ = digits[i];
+		}
+	} else {
+		*p++ = digits[0];
+		if (nd > 1) {
+			*p++ = '.';
+			for (i = 1; i < nd; ++i) *p++ = digits[i];
+		}
+		*p++ = 'e';
+		*p++ = e < 0 ? '-' : '+';
+		if (e < 0) e = -e;
+		*p++ = ks_digit_pairs[e * 2];
+		*p++ = ks_digit_pairs[e * 2 + 1];
+	}
+	return kputsn(buf, p - buf, s);
+}
+
 char *kstrtok(const char *str, const char *sep, ks_tokaux_t *aux)
 {
 	const char *p, *start;
@@ -22,18 +22,25 @@
     THE SOFTWARE.
 */
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "htslib/hts.h"
 #include "htslib/kstring.h"
 #include "htslib/kseq.h"
 #include "htslib/khash_str2int.h"
 #include "htslib/regidx.h"
 
-#define LIDX_SHIFT 13   // number of insignificant index bits
-
-// List of regions for one chromosome
+// List of regions for one chromosome, sorted by start. The index is an
+// implicit binary tree over the regions holding the maximum end coordinate
+// of each subtree: leaf j+nmax is region j, the children of node k are 2k
+// and 2k+1. It lets the overlap queries skip runs of regions ending before
+// the query start, however long, without looking at them.
 typedef struct
 {
-    int *idx, nidx;
+    uint32_t *max;
+    int nmax;           // number of leaves, a power of two
     int nregs, mregs;   // n:used, m:alloced
     reg_t *regs;
     void *payload;
@@ -56,6 +63,11 @@ struct _regidx_t
     int rid_prev, start_prev, end_prev;
     int payload_size;
     void *payload;
+
+    // set by regidx_load(): the regions, index and payloads live in the
+    // snapshot, which is mapped (map_len>0) or read into memory
+    void *map;
+    size_t map_len;
 };
 
 int regidx_seq_nregs(regidx_t *idx, const char *seq)
@@ -84,36 +96,50 @@ int _regidx_build_index(regidx_t *idx)
     for (iseq=0; iseq<idx->nseq; iseq++)
     {
         reglist_t *list = &idx->seq[iseq];
-        int j,k, imax = 0;   // max index bin
-        for (j=0; j<list->nregs; j++)
-        {
-            int ibeg = list->regs[j].start >> LIDX_SHIFT;
-            int iend = list->regs[j].end >> LIDX_SHIFT;
-            if ( imax < iend + 1 )
-            {
-                int old_imax = imax; 
-                imax = iend + 1;
-                kroundup32(imax);
-                list->idx = (int*) realloc(list->idx, imax*sizeof(int));
-                for (k=old_imax; k<imax; k++) list->idx[k] = -1;
-            }
-            if ( ibeg==iend )
-            {
-                if ( list->idx[ibeg]<0 ) list->idx[ibeg] = j;
-            }
-            else
-            {
-                for (k=ibeg; k<=iend; k++)
-                    if ( list->idx[k]<0 ) list->idx[k] = j;
-            }
-            list->nidx = iend + 1;
-        }
+        int j, nmax = list->nregs;
+        kroundup32(nmax);
+        if ( nmax < 1 ) nmax = 1;
+        list->nmax = nmax;
+        list->max  = (uint32_t*) realloc(list->max, 2*nmax*sizeof(uint32_t));
+        for (j=0; j<list->nregs; j++) list->max[nmax+j] = list->regs[j].end;
+        for (; j<nmax; j++) list->max[nmax+j] = 0;
+        for (j=nmax-1; j>0; j--)
+            list->max[j] = list->max[2*j] > list->max[2*j+1] ? list->max[2*j] : list->max[2*j+1];
     }
     return 0;
 }
 
+// Returns the first region at or after ireg which ends at or after from, or
+// nregs if there is none. The search climbs only as high as the distance to
+// the region found requires.
+static int _reglist_next(reglist_t *list, int ireg, uint32_t from)
+{
+    if ( ireg >= list->nregs ) return list->nregs;
+    int k = ireg + list->nmax;
+    if ( list->max[k] >= from ) return ireg;
+    while (1)
+    {
+        while ( k & 1 ) k >>= 1;    // up to the nearest ancestor with a right sibling
+        if ( !k ) return list->nregs;
+        k++;
+        if ( list->max[k] >= from ) break;
+    }
+    while ( k < list->nmax )
+    {
+        k <<= 1;
+        if ( list->max[k] < from ) k++;
+    }
+    ireg = k - list->nmax;
+    return ireg < list->nregs ? ireg : list->nregs;
+}
+
 int regidx_insert(regidx_t *idx, char *line)
 {
+    if ( idx->map )
+    {
+        fprintf(stderr,"Regions cannot be added to an index loaded by regidx_load()\n");
+        return -1;
+    }
     if ( !line )
         return _regidx_build_index(idx);
 
@@ -137,6 +163,14 @@ int regidx_insert(regidx_t *idx, char *line)
     }
 
     reglist_t *list = &idx->seq[rid];
+    if ( list->max )
+    {
+        // the tree no longer covers the regions; queries of this sequence
+        // find nothing until regidx_insert(idx,NULL) builds it again
+        free(list->max);
+        list->max  = NULL;
+        list->nmax = 0;
+    }
     list->nregs++;
     int m_prev = list->mregs;
     hts_expand(reg_t,list->nregs,list->mregs,list->regs);
@@ -219,6 +253,12 @@ error:
 void regidx_destroy(regidx_t *idx)
 {
     int i, j;
+    if ( idx->map )
+    {
+        if ( idx->map_len ) munmap(idx->map, idx->map_len);
+        else free(idx->map);
+        idx->nseq = 0;  // the lists point into the snapshot
+    }
     for (i=0; i<idx->nseq; i++)
     {
         reglist_t *list = &idx->seq[i];
@@ -229,7 +269,7 @@ void regidx_destroy(regidx_t *idx)
         }
         free(list->payload);
         free(list->regs);
-        free(list->idx);
+        free(list->max);
     }
     free(idx->seq_names);
     free(idx->seq);
@@ -239,6 +279,23 @@ void regidx_destroy(regidx_t *idx)
     free(idx);
 }
 
+// Set the iterator to the first region overlapping from,to at or after
+// ireg; returns 1 if there is one, 0 otherwise
+static inline int _reglist_overlap(regidx_t *idx, reglist_t *list, int ireg, uint32_t from, uint32_t to, regitr_t *itr)
+{
+    if ( ireg>=list->nregs || list->regs[ireg].start > to ) return 0;   // no match
+
+    if ( !itr ) return 1;
+
+    itr->i = ireg;
+    itr->n = list->nregs;
+    itr->reg = list->regs;
+    itr->payload = idx->payload_size ? list->payload : NULL;
+    itr->seq = list;
+
+    return 1;
+}
+
 int regidx_overlap(regidx_t *idx, const char *chr, uint32_t from, uint32_t to, regitr_t *itr)
 {
     if ( itr ) itr->i = itr->n = 0;
@@ -247,37 +304,223 @@ int regidx_overlap(regidx_t *idx, const char *chr, uint32_t from, uint32_t to, r
     if ( khash_str2int_get(idx->seq2regs, chr, &iseq)!=0 ) return 0; // no such sequence
 
     reglist_t *list = &idx->seq[iseq];
-    if ( !list->nregs ) return 0;
+    if ( !list->nregs || !list->max ) return 0;
+
+    // The regions are sorted by start: the first one to end after from is
+    // the first overlap, unless it starts after to
+    return _reglist_overlap(idx, list, _reglist_next(list, 0, from), from, to, itr);
+}
+
+void regcur_init(regcur_t *cur, regidx_t *idx)
+{
+    cur->idx  = idx;
+    cur->iseq = -1;
+    cur->ireg = 0;
+    cur->from = 0;
+}
+
+int regcur_overlap(regcur_t *cur, const char *chr, uint32_t from, uint32_t to, regitr_t *itr)
+{
+    regidx_t *idx = cur->idx;
+    if ( itr ) itr->i = itr->n = 0;
 
-    int i, ibeg = from>>LIDX_SHIFT; 
-    int ireg = ibeg < list->nidx ? list->idx[ibeg] : list->idx[ list->nidx - 1 ];
-    if ( ireg < 0 )
+    if ( cur->iseq<0 || strcmp(chr, idx->seq_names[cur->iseq]) )
     {
-        // linear search; if slow, replace with binary search
-        if ( ibeg > list->nidx ) ibeg = list->nidx;
-        for (i=ibeg - 1; i>=0; i--)
-            if ( list->idx[i] >=0 ) break;
-        ireg = i>=0 ? list->idx[i] : 0;
+        if ( khash_str2int_get(idx->seq2regs, chr, &cur->iseq)!=0 ) { cur->iseq = -1; return 0; }
+        cur->ireg = 0;
     }
-    for (i=ireg; i<list->nregs; i++)
+    else if ( from < cur->from ) cur->ireg = 0;     // out of order, start afresh
+    cur->from = from;
+
+    // As from grows, the first region ending at or after it can only move
+    // forward: search from where the previous query stopped
+    reglist_t *list = &idx->seq[cur->iseq];
+    if ( !list->nregs || !list->max ) return 0;
+    cur->ireg = _reglist_next(list, cur->ireg, from);
+    return _reglist_overlap(idx, list, cur->ireg, from, to, itr);
+}
+
+int regitr_overlap_next(regitr_t *itr, uint32_t from, uint32_t to)
+{
+    reglist_t *list = (reglist_t*) itr->seq;
+    if ( itr->i < itr->n ) itr->i = _reglist_next(list, itr->i, from);
+    if ( itr->i < itr->n && itr->reg[itr->i].start <= to ) return 1;
+    itr->i = itr->n;
+    return 0;
+}
+
+/*
+ *  Snapshots.  All integers are in the byte order of the host which wrote
+ *  the file, checked on loading by a known value, and each array starts at
+ *  a multiple of 8 bytes so that it can be used in place:
+ *
+ *      char     magic[4]       "RIDX"
+ *      uint32_t version        1
+ *      uint32_t byte_order     0x01020304
+ *      uint32_t nseq
+ *      uint64_t payload_size
+ *      snap_seq_t seq[nseq]    offsets from the start of the file
+ *      sequence names, regions, index trees and payloads
+ */
+#define REGIDX_SNAP_MAGIC "RIDX"
+#define REGIDX_SNAP_VERSION 1
+#define REGIDX_SNAP_ORDER 0x01020304
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version, byte_order, nseq;
+    uint64_t payload_size;
+}
+snap_hdr_t;
+
+typedef struct
+{
+    uint64_t name, regs, max, payload;
+    uint32_t nregs, nmax;
+}
+snap_seq_t;
+
+static inline uint64_t snap_align(uint64_t off) { return (off + 7) & ~(uint64_t)7; }
+
+// Is the array of n items of size bytes at off aligned and inside a file of
+// file_size bytes?  The products are checked without overflowing.
+static inline int snap_fits(uint64_t off, uint64_t n, uint64_t size, uint64_t file_size)
+{
+    if ( off & 7 || off > file_size ) return 0;
+    return !n || size <= (file_size - off) / n;
+}
+
+static int snap_write(FILE *fp, uint64_t *off, uint64_t at, const void *data, size_t len)
+{
+    static const char zero[8] = {0};
+    if ( at > *off && fwrite(zero, 1, at - *off, fp) != at - *off ) return -1;
+    if ( len && fwrite(data, 1, len, fp) != len ) return -1;
+    *off = at + len;
+    return 0;
+}
+
+int regidx_save(regidx_t *idx, const char *fname)
+{
+    if ( idx->free )
+    {
+        fprintf(stderr,"[%s] payloads which own memory cannot be saved\n", __func__);
+        return -1;
+    }
+    if ( idx->map ) return -1;  // already a snapshot, copy the file instead
+    int i;
+    for (i=0; i<idx->nseq; i++)
+        if ( !idx->seq[i].max ) { _regidx_build_index(idx); break; }
+
+    // Lay out the file
+    snap_hdr_t hdr;
+    memcpy(hdr.magic, REGIDX_SNAP_MAGIC, 4);
+    hdr.version = REGIDX_SNAP_VERSION;
+    hdr.byte_order = REGIDX_SNAP_ORDER;
+    hdr.nseq = idx->nseq;
+    hdr.payload_size = idx->payload_size;
+    snap_seq_t *seq = (snap_seq_t*) calloc(idx->nseq > 0 ? idx->nseq : 1, sizeof(snap_seq_t));
+    uint64_t off = snap_align(sizeof(hdr) + idx->nseq*sizeof(snap_seq_t));
+    for (i=0; i<idx->nseq; i++)
     {
-        if ( list->regs[i].start > to ) return 0;   // no match
-        if ( list->regs[i].end >= from && list->regs[i].start <= to ) break; // found
+        reglist_t *list = &idx->seq[i];
+        seq[i].nregs = list->nregs;
+        seq[i].nmax  = list->nmax;
+        seq[i].name  = off;      off = snap_align(off + strlen(idx->seq_names[i]) + 1);
+        seq[i].regs  = off;      off = snap_align(off + list->nregs*sizeof(reg_t));
+        seq[i].max   = off;      off = snap_align(off + 2*list->nmax*sizeof(uint32_t));
+        seq[i].payload = off;    off = snap_align(off + (uint64_t)list->nregs*idx->payload_size);
+    }
+
+    FILE *fp = fopen(fname, "wb");
+    if ( !fp ) { free(seq); return -1; }
+    off = 0;
+    int ret = snap_write(fp, &off, 0, &hdr, sizeof(hdr));
+    if ( !ret ) ret = snap_write(fp, &off, off, seq, idx->nseq*sizeof(snap_seq_t));
+    for (i=0; i<idx->nseq && !ret; i++)
+    {
+        reglist_t *list = &idx->seq[i];
+        ret = snap_write(fp, &off, seq[i].name, idx->seq_names[i], strlen(idx->seq_names[i]) + 1);
+        if ( !ret ) ret = snap_write(fp, &off, seq[i].regs, list->regs, list->nregs*sizeof(reg_t));
+        if ( !ret ) ret = snap_write(fp, &off, seq[i].max, list->max, 2*list->nmax*sizeof(uint32_t));
+        if ( !ret ) ret = snap_write(fp, &off, seq[i].payload, list->payload, (size_t)list->nregs*idx->payload_size);
     }
+    if ( !ret ) ret = snap_write(fp, &off, snap_align(off), NULL, 0);
+    if ( fclose(fp)!=0 ) ret = -1;
+    free(seq);
+    return ret;
+}
 
-    if ( i>=list->nregs ) return 0;   // no match
+regidx_t *regidx_load(const char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    if ( fd<0 ) return NULL;
+    struct stat st;
+    if ( fstat(fd, &st)<0 || st.st_size < sizeof(snap_hdr_t) ) { close(fd); return NULL; }
 
-    if ( !itr ) return 1;
+    regidx_t *idx = (regidx_t*) calloc(1,sizeof(regidx_t));
+    idx->map_len = st.st_size;
+    idx->map = mmap(NULL, idx->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if ( idx->map==MAP_FAILED )
+    {
+        // No mmap for this file, read it instead
+        idx->map_len = 0;
+        idx->map = malloc(st.st_size);
+        ssize_t nread = 0, ret;
+        while ( idx->map && nread < st.st_size && (ret = read(fd, (char*)idx->map + nread, st.st_size - nread)) > 0 ) nread += ret;
+        if ( !idx->map || nread < st.st_size ) { close(fd); free(idx->map); free(idx); return NULL; }
+    }
+    close(fd);
 
-    itr->i = 0;
-    itr->n = list->nregs - i;
-    itr->reg = &idx->seq[iseq].regs[i];
-    if ( idx->payload_size )
-        itr->payload = idx->seq[iseq].payload + i*idx->payload_size;
-    else
-        itr->payload = NULL;
+    const char *base = (const char*) idx->map;
+    snap_hdr_t hdr;
+    memcpy(&hdr, base, sizeof(hdr));
+    if ( memcmp(hdr.magic, REGIDX_SNAP_MAGIC, 4) || hdr.version!=REGIDX_SNAP_VERSION || hdr.byte_order!=REGIDX_SNAP_ORDER
+        || sizeof(hdr) + (uint64_t)hdr.nseq*sizeof(snap_seq_t) > st.st_size )
+    {
+        fprintf(stderr,"[%s] %s is not a regidx snapshot written on this kind of machine\n", __func__, fname);
+        goto error;
+    }
 
-    return 1;
+    idx->seq2regs = khash_str2int_init();
+    idx->payload_size = hdr.payload_size;
+    idx->nseq = idx->mseq = hdr.nseq;
+    idx->seq = (reglist_t*) calloc(hdr.nseq ? hdr.nseq : 1, sizeof(reglist_t));
+    idx->seq_names = (char**) calloc(hdr.nseq ? hdr.nseq : 1, sizeof(char*));
+    const snap_seq_t *seq = (const snap_seq_t*) (base + sizeof(hdr));
+    int i;
+    for (i=0; i<hdr.nseq; i++)
+    {
+        // Each sequence's name, regions, index tree and payloads follow one
+        // another and must all lie in the file
+        reglist_t *list = &idx->seq[i];
+        uint64_t size = st.st_size;
+        if ( seq[i].nregs > seq[i].nmax
+            || !snap_fits(seq[i].name, 1, 1, size) || seq[i].regs <= seq[i].name
+            || !snap_fits(seq[i].regs, seq[i].nregs, sizeof(reg_t), size)
+            || seq[i].max < seq[i].regs + (uint64_t)seq[i].nregs*sizeof(reg_t)
+            || !snap_fits(seq[i].max, seq[i].nmax, 2*sizeof(uint32_t), size)
+            || seq[i].payload < seq[i].max + (uint64_t)seq[i].nmax*2*sizeof(uint32_t)
+            || !snap_fits(seq[i].payload, seq[i].nregs, hdr.payload_size, size)
+            || memchr(base + seq[i].name, 0, seq[i].regs - seq[i].name)==NULL )
+        {
+            fprintf(stderr,"[%s] %s is truncated or corrupted\n", __func__, fname);
+            goto error;
+        }
+        list->nregs = list->mregs = seq[i].nregs;
+        list->nmax  = seq[i].nmax;
+        list->regs  = (reg_t*) (base + seq[i].regs);
+        list->max   = (uint32_t*) (base + seq[i].max);
+        list->payload = (void*) (base + seq[i].payload);
+        idx->seq_names[i] = strdup(base + seq[i].name);
+        khash_str2int_set(idx->seq2regs, idx->seq_names[i], i);
+    }
+    return idx;
+
+error:
+    if ( !idx->seq2regs ) idx->seq2regs = khash_str2int_init();
+    regidx_destroy(idx);
+    return NULL;
 }
 
 int regidx_parse_bed(const char *line, char **chr_beg, char **chr_end, reg_t *reg, void *payload, void *usr)
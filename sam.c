@@ -1030,13 +1030,13 @@ int sam_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
             } else return -1;
         } else if (type == 'f') {
             if (s+4 <= b->data + b->l_data) {
-                ksprintf(str, "f:%g", *(float*)s);
+                kputsn("f:", 2, str); kputd(*(float*)s, str);
                 s += 4;
             } else return -1;
 
         } else if (type == 'd') {
             if (s+8 <= b->data + b->l_data) {
-                ksprintf(str, "d:%g", *(double*)s);
+                kputsn("d:", 2, str); kputd(*(double*)s, str);
                 s += 8;
             } else return -1;
         } else if (type == 'Z' || type == 'H') {
@@ -1061,7 +1061,7 @@ int sam_format1(const bam_hdr_t *h, const bam1_t *b, kstring_t *str)
                 else if ('S' == sub_type) { kputw(*(uint16_t*)s, str); s += 2; }
                 else if ('i' == sub_type) { kputw(*(int32_t*)s, str); s += 4; }
                 else if ('I' == sub_type) { kputuw(*(uint32_t*)s, str); s += 4; }
-                else if ('f' == sub_type) { ksprintf(str, "%g", *(float*)s); s += 4; }
+                else if ('f' == sub_type) { kputd(*(float*)s, str); s += 4; }
             }
         }
     }
@@ -1198,6 +1198,191 @@ char *bam_aux2Z(const uint8_t *s)
     else return 0;
 }
 
+/*******************************
+ *** Indexed auxiliary fields ***
+ *******************************/
+
+typedef struct {
+    uint16_t tag;     // tag[0]<<8 | tag[1]
+    uint32_t off;     // offset of the type byte from bam_get_aux()
+    uint32_t len;     // length of type byte plus value
+} aux_ent_t;
+
+struct __bam_aux_idx_t {
+    int n, m;
+    aux_ent_t *ent;
+};
+
+bam_aux_idx_t *bam_aux_idx_init(void)
+{
+    return (bam_aux_idx_t*)calloc(1, sizeof(bam_aux_idx_t));
+}
+
+void bam_aux_idx_destroy(bam_aux_idx_t *idx)
+{
+    if (!idx) return;
+    free(idx->ent);
+    free(idx);
+}
+
+// Like skip_aux(), but checks that the value lies within [s,end)
+static inline uint8_t *skip_aux_checked(uint8_t *s, uint8_t *end)
+{
+    int size = aux_type2size(*s);
+    uint32_t n;
+    ++s;
+    switch (size) {
+    case 'Z':
+    case 'H':
+        while (s < end && *s) ++s;
+        return s < end ? s + 1 : NULL;
+    case 'B':
+        if (end - s < 5) return NULL;
+        size = aux_type2size(*s); ++s;
+        if (size < 1 || size > 8) return NULL;
+        memcpy(&n, s, 4); s += 4;
+        return (uint64_t)size * n <= (uint64_t)(end - s) ? s + size * n : NULL;
+    case 0:
+        return NULL;
+    default:
+        return end - s >= size ? s + size : NULL;
+    }
+}
+
+int bam_aux_idx_build(bam_aux_idx_t *idx, const bam1_t *b)
+{
+    uint8_t *aux = bam_get_aux(b), *s = aux, *end = b->data + b->l_data;
+    idx->n = 0;
+    while (end - s >= 3) {
+        aux_ent_t *e;
+        uint8_t *t = skip_aux_checked(s + 2, end);
+        if (!t) return -1;
+        if (idx->n == idx->m) {
+            int m = idx->m ? idx->m * 2 : 16;
+            aux_ent_t *tmp = (aux_ent_t*)realloc(idx->ent, m * sizeof(aux_ent_t));
+            if (!tmp) return -1;
+            idx->ent = tmp; idx->m = m;
+        }
+        e = &idx->ent[idx->n++];
+        e->tag = s[0]<<8 | s[1];
+        e->off = s + 2 - aux;
+        e->len = t - (s + 2);
+        s = t;
+    }
+    return idx->n;
+}
+
+static inline aux_ent_t *aux_idx_find(const bam_aux_idx_t *idx, const char tag[2])
+{
+    uint16_t y = (uint8_t)tag[0]<<8 | (uint8_t)tag[1];
+    int i;
+    for (i = 0; i < idx->n; ++i)
+        if (idx->ent[i].tag == y) return &idx->ent[i];
+    return NULL;
+}
+
+uint8_t *bam_aux_idx_get(const bam_aux_idx_t *idx, const bam1_t *b, const char tag[2])
+{
+    aux_ent_t *e = aux_idx_find(idx, tag);
+    return e ? bam_get_aux(b) + e->off : NULL;
+}
+
+int bam_aux_idx_get_many(const bam_aux_idx_t *idx, const bam1_t *b, int n, const char *tags, uint8_t **vals)
+{
+    uint8_t *aux = bam_get_aux(b);
+    int i, nfound = 0;
+    for (i = 0; i < n; ++i) {
+        aux_ent_t *e = aux_idx_find(idx, tags + 2*i);
+        vals[i] = e ? aux + e->off : NULL;
+        if (e) ++nfound;
+    }
+    return nfound;
+}
+
+int bam_aux_get_many(const bam1_t *b, int n, const char *tags, uint8_t **vals)
+{
+    uint8_t *s = bam_get_aux(b), *end = b->data + b->l_data;
+    int i, nfound = 0;
+    for (i = 0; i < n; ++i) vals[i] = NULL;
+    while (end - s >= 3 && nfound < n) {
+        for (i = 0; i < n; ++i)
+            if (!vals[i] && s[0] == (uint8_t)tags[2*i] && s[1] == (uint8_t)tags[2*i+1]) {
+                vals[i] = s + 2; ++nfound;
+                break;
+            }
+        s = skip_aux(s + 2);
+    }
+    return nfound;
+}
+
+int bam_aux_update(bam1_t *b, bam_aux_idx_t *idx, const char tag[2], char type, int len, const uint8_t *data)
+{
+    uint8_t *aux = bam_get_aux(b), *p;
+    uint32_t off, old_len, new_len = len + 1;
+    int i;
+
+    if (idx) {
+        aux_ent_t *e = aux_idx_find(idx, tag);
+        if (!e) goto append;
+        off = e->off; old_len = e->len;
+    } else {
+        uint8_t *s = bam_aux_get(b, tag);
+        if (!s) goto append;
+        off = s - aux; old_len = skip_aux(s) - s;
+    }
+
+    if (old_len != new_len) {
+        // Splice: shift the fields that follow by the difference in length
+        int32_t delta = (int32_t)new_len - (int32_t)old_len;
+        uint32_t tail = b->l_data - (aux - b->data) - off - old_len;
+        if (delta > 0 && b->l_data + delta > b->m_data) {
+            uint8_t *tmp;
+            uint32_t m = b->l_data + delta;
+            kroundup32(m);
+            if (!(tmp = (uint8_t*)realloc(b->data, m))) return -1;
+            b->data = tmp; b->m_data = m;
+            aux = bam_get_aux(b);
+        }
+        memmove(aux + off + new_len, aux + off + old_len, tail);
+        b->l_data += delta;
+        if (idx)
+            for (i = 0; i < idx->n; ++i) {
+                if (idx->ent[i].off > off) idx->ent[i].off += delta;
+                else if (idx->ent[i].off == off) idx->ent[i].len = new_len;
+            }
+    }
+    p = aux + off;
+    *p = type;
+    memcpy(p + 1, data, len);
+    return 0;
+
+append:
+    // Grow the index first, so that a failure leaves the record and the
+    // index as they were
+    if (idx && idx->n == idx->m) {
+        int m = idx->m ? idx->m * 2 : 16;
+        aux_ent_t *tmp = (aux_ent_t*)realloc(idx->ent, m * sizeof(aux_ent_t));
+        if (!tmp) return -1;
+        idx->ent = tmp; idx->m = m;
+    }
+    off = b->l_data - (aux - b->data) + 2;
+    if (b->l_data + 3 + len > b->m_data) {
+        uint8_t *tmp;
+        uint32_t m = b->l_data + 3 + len;
+        kroundup32(m);
+        if (!(tmp = (uint8_t*)realloc(b->data, m))) return -1;
+        b->data = tmp; b->m_data = m;
+    }
+    bam_aux_append(b, tag, type, len, (uint8_t*)data);
+    if (idx) {
+        idx->ent[idx->n].tag = (uint8_t)tag[0]<<8 | (uint8_t)tag[1];
+        idx->ent[idx->n].off = off;
+        idx->ent[idx->n].len = new_len;
+        idx->n++;
+    }
+    return 0;
+}
+
 int sam_open_mode(char *mode, const char *fn, const char *format)
 {
     // TODO Parse "bam5" etc for compression level
@@ -1279,9 +1464,10 @@ char *bam_flag2str(int flag)
 
 typedef struct {
     int k, x, y, end;
+    int op_end, is_match; // cursor cache: end of operation k, and whether it is M/=/X
 } cstate_t;
 
-static cstate_t g_cstate_null = { -1, 0, 0, 0 };
+static cstate_t g_cstate_null = { -1, 0, 0, 0, 0, 0 };
 
 typedef struct __linkbuf_t {
     bam1_t b;
@@ -1342,8 +1528,18 @@ static inline int resolve_cigar2(bam_pileup1_t *p, int32_t pos, cstate_t *s)
 
     bam1_t *b = p->b;
     bam1_core_t *c = &b->core;
-    uint32_t *cigar = bam_get_cigar(b);
+    uint32_t *cigar;
     int k;
+
+    // Fast path: still strictly inside the current M/=/X operation, so there
+    // is no operation to advance to or peek at and only qpos moves.
+    if (s->is_match && pos + 1 < s->op_end) {
+        p->qpos = s->y + (pos - s->x);
+        p->is_del = p->indel = p->is_refskip = 0;
+        p->is_head = (pos == c->pos); p->is_tail = (pos == s->end);
+        return 1;
+    }
+    cigar = bam_get_cigar(b);
     // determine the current CIGAR operation
 //  fprintf(stderr, "%s\tpos=%d\tend=%d\t(%d,%d,%d)\n", bam_get_qname(b), pos, s->end, s->k, s->x, s->y);
     if (s->k == -1) { // never processed
@@ -1408,10 +1604,45 @@ static inline int resolve_cigar2(bam_pileup1_t *p, int32_t pos, cstate_t *s)
             p->is_refskip = (op == BAM_CREF_SKIP);
         } // cannot be other operations; otherwise a bug
         p->is_head = (pos == c->pos); p->is_tail = (pos == s->end);
+        s->op_end = s->x + l;
+        s->is_match = (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF);
     }
     return 1;
 }
 
+/************************************
+ *** Structure-of-arrays columns ***
+ ************************************/
+
+// All four arrays share one allocation, anchored at soa->base
+static int soa_resize(bam_pileup_soa_t *soa, int m)
+{
+    uint8_t *tmp = (uint8_t*)realloc(soa->base, (size_t)m * 4);
+    if (!tmp) return -1;
+    soa->base = tmp;
+    soa->qual = tmp + m;
+    soa->strand = tmp + 2*m;
+    soa->is_del = tmp + 3*m;
+    return 0;
+}
+
+static void soa_fill(bam_pileup_soa_t *soa, const bam_pileup1_t *plp, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        const bam1_t *b = plp[i].b;
+        if (plp[i].is_del) {
+            soa->base[i] = soa->qual[i] = 0;
+        } else {
+            soa->base[i] = bam_seqi(bam_get_seq(b), plp[i].qpos);
+            soa->qual[i] = bam_get_qual(b)[plp[i].qpos];
+        }
+        soa->strand[i] = bam_is_rev(b);
+        soa->is_del[i] = plp[i].is_del;
+    }
+    soa->n = n;
+}
+
 /***********************
  *** Pileup iterator ***
  ***********************/
@@ -1425,8 +1656,14 @@ struct __bam_plp_t {
     lbnode_t *head, *tail, *dummy;
     int32_t tid, pos, max_tid, max_pos;
     int is_eof, max_plp, error, maxcnt;
+    size_t mem, maxmem;   // bytes of buffered records, and the cap on them (0 for none)
     uint64_t id;
     bam_pileup1_t *plp;
+    int use_soa;
+    bam_pileup_soa_t soa;
+    // called for each read as it leaves the buffer; see bam_mplp_par_auto()
+    void (*drop)(void *data, const bam1_t *b);
+    void *drop_data;
     // for the "auto" interface only
     bam1_t *b;
     bam_plp_auto_f func;
@@ -1466,6 +1703,7 @@ void bam_plp_destroy(bam_plp_t iter)
     mp_destroy(iter->mp);
     if (iter->b) bam_destroy1(iter->b);
     free(iter->plp);
+    free(iter->soa.base);
     free(iter);
 }
 
@@ -1686,11 +1924,21 @@ const bam_pileup1_t *bam_plp_next(bam_plp_t iter, int *_tid, int *_pos, int *_n_
         for (p = iter->head, q = iter->dummy; p->next; q = p, p = p->next) {
             if (p->b.core.tid < iter->tid || (p->b.core.tid == iter->tid && p->end <= iter->pos)) { // then remove
                 overlap_remove(iter, &p->b);
+                if (iter->drop) iter->drop(iter->drop_data, &p->b);
+                iter->mem -= sizeof(lbnode_t) + p->b.l_data;
                 q->next = p->next; mp_free(iter->mp, p); p = q;
             } else if (p->b.core.tid == iter->tid && p->beg <= iter->pos) { // here: p->end > pos; then add to pileup
                 if (n_plp == iter->max_plp) { // then double the capacity
-                    iter->max_plp = iter->max_plp? iter->max_plp<<1 : 256;
-                    iter->plp = (bam_pileup1_t*)realloc(iter->plp, sizeof(bam_pileup1_t) * iter->max_plp);
+                    int max_plp = iter->max_plp? iter->max_plp<<1 : 256;
+                    bam_pileup1_t *plp = (bam_pileup1_t*)realloc(iter->plp, sizeof(bam_pileup1_t) * max_plp);
+                    if (plp) iter->plp = plp;
+                    if (!plp || (iter->use_soa && soa_resize(&iter->soa, max_plp) < 0)) {
+                        iter->head = iter->dummy->next;
+                        iter->error = 1;
+                        *_n_plp = -1;
+                        return 0;
+                    }
+                    iter->max_plp = max_plp;
                 }
                 iter->plp[n_plp].b = &p->b;
                 if (resolve_cigar2(iter->plp + n_plp, iter->pos, &p->s)) ++n_plp; // actually always true...
@@ -1698,6 +1946,7 @@ const bam_pileup1_t *bam_plp_next(bam_plp_t iter, int *_tid, int *_pos, int *_n_
         }
         iter->head = iter->dummy->next; // dummy->next may be changed
         *_n_plp = n_plp; *_tid = iter->tid; *_pos = iter->pos;
+        if (iter->use_soa) soa_fill(&iter->soa, iter->plp, n_plp);
         // update iter->tid and iter->pos
         if (iter->head->next) {
             if (iter->tid > iter->head->b.core.tid) {
@@ -1726,7 +1975,8 @@ int bam_plp_push(bam_plp_t iter, const bam1_t *b)
         if (b->core.tid < 0) { overlap_remove(iter, b); return 0; }
         // Skip only unmapped reads here, any additional filtering must be done in iter->func
         if (b->core.flag & BAM_FUNMAP) { overlap_remove(iter, b); return 0; }
-        if (iter->tid == b->core.tid && iter->pos == b->core.pos && iter->mp->cnt > iter->maxcnt)
+        if (iter->tid == b->core.tid && iter->pos == b->core.pos
+            && (iter->maxmem ? iter->mem > iter->maxmem : iter->mp->cnt > iter->maxcnt))
         {
             overlap_remove(iter, b);
             return 0;
@@ -1751,6 +2001,7 @@ int bam_plp_push(bam_plp_t iter, const bam1_t *b)
         }
         iter->max_tid = b->core.tid; iter->max_pos = iter->tail->beg;
         if (iter->tail->end > iter->pos || iter->tail->b.core.tid > iter->tid) {
+            iter->mem += sizeof(lbnode_t) + iter->tail->b.l_data;
             iter->tail->next = mp_alloc(iter->mp);
             iter->tail = iter->tail->next;
         }
@@ -1795,6 +2046,7 @@ void bam_plp_reset(bam_plp_t iter)
         p = q;
     }
     iter->head = iter->tail;
+    iter->mem = 0;
 }
 
 void bam_plp_set_maxcnt(bam_plp_t iter, int maxcnt)
@@ -1802,6 +2054,23 @@ void bam_plp_set_maxcnt(bam_plp_t iter, int maxcnt)
     iter->maxcnt = maxcnt;
 }
 
+void bam_plp_set_maxmem(bam_plp_t iter, size_t bytes)
+{
+    iter->maxmem = bytes;
+}
+
+int bam_plp_set_soa(bam_plp_t iter, int enable)
+{
+    if (enable && iter->max_plp && soa_resize(&iter->soa, iter->max_plp) < 0) return -1;
+    iter->use_soa = enable;
+    return 0;
+}
+
+const bam_pileup_soa_t *bam_plp_soa(bam_plp_t iter)
+{
+    return iter->use_soa ? &iter->soa : NULL;
+}
+
 /************************
  *** Mpileup iterator ***
  ************************/
@@ -1846,6 +2115,26 @@ void bam_mplp_set_maxcnt(bam_mplp_t iter, int maxcnt)
         iter->iter[i]->maxcnt = maxcnt;
 }
 
+void bam_mplp_set_maxmem(bam_mplp_t iter, size_t bytes)
+{
+    int i;
+    for (i = 0; i < iter->n; ++i)
+        iter->iter[i]->maxmem = bytes;
+}
+
+int bam_mplp_set_soa(bam_mplp_t iter, int enable)
+{
+    int i;
+    for (i = 0; i < iter->n; ++i)
+        if (bam_plp_set_soa(iter->iter[i], enable) < 0) return -1;
+    return 0;
+}
+
+const bam_pileup_soa_t *bam_mplp_soa(bam_mplp_t iter, int i)
+{
+    return bam_plp_soa(iter->iter[i]);
+}
+
 void bam_mplp_destroy(bam_mplp_t iter)
 {
     int i;
@@ -1879,4 +2168,474 @@ int bam_mplp_auto(bam_mplp_t iter, int *_tid, int *_pos, int *n_plp, const bam_p
     return ret;
 }
 
+/*********************************
+ *** Parallel mpileup iterator ***
+ *********************************/
+
+/*
+ * The target region is cut into windows, each piled up on a worker thread by
+ * an ordinary bam_mplp_t reading from per-window index iterators.  A window's
+ * iterators return every read overlapping it, including those starting in
+ * earlier windows, so each column inside the window sees exactly the reads
+ * it would in a single pass, pushed in the same order; this also means both
+ * mates of any pair overlapping within the window are present, so
+ * tweak_overlap_quality() acts as it would in a single pass.  Columns outside
+ * the window are computed (the pileup cannot start mid-read) but discarded.
+ *
+ * As the window's pileup entries must outlive the worker's pileup buffers,
+ * each read that appears in a kept column is copied when it leaves the
+ * buffer, by which time any overlap quality adjustment has been applied.
+ */
+
+KHASH_MAP_INIT_INT64(ptr2slot, int)
+
+typedef struct {
+    samFile **fp;
+    bam_hdr_t **hdr;
+    hts_idx_t **idx;
+} mplp_readers_t;
+
+typedef struct {
+    samFile *fp;
+    bam_hdr_t *hdr;
+    hts_itr_t *itr;
+    struct __bam_mplp_par_t *par;
+    int i;
+} mplp_win_input_t;
+
+typedef struct {
+    struct __bam_mplp_par_t *par;
+    int tid, beg, end;
+    // results
+    int error;
+    int n_col, m_col;
+    int32_t *col_pos;       // position of each column
+    int *col_n;             // n_col x n: entries per input per column
+    size_t *col_off;        // n_col: offset of the column's first entry
+    size_t n_ent, m_ent;
+    bam_pileup1_t *ent;
+    int *ent_slot;          // index into rec[] of each entry's read
+    int n_rec, m_rec;
+    bam1_t **rec;
+    khash_t(ptr2slot) *live;
+} mplp_win_t;
+
+struct __bam_mplp_par_t {
+    int n, n_threads, window, maxcnt, overlaps, started, error;
+    size_t maxmem;
+    char **fns;
+    bam_hdr_t *hdr;
+    int (*filter)(void *data, int i, bam1_t *b);
+    void *filter_data;
+    // windows, dispatched in order and consumed in order
+    int n_win, next_dispatch, n_inflight;
+    int32_t *win_tid, *win_beg, *win_end;
+    t_pool *pool;
+    t_results_queue *q;
+    // open file sets for workers to borrow
+    pthread_mutex_t lock;
+    int n_free, m_free;
+    mplp_readers_t **free_readers;
+    // the window being delivered
+    mplp_win_t *cur;
+    int cur_col;
+    int *n_plp;
+    const bam_pileup1_t **plp;
+};
+
+static void mplp_readers_destroy(mplp_readers_t *r, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (r->idx[i]) hts_idx_destroy(r->idx[i]);
+        if (r->hdr[i]) bam_hdr_destroy(r->hdr[i]);
+        if (r->fp[i]) sam_close(r->fp[i]);
+    }
+    free(r->fp); free(r->hdr); free(r->idx);
+    free(r);
+}
+
+static mplp_readers_t *mplp_readers_open(struct __bam_mplp_par_t *par)
+{
+    int i;
+    mplp_readers_t *r = (mplp_readers_t*)calloc(1, sizeof(mplp_readers_t));
+    if (!r) return NULL;
+    r->fp  = (samFile**)calloc(par->n, sizeof(samFile*));
+    r->hdr = (bam_hdr_t**)calloc(par->n, sizeof(bam_hdr_t*));
+    r->idx = (hts_idx_t**)calloc(par->n, sizeof(hts_idx_t*));
+    if (!r->fp || !r->hdr || !r->idx) goto fail;
+    for (i = 0; i < par->n; ++i) {
+        if ((r->fp[i] = sam_open(par->fns[i], "r")) == NULL) goto fail;
+        if ((r->hdr[i] = sam_hdr_read(r->fp[i])) == NULL) goto fail;
+        if ((r->idx[i] = sam_index_load(r->fp[i], par->fns[i])) == NULL) {
+            fprintf(stderr, "[%s] failed to load the index of %s\n", __func__, par->fns[i]);
+            goto fail;
+        }
+    }
+    return r;
+
+fail:
+    mplp_readers_destroy(r, par->n);
+    return NULL;
+}
+
+static mplp_readers_t *mplp_readers_get(struct __bam_mplp_par_t *par)
+{
+    mplp_readers_t *r = NULL;
+    pthread_mutex_lock(&par->lock);
+    if (par->n_free) r = par->free_readers[--par->n_free];
+    pthread_mutex_unlock(&par->lock);
+    return r ? r : mplp_readers_open(par);
+}
+
+// Returns the readers to the free list, or closes them and returns -1 if
+// the list can't grow
+static int mplp_readers_put(struct __bam_mplp_par_t *par, mplp_readers_t *r)
+{
+    pthread_mutex_lock(&par->lock);
+    if (par->n_free == par->m_free) {
+        int m = par->m_free ? par->m_free * 2 : 8;
+        mplp_readers_t **tmp = (mplp_readers_t**)realloc(par->free_readers, m * sizeof(mplp_readers_t*));
+        if (!tmp) {
+            pthread_mutex_unlock(&par->lock);
+            mplp_readers_destroy(r, par->n);
+            return -1;
+        }
+        par->free_readers = tmp;
+        par->m_free = m;
+    }
+    par->free_readers[par->n_free++] = r;
+    pthread_mutex_unlock(&par->lock);
+    return 0;
+}
+
+static void mplp_win_destroy(mplp_win_t *w)
+{
+    int i;
+    if (!w) return;
+    for (i = 0; i < w->n_rec; ++i)
+        if (w->rec[i]) bam_destroy1(w->rec[i]);
+    if (w->live) kh_destroy(ptr2slot, w->live);
+    free(w->rec); free(w->ent); free(w->ent_slot);
+    free(w->col_pos); free(w->col_n); free(w->col_off);
+    free(w);
+}
+
+static int mplp_win_read(void *data, bam1_t *b)
+{
+    mplp_win_input_t *in = (mplp_win_input_t*)data;
+    int ret;
+    while ((ret = sam_itr_next(in->fp, in->itr, b)) >= 0) {
+        if (!in->par->filter || in->par->filter(in->par->filter_data, in->i, b) == 0) break;
+    }
+    return ret;
+}
+
+static void mplp_win_drop(void *data, const bam1_t *b)
+{
+    mplp_win_t *w = (mplp_win_t*)data;
+    khiter_t k = kh_get(ptr2slot, w->live, (khint64_t)(uintptr_t)b);
+    if (k == kh_end(w->live)) return;
+    if ((w->rec[kh_val(w->live, k)] = bam_dup1(b)) == NULL) w->error = 1;
+    kh_del(ptr2slot, w->live, k);
+}
+
+static int mplp_win_add_column(mplp_win_t *w, int n, int pos, const int *n_plp, const bam_pileup1_t **plp)
+{
+    int i, j, ret;
+    size_t need = w->n_ent;
+    for (i = 0; i < n; ++i) need += n_plp[i];
+    if (w->n_col == w->m_col) {
+        int m = w->m_col ? w->m_col * 2 : 1024;
+        int32_t *pos_tmp;
+        size_t *off_tmp;
+        int *n_tmp;
+        // m_col grows only once all three arrays have
+        if ((pos_tmp = (int32_t*)realloc(w->col_pos, m * sizeof(int32_t))) == NULL) return -1;
+        w->col_pos = pos_tmp;
+        if ((off_tmp = (size_t*)realloc(w->col_off, m * sizeof(size_t))) == NULL) return -1;
+        w->col_off = off_tmp;
+        if ((n_tmp = (int*)realloc(w->col_n, (size_t)m * n * sizeof(int))) == NULL) return -1;
+        w->col_n = n_tmp;
+        w->m_col = m;
+    }
+    if (need > w->m_ent) {
+        size_t m = need > 2 * w->m_ent ? need : 2 * w->m_ent;
+        bam_pileup1_t *ent_tmp;
+        int *slot_tmp;
+        if ((ent_tmp = (bam_pileup1_t*)realloc(w->ent, m * sizeof(bam_pileup1_t))) == NULL) return -1;
+        w->ent = ent_tmp;
+        if ((slot_tmp = (int*)realloc(w->ent_slot, m * sizeof(int))) == NULL) return -1;
+        w->ent_slot = slot_tmp;
+        w->m_ent = m;
+    }
+    w->col_pos[w->n_col] = pos;
+    w->col_off[w->n_col] = w->n_ent;
+    for (i = 0; i < n; ++i) {
+        w->col_n[(size_t)w->n_col * n + i] = n_plp[i];
+        for (j = 0; j < n_plp[i]; ++j) {
+            khiter_t k = kh_put(ptr2slot, w->live, (khint64_t)(uintptr_t)plp[i][j].b, &ret);
+            if (ret < 0) return -1;
+            if (ret) { // first time this read is seen: reserve its slot
+                if (w->n_rec == w->m_rec) {
+                    int m = w->m_rec ? w->m_rec * 2 : 256;
+                    bam1_t **rec_tmp = (bam1_t**)realloc(w->rec, m * sizeof(bam1_t*));
+                    if (!rec_tmp) return -1;
+                    w->rec = rec_tmp;
+                    w->m_rec = m;
+                }
+                w->rec[w->n_rec] = NULL;
+                kh_val(w->live, k) = w->n_rec++;
+            }
+            w->ent[w->n_ent] = plp[i][j];
+            w->ent_slot[w->n_ent++] = kh_val(w->live, k);
+        }
+    }
+    w->n_col++;
+    return 0;
+}
+
+static void *mplp_win_job(void *arg)
+{
+    mplp_win_t *w = (mplp_win_t*)arg;
+    struct __bam_mplp_par_t *par = w->par;
+    mplp_readers_t *r = mplp_readers_get(par);
+    mplp_win_input_t *in = NULL;
+    void **data = NULL;
+    bam_mplp_t mplp = NULL;
+    int i, tid, pos, *n_plp = NULL, ret;
+    const bam_pileup1_t **plp = NULL;
+
+    if (!r) { w->error = 1; return w; }
+    w->live = kh_init(ptr2slot);
+    in = (mplp_win_input_t*)calloc(par->n, sizeof(mplp_win_input_t));
+    data = (void**)calloc(par->n, sizeof(void*));
+    n_plp = (int*)calloc(par->n, sizeof(int));
+    plp = (const bam_pileup1_t**)calloc(par->n, sizeof(bam_pileup1_t*));
+    if (!w->live || !in || !data || !n_plp || !plp) { w->error = 1; goto done; }
+    for (i = 0; i < par->n; ++i) {
+        in[i].fp = r->fp[i]; in[i].hdr = r->hdr[i]; in[i].par = par; in[i].i = i;
+        if ((in[i].itr = sam_itr_queryi(r->idx[i], w->tid, w->beg, w->end)) == NULL) { w->error = 1; goto done; }
+        data[i] = &in[i];
+    }
+    mplp = bam_mplp_init(par->n, mplp_win_read, data);
+    if (par->overlaps) bam_mplp_init_overlaps(mplp);
+    bam_mplp_set_maxcnt(mplp, par->maxcnt);
+    if (par->maxmem) bam_mplp_set_maxmem(mplp, par->maxmem);
+    for (i = 0; i < par->n; ++i) {
+        mplp->iter[i]->drop = mplp_win_drop;
+        mplp->iter[i]->drop_data = w;
+    }
+    while ((ret = bam_mplp_auto(mplp, &tid, &pos, n_plp, plp)) > 0) {
+        if (tid != w->tid || pos < w->beg) continue;
+        if (pos >= w->end) continue; // keep draining, so that every read is dropped
+        if (mplp_win_add_column(w, par->n, pos, n_plp, plp) < 0) { w->error = 1; break; }
+    }
+    if (ret < 0) w->error = 1;
+
+done:
+    if (mplp) bam_mplp_destroy(mplp);
+    if (in)
+        for (i = 0; i < par->n; ++i)
+            if (in[i].itr) hts_itr_destroy(in[i].itr);
+    free(in); free(data); free(n_plp); free(plp);
+    if (mplp_readers_put(par, r) < 0) w->error = 1;
+    return w;
+}
+
+bam_mplp_par_t bam_mplp_par_init(int n, const char **fns, const char *region, int n_threads, int window)
+{
+    bam_mplp_par_t par;
+    samFile *fp;
+    int i, m_win = 0;
+
+    par = (bam_mplp_par_t)calloc(1, sizeof(struct __bam_mplp_par_t));
+    if (!par) return NULL;
+    pthread_mutex_init(&par->lock, NULL);
+    par->n = n;
+    par->n_threads = n_threads > 0 ? n_threads : 1;
+    par->window = window > 0 ? window : 100000;
+    par->maxcnt = 8000;
+    par->fns = (char**)calloc(n, sizeof(char*));
+    par->n_plp = (int*)calloc(n, sizeof(int));
+    par->plp = (const bam_pileup1_t**)calloc(n, sizeof(bam_pileup1_t*));
+    if (!par->fns || !par->n_plp || !par->plp) goto fail;
+    for (i = 0; i < n; ++i)
+        if ((par->fns[i] = strdup(fns[i])) == NULL) goto fail;
+
+    if ((fp = sam_open(fns[0], "r")) == NULL) goto fail;
+    par->hdr = sam_hdr_read(fp);
+    sam_close(fp);
+    if (!par->hdr) goto fail;
+
+    #define ADD_WINDOWS(_tid, _beg, _end) do { \
+        int32_t b_; \
+        for (b_ = (_beg); b_ < (_end); b_ += par->window) { \
+            if (par->n_win == m_win) { \
+                int32_t *tmp_; \
+                m_win = m_win ? m_win * 2 : 64; \
+                if ((tmp_ = (int32_t*)realloc(par->win_tid, m_win * sizeof(int32_t))) == NULL) goto fail; \
+                par->win_tid = tmp_; \
+                if ((tmp_ = (int32_t*)realloc(par->win_beg, m_win * sizeof(int32_t))) == NULL) goto fail; \
+                par->win_beg = tmp_; \
+                if ((tmp_ = (int32_t*)realloc(par->win_end, m_win * sizeof(int32_t))) == NULL) goto fail; \
+                par->win_end = tmp_; \
+            } \
+            par->win_tid[par->n_win] = (_tid); \
+            par->win_beg[par->n_win] = b_; \
+            par->win_end[par->n_win] = (_end) - b_ > par->window ? b_ + par->window : (_end); \
+            par->n_win++; \
+        } \
+    } while (0)
+
+    if (region) {
+        int beg, end, tid;
+        const char *q = hts_parse_reg(region, &beg, &end);
+        char *name;
+        if (!q) goto fail;
+        if ((name = (char*)malloc(q - region + 1)) == NULL) goto fail;
+        memcpy(name, region, q - region); name[q - region] = 0;
+        tid = bam_name2id(par->hdr, name);
+        free(name);
+        if (tid < 0) {
+            fprintf(stderr, "[%s] unknown reference in region \"%s\"\n", __func__, region);
+            goto fail;
+        }
+        if (end > par->hdr->target_len[tid]) end = par->hdr->target_len[tid];
+        ADD_WINDOWS(tid, beg, end);
+    } else {
+        for (i = 0; i < par->hdr->n_targets; ++i)
+            ADD_WINDOWS(i, 0, (int32_t)par->hdr->target_len[i]);
+    }
+    #undef ADD_WINDOWS
+    return par;
+
+fail:
+    bam_mplp_par_destroy(par);
+    return NULL;
+}
+
+void bam_mplp_par_set_filter(bam_mplp_par_t par, int (*filter)(void *data, int i, bam1_t *b), void *data)
+{
+    par->filter = filter;
+    par->filter_data = data;
+}
+
+void bam_mplp_par_init_overlaps(bam_mplp_par_t par)
+{
+    par->overlaps = 1;
+}
+
+void bam_mplp_par_set_maxcnt(bam_mplp_par_t par, int maxcnt)
+{
+    par->maxcnt = maxcnt;
+}
+
+void bam_mplp_par_set_maxmem(bam_mplp_par_t par, size_t bytes)
+{
+    par->maxmem = bytes;
+}
+
+const bam_hdr_t *bam_mplp_par_header(bam_mplp_par_t par)
+{
+    return par->hdr;
+}
+
+static int mplp_par_dispatch(bam_mplp_par_t par)
+{
+    mplp_win_t *w;
+    int k = par->next_dispatch;
+    if ((w = (mplp_win_t*)calloc(1, sizeof(mplp_win_t))) == NULL) return -1;
+    w->par = par;
+    w->tid = par->win_tid[k]; w->beg = par->win_beg[k]; w->end = par->win_end[k];
+    if (t_pool_dispatch(par->pool, par->q, mplp_win_job, w) < 0) {
+        free(w);
+        return -1;
+    }
+    par->next_dispatch++;
+    par->n_inflight++;
+    return 0;
+}
+
+int bam_mplp_par_auto(bam_mplp_par_t par, int *_tid, int *_pos, int *n_plp, const bam_pileup1_t **plp)
+{
+    mplp_win_t *w;
+    size_t off;
+    int i, ret = 0;
+
+    if (par->error) return -1;
+    if (!par->started) {
+        // Twice as many windows in flight as threads keeps the workers busy
+        // while the caller consumes the oldest one
+        par->started = 1;
+        if ((par->pool = t_pool_init(par->n_threads * 2, par->n_threads)) == NULL) goto error;
+        if ((par->q = t_results_queue_init()) == NULL) goto error;
+        while (par->next_dispatch < par->n_win && par->n_inflight < par->n_threads * 2)
+            if (mplp_par_dispatch(par) < 0) goto error;
+    }
+
+    while (!par->cur || par->cur_col >= par->cur->n_col) {
+        t_pool_result *r;
+        mplp_win_destroy(par->cur);
+        par->cur = NULL;
+        if (par->n_inflight == 0) return 0;
+        if ((r = t_pool_next_result_wait(par->q)) == NULL) goto error;
+        par->cur = (mplp_win_t*)r->data;
+        t_pool_delete_result(r, 0);
+        par->n_inflight--;
+        par->cur_col = 0;
+        if (par->next_dispatch < par->n_win && mplp_par_dispatch(par) < 0) goto error;
+        if (par->cur->error) goto error;
+        // point the entries at the reads copied when they left the buffer
+        for (off = 0; off < par->cur->n_ent; ++off)
+            par->cur->ent[off].b = par->cur->rec[par->cur->ent_slot[off]];
+    }
+
+    w = par->cur;
+    *_tid = w->tid;
+    *_pos = w->col_pos[par->cur_col];
+    off = w->col_off[par->cur_col];
+    for (i = 0; i < par->n; ++i) {
+        n_plp[i] = w->col_n[(size_t)par->cur_col * par->n + i];
+        plp[i] = n_plp[i] ? w->ent + off : NULL;
+        off += n_plp[i];
+        if (n_plp[i]) ++ret;
+    }
+    par->cur_col++;
+    return ret;
+
+error:
+    par->error = 1;
+    return -1;
+}
+
+void bam_mplp_par_destroy(bam_mplp_par_t par)
+{
+    int i;
+    if (!par) return;
+    if (par->pool) {
+        t_pool_flush(par->pool);
+        t_pool_destroy(par->pool, 0);
+    }
+    if (par->q) {
+        t_pool_result *r;
+        while ((r = t_pool_next_result(par->q)) != NULL) {
+            mplp_win_destroy((mplp_win_t*)r->data);
+            t_pool_delete_result(r, 0);
+        }
+        t_results_queue_destroy(par->q);
+    }
+    mplp_win_destroy(par->cur);
+    for (i = 0; i < par->n_free; ++i) mplp_readers_destroy(par->free_readers[i], par->n);
+    free(par->free_readers);
+    if (par->fns)
+        for (i = 0; i < par->n; ++i) free(par->fns[i]);
+    free(par->fns);
+    if (par->hdr) bam_hdr_destroy(par->hdr);
+    free(par->win_tid); free(par->win_beg); free(par->win_end);
+    free(par->n_plp); free(par->plp);
+    pthread_mutex_destroy(&par->lock);
+    free(par);
+}
+
 #endif // ~!defined(BAM_NO_PILEUP)
@@ -32,9 +32,72 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/synced_bcf_reader.h"
 #include "htslib/kseq.h"
 #include "htslib/khash_str2int.h"
+#include "htslib/ksort.h"
+#include "cram/thread_pool.h"
 
 #define MAX_CSI_COOR 0x7fffffff     // maximum indexable coordinate of .csi
 
+// Readers with buffered lines, ordered by the position of buffer[1] and then
+// by reader index. ksort's heap keeps the "largest" on top, so this compares
+// in reverse to give a min-heap.
+typedef struct
+{
+    int pos, ireader;
+}
+sr_heap1_t;
+
+#define sr_heap_lt(x, y) ((x).pos > (y).pos || ((x).pos == (y).pos && (x).ireader > (y).ireader))
+KSORT_INIT_STATIC(sr_heap, sr_heap1_t, sr_heap_lt)
+
+typedef struct
+{
+    sr_heap1_t *heap;   // readers with lines in the buffer, except those in dirty
+    int nheap;
+    int *dirty, ndirty; // readers whose buffers changed since they were last filled
+    int *active, nactive;   // readers with has_line set, in reader order
+    int *keep;          // readers at the current position whose alleles did not match
+    int reset;          // readers were added, removed or repositioned: refill all
+    t_pool *pool;       // set by bcf_sr_set_threads()
+    struct sr_prefetch_t *pf;   // prefetch state of each reader, when pool is set
+}
+sr_aux_t;
+
+/*
+ *  Prefetching.  Once bcf_sr_set_threads() has been called, each reader
+ *  keeps a batch of up to SR_PREFETCH_NREC records being read and parsed on
+ *  the thread pool while the merge consumes the previous batch, so that the
+ *  readers decompress and parse concurrently.  The reader's file and
+ *  iterator belong to the worker while a batch is in flight, and the batch
+ *  is always collected before they are touched by the caller's thread.
+ *
+ *  VCF lines are parsed without modifying the header.  A line which would
+ *  add a contig or tag to it is parsed again by _reader_prefetch_next() when
+ *  its turn comes, after the reader's next batch has been collected, so that
+ *  the header changes in file order as when reading serially.
+ */
+#define SR_PREFETCH_NREC 64
+
+typedef struct sr_batch_t
+{
+    bcf_srs_t *files;
+    bcf_sr_t *reader;
+    int n, i, eof;          // records read, records handed out, the end of the region or stream was reached
+    bcf1_t *rec[SR_PREFETCH_NREC];
+    kstring_t line[SR_PREFETCH_NREC];   // VCF lines, needed again by those with undef set
+    int undef[SR_PREFETCH_NREC];        // line could not be parsed without changing the header
+    kstring_t tmp, mem;     // copy of the line being parsed, FORMAT scratch space
+    struct sr_batch_t *next;
+}
+sr_batch_t;
+
+typedef struct sr_prefetch_t
+{
+    t_results_queue *q;
+    sr_batch_t *cur, *ready, *free; // batch being handed out, collected but not yet used, recycled batches
+    int in_flight, eof;     // a batch is being read; the last batch of the region has been collected
+}
+sr_prefetch_t;
+
 typedef struct
 {
     uint32_t start, end;
@@ -51,6 +114,8 @@ region_t;
 static void _regions_add(bcf_sr_regions_t *reg, const char *chr, int start, int end);
 static bcf_sr_regions_t *_regions_init_string(const char *str);
 static int _regions_match_alleles(bcf_sr_regions_t *reg, int als_idx, bcf1_t *rec);
+static void _readers_prefetch_wait(bcf_srs_t *files, int drop);
+static void _reader_prefetch_destroy(sr_prefetch_t *pf);
 
 char *bcf_sr_strerror(int errnum)
 {
@@ -137,11 +202,20 @@ int bcf_sr_add_reader(bcf_srs_t *files, const char *fname)
         return 0;
     }
 
+    sr_aux_t *aux = (sr_aux_t*) files->aux;
+    _readers_prefetch_wait(files, 0);
+    if ( aux->pool )
+    {
+        aux->pf = (sr_prefetch_t*) realloc(aux->pf, sizeof(sr_prefetch_t)*(files->nreaders+1));
+        memset(&aux->pf[files->nreaders],0,sizeof(sr_prefetch_t));
+        aux->pf[files->nreaders].q = t_results_queue_init();
+    }
     files->has_line = (int*) realloc(files->has_line, sizeof(int)*(files->nreaders+1));
     files->has_line[files->nreaders] = 0;
     files->readers  = (bcf_sr_t*) realloc(files->readers, sizeof(bcf_sr_t)*(files->nreaders+1));
     bcf_sr_t *reader = &files->readers[files->nreaders++];
     memset(reader,0,sizeof(bcf_sr_t));
+    aux->reset = 1;
 
     reader->file = file_ptr;
 
@@ -245,6 +319,9 @@ int bcf_sr_add_reader(bcf_srs_t *files, const char *fname)
 bcf_srs_t *bcf_sr_init(void)
 {
     bcf_srs_t *files = (bcf_srs_t*) calloc(1,sizeof(bcf_srs_t));
+    sr_aux_t *aux = (sr_aux_t*) calloc(1,sizeof(sr_aux_t));
+    aux->reset = 1;
+    files->aux = aux;
     return files;
 }
 
@@ -264,7 +341,15 @@ static void bcf_sr_destroy1(bcf_sr_t *reader)
 }
 void bcf_sr_destroy(bcf_srs_t *files)
 {
+    sr_aux_t *aux = (sr_aux_t*) files->aux;
     int i;
+    if ( aux->pool )
+    {
+        _readers_prefetch_wait(files, 0);
+        for (i=0; i<files->nreaders; i++) _reader_prefetch_destroy(&aux->pf[i]);
+        t_pool_destroy(aux->pool, 0);
+        free(aux->pf);
+    }
     for (i=0; i<files->nreaders; i++)
         bcf_sr_destroy1(&files->readers[i]);
     free(files->has_line);
@@ -274,19 +359,29 @@ void bcf_sr_destroy(bcf_srs_t *files)
     if (files->targets) bcf_sr_regions_destroy(files->targets);
     if (files->regions) bcf_sr_regions_destroy(files->regions);
     if ( files->tmps.m ) free(files->tmps.s);
+    free(aux->heap);
+    free(aux->dirty);
+    free(aux->active);
+    free(aux->keep);
+    free(aux);
     free(files);
 }
 
 void bcf_sr_remove_reader(bcf_srs_t *files, int i)
 {
     assert( !files->samples );  // not ready for this yet
+    sr_aux_t *aux = (sr_aux_t*) files->aux;
+    _readers_prefetch_wait(files, 0);
+    if ( aux->pool ) _reader_prefetch_destroy(&aux->pf[i]);
     bcf_sr_destroy1(&files->readers[i]);
     if ( i+1 < files->nreaders )
     {
         memmove(&files->readers[i], &files->readers[i+1], (files->nreaders-i-1)*sizeof(bcf_sr_t));
         memmove(&files->has_line[i], &files->has_line[i+1], (files->nreaders-i-1)*sizeof(int));
+        if ( aux->pool ) memmove(&aux->pf[i], &aux->pf[i+1], (files->nreaders-i-1)*sizeof(sr_prefetch_t));
     }
     files->nreaders--;
+    aux->reset = 1;
 }
 
 
@@ -406,6 +501,186 @@ static int _reader_seek(bcf_sr_t *reader, const char *seq, int start, int end)
     return 0;
 }
 
+static void *_reader_prefetch_job(void *arg)
+{
+    sr_batch_t *b = (sr_batch_t*) arg;
+    bcf_srs_t *files = b->files;
+    bcf_sr_t *reader = b->reader;
+    int is_vcf = reader->tbx_idx || (files->streaming && reader->file->format.format==vcf);
+
+    b->n = b->i = b->eof = 0;
+    while ( b->n < SR_PREFETCH_NREC )
+    {
+        bcf1_t *rec = b->rec[b->n];
+        rec->max_unpack = files->max_unpack;
+        b->undef[b->n] = 0;
+        if ( is_vcf )
+        {
+            kstring_t *line = &b->line[b->n];
+            if ( files->streaming )
+            {
+                if ( hts_getline(reader->file, KS_SEP_LINE, line) < 0 ) { b->eof = 1; break; }
+            }
+            else if ( tbx_itr_next(reader->file, reader->tbx_idx, reader->itr, line) < 0 ) { b->eof = 1; break; }
+            b->tmp.l = 0;
+            kputsn(line->s, line->l, &b->tmp);
+            int ret = vcf_parse_nohdr(&b->tmp, reader->header, rec, &b->mem);
+            if ( ret==-2 ) { b->undef[b->n++] = 1; continue; }
+            if ( ret<0 && files->streaming ) continue;   // skip broken lines, as _reader_fill_buffer does
+        }
+        else if ( files->streaming )
+        {
+            if ( bcf_read1(reader->file, reader->header, rec) < 0 ) { b->eof = 1; break; }
+        }
+        else
+        {
+            if ( bcf_itr_next(reader->file, reader->itr, rec) < 0 ) { b->eof = 1; break; }
+            bcf_subset_format(reader->header, rec);
+        }
+        bcf_unpack(rec, reader->nfilter_ids ? BCF_UN_STR|BCF_UN_FLT : BCF_UN_STR);
+        b->n++;
+    }
+    return b;
+}
+
+static void _reader_prefetch_start(bcf_srs_t *files, int ireader)
+{
+    sr_aux_t *aux = (sr_aux_t*) files->aux;
+    sr_prefetch_t *pf = &aux->pf[ireader];
+    bcf_sr_t *reader = &files->readers[ireader];
+    if ( pf->in_flight || pf->ready || pf->eof ) return;
+    if ( !reader->itr && !files->streaming ) return;
+
+    sr_batch_t *b = pf->free;
+    if ( b ) pf->free = b->next;
+    else
+    {
+        int i;
+        b = (sr_batch_t*) calloc(1, sizeof(sr_batch_t));
+        for (i=0; i<SR_PREFETCH_NREC; i++) b->rec[i] = bcf_init1();
+    }
+    b->files  = files;
+    b->reader = reader;
+    if ( t_pool_dispatch(aux->pool, pf->q, _reader_prefetch_job, b) < 0 )
+    {
+        // No worker could take it, read the batch here instead
+        pf->ready = (sr_batch_t*) _reader_prefetch_job(b);
+        if ( b->eof ) pf->eof = 1;
+        return;
+    }
+    pf->in_flight = 1;
+}
+
+static sr_batch_t *_reader_prefetch_collect(sr_prefetch_t *pf)
+{
+    t_pool_result *r = t_pool_next_result_wait(pf->q);
+    sr_batch_t *b = (sr_batch_t*) r->data;
+    t_pool_delete_result(r, 0);
+    pf->in_flight = 0;
+    if ( b->eof ) pf->eof = 1;
+    return b;
+}
+
+/*
+ *  _reader_prefetch_next() - swaps the next record of the reader into *rec
+ *  Returns 0 on success or -1 at the end of the region or stream
+ */
+static int _reader_prefetch_next(bcf_srs_t *files, int ireader, bcf1_t **rec)
+{
+    sr_prefetch_t *pf = &((sr_aux_t*)files->aux)->pf[ireader];
+    bcf_sr_t *reader = &files->readers[ireader];
+    while (1)
+    {
+        while ( !pf->cur || pf->cur->i >= pf->cur->n )
+        {
+            if ( pf->cur ) { pf->cur->next = pf->free; pf->free = pf->cur; pf->cur = NULL; }
+            if ( !pf->ready )
+            {
+                _reader_prefetch_start(files, ireader);
+                if ( !pf->ready )
+                {
+                    if ( !pf->in_flight ) return -1;
+                    pf->ready = _reader_prefetch_collect(pf);
+                }
+            }
+            pf->cur = pf->ready;
+            pf->ready = NULL;
+            _reader_prefetch_start(files, ireader);     // read the next batch while this one is used
+        }
+        sr_batch_t *b = pf->cur;
+        int i = b->i++;
+        bcf1_t *tmp = *rec; *rec = b->rec[i]; b->rec[i] = tmp;
+        if ( !b->undef[i] ) return 0;
+
+        // The header is about to change, no worker may be reading it
+        if ( pf->in_flight ) pf->ready = _reader_prefetch_collect(pf);
+        (*rec)->max_unpack = files->max_unpack;
+        if ( vcf_parse1(&b->line[i], reader->header, *rec)<0 && files->streaming ) continue;
+        return 0;
+    }
+}
+
+static void _reader_prefetch_free(sr_batch_t *b)
+{
+    while ( b )
+    {
+        sr_batch_t *next = b->next;
+        int i;
+        for (i=0; i<SR_PREFETCH_NREC; i++)
+        {
+            bcf_destroy1(b->rec[i]);
+            free(b->line[i].s);
+        }
+        free(b->tmp.s);
+        free(b->mem.s);
+        free(b);
+        b = next;
+    }
+}
+
+/*
+ *  _readers_prefetch_wait() - collects all batches in flight, so that the
+ *  readers can be moved or closed. With drop set, the records read ahead
+ *  are discarded as well, ready for the readers to seek.
+ */
+static void _readers_prefetch_wait(bcf_srs_t *files, int drop)
+{
+    sr_aux_t *aux = (sr_aux_t*) files->aux;
+    int i;
+    if ( !aux->pool ) return;
+    for (i=0; i<files->nreaders; i++)
+    {
+        sr_prefetch_t *pf = &aux->pf[i];
+        if ( pf->in_flight ) pf->ready = _reader_prefetch_collect(pf);
+        if ( !drop ) continue;
+        if ( pf->cur ) { pf->cur->next = pf->free; pf->free = pf->cur; pf->cur = NULL; }
+        if ( pf->ready ) { pf->ready->next = pf->free; pf->free = pf->ready; pf->ready = NULL; }
+        pf->eof = 0;
+    }
+}
+
+static void _reader_prefetch_destroy(sr_prefetch_t *pf)
+{
+    if ( pf->cur ) _reader_prefetch_free(pf->cur);
+    if ( pf->ready ) _reader_prefetch_free(pf->ready);
+    _reader_prefetch_free(pf->free);
+    t_results_queue_destroy(pf->q);
+}
+
+int bcf_sr_set_threads(bcf_srs_t *files, int n_threads)
+{
+    sr_aux_t *aux = (sr_aux_t*) files->aux;
+    int i;
+    if ( aux->pool ) return -1;
+    if ( n_threads<1 ) return 0;
+
+    // There is at most one job per reader, the queue needs no bound of its own
+    if ( !(aux->pool = t_pool_init(INT_MAX, n_threads)) ) return -1;
+    aux->pf = (sr_prefetch_t*) calloc(files->nreaders ? files->nreaders : 1, sizeof(sr_prefetch_t));
+    for (i=0; i<files->nreaders; i++) aux->pf[i].q = t_results_queue_init();
+    return 0;
+}
+
 /*
  *  _readers_next_region() - jumps to next region if necessary
  *  Returns 0 on success or -1 when there are no more regions left
@@ -426,8 +701,10 @@ static int _readers_next_region(bcf_srs_t *files)
     // No lines in the buffer, need to open new region or quit
     if ( bcf_sr_regions_next(files->regions)<0 ) return -1;
 
+    _readers_prefetch_wait(files, 1);
     for (i=0; i<files->nreaders; i++)
         _reader_seek(&files->readers[i],files->regions->seq_names[files->regions->iseq],files->regions->start,files->regions->end);
+    ((sr_aux_t*)files->aux)->reset = 1;
 
     return 0;
 }
@@ -459,7 +736,11 @@ static void _reader_fill_buffer(bcf_srs_t *files, bcf_sr_t *reader)
                 reader->buffer[reader->mbuffer-i]->pos = -1;    // for rare cases when VCF starts from 1
             }
         }
-        if ( files->streaming )
+        if ( ((sr_aux_t*)files->aux)->pool )
+        {
+            if ( (ret=_reader_prefetch_next(files, reader - files->readers, &reader->buffer[reader->nbuffer+1])) < 0 ) break;   // no more lines
+        }
+        else if ( files->streaming )
         {
             if ( reader->file->format.format==vcf )
             {
@@ -604,47 +885,94 @@ static int _reader_match_alleles(bcf_srs_t *files, bcf_sr_t *reader, bcf1_t *tmp
     return 0;
 }
 
+static void _reader_heap_push(sr_aux_t *aux, bcf_sr_t *readers, int ireader)
+{
+    sr_heap1_t x;
+    x.pos = readers[ireader].buffer[1]->pos;
+    x.ireader = ireader;
+    int i = aux->nheap++;
+    while ( i>0 )
+    {
+        int parent = (i-1)/2;
+        if ( !sr_heap_lt(aux->heap[parent], x) ) break;
+        aux->heap[i] = aux->heap[parent];
+        i = parent;
+    }
+    aux->heap[i] = x;
+}
+
+static int _reader_heap_pop(sr_aux_t *aux)
+{
+    int ireader = aux->heap[0].ireader;
+    aux->heap[0] = aux->heap[--aux->nheap];
+    ks_heapadjust(sr_heap, 0, aux->nheap, aux->heap);
+    return ireader;
+}
+
+// Refill the readers whose buffers changed. The buffers of the other readers
+// are either full or at the end of the region, so filling them is a no-op.
+static void _readers_fill_dirty(bcf_srs_t *files, sr_aux_t *aux)
+{
+    int i;
+    if ( aux->reset )
+    {
+        aux->heap   = (sr_heap1_t*) realloc(aux->heap, sizeof(sr_heap1_t)*files->nreaders);
+        aux->dirty  = (int*) realloc(aux->dirty, sizeof(int)*files->nreaders);
+        aux->active = (int*) realloc(aux->active, sizeof(int)*files->nreaders);
+        aux->keep   = (int*) realloc(aux->keep, sizeof(int)*files->nreaders);
+        for (i=0; i<files->nreaders; i++) aux->dirty[i] = i;
+        aux->ndirty = files->nreaders;
+        aux->nheap  = 0;
+        aux->reset  = 0;
+    }
+    for (i=0; i<aux->ndirty; i++)
+    {
+        bcf_sr_t *reader = &files->readers[aux->dirty[i]];
+        _reader_fill_buffer(files, reader);
+        if ( reader->nbuffer ) _reader_heap_push(aux, files->readers, aux->dirty[i]);
+    }
+    aux->ndirty = 0;
+}
+
 int _reader_next_line(bcf_srs_t *files)
 {
+    sr_aux_t *aux = (sr_aux_t*) files->aux;
     int i, min_pos = INT_MAX;
 
+    if ( aux->reset )
+        memset(files->has_line, 0, sizeof(int)*files->nreaders);
+    else
+        for (i=0; i<aux->nactive; i++) files->has_line[aux->active[i]] = 0;
+    aux->nactive = 0;
+
     // Loop until next suitable line is found or all readers have finished
     while ( 1 )
     {
-        // Get all readers ready for the next region.
-        if ( files->regions && _readers_next_region(files)<0 ) break;
-
-        // Fill buffers
-        const char *chr = NULL;
-        for (i=0; i<files->nreaders; i++)
-        {
-            _reader_fill_buffer(files, &files->readers[i]);
-
-            // Update the minimum coordinate
-            if ( !files->readers[i].nbuffer ) continue;
-            if ( min_pos > files->readers[i].buffer[1]->pos )
-            {
-                min_pos = files->readers[i].buffer[1]->pos;
-                chr = bcf_seqname(files->readers[i].header, files->readers[i].buffer[1]);
-            }
-        }
-        if ( min_pos==INT_MAX )
+        // Fill buffers; only the minimum coordinate is looked at
+        _readers_fill_dirty(files, aux);
+        if ( !aux->nheap )
         {
-            if ( !files->regions ) break;
+            // Get all readers ready for the next region.
+            if ( !files->regions || _readers_next_region(files)<0 ) return 0;
             continue;
         }
+        bcf_sr_t *reader = &files->readers[aux->heap[0].ireader];
+        min_pos = aux->heap[0].pos;
 
         // Skip this position if not present in targets
         if ( files->targets )
         {
+            const char *chr = bcf_seqname(reader->header, reader->buffer[1]);
             int ret = bcf_sr_regions_overlap(files->targets, chr, min_pos, min_pos);
             if ( (!files->targets_exclude && ret<0) || (files->targets_exclude && !ret) )
             {
                 // Remove all lines with this position from the buffer
-                for (i=0; i<files->nreaders; i++)
-                    if ( files->readers[i].nbuffer && files->readers[i].buffer[1]->pos==min_pos )
-                        _reader_shift_buffer(&files->readers[i]);
-                min_pos = INT_MAX;
+                while ( aux->nheap && aux->heap[0].pos==min_pos )
+                {
+                    int ireader = _reader_heap_pop(aux);
+                    _reader_shift_buffer(&files->readers[ireader]);
+                    aux->dirty[aux->ndirty++] = ireader;
+                }
                 continue;
             }
         }
@@ -653,24 +981,30 @@ int _reader_next_line(bcf_srs_t *files)
     }
 
     // There can be records with duplicate positions. Set the active line intelligently so that
-    // the alleles match.
+    // the alleles match. The readers sharing the position come off the heap in reader order.
     int nret = 0;   // number of readers sharing the position
     bcf1_t *first = NULL;   // record which will be used for allele matching
-    for (i=0; i<files->nreaders; i++)
+    int nkeep = 0;
+    while ( aux->nheap && aux->heap[0].pos==min_pos )
     {
-        files->has_line[i] = 0;
-
-        // Skip readers with no records at this position
-        if ( !files->readers[i].nbuffer || files->readers[i].buffer[1]->pos!=min_pos ) continue;
+        int ireader = _reader_heap_pop(aux);
 
         // Until now buffer[0] of all reader was empty and the lines started at buffer[1].
         // Now lines which are ready to be output will be moved to buffer[0].
-        if ( _reader_match_alleles(files, &files->readers[i], first) < 0 ) continue;
-        if ( !first ) first = files->readers[i].buffer[0];
+        if ( _reader_match_alleles(files, &files->readers[ireader], first) < 0 )
+        {
+            // Unchanged, goes back to the heap once all at this position were seen
+            aux->keep[nkeep++] = ireader;
+            continue;
+        }
+        if ( !first ) first = files->readers[ireader].buffer[0];
 
         nret++;
-        files->has_line[i] = 1;
+        files->has_line[ireader] = 1;
+        aux->active[aux->nactive++] = ireader;
+        aux->dirty[aux->ndirty++] = ireader;
     }
+    for (i=0; i<nkeep; i++) _reader_heap_push(aux, files->readers, aux->keep[i]);
     return nret;
 }
 
@@ -681,23 +1015,21 @@ int bcf_sr_next_line(bcf_srs_t *files)
 
     while (1)
     {
+        sr_aux_t *aux = (sr_aux_t*) files->aux;
         int i, ret = _reader_next_line(files);
         if ( !ret ) return ret;
 
-        for (i=0; i<files->nreaders; i++)
-            if ( files->has_line[i] ) break;
-
-        if ( _regions_match_alleles(files->targets, files->targets_als-1, files->readers[i].buffer[0]) ) return ret;
+        if ( _regions_match_alleles(files->targets, files->targets_als-1, files->readers[aux->active[0]].buffer[0]) ) return ret;
 
         // Check if there are more duplicate lines in the buffers. If not, return this line as if it
         // matched the targets, even if there is a type mismatch
-        for (i=0; i<files->nreaders; i++)
+        for (i=0; i<aux->nactive; i++)
         {
-            if ( !files->has_line[i] ) continue;
-            if ( files->readers[i].nbuffer==0 || files->readers[i].buffer[1]->pos!=files->readers[i].buffer[0]->pos ) continue;
+            bcf_sr_t *reader = &files->readers[aux->active[i]];
+            if ( reader->nbuffer==0 || reader->buffer[1]->pos!=reader->buffer[0]->pos ) continue;
             break;
         }
-        if ( i==files->nreaders ) return ret;   // no more lines left, output even if target alleles are not of the same type
+        if ( i==aux->nactive ) return ret;   // no more lines left, output even if target alleles are not of the same type
     }
 }
 
@@ -713,6 +1045,7 @@ static void bcf_sr_seek_start(bcf_srs_t *readers)
 
 int bcf_sr_seek(bcf_srs_t *readers, const char *seq, int pos)
 {
+    ((sr_aux_t*)readers->aux)->reset = 1;
     if ( !seq && !pos )
     {
         // seek to start
@@ -721,6 +1054,7 @@ int bcf_sr_seek(bcf_srs_t *readers, const char *seq, int pos)
     }
 
     bcf_sr_regions_overlap(readers->regions, seq, pos, pos);
+    _readers_prefetch_wait(readers, 1);
     int i, nret = 0;
     for (i=0; i<readers->nreaders; i++)
     {
@@ -802,6 +1136,229 @@ int bcf_sr_set_samples(bcf_srs_t *files, const char *fname, int is_file)
     return 1;
 }
 
+/*
+ *  Region-parallel reading.  Each job reads one window with a private
+ *  bcf_srs_t taken from a shared stack of idle ones and given back when the
+ *  window is done, so no more copies of the readers are opened than there
+ *  are threads.  A reused copy is pointed at the next window by replacing
+ *  its regions: once a window is finished all its readers are at the end of
+ *  their regions, so the next bcf_sr_next_line() seeks afresh.
+ */
+#define SR_PAR_WINDOW_SIZE (16<<20)
+
+typedef struct
+{
+    const char *seq;    // points into the template's regions
+    int beg, end;       // 0-based, inclusive
+}
+sr_window_t;
+
+typedef struct sr_par_job_t
+{
+    struct _bcf_sr_par_t *par;
+    sr_window_t win;
+    kstring_t out;
+    int ret;
+    struct sr_par_job_t *next;
+}
+sr_par_job_t;
+
+struct _bcf_sr_par_t
+{
+    bcf_srs_t *tmpl;
+    bcf_sr_par_func func;
+    void *data;
+    sr_window_t *wins;
+    int nwins, mwins, iwin;
+    t_pool *pool;
+    t_results_queue *q;
+    int n_threads, nqueued;
+    sr_par_job_t *free;     // recycled jobs
+    pthread_mutex_t lock;   // guards srs
+    bcf_srs_t **srs;        // idle copies of the readers, at most one per thread
+    int nsrs, msrs;
+};
+
+static bcf_srs_t *_sr_par_open(bcf_srs_t *tmpl)
+{
+    bcf_srs_t *sr = bcf_sr_init();
+    sr->require_index = 1;
+    sr->explicit_regs = 1;  // the windows are set by _sr_par_job()
+    sr->collapse = tmpl->collapse;
+    sr->apply_filters = tmpl->apply_filters;
+    sr->max_unpack = tmpl->max_unpack;
+    int i;
+    for (i=0; i<tmpl->nreaders; i++)
+        if ( !bcf_sr_add_reader(sr, tmpl->readers[i].fname) )
+        {
+            fprintf(stderr,"[%s:%d %s] Could not open %s: %s\n", __FILE__,__LINE__,__FUNCTION__,tmpl->readers[i].fname,bcf_sr_strerror(sr->errnum));
+            bcf_sr_destroy(sr);
+            return NULL;
+        }
+    return sr;
+}
+
+static void *_sr_par_job(void *arg)
+{
+    sr_par_job_t *job = (sr_par_job_t*) arg;
+    bcf_sr_par_t *par = job->par;
+    bcf_srs_t *sr = NULL;
+    job->out.l = 0;
+    job->ret = 0;
+    pthread_mutex_lock(&par->lock);
+    if ( par->nsrs ) sr = par->srs[--par->nsrs];
+    pthread_mutex_unlock(&par->lock);
+    if ( !sr && !(sr = _sr_par_open(par->tmpl)) ) { job->ret = -1; return job; }
+
+    sr_aux_t *aux = (sr_aux_t*) sr->aux;
+    if ( sr->regions ) bcf_sr_regions_destroy(sr->regions);
+    sr->regions = (bcf_sr_regions_t *) calloc(1, sizeof(bcf_sr_regions_t));
+    sr->regions->start = sr->regions->end = -1;
+    sr->regions->prev_start = sr->regions->prev_seq = -1;
+    _regions_add(sr->regions, job->win.seq, job->win.beg+1, job->win.end+1);
+    aux->reset = 1;
+
+    while ( bcf_sr_next_line(sr) )
+    {
+        // Records starting in the previous window but reaching into this one
+        // have been seen there already
+        if ( sr->readers[aux->active[0]].buffer[0]->pos < job->win.beg ) continue;
+        if ( par->func(sr, par->data, &job->out) < 0 ) { job->ret = -1; break; }
+    }
+    if ( job->ret<0 )
+    {
+        // Stopped in the middle of the window, the readers cannot be reused
+        bcf_sr_destroy(sr);
+        return job;
+    }
+    pthread_mutex_lock(&par->lock);
+    hts_expand(bcf_srs_t*, par->nsrs+1, par->msrs, par->srs);
+    par->srs[par->nsrs++] = sr;
+    pthread_mutex_unlock(&par->lock);
+    return job;
+}
+
+bcf_sr_par_t *bcf_sr_par_init(bcf_srs_t *files, int n_threads, int64_t window_size, bcf_sr_par_func func, void *data)
+{
+    if ( files->streaming || files->explicit_regs || files->targets || files->samples )
+    {
+        files->errnum = api_usage_error;
+        fprintf(stderr,"[%s:%d %s] Error: streaming, regions, targets and samples are not supported\n", __FILE__,__LINE__,__FUNCTION__);
+        return NULL;
+    }
+    if ( n_threads<1 ) n_threads = 1;
+    if ( window_size<=0 ) window_size = SR_PAR_WINDOW_SIZE;
+
+    bcf_sr_par_t *par = (bcf_sr_par_t*) calloc(1, sizeof(bcf_sr_par_t));
+    par->tmpl = files;
+    par->func = func;
+    par->data = data;
+    par->n_threads = n_threads;
+
+    // Split each sequence as the reader with the most windows in it would be split
+    bcf_sr_regions_t *reg = files->regions;
+    int i, j, k;
+    for (i=0; reg && i<reg->nseqs; i++)
+    {
+        int *wins = NULL, nwins = 0;
+        for (j=0; j<files->nreaders; j++)
+        {
+            bcf_sr_t *reader = &files->readers[j];
+            int tid = reader->tbx_idx ? tbx_name2id(reader->tbx_idx, reg->seq_names[i]) : bcf_hdr_name2id(reader->header, reg->seq_names[i]);
+            if ( tid<0 ) continue;
+            int n, *w = hts_idx_split(reader->tbx_idx ? reader->tbx_idx->idx : reader->bcf_idx, tid, window_size, &n);
+            if ( n>nwins ) { free(wins); wins = w; nwins = n; }
+            else free(w);
+        }
+        hts_expand(sr_window_t, par->nwins+nwins, par->mwins, par->wins);
+        for (k=0; k<nwins; k++)
+        {
+            sr_window_t *win = &par->wins[par->nwins++];
+            win->seq = reg->seq_names[i];
+            win->beg = wins[k];
+            win->end = k+1<nwins ? wins[k+1]-1 : MAX_CSI_COOR-1;
+        }
+        free(wins);
+    }
+
+    if ( !(par->pool = t_pool_init(2*n_threads, n_threads)) )
+    {
+        free(par->wins);
+        free(par);
+        return NULL;
+    }
+    par->q = t_results_queue_init();
+    pthread_mutex_init(&par->lock, NULL);
+    return par;
+}
+
+int bcf_sr_par_next(bcf_sr_par_t *par, kstring_t *out)
+{
+    while ( par->iwin < par->nwins && par->nqueued < 2*par->n_threads )
+    {
+        sr_par_job_t *job = par->free;
+        if ( job ) par->free = job->next;
+        else
+        {
+            job = (sr_par_job_t*) calloc(1, sizeof(sr_par_job_t));
+            if ( !job ) return -1;
+            job->par = par;
+        }
+        job->win = par->wins[par->iwin];
+        if ( t_pool_dispatch(par->pool, par->q, _sr_par_job, job) < 0 )
+        {
+            // Keep it on the free list, bcf_sr_par_destroy() releases it with its readers
+            job->next = par->free;
+            par->free = job;
+            return -1;
+        }
+        par->iwin++;
+        par->nqueued++;
+    }
+    if ( !par->nqueued ) return 0;
+
+    t_pool_result *r = t_pool_next_result_wait(par->q);
+    if ( !r ) return -1;
+    sr_par_job_t *job = (sr_par_job_t*) r->data;
+    t_pool_delete_result(r, 0);
+    par->nqueued--;
+
+    kstring_t tmp = *out; *out = job->out; job->out = tmp;
+    int ret = job->ret;
+    job->next = par->free;
+    par->free = job;
+    return ret<0 ? -1 : 1;
+}
+
+void bcf_sr_par_destroy(bcf_sr_par_t *par)
+{
+    while ( par->nqueued )
+    {
+        t_pool_result *r = t_pool_next_result_wait(par->q);
+        if ( !r ) break;
+        sr_par_job_t *job = (sr_par_job_t*) r->data;
+        t_pool_delete_result(r, 0);
+        job->next = par->free;
+        par->free = job;
+        par->nqueued--;
+    }
+    t_pool_destroy(par->pool, 0);
+    t_results_queue_destroy(par->q);
+    while ( par->free )
+    {
+        sr_par_job_t *job = par->free;
+        par->free = job->next;
+        free(job->out.s);
+        free(job);
+    }
+    int i;
+    for (i=0; i<par->nsrs; i++) bcf_sr_destroy(par->srs[i]);
+    free(par->srs);
+    pthread_mutex_destroy(&par->lock);
+    free(par->wins);
+    free(par);
+}
+
 // Add a new region into a list sorted by start,end. On input the coordinates
 // are 1-based, stored 0-based, inclusive.
 static void _regions_add(bcf_sr_regions_t *reg, const char *chr, int start, int end)
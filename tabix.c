@@ -27,10 +27,12 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include "htslib/tbx.h"
 #include "htslib/sam.h"
 #include "htslib/vcf.h"
@@ -38,11 +40,13 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/bgzf.h"
 #include "htslib/hts.h"
 #include "htslib/regidx.h"
+#include "cram/thread_pool.h"
 
 typedef struct
 {
     char *regions_fname, *targets_fname;
-    int print_header, header_only, file_info;
+    int print_header, header_only, file_info, annotate, n_threads;
+    regidx_t *regions;  // -R regions, queried in one batch per sequence
 }
 args_t;
 
@@ -137,6 +141,199 @@ static char **parse_regions(char *regions_fname, char **argv, int argc, int *nre
     for (iseq=0; iseq<argc; iseq++) regs[ireg++] = strdup(argv[iseq]);
     return regs;
 }
+// The -R regions of one sequence as 0-based half-open intervals, in a
+// buffer reused between calls
+static hts_pair32_t *seq_regions(regidx_t *idx, const char *seq, hts_pair32_t **regs, int *mregs, int *nregs)
+{
+    regitr_t itr;
+    *nregs = 0;
+    if ( !regidx_overlap(idx, seq, 0, UINT32_MAX, &itr) ) return NULL;
+    while ( itr.i < itr.n )
+    {
+        if ( *nregs == *mregs )
+        {
+            *mregs = *mregs ? *mregs*2 : 64;
+            *regs = (hts_pair32_t*) realloc(*regs, sizeof(hts_pair32_t) * *mregs);
+        }
+        // open-ended regions, such as BED lines ending at UINT32_MAX, are
+        // clamped to what hts_pair32_t holds
+        (*regs)[*nregs].beg = REGITR_START(itr) < INT_MAX ? REGITR_START(itr) : INT_MAX;
+        (*regs)[*nregs].end = REGITR_END(itr) < INT_MAX ? REGITR_END(itr) + 1 : INT_MAX;
+        (*nregs)++;
+        itr.i++;
+    }
+    return *regs;
+}
+
+// Append a column listing the -R regions which the record seq:beg-end overlaps
+static void annotate_regions(regcur_t *cur, const char *seq, int beg, int end, kstring_t *str)
+{
+    regitr_t itr;
+    int n = 0;
+    if ( end <= beg ) end = beg + 1;
+    kputc('\t', str);
+    if ( regcur_overlap(cur, seq, beg, end-1, &itr) )
+    {
+        while ( REGITR_OVERLAP(itr, beg, end-1) )
+        {
+            if ( n++ ) kputc(',', str);
+            kputs(seq, str); kputc(':', str);
+            kputuw(REGITR_START(itr)+1, str); kputc('-', str);
+            kputuw(REGITR_END(itr)+1, str);
+            itr.i++;
+        }
+    }
+    if ( !n ) kputc('.', str);
+}
+
+typedef struct
+{
+    args_t *args;
+    char *fname;
+    tbx_t *tbx;
+    regidx_t *targets;
+    const char **seq;
+    int nseq;
+    pthread_mutex_t lock;   // guards fps, the file handles free for the workers
+    htsFile **fps;
+    int nfps, mfps;
+}
+tbx_query_t;
+
+// Output the lines of the -R regions of the sequence tid, or of the region
+// reg, to out or, if NULL, to stdout
+static void query_tbx1(tbx_query_t *q, htsFile *fp, int tid, const char *reg, kstring_t *str, kstring_t *out)
+{
+    hts_itr_t *itr;
+    regcur_t cur;
+    if ( !reg )
+    {
+        // Batched: the merged regions of the sequence are read in one pass
+        hts_pair32_t *breg = NULL;
+        int mreg = 0, nreg;
+        if ( !seq_regions(q->args->regions, q->seq[tid], &breg, &mreg, &nreg) ) return;
+        itr = tbx_itr_queryregs(q->tbx, tid, breg, &nreg);
+        free(breg);
+        if ( !itr ) return;
+        regcur_init(&cur, q->args->regions);
+    }
+    else
+    {
+        itr = tbx_itr_querys(q->tbx, reg);
+        if ( !itr ) return;
+    }
+    while (tbx_itr_next(fp, q->tbx, itr, str) >= 0)
+    {
+        if ( q->targets && !regidx_overlap(q->targets,q->seq[itr->curr_tid],itr->curr_beg,itr->curr_end, NULL) ) continue;
+        if ( !reg && q->args->annotate ) annotate_regions(&cur, q->seq[tid], itr->curr_beg, itr->curr_end, str);
+        if ( out )
+        {
+            kputsn(str->s, str->l, out);
+            kputc('\n', out);
+        }
+        else
+            puts(str->s);
+    }
+    tbx_itr_destroy(itr);
+}
+
+typedef struct
+{
+    tbx_query_t *q;
+    int tid;
+    const char *reg;
+    kstring_t out;
+    int failed;     // the file could not be opened; reported by query_job_print()
+}
+query_job_t;
+
+static void *query_job(void *arg)
+{
+    query_job_t *job = (query_job_t*) arg;
+    tbx_query_t *q = job->q;
+    kstring_t str = {0,0,0};
+    htsFile *fp = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if ( q->nfps ) fp = q->fps[--q->nfps];
+    pthread_mutex_unlock(&q->lock);
+    if ( !fp && !(fp = hts_open(q->fname,"r")) )
+    {
+        // error() exits, which must not happen on a pool thread
+        job->failed = 1;
+        return job;
+    }
+
+    query_tbx1(q, fp, job->tid, job->reg, &str, &job->out);
+
+    pthread_mutex_lock(&q->lock);
+    hts_expand(htsFile*, q->nfps+1, q->mfps, q->fps);
+    q->fps[q->nfps++] = fp;
+    pthread_mutex_unlock(&q->lock);
+    free(str.s);
+    return job;
+}
+
+static void query_job_print(query_job_t *job)
+{
+    if ( job->failed ) error("Could not read %s\n", job->q->fname);
+    if ( job->out.l ) fwrite(job->out.s, 1, job->out.l, stdout);
+    free(job->out.s);
+    free(job);
+}
+
+// Query the units on threads, each with a file handle of its own, and print
+// their output in the order requested
+static void query_tbx_mt(tbx_query_t *q, int nunits, char **regs)
+{
+    int i, n_pending = 0, n_threads = q->args->n_threads;
+    t_pool *pool = t_pool_init(n_threads*2, n_threads);
+    t_results_queue *rq = t_results_queue_init();
+    if ( !pool || !rq ) error("Could not start %d threads\n", n_threads);
+    pthread_mutex_init(&q->lock, NULL);
+    for (i=0; i<=nunits; i++)
+    {
+        if ( i<nunits )
+        {
+            query_job_t *job = (query_job_t*) calloc(1, sizeof(query_job_t));
+            if ( !job ) error("Could not allocate memory\n");
+            job->q   = q;
+            job->tid = regs ? -1 : i;
+            job->reg = regs ? regs[i] : NULL;
+            if ( t_pool_dispatch(pool, rq, query_job, job) < 0 )
+            {
+                // Query this unit here, once the units before it are printed
+                while ( n_pending )
+                {
+                    t_pool_result *r = t_pool_next_result_wait(rq);
+                    if ( !r ) error("Could not collect the query results\n");
+                    query_job_print((query_job_t*) r->data);
+                    t_pool_delete_result(r, 0);
+                    n_pending--;
+                }
+                query_job_print((query_job_t*) query_job(job));
+                continue;
+            }
+            n_pending++;
+        }
+        // Print finished units in order, holding at most 2*n_threads at once
+        while ( n_pending && (i==nunits || n_pending >= n_threads*2) )
+        {
+            t_pool_result *r = t_pool_next_result_wait(rq);
+            if ( !r ) error("Could not collect the query results\n");
+            query_job_print((query_job_t*) r->data);
+            t_pool_delete_result(r, 0);
+            n_pending--;
+        }
+    }
+    t_pool_destroy(pool, 0);
+    t_results_queue_destroy(rq);
+    for (i=0; i<q->nfps; i++)
+        if ( hts_close(q->fps[i]) ) error("hts_close returned non-zero status: %s\n", q->fname);
+    free(q->fps);
+    pthread_mutex_destroy(&q->lock);
+}
+
 static int query_regions(args_t *args, char *fname, char **regs, int nregs)
 {
     int i;
@@ -153,6 +350,7 @@ static int query_regions(args_t *args, char *fname, char **regs, int nregs)
 
     if ( format == bcf )
     {
+        if ( args->annotate ) error("The -a option is not supported for BCF files\n");
         htsFile *out = hts_open("-","w");
         if ( !out ) error("Could not open stdout\n", fname);
         hts_idx_t *idx = bcf_index_load(fname);
@@ -161,7 +359,31 @@ static int query_regions(args_t *args, char *fname, char **regs, int nregs)
         if ( !hdr ) error("Could not read the header: %s\n", fname);
         if ( args->print_header )
             bcf_hdr_write(out,hdr);
-        if ( !args->header_only )
+        if ( !args->header_only && args->regions )
+        {
+            // Batched: the merged regions of each sequence are read in one pass
+            bcf1_t *rec = bcf_init();
+            hts_pair32_t *breg = NULL;
+            int mreg = 0, nreg, tid, nseq;
+            const char **seq = bcf_index_seqnames(idx, hdr, &nseq);
+            for (i=0; i<nseq; i++)
+            {
+                if ( !seq_regions(args->regions, seq[i], &breg, &mreg, &nreg) ) continue;
+                tid = bcf_hdr_name2id(hdr, seq[i]);
+                hts_itr_t *itr = bcf_itr_queryregs(idx, tid, breg, &nreg);
+                if ( !itr ) continue;
+                while ( bcf_itr_next(fp, itr, rec) >=0 )
+                {
+                    if ( reg_idx && !regidx_overlap(reg_idx, seq[i],rec->pos,rec->pos+rec->rlen-1, NULL) ) continue;
+                    bcf_write(out,hdr,rec);
+                }
+                bcf_itr_destroy(itr);
+            }
+            free(seq);
+            free(breg);
+            bcf_destroy(rec);
+        }
+        else if ( !args->header_only )
         {
             bcf1_t *rec = bcf_init();
             for (i=0; i<nregs; i++)
@@ -195,21 +417,21 @@ static int query_regions(args_t *args, char *fname, char **regs, int nregs)
         }
         if ( !args->header_only )
         {
-            int nseq;
-            const char **seq = NULL;
-            if ( reg_idx ) seq = tbx_seqnames(tbx, &nseq);
-            for (i=0; i<nregs; i++)
-            {
-                hts_itr_t *itr = tbx_itr_querys(tbx, regs[i]);
-                if ( !itr ) continue;
-                while (tbx_itr_next(fp, tbx, itr, &str) >= 0)
-                {
-                    if ( reg_idx && !regidx_overlap(reg_idx,seq[itr->curr_tid],itr->curr_beg,itr->curr_end, NULL) ) continue;
-                    puts(str.s);
-                }
-                tbx_itr_destroy(itr);
-            }
-            free(seq);
+            tbx_query_t q;
+            memset(&q, 0, sizeof(q));
+            q.args = args;
+            q.fname = fname;
+            q.tbx = tbx;
+            q.targets = reg_idx;
+            q.seq = tbx_seqnames(tbx, &q.nseq);
+            // The units of work: each sequence with -R regions, or each region given
+            int nunits = args->regions ? q.nseq : nregs;
+            if ( args->n_threads > 1 && nunits > 1 )
+                query_tbx_mt(&q, nunits, args->regions ? NULL : regs);
+            else
+                for (i=0; i<nunits; i++)
+                    query_tbx1(&q, fp, args->regions ? i : -1, args->regions ? NULL : regs[i], &str, NULL);
+            free(q.seq);
         }
         free(str.s);
         tbx_destroy(tbx);
@@ -218,6 +440,7 @@ static int query_regions(args_t *args, char *fname, char **regs, int nregs)
         error("Please use \"samtools view\" for querying BAM files.\n");
 
     if ( reg_idx ) regidx_destroy(reg_idx);
+    if ( args->regions ) regidx_destroy(args->regions);
     if ( hts_close(fp) ) error("hts_close returned non-zero status: %s\n", fname);
 
     for (i=0; i<nregs; i++) free(regs[i]);
@@ -368,14 +591,16 @@ static int usage(void)
     fprintf(stderr, "   -p, --preset STR           gff, bed, sam, vcf\n");
     fprintf(stderr, "   -s, --sequence INT         column number for sequence names (suppressed by -p) [1]\n");
     fprintf(stderr, "   -S, --skip-lines INT       skip first INT lines [0]\n");
+    fprintf(stderr, "   -@, --threads INT          number of threads for indexing and for querying text files [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Querying and other options:\n");
+    fprintf(stderr, "   -a, --annotate             with -R, append a column listing the regions each line overlaps\n");
     fprintf(stderr, "   -h, --print-header         print also the header lines\n");
     fprintf(stderr, "   -H, --only-header          print only the header lines\n");
     fprintf(stderr, "   -i, --file-info            print file format info\n");
     fprintf(stderr, "   -l, --list-chroms          list chromosome names\n");
     fprintf(stderr, "   -r, --reheader FILE        replace the header with the content of FILE\n");
-    fprintf(stderr, "   -R, --regions FILE         restrict to regions listed in the file\n");
+    fprintf(stderr, "   -R, --regions FILE         restrict to regions listed in the file; each line is printed once\n");
     fprintf(stderr, "   -T, --targets FILE         similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "\n");
     return 1;
@@ -392,6 +617,7 @@ int main(int argc, char *argv[])
     static struct option loptions[] =
     {
         {"help",0,0,'h'},
+        {"annotate",0,0,'a'},
         {"regions",1,0,'R'},
         {"targets",1,0,'T'},
         {"file-info",0,0,'i'},
@@ -407,14 +633,16 @@ int main(int argc, char *argv[])
         {"sequence",1,0,'s'},
         {"skip-lines",1,0,'S'},
         {"list-chroms",0,0,'l'},
+        {"threads",1,0,'@'},
         {"reheader",1,0,'r'},
         {0,0,0,0}
     };
 
-    while ((c = getopt_long(argc, argv, "hH?0b:c:e:fm:p:s:S:lr:iCR:T:", loptions,NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "hH?0ab:c:e:fm:p:s:S:lr:iCR:T:@:", loptions,NULL)) >= 0)
     {
         switch (c)
         {
+            case 'a': args.annotate = 1; break;
             case 'R': args.regions_fname = optarg; break;
             case 'T': args.targets_fname = optarg; break;
             case 'C': do_csi = 1; break;
@@ -440,6 +668,7 @@ int main(int argc, char *argv[])
                       break;
             case 's': conf.sc = atoi(optarg); break;
             case 'S': conf.line_skip = atoi(optarg); break;
+            case '@': args.n_threads = atoi(optarg); break;
             default: return usage();
         }
     }
@@ -453,7 +682,15 @@ int main(int argc, char *argv[])
     {
         int nregs = 0;
         char **regs = NULL;
-        if ( !args.header_only )
+        if ( args.annotate && (!args.regions_fname || argc > optind+1) ) error("The -a option requires -R and no regions on the command line\n");
+        if ( args.regions_fname && argc == optind+1 )
+        {
+            // Batched per sequence; with regions on the command line as well,
+            // each region is queried on its own as before
+            args.regions = regidx_init(args.regions_fname, NULL, NULL, 0, NULL);
+            if ( !args.regions ) error("Could not read %s\n", args.regions_fname);
+        }
+        else if ( !args.header_only )
             regs = parse_regions(args.regions_fname, argv+optind+1, argc-optind-1, &nregs);
         return query_regions(&args, argv[optind], regs, nregs);
     }
@@ -532,12 +769,12 @@ int main(int argc, char *argv[])
             if ( bam_index_build(fname, min_shift)!=0 ) error("bam_index_build failed: %s\n", fname);
             return 0;
         }
-        if ( tbx_index_build(fname, min_shift, &conf)!=0 ) error("tbx_index_build failed: %s\n", fname);
+        if ( tbx_index_build_mt(fname, min_shift, &conf, args.n_threads)!=0 ) error("tbx_index_build failed: %s\n", fname);
         return 0;
     }
     else    // TBI index
     {
-        if ( tbx_index_build(fname, min_shift, &conf) ) error("tbx_index_build failed: %s\n", fname);
+        if ( tbx_index_build_mt(fname, min_shift, &conf, args.n_threads) ) error("tbx_index_build failed: %s\n", fname);
         return 0;
     }
     return 0;
@@ -30,8 +30,10 @@ DEALINGS IN THE SOFTWARE.  */
 #include <assert.h>
 #include "htslib/tbx.h"
 #include "htslib/bgzf.h"
+#include "htslib/kstring.h"
 
 #include "htslib/khash.h"
+#include "cram/thread_pool.h"
 KHASH_DECLARE(s2i, kh_cstr_t, int64_t)
 
 tbx_conf_t tbx_conf_gff = { 0, 1, 4, 5, '#', 0 };
@@ -68,72 +70,92 @@ int tbx_name2id(tbx_t *tbx, const char *ss)
     return get_tid(tbx, ss, 0);
 }
 
+// Parse an integer as strtol(p, end, 0) does. Plain runs of decimal digits,
+// that is nearly every coordinate, skip the locale and base handling.
+static inline int64_t parse_int(const char *p, char **end)
+{
+    const char *q = p;
+    int64_t x;
+    if (*q < '1' || *q > '9') return strtol(p, end, 0);  // sign, space, octal, hex or not a number
+    x = *q++ - '0';
+    while (*q >= '0' && *q <= '9' && q - p < 18) x = x * 10 + (*q++ - '0');
+    if (*q >= '0' && *q <= '9') return strtol(p, end, 0);  // long enough to overflow
+    *end = (char*)q;
+    return x;
+}
+
 int tbx_parse1(const tbx_conf_t *conf, int len, char *line, tbx_intv_t *intv)
 {
-    int i, b = 0, id = 1, ncols = 0;
+    int i, b = 0, id = 1, last;
     char *s;
     intv->ss = intv->se = 0; intv->beg = intv->end = -1;
-    for (i = 0; i <= len; ++i) {
-        if (line[i] == '\t' || line[i] == 0) {
-            ++ncols;
-            if (id == conf->sc) {
-                intv->ss = line + b; intv->se = line + i;
-            } else if (id == conf->bc) {
-                // here ->beg is 0-based.
-                intv->beg = intv->end = strtol(line + b, &s, 0);
-                if ( s==line+b ) return -1; // expected int
-                if (!(conf->preset&TBX_UCSC)) --intv->beg;
-                else ++intv->end;
-                if (intv->beg < 0) intv->beg = 0;
-                if (intv->end < 1) intv->end = 1;
-            } else {
-                if ((conf->preset&0xffff) == TBX_GENERIC) {
-                    if (id == conf->ec)
-                    {
-                        intv->end = strtol(line + b, &s, 0);
-                        if ( s==line+b ) return -1; // expected int
-                    }
-                } else if ((conf->preset&0xffff) == TBX_SAM) {
-                    if (id == 6) { // CIGAR
-                        int l = 0, op;
-                        char *t;
-                        for (s = line + b; s < line + i;) {
-                            long x = strtol(s, &t, 10);
-                            op = toupper(*t);
-                            if (op == 'M' || op == 'D' || op == 'N') l += x;
-                            s = t + 1;
-                        }
-                        if (l == 0) l = 1;
-                        intv->end = intv->beg + l;
+    // The columns after the last one needed are not looked at
+    last = conf->sc > conf->bc ? conf->sc : conf->bc;
+    if ((conf->preset&0xffff) == TBX_GENERIC) { if (last < conf->ec) last = conf->ec; }
+    else if ((conf->preset&0xffff) == TBX_SAM) { if (last < 6) last = 6; }
+    else if ((conf->preset&0xffff) == TBX_VCF) { if (last < 8) last = 8; }
+    while (id <= last && b <= len) {
+        // memchr() skips to the next tab a word or a vector at a time
+        s = (char*)memchr(line + b, '\t', len - b);
+        i = s ? s - line : len;
+        if (id == conf->sc) {
+            intv->ss = line + b; intv->se = line + i;
+        } else if (id == conf->bc) {
+            // here ->beg is 0-based.
+            intv->beg = intv->end = parse_int(line + b, &s);
+            if ( s==line+b ) return -1; // expected int
+            if (!(conf->preset&TBX_UCSC)) --intv->beg;
+            else ++intv->end;
+            if (intv->beg < 0) intv->beg = 0;
+            if (intv->end < 1) intv->end = 1;
+        } else {
+            if ((conf->preset&0xffff) == TBX_GENERIC) {
+                if (id == conf->ec)
+                {
+                    intv->end = parse_int(line + b, &s);
+                    if ( s==line+b ) return -1; // expected int
+                }
+            } else if ((conf->preset&0xffff) == TBX_SAM) {
+                if (id == 6) { // CIGAR
+                    int l = 0, op;
+                    char *t;
+                    for (s = line + b; s < line + i;) {
+                        long x = strtol(s, &t, 10);
+                        op = toupper(*t);
+                        if (op == 'M' || op == 'D' || op == 'N') l += x;
+                        s = t + 1;
                     }
-                } else if ((conf->preset&0xffff) == TBX_VCF) {
-                    if (id == 4) {
-                        if (b < i) intv->end = intv->beg + (i - b);
-                    } else if (id == 8) { // look for "END="
-                        int c = line[i];
-                        line[i] = 0;
-                        s = strstr(line + b, "END=");
-                        if (s == line + b) s += 4;
-                        else if (s) {
-                            s = strstr(line + b, ";END=");
-                            if (s) s += 5;
-                        }
-                        if (s) intv->end = strtol(s, &s, 0);
-                        line[i] = c;
+                    if (l == 0) l = 1;
+                    intv->end = intv->beg + l;
+                }
+            } else if ((conf->preset&0xffff) == TBX_VCF) {
+                if (id == 4) {
+                    if (b < i) intv->end = intv->beg + (i - b);
+                } else if (id == 8) { // look for "END="
+                    int c = line[i];
+                    line[i] = 0;
+                    s = strstr(line + b, "END=");
+                    if (s == line + b) s += 4;
+                    else if (s) {
+                        s = strstr(line + b, ";END=");
+                        if (s) s += 5;
                     }
+                    if (s) intv->end = parse_int(s, &s);
+                    line[i] = c;
                 }
             }
-            b = i + 1;
-            ++id;
         }
+        b = i + 1;
+        ++id;
     }
     if (intv->ss == 0 || intv->se == 0 || intv->beg < 0 || intv->end < 0) return -1;
     return 0;
 }
 
-static inline int get_intv(tbx_t *tbx, kstring_t *str, tbx_intv_t *intv, int is_add)
+// Look up the sequence of a line parsed by tbx_parse1(), which returned ret
+static int resolve_intv(tbx_t *tbx, kstring_t *str, tbx_intv_t *intv, int ret, int is_add)
 {
-    if (tbx_parse1(&tbx->conf, str->l, str->s, intv) == 0) {
+    if (ret == 0) {
         int c = *intv->se;
         *intv->se = '\0'; intv->tid = get_tid(tbx, intv->ss, is_add); *intv->se = c;
         return (intv->tid >= 0 && intv->beg >= 0 && intv->end >= 0)? 0 : -1;
@@ -146,11 +168,16 @@ static inline int get_intv(tbx_t *tbx, kstring_t *str, tbx_intv_t *intv, int is_
             case TBX_UCSC: type = "TBX_UCSC"; break;
             default: type = "TBX_GENERIC"; break;
         }
-        fprintf(stderr, "[E::%s] failed to parse %s, was wrong -p [type] used?\nThe offending line was: \"%s\"\n", __func__, type, str->s);
+        fprintf(stderr, "[E::get_intv] failed to parse %s, was wrong -p [type] used?\nThe offending line was: \"%s\"\n", type, str->s);
         return -1;
     }
 }
 
+static inline int get_intv(tbx_t *tbx, kstring_t *str, tbx_intv_t *intv, int is_add)
+{
+    return resolve_intv(tbx, str, intv, tbx_parse1(&tbx->conf, str->l, str->s, intv), is_add);
+}
+
 int tbx_readrec(BGZF *fp, void *tbxv, void *sv, int *tid, int *beg, int *end)
 {
     tbx_t *tbx = (tbx_t *) tbxv;
@@ -236,6 +263,187 @@ tbx_t *tbx_index(BGZF *fp, int min_shift, const tbx_conf_t *conf)
     return tbx;
 }
 
+/*
+    With threads, the data lines are gathered in batches which the pool
+    parses with tbx_parse1(); the batches come back in order and the main
+    thread assigns the sequence ids and pushes the intervals to the index,
+    so the index is the same as one built serially.
+*/
+#define TBX_BATCH 4096
+
+typedef struct tbx_batch_t {
+    struct tbx_batch_t *next;   // free list
+    const tbx_conf_t *conf;
+    kstring_t str;              // the lines, each NUL-terminated
+    int n, m, *off, *ret;       // start of each line in str, tbx_parse1() status
+    uint64_t *voff;             // virtual offset after each line
+    tbx_intv_t *intv;
+} tbx_batch_t;
+
+static void *parse_batch(void *arg)
+{
+    tbx_batch_t *b = (tbx_batch_t*) arg;
+    int i;
+    for (i = 0; i < b->n; ++i) {
+        int len = (i + 1 < b->n ? b->off[i+1] : (int)b->str.l) - b->off[i] - 1;
+        b->ret[i] = tbx_parse1(b->conf, len, b->str.s + b->off[i], &b->intv[i]);
+    }
+    return b;
+}
+
+// Returns 0 or -1 if out of memory
+static int batch_add(tbx_batch_t *b, kstring_t *str, uint64_t voff)
+{
+    if (b->n == b->m) {
+        // b->m grows only once all four arrays have
+        int m = b->m ? b->m << 1 : 256, *off, *ret;
+        uint64_t *voffs;
+        tbx_intv_t *intv;
+        if (!(off = (int*)realloc(b->off, m * sizeof(int)))) return -1;
+        b->off = off;
+        if (!(ret = (int*)realloc(b->ret, m * sizeof(int)))) return -1;
+        b->ret = ret;
+        if (!(voffs = (uint64_t*)realloc(b->voff, m * sizeof(uint64_t)))) return -1;
+        b->voff = voffs;
+        if (!(intv = (tbx_intv_t*)realloc(b->intv, m * sizeof(tbx_intv_t)))) return -1;
+        b->intv = intv;
+        b->m = m;
+    }
+    b->off[b->n] = b->str.l;
+    b->voff[b->n] = voff;
+    if (kputsn(str->s, str->l, &b->str) < 0 || kputc_(0, &b->str) < 0) return -1;
+    b->n++;
+    return 0;
+}
+
+// Push the intervals of a parsed batch to the index; returns 0 or -1 on error.
+// As in tbx_index(), a line that fails to parse keeps the sequence id of the
+// line before it, which *tid carries from one batch to the next.
+static int batch_push(tbx_t *tbx, tbx_batch_t *b, int *tid)
+{
+    int i;
+    for (i = 0; i < b->n; ++i) {
+        tbx_intv_t *intv = &b->intv[i];
+        kstring_t str;
+        str.s = b->str.s + b->off[i];
+        str.m = str.l = (i + 1 < b->n ? b->off[i+1] : (int)b->str.l) - b->off[i] - 1;
+        intv->tid = *tid;
+        resolve_intv(tbx, &str, intv, b->ret[i], 1);
+        *tid = intv->tid;
+        if (hts_idx_push(tbx->idx, intv->tid, intv->beg, intv->end, b->voff[i], 1) < 0) return -1;
+    }
+    b->n = 0; b->str.l = 0;
+    return 0;
+}
+
+static void batch_free(tbx_batch_t *b)
+{
+    free(b->str.s); free(b->off); free(b->ret); free(b->voff); free(b->intv);
+    free(b);
+}
+
+static tbx_t *tbx_index_mt(BGZF *fp, int min_shift, const tbx_conf_t *conf, int n_threads)
+{
+    tbx_t *tbx;
+    kstring_t str = {0,0,0};
+    int ret, first = 0, n_lvls, fmt, n_pending = 0, failed = 0, tid = -1;
+    int64_t lineno = 0;
+    uint64_t last_off = 0;
+    tbx_batch_t *b = NULL, *free_b = NULL;
+    t_pool *pool;
+    t_results_queue *q;
+
+    if (!(pool = t_pool_init(n_threads*2, n_threads))) return NULL;
+    if (!(q = t_results_queue_init())) { t_pool_destroy(pool, 0); return NULL; }
+    if (!(tbx = (tbx_t*)calloc(1, sizeof(tbx_t)))) {
+        t_pool_destroy(pool, 0);
+        t_results_queue_destroy(q);
+        return NULL;
+    }
+    tbx->conf = *conf;
+    if (min_shift > 0) n_lvls = (TBX_MAX_SHIFT - min_shift + 2) / 3, fmt = HTS_FMT_CSI;
+    else min_shift = 14, n_lvls = 5, fmt = HTS_FMT_TBI;
+    for (;;) {
+        ret = bgzf_getline(fp, '\n', &str);
+        if (ret >= 0) {
+            ++lineno;
+            if (lineno <= tbx->conf.line_skip || str.s[0] == tbx->conf.meta_char) {
+                last_off = bgzf_tell(fp);
+                continue;
+            }
+            if (first == 0) {
+                tbx->idx = hts_idx_init(0, fmt, last_off, min_shift, n_lvls);
+                first = 1;
+            }
+            if (!b) {
+                if ((b = free_b)) free_b = b->next;
+                else if ((b = (tbx_batch_t*)calloc(1, sizeof(tbx_batch_t))))
+                    b->conf = &tbx->conf;
+                else {
+                    failed = 1;
+                    break;
+                }
+            }
+            if (batch_add(b, &str, bgzf_tell(fp)) < 0) {
+                failed = 1;
+                break;  // b is freed below
+            }
+            if (b->n < TBX_BATCH) continue;
+        }
+        if (b && b->n) {
+            if (t_pool_dispatch(pool, q, parse_batch, b) < 0) {
+                failed = 1;
+                break;  // b is freed below
+            }
+            n_pending++;
+            b = NULL;
+        }
+        // collect the parsed batches in order, waiting only when the pool is full or at the end
+        while (n_pending && (ret < 0 || n_pending >= n_threads*2)) {
+            t_pool_result *r = t_pool_next_result_wait(q);
+            if (!r) {
+                failed = 1;
+                n_pending = 0;
+                break;
+            }
+            tbx_batch_t *done = (tbx_batch_t*) r->data;
+            t_pool_delete_result(r, 0);
+            n_pending--;
+            if (!failed && batch_push(tbx, done, &tid) < 0) failed = 1;
+            done->next = free_b;
+            free_b = done;
+        }
+        if (ret < 0 || failed) break;
+    }
+    while (n_pending) {
+        t_pool_result *r = t_pool_next_result_wait(q);
+        if (!r) break;
+        tbx_batch_t *done = (tbx_batch_t*) r->data;
+        t_pool_delete_result(r, 0);
+        n_pending--;
+        done->next = free_b;
+        free_b = done;
+    }
+    t_pool_destroy(pool, 0);
+    t_results_queue_destroy(q);
+    if (b) batch_free(b);
+    while (free_b) {
+        b = free_b->next;
+        batch_free(free_b);
+        free_b = b;
+    }
+    free(str.s);
+    if (failed) {
+        tbx_destroy(tbx);
+        return NULL;
+    }
+    if ( !tbx->idx ) tbx->idx = hts_idx_init(0, fmt, last_off, min_shift, n_lvls);   // empty file
+    if ( !tbx->dict ) tbx->dict = kh_init(s2i);
+    hts_idx_finish(tbx->idx, bgzf_tell(fp));
+    tbx_set_meta(tbx);
+    return tbx;
+}
+
 void tbx_destroy(tbx_t *tbx)
 {
     khash_t(s2i) *d = (khash_t(s2i)*)tbx->dict;
@@ -251,13 +459,24 @@ void tbx_destroy(tbx_t *tbx)
 }
 
 int tbx_index_build(const char *fn, int min_shift, const tbx_conf_t *conf)
+{
+    return tbx_index_build_mt(fn, min_shift, conf, 0);
+}
+
+int tbx_index_build_mt(const char *fn, int min_shift, const tbx_conf_t *conf, int n_threads)
 {
     tbx_t *tbx;
     BGZF *fp;
     if ( bgzf_is_bgzf(fn)!=1 ) { fprintf(stderr,"Not a BGZF file: %s\n", fn); return -1; }
     if ((fp = bgzf_open(fn, "r")) == 0) return -1;
     if ( !fp->is_compressed ) { bgzf_close(fp); return -1; }
-    tbx = tbx_index(fp, min_shift, conf);
+    if ( n_threads > 1 )
+    {
+        if ( bgzf_mt(fp, n_threads, 64) < 0 ) { bgzf_close(fp); return -1; }
+        tbx = tbx_index_mt(fp, min_shift, conf, n_threads);
+    }
+    else
+        tbx = tbx_index(fp, min_shift, conf);
     bgzf_close(fp);
     if ( !tbx ) return -1;
     hts_idx_save(tbx->idx, fn, min_shift > 0? HTS_FMT_CSI : HTS_FMT_TBI);
@@ -29,6 +29,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <math.h>
 
 #include "htslib/sam.h"
+#include "htslib/bam_sort.h"
 #include "htslib/kstring.h"
 
 int status;
@@ -153,6 +154,356 @@ static int aux_fields1(void)
     return 1;
 }
 
+static void aux_fields_indexed1(void)
+{
+    static const char sam[] = "data:"
+"@SQ\tSN:one\tLN:1000\n"
+"r1\t0\tone\t500\t20\t8M\t*\t0\t0\tATGCATGC\tqqqqqqqq\tRG:Z:grp1\tNM:i:3\tXB:B:s,1,2,3\tMD:Z:8\tXf:f:1.5\n";
+
+    samFile *in = sam_open(sam, "r");
+    bam_hdr_t *header = sam_hdr_read(in);
+    bam1_t *aln = bam_init1();
+    bam_aux_idx_t *idx = bam_aux_idx_init();
+    kstring_t ks = { 0, 0, NULL };
+    uint8_t *v[4], *p;
+    int32_t nm = 300;
+
+    if (sam_read1(in, header, aln) < 0) { fail("can't read record"); goto done; }
+
+    if (bam_aux_get_many(aln, 4, "MDRGZZNM", v) != 3 || !v[0] || !v[1] || v[2] || !v[3])
+        fail("bam_aux_get_many found the wrong tags");
+    else if (strcmp(bam_aux2Z(v[0]), "8") != 0 || strcmp(bam_aux2Z(v[1]), "grp1") != 0 || bam_aux2i(v[3]) != 3)
+        fail("bam_aux_get_many returned the wrong values");
+
+    if (bam_aux_idx_build(idx, aln) != 5)
+        fail("bam_aux_idx_build did not index 5 fields");
+    if (bam_aux_idx_get_many(idx, aln, 4, "MDRGZZNM", v) != 3 || v[0] != bam_aux_get(aln, "MD") || v[2])
+        fail("bam_aux_idx_get_many disagrees with bam_aux_get");
+
+    // Same size: in place; larger and smaller: spliced; absent: appended
+    bam_aux_update(aln, idx, "RG", 'Z', 5, (const uint8_t*)"grp2");
+    bam_aux_update(aln, idx, "NM", 'i', 4, (const uint8_t*)&nm);
+    bam_aux_update(aln, idx, "MD", 'Z', 7, (const uint8_t*)"3A2C1T");
+    bam_aux_update(aln, idx, "RG", 'Z', 2, (const uint8_t*)"g");
+    bam_aux_update(aln, idx, "XZ", 'Z', 3, (const uint8_t*)"hi");
+
+    if ((p = bam_aux_idx_get(idx, aln, "Xf")) == NULL || bam_aux2f(p) != 1.5)
+        fail("index out of step after updates");
+    if ((p = bam_aux_idx_get(idx, aln, "XZ")) == NULL || strcmp(bam_aux2Z(p), "hi") != 0)
+        fail("appended field not indexed");
+    bam_aux_update(aln, NULL, "XB", 'Z', 2, (const uint8_t*)"b");
+
+    if (sam_format1(header, aln, &ks) < 0)
+        fail("can't format record");
+    else if (strcmp(ks.s, "r1\t0\tone\t500\t20\t8M\t*\t0\t0\tATGCATGC\tqqqqqqqq\tRG:Z:g\tNM:i:300\tXB:Z:b\tMD:Z:3A2C1T\tXf:f:1.5\tXZ:Z:hi") != 0)
+        fail("record updated incorrectly: \"%s\"", ks.s);
+
+done:
+    free(ks.s);
+    bam_aux_idx_destroy(idx);
+    bam_destroy1(aln);
+    bam_hdr_destroy(header);
+    sam_close(in);
+}
+
+static void check_sorted(const char *fn, int order, int expected_n)
+{
+    samFile *in = sam_open(fn, "r");
+    bam_hdr_t *h = in ? sam_hdr_read(in) : NULL;
+    bam1_t *b = bam_init1(), *prev = bam_init1();
+    int n = 0;
+
+    if (!h) { fail("can't read %s", fn); goto done; }
+    if (!strstr(h->text, order == BAM_SORT_NAME ? "SO:queryname" : "SO:coordinate"))
+        fail("%s: header lacks the sort order", fn);
+    while (sam_read1(in, h, b) >= 0) {
+        if (n++) {
+            if (order == BAM_SORT_COORD) {
+                uint32_t t0 = prev->core.tid, t1 = b->core.tid;
+                if (t0 > t1 || (t0 == t1 && prev->core.pos > b->core.pos))
+                    fail("%s: %s before %s", fn, bam_get_qname(prev), bam_get_qname(b));
+            }
+            else if (atoi(bam_get_qname(prev) + 1) > atoi(bam_get_qname(b) + 1))
+                fail("%s: %s before %s", fn, bam_get_qname(prev), bam_get_qname(b));
+        }
+        bam_copy1(prev, b);
+    }
+    if (n != expected_n) fail("%s: %d records, expected %d", fn, n, expected_n);
+
+done:
+    bam_destroy1(b); bam_destroy1(prev);
+    if (h) bam_hdr_destroy(h);
+    if (in) sam_close(in);
+}
+
+static void sort1(void)
+{
+    static const char sam[] = "data:"
+"@HD\tVN:1.4\tSO:unsorted\n"
+"@SQ\tSN:one\tLN:1000\n"
+"@SQ\tSN:two\tLN:500\n"
+"r10\t0\ttwo\t50\t20\t4M\t*\t0\t0\tACGT\tqqqq\n"
+"r2\t4\t*\t0\t0\t*\t*\t0\t0\tACGT\tqqqq\n"
+"r9\t0\tone\t300\t20\t4M\t*\t0\t0\tACGT\tqqqq\n"
+"r1\t16\tone\t10\t20\t4M\t*\t0\t0\tACGT\tqqqq\n"
+"r100\t0\ttwo\t5\t20\t4M\t*\t0\t0\tACGT\tqqqq\n"
+"r3\t0\tone\t300\t20\t4M\t*\t0\t0\tACGT\tqqqq\n"
+"r20\t0\tone\t999\t20\t4M\t*\t0\t0\tACGT\tqqqq\n";
+    const char *fns[2] = { "test/sort1.tmp.bam", "test/sort2.tmp.bam" };
+    bam_sort_opts_t opts;
+
+    // A tiny budget makes every record spill to its own temporary file
+    bam_sort_opts_init(&opts);
+    opts.max_mem = 1;
+    opts.n_threads = 2;
+    if (bam_sort_file(sam, fns[0], &opts) < 0) fail("bam_sort_file (spilling) failed");
+    else check_sorted(fns[0], BAM_SORT_COORD, 7);
+
+    bam_sort_opts_init(&opts);
+    if (bam_sort_file(sam, fns[1], &opts) < 0) fail("bam_sort_file (in memory) failed");
+    else check_sorted(fns[1], BAM_SORT_COORD, 7);
+
+    if (bam_merge_files(2, fns, "test/sort3.tmp.bam", NULL) < 0) fail("bam_merge_files failed");
+    else check_sorted("test/sort3.tmp.bam", BAM_SORT_COORD, 14);
+
+    // Files whose tids name other references can't be merged
+    static const char other[] = "data:"
+"@SQ\tSN:two\tLN:500\n"
+"@SQ\tSN:one\tLN:1000\n"
+"r1\t0\tone\t10\t20\t4M\t*\t0\t0\tACGT\tqqqq\n";
+    const char *mixed[2] = { fns[0], "test/sort5.tmp.bam" };
+    if (bam_sort_file(other, mixed[1], &opts) < 0) fail("bam_sort_file (other references) failed");
+    else if (bam_merge_files(2, mixed, "test/sort6.tmp.bam", NULL) == 0)
+        fail("bam_merge_files merged files with different references");
+
+    opts.order = BAM_SORT_NAME;
+    opts.n_threads = 3;
+    if (bam_sort_file(sam, "test/sort4.tmp.bam", &opts) < 0) fail("bam_sort_file (names) failed");
+    else check_sorted("test/sort4.tmp.bam", BAM_SORT_NAME, 7);
+}
+
+typedef struct {
+    samFile *fp;
+    bam_hdr_t *h;
+} plp_data_t;
+
+static int plp_read(void *data, bam1_t *b)
+{
+    plp_data_t *d = (plp_data_t*)data;
+    return sam_read1(d->fp, d->h, b);
+}
+
+// 300 reads stacked at one position, some with deletions and some reversed,
+// so that the column outgrows the initial 256 entries
+static void pileup_sam(kstring_t *sam)
+{
+    int i, j;
+    sam->l = 0;
+    kputs("data:@SQ\tSN:one\tLN:1000\n", sam);
+    for (i = 0; i < 300; i++) {
+        int len = i % 3 ? 10 : 8;
+        ksprintf(sam, "r%d\t%d\tone\t100\t20\t%s\t*\t0\t0\t", i, i % 2 ? 16 : 0, i % 3 ? "10M" : "4M2D4M");
+        for (j = 0; j < len; j++) kputc("ACGT"[(i + j) % 4], sam);
+        kputc('\t', sam);
+        for (j = 0; j < len; j++) kputc('!' + (i * 7 + j) % 40, sam);
+        kputc('\n', sam);
+    }
+}
+
+// Returns the greatest depth seen, or -1 on failure
+static int pileup1(const char *sam, size_t maxmem, int soa)
+{
+    plp_data_t d;
+    bam_plp_t iter;
+    const bam_pileup1_t *plp;
+    int tid, pos, n, i, max_n = 0;
+
+    if ((d.fp = sam_open(sam, "r")) == NULL || (d.h = sam_hdr_read(d.fp)) == NULL) {
+        fail("can't read the pileup input");
+        return -1;
+    }
+    iter = bam_plp_init(plp_read, &d);
+    if (maxmem) bam_plp_set_maxmem(iter, maxmem);
+    if (soa && bam_plp_set_soa(iter, 1) < 0) fail("bam_plp_set_soa failed");
+    while ((plp = bam_plp_auto(iter, &tid, &pos, &n)) != 0) {
+        if (n > max_n) max_n = n;
+        if (!soa) continue;
+        const bam_pileup_soa_t *c = bam_plp_soa(iter);
+        if (!c || c->n != n) { fail("SoA column at %d has %d reads, expected %d", pos+1, c ? c->n : -1, n); break; }
+        for (i = 0; i < n; i++) {
+            const bam1_t *b = plp[i].b;
+            int base = plp[i].is_del ? 0 : bam_seqi(bam_get_seq(b), plp[i].qpos);
+            int qual = plp[i].is_del ? 0 : bam_get_qual(b)[plp[i].qpos];
+            if (c->base[i] != base || c->qual[i] != qual || c->strand[i] != bam_is_rev(b) || c->is_del[i] != plp[i].is_del) {
+                fail("SoA column at %d differs from bam_pileup1_t for %s", pos+1, bam_get_qname(b));
+                break;
+            }
+        }
+    }
+    if (n < 0) { fail("pileup failed"); max_n = -1; }
+    bam_plp_destroy(iter);
+    bam_hdr_destroy(d.h);
+    sam_close(d.fp);
+    return max_n;
+}
+
+static void pileup_soa1(void)
+{
+    kstring_t sam = { 0, 0, NULL };
+    pileup_sam(&sam);
+    if (pileup1(sam.s, 0, 1) != 300) fail("SoA pileup lost reads");
+    free(sam.s);
+}
+
+static void pileup_maxmem1(void)
+{
+    kstring_t sam = { 0, 0, NULL };
+    int all, capped, wider;
+    pileup_sam(&sam);
+    all = pileup1(sam.s, 0, 0);
+    capped = pileup1(sam.s, 4096, 0);
+    wider = pileup1(sam.s, 16384, 0);
+    if (all != 300) fail("pileup without a cap has depth %d, expected 300", all);
+    if (capped <= 0 || capped >= wider || wider >= all)
+        fail("maxmem caps gave depths %d and %d of %d", capped, wider, all);
+    free(sam.s);
+}
+
+// Reads of 6-40bp scattered over two references, so that many of them
+// straddle the boundaries of 50bp windows, and overlapping read pairs, some
+// of them across boundaries and some disagreeing on a base
+static void pileup_par_sam(kstring_t *sam, int seed)
+{
+    int i, j, k;
+    sam->l = 0;
+    kputs("data:@SQ\tSN:one\tLN:700\n@SQ\tSN:two\tLN:300\n", sam);
+    for (i = 0; i < 400; i++) {
+        int len = 6 + (i * 13 + seed) % 35, del = i % 5 == 0 && len > 10;
+        int tid = i % 4 == 3, pos = 1 + (i * 37 + seed * 11) % ((tid ? 300 : 700) - len);
+        ksprintf(sam, "s%d.%d\t%d\t%s\t%d\t20\t", seed, i, i % 2 ? 16 : 0, tid ? "two" : "one", pos);
+        if (del) ksprintf(sam, "%dM2D%dM", len / 2, len - len / 2);
+        else ksprintf(sam, "%dM", len);
+        kputs("\t*\t0\t0\t", sam);
+        for (j = 0; j < len; j++) kputc("ACGT"[(i + j) % 4], sam);
+        kputc('\t', sam);
+        for (j = 0; j < len; j++) kputc('!' + (i + j) % 40, sam);
+        kputc('\n', sam);
+    }
+    for (i = 0; i < 60; i++) {
+        int pos[2], shift = 5 + i % 20, len = 30;
+        pos[0] = 1 + (i * 53 + seed * 7) % (700 - len - shift);
+        pos[1] = pos[0] + shift;
+        for (k = 0; k < 2; k++) {
+            // proper pair, mate reverse or read reverse, first or second
+            ksprintf(sam, "p%d.%d\t%d\tone\t%d\t20\t%dM\t=\t%d\t%d\t", seed, i,
+                     k ? 147 : 99, pos[k], len, pos[1-k], k ? -(shift + len) : shift + len);
+            for (j = 0; j < len; j++) {
+                int ref = pos[k] + j, alt = k && i % 3 == 0 && j == len / 2;
+                kputc("ACGT"[(ref + alt) % 4], sam);
+            }
+            kputc('\t', sam);
+            for (j = 0; j < len; j++) kputc('I' - (i + j + k) % 10, sam);
+            kputc('\n', sam);
+        }
+    }
+}
+
+// Compares bam_mplp_par_auto() column by column with bam_mplp_auto(),
+// reads, positions in them and base qualities, which overlap handling
+// lowers.  Returns the number of entries of quality 0, or -1 on failure.
+static int pileup_par_cmp(const char **fns, int overlaps)
+{
+    plp_data_t d[2], *dp[2] = { &d[0], &d[1] };
+    const bam_pileup1_t *plp[2], *par_plp[2];
+    int n_plp[2], par_n_plp[2], tid, pos, par_tid, par_pos, ret, par_ret, i, j, n_col = 0, n_zero = 0;
+    bam_mplp_par_t par = NULL;
+    bam_mplp_t mplp = NULL;
+
+    memset(d, 0, sizeof(d));
+    for (i = 0; i < 2; i++)
+        if ((d[i].fp = sam_open(fns[i], "r")) == NULL || (d[i].h = sam_hdr_read(d[i].fp)) == NULL) {
+            fail("can't read %s", fns[i]);
+            goto fail;
+        }
+    mplp = bam_mplp_init(2, plp_read, (void**)dp);
+    if ((par = bam_mplp_par_init(2, fns, NULL, 3, 50)) == NULL) {
+        fail("bam_mplp_par_init failed");
+        goto fail;
+    }
+    if (overlaps) {
+        bam_mplp_init_overlaps(mplp);
+        bam_mplp_par_init_overlaps(par);
+    }
+
+    for (;;) {
+        ret = bam_mplp_auto(mplp, &tid, &pos, n_plp, plp);
+        par_ret = bam_mplp_par_auto(par, &par_tid, &par_pos, par_n_plp, par_plp);
+        if (ret < 0 || par_ret < 0) { fail("pileup failed"); goto fail; }
+        if (ret != par_ret) { fail("parallel pileup returned %d, expected %d", par_ret, ret); goto fail; }
+        if (ret == 0) break;
+        if (tid != par_tid || pos != par_pos) {
+            fail("parallel pileup at %d:%d, expected %d:%d", par_tid, par_pos+1, tid, pos+1);
+            goto fail;
+        }
+        for (i = 0; i < 2; i++) {
+            if (n_plp[i] != par_n_plp[i]) {
+                fail("column %d:%d of input %d has %d reads, expected %d", tid, pos+1, i, par_n_plp[i], n_plp[i]);
+                goto fail;
+            }
+            for (j = 0; j < n_plp[i]; j++) {
+                const bam_pileup1_t *a = &plp[i][j], *b = &par_plp[i][j];
+                int qa = a->is_del ? -1 : bam_get_qual(a->b)[a->qpos];
+                int qb = b->is_del ? -1 : bam_get_qual(b->b)[b->qpos];
+                if (strcmp(bam_get_qname(a->b), bam_get_qname(b->b)) != 0 || a->qpos != b->qpos
+                    || a->is_del != b->is_del || a->is_head != b->is_head || a->is_tail != b->is_tail || qa != qb) {
+                    fail("column %d:%d differs for %s%s", tid, pos+1, bam_get_qname(a->b), overlaps ? " with overlaps" : "");
+                    goto fail;
+                }
+                if (qa == 0 && bam_get_qname(a->b)[0] == 'p') ++n_zero;
+            }
+        }
+        n_col++;
+    }
+    if (n_col < 500) fail("only %d columns were compared", n_col);
+
+    if (0) {
+fail:
+        n_zero = -1;
+    }
+    if (par) bam_mplp_par_destroy(par);
+    if (mplp) bam_mplp_destroy(mplp);
+    for (i = 0; i < 2; i++) {
+        if (d[i].h) bam_hdr_destroy(d[i].h);
+        if (d[i].fp) sam_close(d[i].fp);
+    }
+    return n_zero;
+}
+
+static void pileup_par1(void)
+{
+    const char *fns[2] = { "test/plp1.tmp.bam", "test/plp2.tmp.bam" };
+    kstring_t sam = { 0, 0, NULL };
+    bam_sort_opts_t opts;
+    int i, plain, olap;
+
+    bam_sort_opts_init(&opts);
+    for (i = 0; i < 2; i++) {
+        pileup_par_sam(&sam, i);
+        if (bam_sort_file(sam.s, fns[i], &opts) < 0 || bam_index_build(fns[i], 0) < 0) {
+            fail("can't write %s", fns[i]);
+            free(sam.s);
+            return;
+        }
+    }
+    free(sam.s);
+
+    // The pairs' qualities are 31-40 and lowered to 0 only where mates overlap
+    plain = pileup_par_cmp(fns, 0);
+    olap = pileup_par_cmp(fns, 1);
+    if (plain != 0 || olap <= 0)
+        fail("pairs have %d and %d zero qualities without and with overlap handling", plain, olap);
+}
+
 static void iterators1(void)
 {
     hts_itr_destroy(sam_itr_queryi(NULL, HTS_IDX_REST, 0, 0));
@@ -164,7 +515,12 @@ int main(void)
     status = EXIT_SUCCESS;
 
     aux_fields1();
+    aux_fields_indexed1();
     iterators1();
+    sort1();
+    pileup_soa1();
+    pileup_maxmem1();
+    pileup_par1();
 
     return status;
 }
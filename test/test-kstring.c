@@ -0,0 +1,178 @@
+/*  test/test-kstring.c -- kstring number formatting tests and benchmark.
+
+    Copyright (C) 2026 The htslib contributors.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/*
+    Checks that kputw(), kputuw(), kputl() and kputd() produce exactly what
+    the printf family produces, and with -b times them against ksprintf().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "htslib/kstring.h"
+
+static int nfail = 0;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t rng(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static float rand_float_bits(void)
+{
+    uint32_t u = rng();
+    float f;
+    memcpy(&f, &u, 4);
+    return f;
+}
+
+static void check_d(double d, kstring_t *a, kstring_t *b)
+{
+    a->l = b->l = 0;
+    kputd(d, a);
+    ksprintf(b, "%g", d);
+    if (a->l != b->l || memcmp(a->s, b->s, a->l) != 0) {
+        if (nfail++ < 20)
+            fprintf(stderr, "kputd(%.17g): got \"%s\", expected \"%s\"\n", d, a->s, b->s);
+    }
+}
+
+static void check_l(long x, kstring_t *a, kstring_t *b)
+{
+    a->l = b->l = 0;
+    kputl(x, a);
+    ksprintf(b, "%ld", x);
+    if (a->l != b->l || memcmp(a->s, b->s, a->l) != 0) {
+        if (nfail++ < 20) fprintf(stderr, "kputl(%ld): got \"%s\"\n", x, a->s);
+    }
+    if (x >= INT_MIN && x <= INT_MAX) {
+        a->l = 0;
+        kputw((int)x, a);
+        if (strcmp(a->s, b->s) != 0 && nfail++ < 20)
+            fprintf(stderr, "kputw(%ld): got \"%s\"\n", x, a->s);
+    }
+    if (x >= 0 && x <= UINT_MAX) {
+        a->l = 0;
+        kputuw((unsigned)x, a);
+        if (strcmp(a->s, b->s) != 0 && nfail++ < 20)
+            fprintf(stderr, "kputuw(%ld): got \"%s\"\n", x, a->s);
+    }
+}
+
+static void test_formatting(void)
+{
+    static const double special[] = {
+        0.0, -0.0, 1.0, -1.0, 0.5, 0.1, 1e-5, 1e-4, 9.99995e-5, 0.000123456,
+        999999.0, 999999.5, 999999.4, 1e6, 123456.5, 100000.0, 1e100, -1e-100,
+        3.4028234663852886e38, 1.17549435e-38, 1.4e-45, 5e-324, 0.3, 2.5e-5,
+        INFINITY, -INFINITY, NAN
+    };
+    static const long ints[] = {
+        0, 1, -1, 9, 10, 99, 100, 101, 999, 1000, 65535, 65536,
+        INT_MAX, INT_MIN, (long)INT_MAX + 1, (long)UINT_MAX, LONG_MAX, LONG_MIN
+    };
+    kstring_t a = {0,0,0}, b = {0,0,0};
+    int i;
+
+    for (i = 0; i < sizeof(special)/sizeof(*special); i++) check_d(special[i], &a, &b);
+    for (i = 0; i < sizeof(ints)/sizeof(*ints); i++) check_l(ints[i], &a, &b);
+
+    // Every power-of-ten neighbourhood, and the six-digit rounding points
+    for (i = -45; i <= 39; i++) {
+        double p = pow(10, i);
+        check_d(p, &a, &b);
+        check_d(nextafter(p, 0), &a, &b);
+        check_d(nextafter(p, INFINITY), &a, &b);
+        check_d((float)p, &a, &b);
+        check_d(9.999995 * p, &a, &b);
+        check_d(-1.000005 * p, &a, &b);
+    }
+
+    // Random float bit patterns, as found in BCF, and "typical" values
+    for (i = 0; i < 2000000; i++) check_d(rand_float_bits(), &a, &b);
+    for (i = 0; i < 1000000; i++) check_d((float)((rng() % 2000001) / 1000.0 - 1000), &a, &b);
+    for (i = 0; i < 1000000; i++) check_d((double)(int64_t)rng() / (double)(int64_t)rng(), &a, &b);
+    for (i = 0; i < 1000000; i++) check_l((long)rng() >> (rng() % 64), &a, &b);
+
+    free(a.s); free(b.s);
+}
+
+static double elapsed(clock_t t0)
+{
+    return (double)(clock() - t0) / CLOCKS_PER_SEC;
+}
+
+static void benchmark(void)
+{
+    const int n = 5000000;
+    float *f = malloc(n * sizeof(float));
+    int32_t *v = malloc(n * sizeof(int32_t));
+    kstring_t s = {0,0,0};
+    clock_t t0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        f[i] = (float)((rng() % 1000000) / 1000.0);    // e.g. GL, AF, QUAL
+        v[i] = (int32_t)(rng() % 100000);              // e.g. DP, AD, POS
+    }
+
+    s.l = 0; t0 = clock();
+    for (i = 0; i < n; i++) { ksprintf(&s, "%g", f[i]); kputc(',', &s); if (s.l > 1<<20) s.l = 0; }
+    printf("ksprintf(\"%%g\"): %.3f s\n", elapsed(t0));
+    s.l = 0; t0 = clock();
+    for (i = 0; i < n; i++) { kputd(f[i], &s); kputc(',', &s); if (s.l > 1<<20) s.l = 0; }
+    printf("kputd:           %.3f s\n", elapsed(t0));
+    s.l = 0; t0 = clock();
+    for (i = 0; i < n; i++) { ksprintf(&s, "%d", v[i]); kputc(',', &s); if (s.l > 1<<20) s.l = 0; }
+    printf("ksprintf(\"%%d\"): %.3f s\n", elapsed(t0));
+    s.l = 0; t0 = clock();
+    for (i = 0; i < n; i++) { kputw(v[i], &s); kputc(',', &s); if (s.l > 1<<20) s.l = 0; }
+    printf("kputw:           %.3f s\n", elapsed(t0));
+
+    free(s.s); free(f); free(v);
+}
+
+int main(int argc, char **argv)
+{
+    int c, bench = 0;
+    while ((c = getopt(argc, argv, "b")) >= 0)
+        if (c == 'b') bench = 1;
+
+    test_formatting();
+    if (nfail) {
+        fprintf(stderr, "%d formatting mismatches\n", nfail);
+        return 1;
+    }
+    if (bench) benchmark();
+    return 0;
+}
@@ -28,6 +28,8 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <htslib/regidx.h>
 
 void error(const char *format, ...)
@@ -71,6 +73,285 @@ void custom_free(void *payload)
     free(*dat);
 }
 
+// Compare the overlaps reported for random queries against brute force, with
+// long regions scattered among short ones
+void test_random_overlaps(void)
+{
+    int nregs = 5000, i, j;
+    reg_t *regs = (reg_t*) malloc(sizeof(reg_t)*nregs);
+    uint32_t start = 0;
+    srand(42);
+    regidx_t *idx = regidx_init(NULL,NULL,NULL,0,NULL);
+    for (i=0; i<nregs; i++)
+    {
+        start += 1 + rand() % 100;
+        uint32_t len = rand()%50==0 ? rand()%100000 : rand()%100;
+        regs[i].start = start;
+        regs[i].end   = start + len;
+        char line[64];
+        snprintf(line,sizeof(line),"chr1\t%u\t%u", regs[i].start+1, regs[i].end+1);
+        if ( regidx_insert(idx,line)!=0 ) error("insert failed: %s\n", line);
+    }
+    regidx_insert(idx,NULL);
+
+    for (i=0; i<20000; i++)
+    {
+        uint32_t from = rand() % (start + 1000), to = from + (rand()%4 ? rand()%50 : rand()%5000);
+        regitr_t itr;
+        int nexp = 0, nobs = 0, ret = regidx_overlap(idx,"chr1",from,to,&itr);
+        for (j=0; j<nregs; j++)
+        {
+            if ( regs[j].start > to || regs[j].end < from ) continue;
+            nexp++;
+            if ( !ret || !REGITR_OVERLAP(itr,from,to) ) error("missed overlap: %u-%u with %u-%u\n", from,to,regs[j].start,regs[j].end);
+            if ( REGITR_START(itr)!=regs[j].start || REGITR_END(itr)!=regs[j].end )
+                error("wrong overlap: %u-%u with %u-%u, expected %u-%u\n", from,to,REGITR_START(itr),REGITR_END(itr),regs[j].start,regs[j].end);
+            nobs++;
+            itr.i++;
+        }
+        if ( ret && REGITR_OVERLAP(itr,from,to) ) error("extra overlap: %u-%u with %u-%u\n", from,to,REGITR_START(itr),REGITR_END(itr));
+        if ( ret != (nexp>0) || nobs!=nexp ) error("overlap of %u-%u: returned %d, %d regions, expected %d\n", from,to,ret,nobs,nexp);
+    }
+    regidx_destroy(idx);
+    free(regs);
+}
+
+// The overlaps of sorted query streams, with chromosome switches and the
+// occasional step back, must be those regidx_overlap() reports
+void test_cursor(void)
+{
+    static const char *chrs[] = { "1", "2", "X" };
+    int i, j;
+    regidx_t *idx = regidx_init(NULL,NULL,NULL,0,NULL);
+    for (i=0; i<2; i++)
+    {
+        uint32_t start = 0;
+        for (j=0; j<3000; j++)
+        {
+            char line[64];
+            start += 1 + rand() % 200;
+            snprintf(line,sizeof(line),"%s\t%u\t%u", chrs[i], start, start + (rand()%20==0 ? rand()%20000 : rand()%300));
+            if ( regidx_insert(idx,line)!=0 ) error("insert failed: %s\n", line);
+        }
+    }
+    regidx_insert(idx,NULL);
+
+    regcur_t cur;
+    regcur_init(&cur, idx);
+    for (i=0; i<3; i++)
+    {
+        uint32_t from = 0;
+        for (j=0; j<20000; j++)
+        {
+            from += rand()%3==0 ? rand()%100 : 0;
+            if ( rand()%1000==0 ) from -= from > 5000 ? 5000 : from;
+            uint32_t to = from + rand()%500;
+            regitr_t a, b;
+            int ra = regidx_overlap(idx,chrs[i],from,to,&a), rb = regcur_overlap(&cur,chrs[i],from,to,&b);
+            if ( ra!=rb ) error("cursor query %s:%u-%u returned %d, expected %d\n", chrs[i],from,to,rb,ra);
+            while ( ra && REGITR_OVERLAP(a,from,to) )
+            {
+                if ( !REGITR_OVERLAP(b,from,to) || REGITR_START(a)!=REGITR_START(b) || REGITR_END(a)!=REGITR_END(b) )
+                    error("cursor query %s:%u-%u differs\n", chrs[i],from,to);
+                a.i++; b.i++;
+            }
+            if ( rb && REGITR_OVERLAP(b,from,to) ) error("cursor query %s:%u-%u has extra overlaps\n", chrs[i],from,to);
+        }
+    }
+    regidx_destroy(idx);
+}
+
+// Regions added after the index is built, here past a power of two so that
+// the old tree would be too small, are found once it is built again
+void test_insert_after_build(void)
+{
+    int i;
+    char line[64];
+    regitr_t itr;
+    regidx_t *idx = regidx_init(NULL,NULL,NULL,0,NULL);
+    for (i=0; i<1024; i++)
+    {
+        snprintf(line,sizeof(line),"chr1\t%d\t%d", 10*i+1, 10*i+5);
+        if ( regidx_insert(idx,line)!=0 ) error("insert failed: %s\n", line);
+    }
+    regidx_insert(idx,NULL);
+    if ( !regidx_overlap(idx,"chr1",0,0,&itr) ) error("query of a built index failed\n");
+
+    // 10231-10231 ends before the query below and must be skipped
+    if ( regidx_insert(idx,"chr1\t10232\t10232")!=0 || regidx_insert(idx,"chr1\t10251\t10291")!=0 ) error("insert failed\n");
+    if ( regidx_overlap(idx,"chr1",10234,10260,&itr) ) error("query of a stale index found an overlap\n");
+    regidx_insert(idx,NULL);
+    if ( !regidx_overlap(idx,"chr1",10234,10260,&itr) || REGITR_START(itr)!=10230 ) error("query after the rebuild failed\n");
+    itr.i++;
+    if ( !REGITR_OVERLAP(itr,10234,10260) || REGITR_START(itr)!=10250 ) error("region added after the build not found\n");
+    itr.i++;
+    if ( REGITR_OVERLAP(itr,10234,10260) ) error("extra overlap after the rebuild\n");
+    regidx_destroy(idx);
+}
+
+// Payload without memory of its own: the line number
+int number_parse(const char *line, char **chr_beg, char **chr_end, reg_t *reg, void *payload, void *usr)
+{
+    int ret = regidx_parse_tab(line,chr_beg,chr_end,reg,NULL,NULL);
+    if ( ret==0 ) *((int*)payload) = (*(int*)usr)++;
+    return ret;
+}
+
+// A snapshot must answer queries as the index it was saved from
+void test_snapshot(void)
+{
+    const char *fname = "test-regidx.tmp.ridx";
+    static const char *chrs[] = { "chr1", "chr2", "chrUn_gl000220" };
+    int i, j, nline = 0;
+    regidx_t *idx = regidx_init(NULL,number_parse,NULL,sizeof(int),&nline);
+    for (i=0; i<3; i++)
+    {
+        uint32_t start = 0;
+        for (j=0; j<(i==2 ? 1 : 2000); j++)
+        {
+            char line[64];
+            start += 1 + rand() % 200;
+            snprintf(line,sizeof(line),"%s\t%u\t%u", chrs[i], start, start + (rand()%20==0 ? rand()%20000 : rand()%300));
+            if ( regidx_insert(idx,line)!=0 ) error("insert failed: %s\n", line);
+        }
+    }
+    regidx_insert(idx,NULL);
+    if ( regidx_save(idx,fname)!=0 ) error("regidx_save failed\n");
+
+    regidx_t *snap = regidx_load(fname);
+    if ( !snap ) error("regidx_load failed\n");
+    if ( regidx_nregs(snap)!=regidx_nregs(idx) || regidx_seq_nregs(snap,"chr2")!=2000 ) error("snapshot has wrong number of regions\n");
+    if ( regidx_insert(snap,"chr1\t1\t1")==0 ) error("regidx_insert into a snapshot succeeded\n");
+    for (i=0; i<10000; i++)
+    {
+        const char *chr = chrs[rand()%3];
+        uint32_t from = rand()%400000, to = from + rand()%1000;
+        regitr_t a, b;
+        int ra = regidx_overlap(idx,chr,from,to,&a), rb = regidx_overlap(snap,chr,from,to,&b);
+        if ( ra!=rb ) error("snapshot query %s:%u-%u returned %d, expected %d\n", chr,from,to,rb,ra);
+        while ( ra && REGITR_OVERLAP(a,from,to) )
+        {
+            if ( !REGITR_OVERLAP(b,from,to) || REGITR_START(a)!=REGITR_START(b) || REGITR_END(a)!=REGITR_END(b)
+                || REGITR_PAYLOAD(a,int)!=REGITR_PAYLOAD(b,int) )
+                error("snapshot query %s:%u-%u differs\n", chr,from,to);
+            a.i++; b.i++;
+        }
+        if ( rb && REGITR_OVERLAP(b,from,to) ) error("snapshot query %s:%u-%u has extra overlaps\n", chr,from,to);
+    }
+    regidx_destroy(snap);
+    regidx_destroy(idx);
+
+    // Truncated and corrupted snapshots must be rejected, not read past
+    FILE *fp = fopen(fname,"rb");
+    if ( !fp ) error("%s: could not read\n", fname);
+    char *buf = NULL;
+    size_t len = 0, n;
+    do {
+        buf = (char*) realloc(buf, len + 65536);
+        len += n = fread(buf + len, 1, 65536, fp);
+    } while ( n );
+    fclose(fp);
+    const char *tmp_fname = "test-regidx.tmp.bad.ridx";
+    size_t cut[] = { 4, 24, 60, 100, 200, len/4, len/2, len - 4096, len - 64, len - 8 };
+    for (i=0; i<sizeof(cut)/sizeof(*cut); i++)
+    {
+        fp = fopen(tmp_fname,"wb");
+        if ( !fp || fwrite(buf,1,cut[i],fp)!=cut[i] || fclose(fp)!=0 ) error("%s: could not write\n", tmp_fname);
+        if ( (snap = regidx_load(tmp_fname)) ) error("regidx_load of a snapshot cut at %zu of %zu bytes succeeded\n", cut[i], len);
+    }
+    // The offsets of the first sequence: name, regs, max, payload
+    uint64_t *off = (uint64_t*) (buf + 24);
+    for (i=0; i<4; i++)
+    {
+        uint64_t save = off[i];
+        off[i] = i==0 ? len + 8 : (uint64_t)-8;
+        fp = fopen(tmp_fname,"wb");
+        if ( !fp || fwrite(buf,1,len,fp)!=len || fclose(fp)!=0 ) error("%s: could not write\n", tmp_fname);
+        if ( (snap = regidx_load(tmp_fname)) ) error("regidx_load of a snapshot with a bad offset %d succeeded\n", i);
+        off[i] = save;
+    }
+    free(buf);
+    unlink(tmp_fname);
+
+    // Payloads owning memory cannot be saved
+    idx = regidx_init(NULL,custom_parse,custom_free,sizeof(char*),NULL);
+    regidx_insert(idx,"1 10 20 x");
+    regidx_insert(idx,NULL);
+    if ( regidx_save(idx,fname)==0 ) error("regidx_save with allocated payloads succeeded\n");
+    regidx_destroy(idx);
+    unlink(fname);
+}
+
+static double elapsed(clock_t t0)
+{
+    return (double)(clock() - t0) / CLOCKS_PER_SEC;
+}
+
+// Time sorted queries of a BED file with millions of intervals, one query
+// every 10bp as when annotating a dense VCF
+void benchmark(void)
+{
+    const char *fname = "test-regidx.tmp.bed";
+    const int nchr = 4, nregs = 1000000, len = 10000000;
+    int i, j;
+    char chr[16];
+
+    FILE *fp = fopen(fname,"w");
+    if ( !fp ) error("%s: could not write\n", fname);
+    for (i=0; i<nchr; i++)
+    {
+        uint32_t start = 0;
+        for (j=0; j<nregs; j++)
+        {
+            start += 1 + rand() % (2*len/nregs - 1);
+            fprintf(fp,"chr%d\t%u\t%u\n", i+1, start, start + (rand()%1000==0 ? rand()%100000 : 1 + rand()%200));
+        }
+    }
+    fclose(fp);
+
+    clock_t t0 = clock();
+    regidx_t *idx = regidx_init(fname,NULL,NULL,0,NULL);
+    if ( !idx ) error("%s: could not load\n", fname);
+    printf("regidx_init, %d intervals: %.3f s\n", regidx_nregs(idx), elapsed(t0));
+
+    const char *snap_fname = "test-regidx.tmp.ridx";
+    t0 = clock();
+    if ( regidx_save(idx,snap_fname)!=0 ) error("%s: could not save\n", snap_fname);
+    printf("regidx_save: %.3f s\n", elapsed(t0));
+    regidx_destroy(idx);
+    t0 = clock();
+    if ( !(idx = regidx_load(snap_fname)) ) error("%s: could not load\n", snap_fname);
+    printf("regidx_load: %.3f s\n", elapsed(t0));
+    unlink(snap_fname);
+
+    // Iterate the overlaps, then only check for one as when filtering
+    int pass;
+    for (pass=0; pass<4; pass++)
+    {
+        regcur_t cur;
+        regitr_t itr, *pitr = pass<2 ? &itr : NULL;
+        long nhit = 0;
+        regcur_init(&cur, idx);
+        t0 = clock();
+        for (i=0; i<nchr; i++)
+        {
+            snprintf(chr,sizeof(chr),"chr%d",i+1);
+            uint32_t pos;
+            for (pos=0; pos<len; pos+=10)
+            {
+                int ret = pass%2 ? regcur_overlap(&cur,chr,pos,pos,pitr) : regidx_overlap(idx,chr,pos,pos,pitr);
+                if ( !ret ) continue;
+                if ( !pitr ) { nhit++; continue; }
+                while ( REGITR_OVERLAP(itr,pos,pos) ) { nhit++; itr.i++; }
+            }
+        }
+        printf("%s, %d queries, %ld %s: %.3f s\n", pass%2 ? "regcur_overlap" : "regidx_overlap", nchr*len/10, nhit,
+            pitr ? "overlaps" : "with overlaps", elapsed(t0));
+    }
+    regidx_destroy(idx);
+    unlink(fname);
+}
+
 int main(int argc, char **argv)
 {
     // Init index with no file name, we will insert the regions manually
@@ -109,6 +390,14 @@ int main(int argc, char **argv)
 
     // Clean up
     regidx_destroy(idx);
+
+    test_random_overlaps();
+    test_cursor();
+    test_insert_after_build();
+    test_snapshot();
+
+    // With -b, also time the queries
+    if ( argc>1 && !strcmp(argv[1],"-b") ) benchmark();
     
     return 0;
 }
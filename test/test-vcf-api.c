@@ -23,9 +23,14 @@ FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 DEALINGS IN THE SOFTWARE.  */
 
 #include <stdio.h>
+#include <string.h>
 #include <htslib/hts.h>
 #include <htslib/vcf.h>
+#include <htslib/vcfutils.h>
+#include <htslib/synced_bcf_reader.h>
+#include <htslib/vcf_sweep.h>
 #include <htslib/kstring.h>
+#include <htslib/bgzf.h>
 #include <htslib/kseq.h>
 
 void write_bcf(char *fname)
@@ -271,12 +276,1407 @@ void iterator(const char *fname)
     }
 }
 
+static void read_all(const char *fname, int n_threads, const char *samples, kstring_t *str)
+{
+    htsFile *fp = hts_open(fname, "r");
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    bcf1_t *rec = bcf_init1();
+    if ( samples ) bcf_hdr_set_samples(hdr, samples, 0);
+    if ( n_threads && hts_set_threads(fp, n_threads)!=0 )
+    {
+        fprintf(stderr,"hts_set_threads(%s) failed\n", fname);
+        exit(1);
+    }
+    str->l = 0;
+    while ( bcf_read1(fp, hdr, rec)>=0 )
+    {
+        ksprintf(str, "%d\t", rec->errcode);
+        vcf_format1(hdr, rec, str);
+    }
+    int len;
+    char *htxt = bcf_hdr_fmt_text(hdr, 0, &len);
+    kputsn(htxt, len, str);
+    free(htxt);
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(fp);
+}
+
+void threaded_read(const char *fname)
+{
+    // Enough lines for several batches, with tags and contigs missing
+    // from the header turning up part way through
+    char *vcf_fname = (char*) malloc(strlen(fname)+8);
+    snprintf(vcf_fname,strlen(fname)+8,"%s.mt.vcf",fname);
+    FILE *fp = fopen(vcf_fname,"w");
+    fprintf(fp, "##fileformat=VCFv4.1\n##contig=<ID=1>\n");
+    fprintf(fp, "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">\n");
+    fprintf(fp, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n");
+    fprintf(fp, "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Quality\">\n");
+    fprintf(fp, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\tC\n");
+    int i;
+    for (i=0; i<5000; i++)
+    {
+        const char *chr = i<3000 ? "1" : "2";
+        const char *info = i%1700==1699 ? "XI=1" : "DP=10";
+        const char *flt = i==2500 ? "XF" : "PASS";
+        const char *fmt = i%2000==1999 ? "GT:XG" : "GT:GQ";
+        fprintf(fp, "%s\t%d\t.\tA\tC,G\t%d.5\t%s\t%s\t%s\t0/1:%d\t1|2:.\t./.:7\n",
+                chr, i+1, i%100, flt, info, fmt, i%50);
+    }
+    fclose(fp);
+
+    kstring_t serial = {0,0,0}, threaded = {0,0,0};
+    read_all(vcf_fname, 0, NULL, &serial);
+    read_all(vcf_fname, 3, NULL, &threaded);
+    if ( serial.l!=threaded.l || memcmp(serial.s,threaded.s,serial.l) )
+    {
+        fprintf(stderr,"threaded VCF reading of %s differs from serial reading\n", vcf_fname);
+        exit(1);
+    }
+
+    // Lines long enough to have their sample columns parsed in parallel
+    fp = fopen(vcf_fname,"w");
+    fprintf(fp, "##fileformat=VCFv4.1\n##contig=<ID=1>\n");
+    fprintf(fp, "##FORMAT=<ID=ST,Number=1,Type=String,Description=\"String\">\n");
+    fprintf(fp, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n");
+    fprintf(fp, "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Likelihoods\">\n");
+    fprintf(fp, "##FORMAT=<ID=AB,Number=1,Type=Float,Description=\"Balance\">\n");
+    fprintf(fp, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT");
+    for (i=0; i<60000; i++) fprintf(fp, "\ts%d", i);
+    for (i=0; i<6; i++)
+    {
+        int j;
+        fprintf(fp, "\n1\t%d\t.\tA\tC\t.\t.\t.\t%s", i+1, i==3 ? "ST:GT:PL" : "ST:GT:PL:AB");
+        for (j=0; j<60000; j++)
+        {
+            if ( j%7777==0 ) fprintf(fp, "\t%.*s:0|1|2", j%9, "abcdefghi");
+            else if ( j%5000==0 ) fprintf(fp, "\t.");
+            else
+            {
+                fprintf(fp, "\t%c:%d/%d:%d,%d,%d", 'a'+j%26, j%2, (i+j)%2, j%99, i, j%7);
+                if ( i!=3 ) fprintf(fp, ":%d.25", j%4);
+            }
+        }
+    }
+    fprintf(fp, "\n");
+    fclose(fp);
+
+    read_all(vcf_fname, 0, NULL, &serial);
+    read_all(vcf_fname, 4, NULL, &threaded);
+    if ( serial.l!=threaded.l || memcmp(serial.s,threaded.s,serial.l) )
+    {
+        fprintf(stderr,"parallel parsing of the long lines of %s differs from serial parsing\n", vcf_fname);
+        exit(1);
+    }
+    read_all(vcf_fname, 0, "^s1,s7777,s59999", &serial);
+    read_all(vcf_fname, 4, "^s1,s7777,s59999", &threaded);
+    if ( serial.l!=threaded.l || memcmp(serial.s,threaded.s,serial.l) )
+    {
+        fprintf(stderr,"parallel parsing of a sample subset of %s differs from serial parsing\n", vcf_fname);
+        exit(1);
+    }
+    free(serial.s);
+    free(threaded.s);
+    free(vcf_fname);
+}
+
+void subset_samples(const char *fname)
+{
+    // Subsetting BCF records must give what subsetting while parsing VCF gives
+    char *vcf_fname = (char*) malloc(strlen(fname)+12);
+    snprintf(vcf_fname,strlen(fname)+12,"%s.sub.vcf",fname);
+    FILE *fp = fopen(vcf_fname,"w");
+    fprintf(fp, "##fileformat=VCFv4.1\n##contig=<ID=1>\n");
+    fprintf(fp, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n");
+    fprintf(fp, "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Likelihoods\">\n");
+    fprintf(fp, "##FORMAT=<ID=AB,Number=1,Type=Float,Description=\"Balance\">\n");
+    fprintf(fp, "##FORMAT=<ID=ST,Number=1,Type=String,Description=\"String\">\n");
+    fprintf(fp, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT");
+    int i, j;
+    for (j=0; j<40; j++) fprintf(fp, "\ts%d", j);
+    for (i=0; i<20; i++)
+    {
+        fprintf(fp, "\n1\t%d\t.\tA\tC\t.\t.\t.\t%s", i+1, i%3 ? "GT:PL:AB:ST" : "GT:PL");
+        for (j=0; j<40; j++)
+        {
+            fprintf(fp, "\t%d/%d:%d,%d,%d", j%2, (i+j)%2, j*i, j, (i*300+j)%1000);
+            if ( i%3 ) fprintf(fp, ":%d.5:%.*s", j, 1+(i+j)%5, "abcde");
+        }
+    }
+    fprintf(fp, "\n");
+    fclose(fp);
+
+    char *bcf_fname = (char*) malloc(strlen(fname)+12);
+    snprintf(bcf_fname,strlen(fname)+12,"%s.sub.bcf",fname);
+    htsFile *in = hts_open(vcf_fname, "r"), *out = hts_open(bcf_fname, "wb");
+    bcf_hdr_t *hdr = bcf_hdr_read(in);
+    bcf1_t *rec = bcf_init1();
+    bcf_hdr_write(out, hdr);
+    while ( bcf_read1(in, hdr, rec)>=0 ) bcf_write1(out, hdr, rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(in);
+    hts_close(out);
+
+    static const char *subsets[] = { "s0", "s39", "s0,s1,s2,s3", "s1,s2,s5,s6,s7,s30,s39", "^s0", "^s20", "^s1,s3,s5,s7" };
+    kstring_t vcf = {0,0,0}, bcf = {0,0,0};
+    for (i=0; i<sizeof(subsets)/sizeof(*subsets); i++)
+    {
+        read_all(vcf_fname, 0, subsets[i], &vcf);
+        read_all(bcf_fname, 0, subsets[i], &bcf);
+        if ( vcf.l!=bcf.l || memcmp(vcf.s,bcf.s,vcf.l) )
+        {
+            fprintf(stderr,"BCF subset %s of %s differs from the VCF subset\n", subsets[i], bcf_fname);
+            exit(1);
+        }
+    }
+    free(vcf.s);
+    free(bcf.s);
+
+    // The subsetting is skipped and the sample columns dropped when FORMAT
+    // is not wanted, in BCF as in VCF
+    int k;
+    kstring_t str[2] = {{0,0,0},{0,0,0}};
+    for (k=0; k<2; k++)
+    {
+        in = hts_open(k ? bcf_fname : vcf_fname, "r");
+        hdr = bcf_hdr_read(in);
+        bcf_hdr_set_samples(hdr, "s3,s4", 0);
+        rec->max_unpack = BCF_UN_INFO;
+        while ( bcf_read1(in, hdr, rec)>=0 )
+        {
+            if ( rec->n_fmt || rec->indiv.l )
+            {
+                fprintf(stderr,"FORMAT fields of %s were kept with max_unpack=BCF_UN_INFO\n", k ? bcf_fname : vcf_fname);
+                exit(1);
+            }
+            vcf_format1(hdr, rec, &str[k]);
+        }
+        bcf_hdr_destroy(hdr);
+        hts_close(in);
+    }
+    if ( str[0].l!=str[1].l || memcmp(str[0].s,str[1].s,str[0].l) )
+    {
+        fprintf(stderr,"BCF and VCF records differ with max_unpack=BCF_UN_INFO:\n%s\n%s\n", str[0].s, str[1].s);
+        exit(1);
+    }
+    free(str[0].s); free(str[1].s);
+    bcf_destroy1(rec);
+    free(vcf_fname);
+    free(bcf_fname);
+}
+
+// Expected dosage and phasing of every sample of every record, from bcf_get_genotypes()
+static int gt_expected(const char *fname, const char *samples, int beg, int end, int8_t **dosage, uint8_t **phased)
+{
+    htsFile *fp = hts_open(fname, "r");
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    bcf1_t *rec = bcf_init1();
+    if ( samples ) bcf_hdr_set_samples(hdr, samples, 0);
+    int32_t *gt = NULL;
+    int i, j, ngt = 0, nrec = 0, nsmpl = bcf_hdr_nsamples(hdr);
+    *dosage = NULL; *phased = NULL;
+    while ( bcf_read1(fp, hdr, rec)>=0 )
+    {
+        if ( rec->pos+1<beg || rec->pos+1>end ) continue;
+        *dosage = (int8_t*) realloc(*dosage, (nrec+1)*nsmpl);
+        *phased = (uint8_t*) realloc(*phased, (nrec+1)*nsmpl);
+        int8_t *d = *dosage + nrec*nsmpl;
+        uint8_t *ph = *phased + nrec*nsmpl;
+        int n = bcf_get_genotypes(hdr, rec, &gt, &ngt);
+        for (i=0; i<nsmpl; i++)
+        {
+            int32_t *a = gt + i*(n/nsmpl);
+            d[i] = -1; ph[i] = 0;
+            if ( n<=0 ) continue;
+            d[i] = 0;
+            for (j=0; j<n/nsmpl && a[j]!=bcf_int32_vector_end; j++)
+            {
+                if ( bcf_gt_is_missing(a[j]) ) { d[i] = -1; break; }
+                if ( bcf_gt_allele(a[j])>0 ) d[i]++;
+            }
+            if ( n/nsmpl<2 || a[1]==bcf_int32_vector_end ) continue;
+            ph[i] = 1;
+            for (j=1; j<n/nsmpl && a[j]!=bcf_int32_vector_end; j++)
+                if ( !bcf_gt_is_phased(a[j]) ) ph[i] = 0;
+        }
+        nrec++;
+    }
+    free(gt);
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(fp);
+    return nrec;
+}
+
+static void check_gt_reader(const char *fname, const char *region, int beg, int end, const char *samples, int n_threads, int bits, int m_variant)
+{
+    int8_t *exp_dosage;
+    uint8_t *exp_phased;
+    int nexp = gt_expected(fname, samples, beg, end, &exp_dosage, &exp_phased);
+
+    bcf_gt_reader_t *r = bcf_gt_reader_open(fname, region, samples, n_threads);
+    if ( !r ) { fprintf(stderr,"bcf_gt_reader_open(%s) failed\n", fname); exit(1); }
+    int i, s, n, nrec = 0, nsmpl = bcf_hdr_nsamples(bcf_gt_reader_header(r));
+    bcf_gt_matrix_t mat;
+    if ( bcf_gt_matrix_init(&mat, nsmpl, m_variant, bits, NULL)!=0 ) { fprintf(stderr,"bcf_gt_matrix_init failed\n"); exit(1); }
+    while ( (n = bcf_gt_reader_next(r, &mat)) > 0 )
+    {
+        for (i=0; i<n; i++, nrec++)
+        {
+            const uint8_t *row = mat.dosage + i*mat.dosage_stride;
+            const uint8_t *ph = mat.phased + i*mat.mask_stride, *miss = mat.missing + i*mat.mask_stride;
+            for (s=0; nrec<nexp && s<nsmpl; s++)
+            {
+                int exp = exp_dosage[nrec*nsmpl+s], d;
+                if ( bits==BCF_GT_INT8 ) d = (int8_t)row[s];
+                else
+                {
+                    d = (row[s/4] >> 2*(s%4)) & 3;
+                    if ( d==3 ) d = -1;
+                    if ( exp>2 ) exp = 2;
+                }
+                if ( d!=exp || !(miss[s/8] & 1<<(s%8))!=!(exp<0) || !(ph[s/8] & 1<<(s%8))!=!exp_phased[nrec*nsmpl+s] )
+                {
+                    fprintf(stderr,"genotype matrix of %s differs at record %d, sample %d, %d bits\n", fname, nrec, s, bits);
+                    exit(1);
+                }
+            }
+        }
+    }
+    if ( n<0 || nrec!=nexp )
+    {
+        fprintf(stderr,"bcf_gt_reader_next(%s) returned %d after %d of %d records\n", fname, n, nrec, nexp);
+        exit(1);
+    }
+    bcf_gt_matrix_destroy(&mat);
+    bcf_gt_reader_close(r);
+    free(exp_dosage);
+    free(exp_phased);
+}
+
+void gt_matrix(const char *fname)
+{
+    char *vcf_fname = (char*) malloc(strlen(fname)+12);
+    snprintf(vcf_fname,strlen(fname)+12,"%s.gt.vcf",fname);
+    FILE *fp = fopen(vcf_fname,"w");
+    fprintf(fp, "##fileformat=VCFv4.1\n##contig=<ID=1>\n");
+    fprintf(fp, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n");
+    fprintf(fp, "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">\n");
+    fprintf(fp, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT");
+    static const char *diploid[] = { "0/0", "0/1", "1/1", "0|1", "1|0", "1|1", "./.", ".|.", "./1", ".", "2/3", "0|2" };
+    static const char *mixed[] = { "0", "1", ".", "0/1/1", "1|1|2", "0|1/1", "0/0/0/1" };
+    int i, j, nsmpl = 53;
+    for (j=0; j<nsmpl; j++) fprintf(fp, "\ts%d", j);
+    for (i=0; i<20; i++)
+    {
+        fprintf(fp, "\n1\t%d\t.\tA\tC,G,T\t.\t.\t.\t%s", i+1, i==7 ? "DP" : "GT:DP");
+        for (j=0; j<nsmpl; j++)
+        {
+            if ( i==7 ) fprintf(fp, "\t%d", j);
+            else if ( i%5==3 && j%3==0 ) fprintf(fp, "\t%s:%d", mixed[(i+j)%7], j);
+            else fprintf(fp, "\t%s:%d", diploid[(i*7+j)%12], j);
+        }
+    }
+    fprintf(fp, "\n");
+    fclose(fp);
+
+    char *bcf_fname = (char*) malloc(strlen(fname)+12);
+    snprintf(bcf_fname,strlen(fname)+12,"%s.gt.bcf",fname);
+    htsFile *in = hts_open(vcf_fname, "r"), *out = hts_open(bcf_fname, "wb");
+    bcf_hdr_t *hdr = bcf_hdr_read(in);
+    bcf1_t *rec = bcf_init1();
+    bcf_hdr_write(out, hdr);
+    while ( bcf_read1(in, hdr, rec)>=0 ) bcf_write1(out, hdr, rec);
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(in);
+    hts_close(out);
+    if ( bcf_index_build(bcf_fname, 14)!=0 ) { fprintf(stderr,"bcf_index_build(%s) failed\n", bcf_fname); exit(1); }
+
+    int bits;
+    for (bits=BCF_GT_2BIT; bits<=BCF_GT_INT8; bits+=BCF_GT_INT8-BCF_GT_2BIT)
+    {
+        check_gt_reader(vcf_fname, NULL, 0, 1<<30, NULL, 0, bits, 3);
+        check_gt_reader(vcf_fname, NULL, 0, 1<<30, NULL, 2, bits, 100);
+        check_gt_reader(vcf_fname, NULL, 0, 1<<30, "s0,s3,s10,s11,s12,s52", 2, bits, 6);
+        check_gt_reader(bcf_fname, NULL, 0, 1<<30, NULL, 0, bits, 7);
+        check_gt_reader(bcf_fname, "1:5-12", 5, 12, NULL, 0, bits, 4);
+        check_gt_reader(bcf_fname, "1:5-12", 5, 12, "^s1,s2", 0, bits, 4);
+    }
+    free(vcf_fname);
+    free(bcf_fname);
+}
+
+static void write_annotated(const char *in_fname, const char *out_fname, int n_threads)
+{
+    htsFile *in = hts_open(in_fname, "rb"), *out = hts_open(out_fname, "wb");
+    bcf_hdr_t *hdr = bcf_hdr_read(in);
+    bcf1_t *rec = bcf_init1();
+    if ( n_threads && hts_set_threads(out, n_threads)!=0 )
+    {
+        fprintf(stderr,"hts_set_threads(%s) failed\n", out_fname);
+        exit(1);
+    }
+    bgzf_index_build_init(out->fp.bgzf);
+    bcf_hdr_append(hdr, "##INFO=<ID=IX,Number=2,Type=Integer,Description=\"Index\">");
+    bcf_hdr_sync(hdr);
+    bcf_hdr_write(out, hdr);
+    int i, n = 0;
+    for (i=0; i<300; i++)
+    {
+        while ( bcf_read1(in, hdr, rec)>=0 )
+        {
+            int32_t ix[2] = { n++, i };
+            rec->pos += i*100;
+            bcf_update_info_int32(hdr, rec, "IX", ix, 2);
+            if ( bcf_write1(out, hdr, rec)!=0 ) { fprintf(stderr,"bcf_write1(%s) failed\n", out_fname); exit(1); }
+        }
+        if ( bgzf_seek(in->fp.bgzf, 0, SEEK_SET)!=0 ) { fprintf(stderr,"could not rewind %s\n", in_fname); exit(1); }
+        bcf_hdr_destroy(bcf_hdr_read(in));
+    }
+    if ( bgzf_index_dump(out->fp.bgzf, out_fname, ".gzi")!=0 ) { fprintf(stderr,"bgzf_index_dump(%s) failed\n", out_fname); exit(1); }
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(in);
+    if ( hts_close(out)!=0 ) { fprintf(stderr,"hts_close(%s) failed\n", out_fname); exit(1); }
+}
+
+static void slurp(const char *fname, kstring_t *str)
+{
+    FILE *fp = fopen(fname, "rb");
+    char buf[4096];
+    size_t n;
+    str->l = 0;
+    if ( !fp ) { fprintf(stderr,"could not read %s\n", fname); exit(1); }
+    while ( (n = fread(buf, 1, sizeof(buf), fp)) > 0 ) kputsn(buf, n, str);
+    fclose(fp);
+}
+
+void threaded_write(const char *fname)
+{
+    // Records edited before writing are encoded and compressed in the same
+    // order, into the same blocks, whether or not threads are used
+    char *in_fname = (char*) malloc(strlen(fname)+12), *serial_fname = (char*) malloc(strlen(fname)+12), *mt_fname = (char*) malloc(strlen(fname)+12);
+    snprintf(in_fname,strlen(fname)+12,"%s.sub.bcf",fname);
+    snprintf(serial_fname,strlen(fname)+12,"%s.st.bcf",fname);
+    snprintf(mt_fname,strlen(fname)+12,"%s.mt.bcf",fname);
+    write_annotated(in_fname, serial_fname, 0);
+    write_annotated(in_fname, mt_fname, 3);
+
+    kstring_t a = {0,0,0}, b = {0,0,0};
+    int i;
+    for (i=0; i<2; i++)
+    {
+        kstring_t fn = {0,0,0};
+        ksprintf(&fn, "%s%s", serial_fname, i ? ".gzi" : "");
+        slurp(fn.s, &a);
+        fn.l = 0;
+        ksprintf(&fn, "%s%s", mt_fname, i ? ".gzi" : "");
+        slurp(fn.s, &b);
+        if ( a.l!=b.l || memcmp(a.s,b.s,a.l) )
+        {
+            fprintf(stderr,"%s differs when written with threads\n", fn.s);
+            exit(1);
+        }
+        free(fn.s);
+    }
+    free(a.s); free(b.s);
+    free(in_fname); free(serial_fname); free(mt_fname);
+}
+
+void update_format(const char *fname)
+{
+    // FORMAT fields overwritten in place, resized, removed and added must
+    // read back as they were formatted before writing
+    char *in_fname = (char*) malloc(strlen(fname)+12), *out_fname = (char*) malloc(strlen(fname)+12);
+    snprintf(in_fname,strlen(fname)+12,"%s.sub.bcf",fname);
+    snprintf(out_fname,strlen(fname)+12,"%s.upd.bcf",fname);
+    htsFile *in = hts_open(in_fname, "rb"), *out = hts_open(out_fname, "wb");
+    bcf_hdr_t *hdr = bcf_hdr_read(in);
+    bcf1_t *rec = bcf_init1();
+    bcf_hdr_append(hdr, "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">");
+    bcf_hdr_sync(hdr);
+    bcf_hdr_write(out, hdr);
+
+    int i, j, nrec = 0, nsmpl = bcf_hdr_nsamples(hdr);
+    int32_t *ival = (int32_t*) malloc(sizeof(int32_t)*3*nsmpl);
+    float *fval = (float*) malloc(sizeof(float)*nsmpl);
+    const char **sval = (const char**) malloc(sizeof(char*)*nsmpl);
+    kstring_t *exp = NULL;
+    while ( bcf_read1(in, hdr, rec)>=0 )
+    {
+        bcf_unpack(rec, BCF_UN_FMT);
+        char *indiv = rec->indiv.s;
+        switch (nrec%4)
+        {
+            case 0:
+                // values that fit the width already used are written in place
+                for (j=0; j<3*nsmpl; j++) ival[j] = j%3==2 ? bcf_int32_missing : (j*nrec)%100;
+                bcf_update_format_int32(hdr, rec, "PL", ival, 3*nsmpl);
+                if ( rec->indiv.s!=indiv || rec->d.indiv_dirty )
+                {
+                    fprintf(stderr,"PL of %s:%d was not overwritten in place\n", bcf_seqname(hdr,rec), rec->pos+1);
+                    exit(1);
+                }
+                break;
+            case 1:
+                for (j=0; j<nsmpl; j++) sval[j] = j%2 ? "x" : "abcdefghij";
+                if ( bcf_get_fmt(hdr, rec, "ST") ) bcf_update_format_string(hdr, rec, "ST", sval, nsmpl);
+                for (j=0; j<nsmpl; j++) fval[j] = j*0.5;
+                if ( bcf_get_fmt(hdr, rec, "AB") ) bcf_update_format_float(hdr, rec, "AB", fval, nsmpl);
+                break;
+            case 2:
+                bcf_update_format_int32(hdr, rec, "GT", NULL, 0);
+                for (j=0; j<nsmpl; j++) ival[j] = j + nrec;
+                bcf_update_format_int32(hdr, rec, "DP", ival, nsmpl);
+                for (j=0; j<3*nsmpl; j++) ival[j] = 40000 + j;
+                bcf_update_format_int32(hdr, rec, "PL", ival, 3*nsmpl);
+                for (j=0; j<3*nsmpl; j++) ival[j] = 100000 + j;
+                bcf_update_format_int32(hdr, rec, "PL", ival, 3*nsmpl);
+                break;
+            case 3:
+                for (j=0; j<nsmpl; j++) ival[j] = j;
+                bcf_update_format_int32(hdr, rec, "PL", ival, nsmpl);
+                break;
+        }
+        exp = (kstring_t*) realloc(exp, sizeof(kstring_t)*(nrec+1));
+        memset(&exp[nrec], 0, sizeof(kstring_t));
+        vcf_format1(hdr, rec, &exp[nrec]);
+        if ( bcf_write1(out, hdr, rec)!=0 ) { fprintf(stderr,"bcf_write1(%s) failed\n", out_fname); exit(1); }
+        nrec++;
+    }
+    bcf_hdr_destroy(hdr);
+    hts_close(in);
+    hts_close(out);
+
+    kstring_t str = {0,0,0};
+    in = hts_open(out_fname, "rb");
+    hdr = bcf_hdr_read(in);
+    for (i=0; bcf_read1(in, hdr, rec)>=0; i++)
+    {
+        str.l = 0;
+        vcf_format1(hdr, rec, &str);
+        if ( i>=nrec || str.l!=exp[i].l || memcmp(str.s,exp[i].s,str.l) )
+        {
+            fprintf(stderr,"record %d of %s differs from the record written\n", i, out_fname);
+            exit(1);
+        }
+    }
+    if ( i!=nrec ) { fprintf(stderr,"read %d of %d records from %s\n", i, nrec, out_fname); exit(1); }
+    for (i=0; i<nrec; i++) free(exp[i].s);
+    free(exp); free(str.s);
+    free(ival); free(fval); free(sval);
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(in);
+    free(in_fname); free(out_fname);
+}
+
+static bcf_hdr_t *translate_dst_hdr(int n_dummy)
+{
+    kstring_t str = {0,0,0};
+    int i;
+    kputs("##fileformat=VCFv4.1\n##contig=<ID=2>\n##contig=<ID=1>\n", &str);
+    for (i=0; i<n_dummy; i++) ksprintf(&str, "##INFO=<ID=X%d,Number=1,Type=Integer,Description=\"Dummy\">\n", i);
+    kputs("##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Likelihoods\">\n", &str);
+    kputs("##INFO=<ID=AF,Number=A,Type=Float,Description=\"Frequency\">\n", &str);
+    kputs("##FILTER=<ID=q10,Description=\"Quality\">\n", &str);
+    kputs("##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n", &str);
+    kputs("##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">\n", &str);
+    kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\n", &str);
+    bcf_hdr_t *hdr = bcf_hdr_init("w");
+    bcf_hdr_parse(hdr, str.s);
+    free(str.s);
+    return hdr;
+}
+
+void translate(const char *fname)
+{
+    // Lines translated to a header with the same tags in another order,
+    // with ids of the same and of different widths, must read back as
+    // they were before translation
+    char *vcf_fname = (char*) malloc(strlen(fname)+12), *out_fname = (char*) malloc(strlen(fname)+12);
+    snprintf(vcf_fname,strlen(fname)+12,"%s.tr.vcf",fname);
+    snprintf(out_fname,strlen(fname)+12,"%s.tr.bcf",fname);
+    FILE *fp = fopen(vcf_fname,"w");
+    fprintf(fp, "##fileformat=VCFv4.1\n##contig=<ID=1>\n##contig=<ID=2>\n");
+    fprintf(fp, "##FILTER=<ID=q10,Description=\"Quality\">\n");
+    fprintf(fp, "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">\n");
+    fprintf(fp, "##INFO=<ID=AF,Number=A,Type=Float,Description=\"Frequency\">\n");
+    fprintf(fp, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n");
+    fprintf(fp, "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Likelihoods\">\n");
+    fprintf(fp, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\n");
+    fprintf(fp, "1\t10\t.\tA\tC\t5\tq10\tDP=3;AF=0.5\tGT:PL\t0/1:1,2,3\t1/1:4,5,6\n");
+    fprintf(fp, "1\t20\t.\tA\tC,G\t.\tPASS\tAF=0.1,0.2\tPL:GT\t1,2,3,4,5,6:0|2\t.:1/1\n");
+    fprintf(fp, "2\t30\trs1\tA\t.\t.\t.\tDP=300\tGT\t0\t1\n");
+    fprintf(fp, "2\t40\t.\tA\tT\t.\tq10;PASS\t.\tGT\t.\t.\n");
+    fclose(fp);
+
+    int n_dummy, unpack;
+    for (n_dummy=0; n_dummy<=200; n_dummy+=200)
+    for (unpack=0; unpack<2; unpack++)
+    {
+        htsFile *in = hts_open(vcf_fname, "r"), *out = hts_open(out_fname, "wb");
+        bcf_hdr_t *src = bcf_hdr_read(in), *dst = translate_dst_hdr(n_dummy);
+        bcf1_t *rec = bcf_init1();
+        kstring_t exp = {0,0,0}, str = {0,0,0};
+        bcf_hdr_write(out, dst);
+        while ( bcf_read1(in, src, rec)>=0 )
+        {
+            bcf1_t *copy = bcf_dup(rec);     // formatting unpacks the line
+            vcf_format1(src, copy, &exp);
+            bcf_destroy1(copy);
+            if ( unpack ) bcf_unpack(rec, BCF_UN_ALL);
+            bcf_translate(dst, src, rec);
+            bcf_write1(out, dst, rec);
+        }
+        bcf_hdr_destroy(src);
+        bcf_hdr_destroy(dst);
+        hts_close(in);
+        hts_close(out);
+
+        in = hts_open(out_fname, "rb");
+        dst = bcf_hdr_read(in);
+        while ( bcf_read1(in, dst, rec)>=0 ) vcf_format1(dst, rec, &str);
+        if ( str.l!=exp.l || memcmp(str.s,exp.s,str.l) )
+        {
+            fprintf(stderr,"translated lines differ, %d extra tags, %s\n%s\n%s", n_dummy, unpack ? "unpacked" : "packed", exp.s, str.s);
+            exit(1);
+        }
+        free(exp.s); free(str.s);
+        bcf_destroy1(rec);
+        bcf_hdr_destroy(dst);
+        hts_close(in);
+    }
+    free(vcf_fname); free(out_fname);
+}
+
+void translate_resync(void)
+{
+    // The destination gains a tag that fills a hole left by IDX, so its
+    // dictionary does not grow; the cached plan must still be rebuilt
+    bcf_hdr_t *src = bcf_hdr_init("w"), *dst = bcf_hdr_init("w");
+    bcf_hdr_parse(src, "##fileformat=VCFv4.1\n##contig=<ID=1>\n"
+        "##INFO=<ID=AF,Number=1,Type=Integer,Description=\"A\">\n"
+        "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"D\">\n"
+        "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
+    bcf_hdr_parse(dst, "##fileformat=VCFv4.1\n##contig=<ID=1>\n"
+        "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"D\",IDX=3>\n"
+        "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
+    bcf1_t *rec = bcf_init1();
+    int32_t val = 1, i, n = dst->n[BCF_DT_ID];
+    for (i=0; i<2; i++)
+    {
+        bcf_clear1(rec);
+        rec->rid = 0;
+        bcf_update_alleles_str(src, rec, "A,C");
+        bcf_update_info_int32(src, rec, "AF", &val, 1);
+        bcf_update_info_int32(src, rec, "DP", &val, 1);
+        bcf_translate(dst, src, rec);
+        bcf_unpack(rec, BCF_UN_INFO);
+        int af = i ? bcf_hdr_id2int(dst, BCF_DT_ID, "AF") : bcf_hdr_id2int(src, BCF_DT_ID, "AF");
+        if ( rec->n_info!=2 || rec->d.info[0].key!=af || rec->d.info[1].key!=bcf_hdr_id2int(dst, BCF_DT_ID, "DP") )
+        {
+            fprintf(stderr,"translation after a header change used a stale plan\n");
+            exit(1);
+        }
+        bcf_hdr_append(dst, "##INFO=<ID=AF,Number=1,Type=Integer,Description=\"A\">");
+        bcf_hdr_sync(dst);
+        if ( dst->n[BCF_DT_ID]!=n ) { fprintf(stderr,"the IDX hole was not filled\n"); exit(1); }
+    }
+
+    // A new destination, which may be allocated where the old one was, has
+    // the tags in another order and must not be given the old plan
+    bcf_hdr_destroy(dst);
+    dst = bcf_hdr_init("w");
+    bcf_hdr_parse(dst, "##fileformat=VCFv4.1\n##contig=<ID=1>\n"
+        "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"D\">\n"
+        "##INFO=<ID=AF,Number=1,Type=Integer,Description=\"A\">\n"
+        "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
+    bcf_clear1(rec);
+    rec->rid = 0;
+    bcf_update_alleles_str(src, rec, "A,C");
+    bcf_update_info_int32(src, rec, "AF", &val, 1);
+    bcf_translate(dst, src, rec);
+    bcf_unpack(rec, BCF_UN_INFO);
+    if ( rec->n_info!=1 || rec->d.info[0].key!=bcf_hdr_id2int(dst, BCF_DT_ID, "AF") )
+    {
+        fprintf(stderr,"translation to a new header used a stale plan\n");
+        exit(1);
+    }
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(src);
+    bcf_hdr_destroy(dst);
+}
+
+static void check_hdr_text(const char *what, bcf_hdr_t *exp, bcf_hdr_t *hdr, int is_bcf)
+{
+    char *a = bcf_hdr_fmt_text(exp, is_bcf, NULL), *b = bcf_hdr_fmt_text(hdr, is_bcf, NULL);
+    if ( strcmp(a,b) )
+    {
+        fprintf(stderr,"%s: headers differ\n", what);
+        exit(1);
+    }
+    free(a); free(b);
+}
+
+void huge_header(void)
+{
+    // Copies, subsets and merges of a header with many contigs and samples
+    // must look as if they were parsed from the header's text
+    const int n = 20000;
+    kstring_t str = {0,0,0};
+    int i;
+    kputs("##fileformat=VCFv4.2\n##source=test\n", &str);
+    for (i=0; i<n; i++) ksprintf(&str, "##contig=<ID=chr%d,length=%d>\n", i, i+1000);
+    kputs("##INFO=<ID=X,Number=1,Type=Integer,Description=\"X\">\n", &str);
+    kputs("##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">\n", &str);
+    kputs("##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">\n", &str);
+    kputs("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT", &str);
+    for (i=0; i<n; i++) ksprintf(&str, "\tS%d", i);
+    kputc('\n', &str);
+    bcf_hdr_t *hdr = bcf_hdr_init("r");
+    bcf_hdr_parse(hdr, str.s);
+    free(str.s);
+    if ( bcf_hdr_nsamples(hdr)!=n || hdr->n[BCF_DT_CTG]!=n || strcmp(bcf_hdr_id2name(hdr,n-1),"chr19999") )
+    {
+        fprintf(stderr,"huge header parsed wrongly\n");
+        exit(1);
+    }
+
+    bcf_hdr_t *dup = bcf_hdr_dup(hdr);
+    check_hdr_text("dup", hdr, dup, 0);
+    check_hdr_text("dup", hdr, dup, 1);
+    char *htxt = bcf_hdr_fmt_text(hdr, 1, NULL);
+    bcf_hdr_t *parsed = bcf_hdr_init("r");
+    bcf_hdr_parse(parsed, htxt);
+    free(htxt);
+    check_hdr_text("parse", parsed, dup, 1);
+    bcf_hdr_destroy(parsed);
+
+    // A new tag syncs only the ID dictionary
+    bcf_hdr_append(dup, "##INFO=<ID=NEW,Number=1,Type=Float,Description=\"New\">");
+    bcf_hdr_sync(dup);
+    int id = bcf_hdr_id2int(dup, BCF_DT_ID, "NEW");
+    if ( id<0 || strcmp(bcf_hdr_int2id(dup,BCF_DT_ID,id),"NEW") || bcf_hdr_id2type(dup,BCF_HL_INFO,id)!=BCF_HT_REAL
+        || strcmp(bcf_hdr_int2id(dup,BCF_DT_CTG,123),"chr123") || strcmp(bcf_hdr_int2id(dup,BCF_DT_SAMPLE,n-1),"S19999") )
+    {
+        fprintf(stderr,"dup header not synced\n");
+        exit(1);
+    }
+    bcf_hdr_destroy(dup);
+
+    // Removed lines are not copied
+    bcf_hdr_remove(hdr, BCF_HL_INFO, "X");
+    bcf_hdr_remove(hdr, BCF_HL_INFO, "DP");
+    dup = bcf_hdr_dup(hdr);
+    check_hdr_text("dup after remove", hdr, dup, 1);
+    id = bcf_hdr_id2int(dup, BCF_DT_ID, "DP");
+    if ( bcf_hdr_id2int(dup, BCF_DT_ID, "X")>=0 || id<0 || bcf_hdr_idinfo_exists(dup,BCF_HL_INFO,id) || !bcf_hdr_idinfo_exists(dup,BCF_HL_FMT,id) )
+    {
+        fprintf(stderr,"removed lines copied\n");
+        exit(1);
+    }
+    bcf_hdr_destroy(dup);
+
+    char *names[] = { "S3", "S7", "none", "S19999" };
+    int imap[4];
+    bcf_hdr_t *sub = bcf_hdr_subset(hdr, 4, names, imap);
+    if ( bcf_hdr_nsamples(sub)!=3 || imap[0]!=3 || imap[1]!=7 || imap[2]!=-1 || imap[3]!=19999
+        || strcmp(sub->samples[2],"S19999") || bcf_hdr_id2int(sub,BCF_DT_SAMPLE,"S7")!=1 )
+    {
+        fprintf(stderr,"bad header subset\n");
+        exit(1);
+    }
+    bcf_hdr_set_samples(hdr, "S19999,S7,S3", 0);
+    check_hdr_text("subset", hdr, sub, 1);
+    bcf_hdr_destroy(sub);
+
+    bcf_hdr_t *dst = bcf_hdr_init("w");
+    bcf_hdr_append(dst, "##contig=<ID=extra>");
+    bcf_hdr_append(dst, "##contig=<ID=chr5,length=1005>");
+    bcf_hdr_sync(dst);
+    bcf_hdr_combine(dst, hdr);
+    if ( dst->n[BCF_DT_CTG]!=n+1 || bcf_hdr_name2id(dst,"chr5")!=1 || strcmp(bcf_hdr_id2name(dst,n),"chr19999") )
+    {
+        fprintf(stderr,"bad header combine\n");
+        exit(1);
+    }
+    bcf_hdr_destroy(dst);
+    bcf_hdr_destroy(hdr);
+}
+
+// Print the current line of the readers; with full set, the records are
+// printed whole rather than as their alleles
+static int synced_line(bcf_srs_t *sr, void *full, kstring_t *str)
+{
+    bcf1_t *rec = NULL;
+    int i, n = sr->nreaders;
+    for (i=0; i<n; i++)
+        if ( bcf_sr_has_line(sr,i) ) { rec = bcf_sr_get_line(sr,i); break; }
+    ksprintf(str, "%s:%d", bcf_seqname(bcf_sr_get_header(sr,i),rec), rec->pos+1);
+    for (i=0; i<n; i++)
+    {
+        if ( !bcf_sr_has_line(sr,i) ) { kputs(" -", str); continue; }
+        rec = bcf_sr_get_line(sr,i);
+        if ( *(int*)full ) { kputc(' ', str); vcf_format(bcf_sr_get_header(sr,i), rec, str); str->s[--str->l] = 0; }
+        else ksprintf(str, " %s>%s", rec->d.allele[0], rec->n_allele>1 ? rec->d.allele[1] : ".");
+    }
+    kputc('\n', str);
+    return 0;
+}
+
+// With window_size set, read region-parallel with n_threads
+static void synced_lines(char **fnames, int n, int collapse, const char *targets, int n_threads, int64_t window_size, int full, kstring_t *str)
+{
+    bcf_srs_t *sr = bcf_sr_init();
+    sr->require_index = 1;
+    sr->collapse = collapse;
+    if ( targets ) bcf_sr_set_targets(sr, targets, 0, 0);
+    int i;
+    for (i=0; i<n; i++)
+    {
+        if ( i==1 && n_threads && !window_size ) bcf_sr_set_threads(sr, n_threads);
+        if ( !bcf_sr_add_reader(sr, fnames[i]) ) { fprintf(stderr,"bcf_sr_add_reader(%s): %s\n", fnames[i], bcf_sr_strerror(sr->errnum)); exit(1); }
+    }
+    if ( window_size )
+    {
+        bcf_sr_par_t *par = bcf_sr_par_init(sr, n_threads, window_size, synced_line, &full);
+        kstring_t win = {0,0,0};
+        int ret;
+        while ( (ret=bcf_sr_par_next(par, &win))>0 ) kputsn(win.s, win.l, str);
+        if ( ret<0 ) { fprintf(stderr,"bcf_sr_par_next failed\n"); exit(1); }
+        bcf_sr_par_destroy(par);
+        free(win.s);
+    }
+    else
+        while ( bcf_sr_next_line(sr) ) synced_line(sr, &full, str);
+    bcf_sr_destroy(sr);
+}
+
+static void test_vcf_header(kstring_t *str)
+{
+    ksprintf(str, "##fileformat=VCFv4.1\n##contig=<ID=1>\n##contig=<ID=2>\n");
+    ksprintf(str, "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">\n");
+    ksprintf(str, "##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position\">\n");
+    ksprintf(str, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
+}
+
+static void tabix_index(const char *fname)
+{
+    if ( tbx_index_build(fname, 0, &tbx_conf_vcf)!=0 ) { fprintf(stderr,"tbx_index_build(%s) failed\n", fname); exit(1); }
+}
+
+// Write the VCF header and body to fname, bgzip-compressed and tabix-indexed
+static void synced_tabix_vcf(const char *fname, const char *body)
+{
+    BGZF *fp = bgzf_open(fname, "w");
+    kstring_t str = {0,0,0};
+    test_vcf_header(&str);
+    kputs(body, &str);
+    bgzf_write(fp, str.s, str.l);
+    bgzf_close(fp);
+    free(str.s);
+    tabix_index(fname);
+}
+
+// Write n records made by gen() to fname, bgzip-compressed, flushing a BGZF
+// block after every flush-th record so that some blocks end with a line and
+// some in the middle of one; with flush 0 blocks end only where they fill up
+typedef void (*vcf_record_f)(int i, int n, void *data, kstring_t *str);
+static void blocked_vcf(const char *fname, int n, int flush, vcf_record_f gen, void *data)
+{
+    BGZF *fp = bgzf_open(fname, "w");
+    kstring_t str = {0,0,0};
+    int i;
+    test_vcf_header(&str);
+    for (i=0; i<n; i++)
+    {
+        gen(i, n, data, &str);
+        if ( flush && i%flush==0 )
+        {
+            bgzf_write(fp, str.s, str.l);
+            bgzf_flush(fp);
+            str.l = 0;
+        }
+    }
+    bgzf_write(fp, str.s, str.l);
+    bgzf_close(fp);
+    free(str.s);
+}
+
+// Tabix-indexed VCFs long enough for several prefetch batches, with INFO tags
+// missing from the header, read with and without threads; and VCFs spread
+// over many index bins, with records spanning several, read region-parallel
+static void synced_reader_threads(const char *fname)
+{
+    int n = 3, i, j;
+    char **fnames = (char**) malloc(sizeof(char*)*n);
+    kstring_t body = {0,0,0};
+    for (i=0; i<n; i++)
+    {
+        fnames[i] = (char*) malloc(strlen(fname)+16);
+        snprintf(fnames[i],strlen(fname)+16,"%s.srt%d.vcf.gz",fname,i);
+        body.l = 0;
+        for (j=0; j<600; j++)
+        {
+            if ( (j*7+i)%3==0 ) continue;
+            ksprintf(&body, "%d\t%d\t.\tA\t%s\t.\t.\tDP=%d", j<400 ? 1 : 2, j%400*10+1, j%5 ? "C" : "G", j);
+            if ( j==100+i || j==450 ) ksprintf(&body, ";X%d=%d", j, i);
+            kputc('\n', &body);
+        }
+        synced_tabix_vcf(fnames[i], body.s);
+    }
+    for (i=0; i<2; i++)
+    {
+        kstring_t str = {0,0,0}, mt = {0,0,0};
+        synced_lines(fnames, n, i ? COLLAPSE_ANY : COLLAPSE_NONE, i ? "1:1000-3000,2" : NULL, 0, 0, 1, &str);
+        synced_lines(fnames, n, i ? COLLAPSE_ANY : COLLAPSE_NONE, i ? "1:1000-3000,2" : NULL, 3, 0, 1, &mt);
+        if ( !str.l || strcmp(str.s,mt.s) )
+        {
+            fprintf(stderr,"threaded synced lines differ, case %d\n", i);
+            exit(1);
+        }
+        free(str.s);
+        free(mt.s);
+    }
+
+    for (i=0; i<n; i++)
+    {
+        snprintf(fnames[i],strlen(fname)+16,"%s.srw%d.vcf.gz",fname,i);
+        body.l = 0;
+        for (j=0; j<600; j++)
+        {
+            if ( (j*7+i)%3==0 ) continue;
+            int pos = j%400*5000+1;
+            ksprintf(&body, "%d\t%d\t.\tA\t%s\t.\t.\tDP=%d", j<400 ? 1 : 2, pos, j%5 ? "C" : "G", j);
+            if ( j%50==i ) ksprintf(&body, ";END=%d", pos+40000*(i+1));
+            kputc('\n', &body);
+        }
+        synced_tabix_vcf(fnames[i], body.s);
+    }
+    static const int64_t window_size[] = { 1, 200, 1<<20 };
+    for (i=0; i<6; i++)
+    {
+        kstring_t str = {0,0,0}, mt = {0,0,0};
+        int collapse = i%2 ? COLLAPSE_ANY : COLLAPSE_NONE;
+        synced_lines(fnames, n, collapse, NULL, 0, 0, 1, &str);
+        synced_lines(fnames, n, collapse, NULL, 3, window_size[i/2], 1, &mt);
+        if ( !str.l || strcmp(str.s,mt.s) )
+        {
+            fprintf(stderr,"region-parallel synced lines differ, case %d\n", i);
+            exit(1);
+        }
+        free(str.s);
+        free(mt.s);
+    }
+    free(body.s);
+    for (i=0; i<n; i++) free(fnames[i]);
+    free(fnames);
+}
+
+void synced_reader(const char *fname)
+{
+    // Sites shared by some of the files, on different chromosomes, with
+    // duplicate positions whose alleles may or may not be matched. With
+    // COLLAPSE_SNPS and COLLAPSE_ANY the duplicates within a file collapse.
+    static const char *lines[] =
+    {
+        "1\t10\tA\tC|1\t20\tA\tG|1\t20\tAT\tA|1\t30\tG\tT|2\t5\tC\tA",
+        "1\t10\tA\tT|1\t20\tAT\tA|1\t25\tC\tG|1\t30\tG\tT|2\t5\tC\tA|2\t7\tT\tC",
+        "1\t20\tA\tG|1\t20\tA\tC|1\t40\tT\tA",
+        "2\t7\tT\tC|2\t9\tG\tA",
+        "1\t10\tA\tC|1\t30\tG\tT,C|1\t30\tG\tT|2\t9\tG\tA",
+    };
+    static const char *expected[] =
+    {
+        // COLLAPSE_NONE
+        "1:10 A>C - - - A>C\n1:10 - A>T - - -\n1:20 A>G - A>G - -\n1:20 AT>A AT>A - - -\n1:20 - - A>C - -\n"
+        "1:25 - C>G - - -\n1:30 G>T G>T - - G>T\n1:30 - - - - G>T\n1:40 - - T>A - -\n"
+        "2:5 C>A C>A - - -\n2:7 - T>C - T>C -\n2:9 - - - G>A G>A\n",
+        // COLLAPSE_SNPS
+        "1:10 A>C A>T - - A>C\n1:20 A>G - A>G - -\n1:20 AT>A AT>A - - -\n1:25 - C>G - - -\n"
+        "1:30 G>T G>T - - G>T\n1:40 - - T>A - -\n2:5 C>A C>A - - -\n2:7 - T>C - T>C -\n2:9 - - - G>A G>A\n",
+        // COLLAPSE_ANY
+        "1:10 A>C A>T - - A>C\n1:20 A>G AT>A A>G - -\n1:25 - C>G - - -\n"
+        "1:30 G>T G>T - - G>T\n1:40 - - T>A - -\n2:5 C>A C>A - - -\n2:7 - T>C - T>C -\n2:9 - - - G>A G>A\n",
+        // targets, COLLAPSE_NONE
+        "1:20 A>G - A>G - -\n1:20 AT>A AT>A - - -\n1:20 - - A>C - -\n1:25 - C>G - - -\n"
+        "1:30 G>T G>T - - G>T\n1:30 - - - - G>T\n2:9 - - - G>A G>A\n",
+    };
+    int n = sizeof(lines)/sizeof(*lines), i;
+    char **fnames = (char**) malloc(sizeof(char*)*n);
+    for (i=0; i<n; i++)
+    {
+        char *vcf_fname = (char*) malloc(strlen(fname)+12);
+        snprintf(vcf_fname,strlen(fname)+12,"%s.sr.vcf",fname);
+        fnames[i] = (char*) malloc(strlen(fname)+12);
+        snprintf(fnames[i],strlen(fname)+12,"%s.sr%d.bcf",fname,i);
+        FILE *fp = fopen(vcf_fname,"w");
+        fprintf(fp, "##fileformat=VCFv4.1\n##contig=<ID=1>\n##contig=<ID=2>\n");
+        fprintf(fp, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
+        const char *p;
+        for (p=lines[i]; *p; p++)
+        {
+            if ( *p=='|' ) { fputc('\n', fp); continue; }
+            if ( *p=='\t' && (p[1]=='A' || p[1]=='C' || p[1]=='G' || p[1]=='T') && p[-1]>='0' && p[-1]<='9' ) fputs("\t.", fp);
+            fputc(*p, fp);
+            if ( (p[1]=='|' || !p[1]) ) fputs("\t.\t.\t.", fp);
+        }
+        fputc('\n', fp);
+        fclose(fp);
+
+        htsFile *in = hts_open(vcf_fname, "r"), *out = hts_open(fnames[i], "wb");
+        bcf_hdr_t *hdr = bcf_hdr_read(in);
+        bcf1_t *rec = bcf_init1();
+        bcf_hdr_write(out, hdr);
+        while ( bcf_read1(in, hdr, rec)>=0 ) bcf_write1(out, hdr, rec);
+        bcf_destroy1(rec);
+        bcf_hdr_destroy(hdr);
+        hts_close(in);
+        hts_close(out);
+        if ( bcf_index_build(fnames[i], 14)!=0 ) { fprintf(stderr,"bcf_index_build(%s) failed\n", fnames[i]); exit(1); }
+        free(vcf_fname);
+    }
+
+    static const int collapse[] = { COLLAPSE_NONE, COLLAPSE_SNPS, COLLAPSE_ANY, COLLAPSE_NONE };
+    for (i=0; i<4; i++)
+    {
+        kstring_t str = {0,0,0};
+        int n_threads;
+        for (n_threads=0; n_threads<=2; n_threads+=2)
+        {
+            str.l = 0;
+            synced_lines(fnames, n, collapse[i], i==3 ? "1:15-30,2:9" : NULL, n_threads, 0, 0, &str);
+            if ( strcmp(str.s,expected[i]) )
+            {
+                fprintf(stderr,"synced lines differ, case %d, %d threads\n%s\n%s", i, n_threads, expected[i], str.s);
+                exit(1);
+            }
+        }
+        free(str.s);
+    }
+    for (i=0; i<n; i++) free(fnames[i]);
+    free(fnames);
+
+    synced_reader_threads(fname);
+}
+
+// Half of the records on each of two contigs, step apart, and every nend-th
+// of them len long
+typedef struct { int step, nend, len; } spanning_t;
+static void spanning_record(int i, int n, void *data, kstring_t *str)
+{
+    spanning_t *sp = (spanning_t*) data;
+    int pos = i%(n/2)*sp->step+1;
+    ksprintf(str, "%d\t%d\t.\tA\tC\t.\t.\tDP=%d", i<n/2 ? 1 : 2, pos, i);
+    if ( i%sp->nend==0 ) ksprintf(str, ";END=%d", pos+sp->len);
+    kputc('\n', str);
+}
+
+// Overlapping, abutting and unsorted regions queried in one batch give the
+// records of the separate queries, each once and in file order
+void batched_regions(const char *fname)
+{
+    char *vcf = (char*) malloc(strlen(fname)+16);
+    snprintf(vcf,strlen(fname)+16,"%s.br.vcf.gz",fname);
+    kstring_t str = {0,0,0}, exp = {0,0,0}, out = {0,0,0};
+    int i, j, k, n = 1000;
+    spanning_t sp = { 200, 37, 5000 };
+    blocked_vcf(vcf, n, 0, spanning_record, &sp);
+    tabix_index(vcf);
+
+    htsFile *fp = hts_open(vcf, "r");
+    tbx_t *tbx = tbx_index_load(vcf);
+    char *hit = (char*) malloc(n);
+    srand(7);
+    for (k=0; k<20; k++)
+    {
+        int tid = k%2, nreg = 1 + rand()%30;
+        hts_pair32_t *reg = (hts_pair32_t*) malloc(sizeof(hts_pair32_t)*nreg);
+        memset(hit, 0, n);
+        for (i=0; i<nreg; i++)
+        {
+            reg[i].beg = rand()%110000;
+            reg[i].end = i%5==4 ? reg[i-1].end : reg[i].beg + rand()%(k<10 ? 500 : 20000);
+            hts_itr_t *itr = tbx_itr_queryi(tbx, tid, reg[i].beg, reg[i].end);
+            while ( tbx_itr_next(fp, tbx, itr, &str) >= 0 )
+                hit[atoi(strstr(str.s,"DP=")+3)] = 1;
+            tbx_itr_destroy(itr);
+        }
+        exp.l = out.l = 0;
+        for (j=0; j<n; j++)
+            if ( hit[j] ) { kputw(j, &exp); kputc(' ', &exp); }
+
+        hts_itr_t *itr = tbx_itr_queryregs(tbx, tid, reg, &nreg);
+        for (i=1; i<nreg; i++)
+            if ( reg[i].beg <= reg[i-1].end ) { fprintf(stderr,"batched regions not merged\n"); exit(1); }
+        while ( tbx_itr_next(fp, tbx, itr, &str) >= 0 )
+        {
+            kputw(atoi(strstr(str.s,"DP=")+3), &out); kputc(' ', &out);
+        }
+        tbx_itr_destroy(itr);
+        if ( strcmp(exp.l ? exp.s : "", out.l ? out.s : "") )
+        {
+            fprintf(stderr,"batched regions differ, case %d:\n\t%s\n\t%s\n", k, exp.s, out.s);
+            exit(1);
+        }
+        free(reg);
+    }
+    free(hit);
+    tbx_destroy(tbx);
+    hts_close(fp);
+    free(str.s); free(exp.s); free(out.s);
+    free(vcf);
+}
+
+// Indexes built on threads are the same as serial ones, and reading with
+// blocks inflated ahead gives the same lines, also across index jumps
+static void read_lines(htsFile *fp, tbx_t *tbx, int n_threads, int k, kstring_t *out)
+{
+    kstring_t str = {0,0,0};
+    out->l = 0;
+    if ( !tbx )
+    {
+        // Threads are started with the first block already loaded, as
+        // after reading a header
+        int n = 0;
+        while ( bgzf_getline(hts_get_bgzfp(fp), '\n', &str) >= 0 )
+        {
+            if ( !n++ && n_threads ) bgzf_mt(hts_get_bgzfp(fp), n_threads, 2);
+            kputs(str.s, out); kputc('\t', out);
+            kputl(bgzf_tell(hts_get_bgzfp(fp)), out); kputc('\n', out);
+        }
+        free(str.s);
+        return;
+    }
+    if ( n_threads ) bgzf_mt(hts_get_bgzfp(fp), n_threads, 2);
+    srand(k);
+    for (k=0; k<50; k++)
+    {
+        int beg = rand()%600000;
+        hts_itr_t *itr = tbx_itr_queryi(tbx, k%2, beg, beg + rand()%(k%5 ? 2000 : 100000));
+        while ( tbx_itr_next(fp, tbx, itr, &str) >= 0 ) { kputs(str.s, out); kputc('\n', out); }
+        tbx_itr_destroy(itr);
+        kputl(bgzf_tell(hts_get_bgzfp(fp)), out); kputc('\n', out);
+    }
+    free(str.s);
+}
+
+void threaded_tabix(const char *fname)
+{
+    char *vcf = (char*) malloc(strlen(fname)+32);
+    kstring_t exp = {0,0,0}, out = {0,0,0};
+    int i;
+    spanning_t sp = { 30, 53, 3000 };
+    snprintf(vcf,strlen(fname)+32,"%s.mt.vcf.gz.tbi",fname);
+    char *tbi = strdup(vcf);
+    vcf[strlen(vcf)-4] = 0;
+    blocked_vcf(vcf, 40000, 997, spanning_record, &sp);
+    tabix_index(vcf);
+    slurp(tbi, &exp);
+    for (i=2; i<=4; i+=2)
+    {
+        if ( tbx_index_build_mt(vcf, 0, &tbx_conf_vcf, i)!=0 ) { fprintf(stderr,"tbx_index_build_mt(%s) failed\n", vcf); exit(1); }
+        slurp(tbi, &out);
+        if ( exp.l!=out.l || memcmp(exp.s,out.s,exp.l) ) { fprintf(stderr,"threaded index differs, %d threads\n", i); exit(1); }
+    }
+
+    // A line that fails to parse keeps the sequence of the line before it,
+    // also when it is the first of a batch parsed on another thread
+    char *bed = (char*) malloc(strlen(fname)+32), *bed_tbi = (char*) malloc(strlen(fname)+32);
+    snprintf(bed,strlen(fname)+32,"%s.mt.bed.gz",fname);
+    snprintf(bed_tbi,strlen(fname)+32,"%s.mt.bed.gz.tbi",fname);
+    BGZF *bgzf = bgzf_open(bed, "w");
+    kstring_t body = {0,0,0};
+    for (i=0; i<10000; i++)
+    {
+        if ( i==4096 ) kputs("1\t122860\tx\n", &body);
+        ksprintf(&body, "%d\t%d\t%d\n", i<5000 ? 1 : 2, i%5000*30, i%5000*30+20);
+    }
+    bgzf_write(bgzf, body.s, body.l);
+    bgzf_close(bgzf);
+    if ( tbx_index_build(bed, 0, &tbx_conf_bed)!=0 ) { fprintf(stderr,"tbx_index_build(%s) failed\n", bed); exit(1); }
+    slurp(bed_tbi, &exp);
+    if ( tbx_index_build_mt(bed, 0, &tbx_conf_bed, 2)!=0 ) { fprintf(stderr,"tbx_index_build_mt(%s) failed\n", bed); exit(1); }
+    slurp(bed_tbi, &out);
+    if ( exp.l!=out.l || memcmp(exp.s,out.s,exp.l) ) { fprintf(stderr,"threaded index differs after a bad line\n"); exit(1); }
+    free(body.s); free(bed); free(bed_tbi);
+
+    tbx_t *tbx = tbx_index_load(vcf);
+    for (i=0; i<4; i++)
+    {
+        htsFile *fp = hts_open(vcf, "r");
+        read_lines(fp, i<2 ? NULL : tbx, 0, i, &exp);
+        hts_close(fp);
+        fp = hts_open(vcf, "r");
+        read_lines(fp, i<2 ? NULL : tbx, 3, i, &out);
+        hts_close(fp);
+        if ( !exp.l || strcmp(exp.s,out.s) ) { fprintf(stderr,"reading with threads differs, case %d\n", i); exit(1); }
+    }
+    tbx_destroy(tbx);
+    free(exp.s); free(out.s);
+    free(tbi);
+    free(vcf);
+}
+
+static void sweep_file(const char *fname, const int *exp, int n)
+{
+    bcf_sweep_t *sw = bcf_sweep_init(fname);
+    bcf1_t *rec;
+    int i, pass;
+    for (pass=0; pass<2; pass++)
+    {
+        for (i=0; (rec = bcf_sweep_fwd(sw)); i++)
+            if ( i>=n || rec->rid*1000000+rec->pos!=exp[i] ) break;
+        if ( rec || i!=n ) { fprintf(stderr,"forward sweep %d of %s differs at %d\n", pass, fname, i); exit(1); }
+        for (i=n-1; (rec = bcf_sweep_bwd(sw)); i--)
+        {
+            if ( i<0 || rec->rid*1000000+rec->pos!=exp[i] ) break;
+            bcf_unpack(rec, BCF_UN_STR);
+            if ( strcmp(rec->d.id, ".") && atoi(rec->d.id+2)!=i ) break;
+        }
+        if ( rec || i!=-1 ) { fprintf(stderr,"backward sweep %d of %s differs at %d\n", pass, fname, i); exit(1); }
+    }
+    bcf_sweep_destroy(sw);
+}
+
+// Records of varying length, some sharing a position; data collects the
+// expected rid*1000000+pos of each
+static void sweep_record(int i, int n, void *data, kstring_t *str)
+{
+    int rid = i<n/2 ? 0 : 1, pos = (i%(n/2))*7 + i%3;
+    ((int*)data)[i] = rid*1000000 + pos;
+    ksprintf(str, "%d\t%d\t", rid+1, pos+1);
+    if ( i%5 ) ksprintf(str, "id%d", i); else kputc('.', str);
+    ksprintf(str, "\tA\t%.*s\t.\t.\tDP=%d\n", 1+i%40, "CGTACGTACGTACGTACGTACGTACGTACGTACGTACGTA", i);
+}
+
+void sweep(const char *fname)
+{
+    // Enough records for many chunks
+    char *vcf = (char*) malloc(strlen(fname)+32);
+    int n = 30000, *exp = (int*) malloc(n*sizeof(int));
+    snprintf(vcf,strlen(fname)+32,"%s.sw.vcf.gz",fname);
+    blocked_vcf(vcf, n, 811, sweep_record, exp);
+    sweep_file(vcf, exp, n);
+
+    // The same records as BCF and as uncompressed VCF
+    htsFile *in = hts_open(vcf, "r");
+    bcf_hdr_t *hdr = bcf_hdr_read(in);
+    bcf1_t *rec = bcf_init1();
+    char *bcf = strdup(vcf), *txt = strdup(vcf);
+    strcpy(bcf+strlen(bcf)-6, "bcf");
+    txt[strlen(txt)-3] = 0;
+    htsFile *out = hts_open(bcf, "wb"), *out_txt = hts_open(txt, "w");
+    bcf_hdr_write(out, hdr);
+    bcf_hdr_write(out_txt, hdr);
+    while ( bcf_read1(in, hdr, rec)==0 )
+    {
+        bcf_write1(out, hdr, rec);
+        bcf_write1(out_txt, hdr, rec);
+    }
+    hts_close(out);
+    hts_close(out_txt);
+    hts_close(in);
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    sweep_file(bcf, exp, n);
+    sweep_file(txt, exp, n);
+
+    free(exp);
+    free(bcf); free(txt); free(vcf);
+}
+
+// Fetch every INFO and FORMAT tag of the header from rec into str
+static void get_all_values(bcf_hdr_t *hdr, bcf1_t *rec, kstring_t *str)
+{
+    void *buf = NULL;
+    int i, j, n, nbuf = 0;
+    for (i=0; i<hdr->n[BCF_DT_ID]; i++)
+    {
+        const char *key = hdr->id[BCF_DT_ID][i].key;
+        int hl;
+        for (hl=BCF_HL_INFO; hl<=BCF_HL_FMT; hl++)
+        {
+            if ( !bcf_hdr_idinfo_exists(hdr,hl,i) ) continue;
+            int type = bcf_hdr_id2type(hdr,hl,i);
+            if ( hl==BCF_HL_FMT && type==BCF_HT_STR && strcmp(key,"GT") )
+            {
+                char **strs = NULL;
+                n = bcf_get_format_string(hdr, rec, key, &strs, &nbuf);
+                ksprintf(str, "%s:%d", key, n);
+                for (j=0; n>0 && j<bcf_hdr_nsamples(hdr); j++) ksprintf(str, " %s", strs[j]);
+                if ( strs ) { free(strs[0]); free(strs); }
+                nbuf = 0;
+                continue;
+            }
+            if ( hl==BCF_HL_INFO )
+                n = bcf_get_info_values(hdr, rec, key, &buf, &nbuf, type);
+            else
+                n = bcf_get_format_values(hdr, rec, key, &buf, &nbuf, type==BCF_HT_STR ? BCF_HT_INT : type);
+            ksprintf(str, "%s:%d", key, n);
+            if ( n>0 && type!=BCF_HT_FLAG ) kputsn((char*)buf, type==BCF_HT_STR && hl==BCF_HL_INFO ? n : n*4, str);
+        }
+    }
+    free(buf);
+}
+
+void lazy_values(const char *fname)
+{
+    htsFile *fp = hts_open(fname, "rb");
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    bcf1_t *rec = bcf_init1();
+    kstring_t lazy = {0,0,0}, unpacked = {0,0,0};
+    while ( bcf_read1(fp, hdr, rec)>=0 )
+    {
+        lazy.l = unpacked.l = 0;
+        get_all_values(hdr, rec, &lazy);
+        if ( rec->unpacked ) { fprintf(stderr,"bcf_get_*_values unpacked the record\n"); exit(1); }
+        bcf_unpack(rec, BCF_UN_ALL);
+        get_all_values(hdr, rec, &unpacked);
+        if ( lazy.l!=unpacked.l || memcmp(lazy.s,unpacked.s,lazy.l) )
+        {
+            fprintf(stderr,"lazy and unpacked tag values differ at %s:%d\n", bcf_seqname(hdr,rec), rec->pos+1);
+            exit(1);
+        }
+    }
+    free(lazy.s); free(unpacked.s);
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(fp);
+}
+
+static void check_view(bcf_hdr_t *hdr, bcf1_t *rec, const char *tag, int type)
+{
+    bcf_fmt_view_t view;
+    int32_t *ibuf = NULL;
+    int i, n, nbuf = 0, nval = 0, nmiss = 0;
+    double sum = 0, min = 0, max = 0, vsum, vmin, vmax;
+
+    if ( bcf_get_format_view(hdr, rec, tag, &view)<0 ) { fprintf(stderr,"no view of %s\n", tag); exit(1); }
+    n = bcf_get_format_values(hdr, rec, tag, (void**)&ibuf, &nbuf, type);
+    if ( n!=view.n*view.n_sample ) { fprintf(stderr,"%s: view of %d values, expected %d\n", tag, view.n*view.n_sample, n); exit(1); }
+    for (i=0; i<n; i++)
+    {
+        double x;
+        if ( type==BCF_HT_INT )
+        {
+            if ( ibuf[i]==bcf_int32_missing ) { nmiss++; continue; }
+            if ( ibuf[i]==bcf_int32_vector_end ) continue;
+            x = ibuf[i];
+        }
+        else
+        {
+            float f = ((float*)ibuf)[i];
+            if ( bcf_float_is_missing(f) ) { nmiss++; continue; }
+            if ( bcf_float_is_vector_end(f) ) continue;
+            x = f;
+        }
+        if ( !nval++ ) min = max = x;
+        if ( x<min ) min = x;
+        if ( x>max ) max = x;
+        sum += x;
+    }
+    if ( bcf_fmt_view_count_missing(&view)!=nmiss
+         || bcf_fmt_view_minmax(&view, &vmin, &vmax)!=nval || (nval && (vmin!=min || vmax!=max))
+         || bcf_fmt_view_sum(&view, &vsum)!=nval || vsum!=sum )
+    {
+        fprintf(stderr,"view reductions of %s at %d differ\n", tag, rec->pos+1);
+        exit(1);
+    }
+
+    if ( !strcmp(tag,"GT") )
+    {
+        int8_t *dosage = (int8_t*) malloc(view.n_sample);
+        bcf_fmt_view_dosage(&view, dosage);
+        for (i=0; i<view.n_sample; i++)
+        {
+            int32_t *gt = ibuf + i*view.n;
+            int j, d = 0;
+            for (j=0; j<view.n && gt[j]!=bcf_int32_vector_end; j++)
+            {
+                if ( bcf_gt_is_missing(gt[j]) || gt[j]<0 ) { d = -1; break; }
+                if ( bcf_gt_allele(gt[j])>0 ) d++;
+            }
+            if ( dosage[i]!=d ) { fprintf(stderr,"dosage of sample %d at %d: %d, expected %d\n", i, rec->pos+1, dosage[i], d); exit(1); }
+        }
+        free(dosage);
+    }
+    free(ibuf);
+}
+
+void format_views(const char *fname)
+{
+    static const char *gts[] = { "0/1", "1|1", "./.", "0", "2/.", ".", "1/2", "0|0", ".|1", "3/3" };
+    char *vcf_fname = (char*) malloc(strlen(fname)+8);
+    snprintf(vcf_fname,strlen(fname)+8,"%s.fv.vcf",fname);
+    FILE *fp = fopen(vcf_fname,"w");
+    fprintf(fp, "##fileformat=VCFv4.1\n##contig=<ID=1>\n");
+    fprintf(fp, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n");
+    fprintf(fp, "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"int8\">\n");
+    fprintf(fp, "##FORMAT=<ID=AD,Number=R,Type=Integer,Description=\"int16\">\n");
+    fprintf(fp, "##FORMAT=<ID=BG,Number=1,Type=Integer,Description=\"int32\">\n");
+    fprintf(fp, "##FORMAT=<ID=GL,Number=G,Type=Float,Description=\"float\">\n");
+    fprintf(fp, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT");
+    int i, j;
+    for (j=0; j<75; j++) fprintf(fp, "\ts%d", j);
+    for (i=0; i<20; i++)
+    {
+        fprintf(fp, "\n1\t%d\t.\tA\tC,G,T\t.\t.\t.\tGT:DP:AD:BG:GL", i+1);
+        for (j=0; j<75; j++)
+        {
+            int k = i*75 + j;
+            fprintf(fp, "\t%s:", gts[(k*7)%10]);
+            if ( k%11==0 ) fprintf(fp, ".:");
+            else fprintf(fp, "%d:", (k*37)%(i<10 ? 128 : 247) - (i<10 ? 0 : 119));
+            if ( k%13==0 ) fprintf(fp, "%d:", k%1000);
+            else fprintf(fp, "%d,.,%d:", k%1000, -(k%300));
+            fprintf(fp, "%d:", k%17==0 ? -100000 : k*1000);
+            fprintf(fp, "%s", k%5==0 ? "." : k%5==1 ? "-0.5,-1.25" : "-1.5,0,-3.75");
+        }
+    }
+    fprintf(fp, "\n");
+    fclose(fp);
+
+    htsFile *in = hts_open(vcf_fname, "r");
+    bcf_hdr_t *hdr = bcf_hdr_read(in);
+    bcf1_t *rec = bcf_init1();
+    while ( bcf_read1(in, hdr, rec)>=0 )
+    {
+        check_view(hdr, rec, "GT", BCF_HT_INT);
+        check_view(hdr, rec, "DP", BCF_HT_INT);
+        check_view(hdr, rec, "AD", BCF_HT_INT);
+        check_view(hdr, rec, "BG", BCF_HT_INT);
+        check_view(hdr, rec, "GL", BCF_HT_REAL);
+    }
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(in);
+    free(vcf_fname);
+}
+
 int main(int argc, char **argv)
 {
     char *fname = argc>1 ? argv[1] : "rmme.bcf";
     write_bcf(fname);
     bcf_to_vcf(fname);
     iterator(fname);
+    lazy_values(fname);
+    format_views(fname);
+    threaded_read(fname);
+    subset_samples(fname);
+    gt_matrix(fname);
+    threaded_write(fname);
+    update_format(fname);
+    translate(fname);
+    translate_resync();
+    huge_header();
+    synced_reader(fname);
+    batched_regions(fname);
+    threaded_tabix(fname);
+    sweep(fname);
     return 0;
 }
 
@@ -37,11 +37,42 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/tbx.h"
 #include "htslib/hfile.h"
 #include "htslib/khash_str2int.h"
+#include "cram/thread_pool.h"
 
 #include "htslib/khash.h"
 KHASH_MAP_INIT_STR(vdict, bcf_idinfo_t)
 typedef khash_t(vdict) vdict_t;
 
+// Library-private state of a header, allocated with it by bcf_hdr_init() so
+// that it can change without changing bcf_hdr_t
+typedef struct
+{
+    bcf_hdr_t hdr;
+    uint64_t gen;                   // state of the header, see bcf_hdr_gen_next()
+    bcf_translate_plan_t *transl;   // for bcf_translate()
+    int nkeep_runs, *keep_runs;     // for bcf_subset_format(): (first,count) of each run of kept samples
+    int mhrec, msamples;            // allocated lengths of hrec and samples
+}
+bcf_hdr_aux_t;
+#define BCF_HDR_AUX(h) ((bcf_hdr_aux_t*)(h))
+
+// Header states are numbered across all headers, so that state kept for one
+// header is never taken for another, even one reusing its address
+static uint64_t bcf_hdr_gen_last = 0;
+static pthread_mutex_t bcf_hdr_gen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t bcf_hdr_gen_next(void)
+{
+    pthread_mutex_lock(&bcf_hdr_gen_lock);
+    uint64_t gen = ++bcf_hdr_gen_last;
+    pthread_mutex_unlock(&bcf_hdr_gen_lock);
+    return gen;
+}
+
+// Bits of bcf_hdr_t.dirty: 1 when anything may have changed, otherwise one
+// bit for each dictionary that gained entries since the last bcf_hdr_sync()
+#define BCF_HDR_DIRTY(type) (2<<(type))
+
 #include "htslib/kseq.h"
 KSTREAM_DECLARE(gzFile, gzread)
 
@@ -85,39 +116,68 @@ int bcf_hdr_add_sample(bcf_hdr_t *h, const char *s)
         return -1;
     }
     int n = kh_size(d);
-    h->samples = (char**) realloc(h->samples,sizeof(char*)*n);
+    hts_expand(char*, n, BCF_HDR_AUX(h)->msamples, h->samples);
     h->samples[n-1] = sdup;
-    h->dirty = 1;
+    h->dirty |= BCF_HDR_DIRTY(BCF_DT_SAMPLE);
     return 0;
 }
 
+static void bcf_hdr_reserve_hrec(bcf_hdr_t *hdr, int n)
+{
+    hts_expand(bcf_hrec_t*, n, BCF_HDR_AUX(hdr)->mhrec, hdr->hrec);
+}
+
+void bcf_hdr_reserve(bcf_hdr_t *hdr, int type, int n)
+{
+    vdict_t *d = (vdict_t*)hdr->dict[type];
+    int size = kh_size(d) + n;
+
+    // khash keeps its buckets at most 77% full; rehashing moves the values
+    // which bcf_hdr_t.id points to
+    khint_t nbuckets = size / 0.77 + 1;
+    if ( nbuckets > kh_n_buckets(d) )
+    {
+        kh_resize(vdict, d, nbuckets);
+        hdr->dirty |= BCF_HDR_DIRTY(type);
+    }
+    if ( type==BCF_DT_SAMPLE )
+    {
+        hts_expand(char*, size, BCF_HDR_AUX(hdr)->msamples, hdr->samples);
+    }
+    else
+        bcf_hdr_reserve_hrec(hdr, hdr->nhrec + n);
+}
+
 int bcf_hdr_parse_sample_line(bcf_hdr_t *h, const char *str)
 {
     int ret = 0;
     int i = 0;
     const char *p, *q;
+    kstring_t s = {0,0,0};
     // add samples
     for (p = q = str;; ++q) {
         if (*q != '\t' && *q != 0 && *q != '\n') continue;
         if (++i > 9) {
-            char *s = (char*)malloc(q - p + 1);
-            strncpy(s, p, q - p);
-            s[q - p] = 0;
-            if ( bcf_hdr_add_sample(h,s) < 0 ) ret = -1;
-            free(s);
+            s.l = 0;
+            kputsn(p, q - p, &s);
+            if ( bcf_hdr_add_sample(h,s.s) < 0 ) ret = -1;
         }
         if (*q == 0 || *q == '\n') break;
         p = q + 1;
     }
+    free(s.s);
     bcf_hdr_add_sample(h,NULL);
     return ret;
 }
 
 int bcf_hdr_sync(bcf_hdr_t *h)
 {
-    int i;
+    // Adding a tag to a header with a million contigs and samples need not
+    // walk those dictionaries again
+    int i, dicts = h->dirty > 1 && !(h->dirty & 1) ? h->dirty >> 1 : 7;
     for (i = 0; i < 3; i++)
     {
+        if ( !(dicts & 1<<i) ) continue;
         vdict_t *d = (vdict_t*)h->dict[i];
         khint_t k;
 
@@ -146,6 +206,7 @@ int bcf_hdr_sync(bcf_hdr_t *h)
         }
     }
     h->dirty = 0;
+    BCF_HDR_AUX(h)->gen = bcf_hdr_gen_next();
     return 0;
 }
 
@@ -165,7 +226,7 @@ void bcf_hrec_destroy(bcf_hrec_t *hrec)
 }
 
 // Copies all fields except IDX.
-bcf_hrec_t *bcf_hrec_dup(bcf_hrec_t *hrec)
+static bcf_hrec_t *hrec_dup(const bcf_hrec_t *hrec, int keep_idx)
 {
     bcf_hrec_t *out = (bcf_hrec_t*) calloc(1,sizeof(bcf_hrec_t));
     out->type = hrec->type;
@@ -177,7 +238,7 @@ bcf_hrec_t *bcf_hrec_dup(bcf_hrec_t *hrec)
     int i, j = 0;
     for (i=0; i<hrec->nkeys; i++)
     {
-        if ( hrec->keys[i] && !strcmp("IDX",hrec->keys[i]) ) continue;
+        if ( !keep_idx && hrec->keys[i] && !strcmp("IDX",hrec->keys[i]) ) continue;
         if ( hrec->keys[i] ) out->keys[j] = strdup(hrec->keys[i]);
         if ( hrec->vals[i] ) out->vals[j] = strdup(hrec->vals[i]);
         j++;
@@ -186,6 +247,11 @@ bcf_hrec_t *bcf_hrec_dup(bcf_hrec_t *hrec)
     return out;
 }
 
+bcf_hrec_t *bcf_hrec_dup(bcf_hrec_t *hrec)
+{
+    return hrec_dup(hrec, 0);
+}
+
 void bcf_hrec_debug(FILE *fp, bcf_hrec_t *hrec)
 {
     fprintf(fp, "key=[%s] value=[%s]", hrec->key, hrec->value?hrec->value:"");
@@ -387,6 +453,7 @@ int bcf_hdr_register_hrec(bcf_hdr_t *hdr, bcf_hrec_t *hrec)
         kh_val(d, k).id = idx;
         kh_val(d, k).info[0] = j;
         kh_val(d, k).hrec[0] = hrec;
+        hdr->dirty |= BCF_HDR_DIRTY(BCF_DT_CTG);
 
         return 1;
     }
@@ -455,6 +522,7 @@ int bcf_hdr_register_hrec(bcf_hdr_t *hdr, bcf_hrec_t *hrec)
         kh_val(d, k).info[info&0xf] = info;
         kh_val(d, k).hrec[info&0xf] = hrec;
         if ( idx==-1 ) hrec_add_idx(hrec, kh_val(d, k).id);
+        hdr->dirty |= BCF_HDR_DIRTY(BCF_DT_ID);
         return 1;
     }
     kh_val(d, k) = bcf_idinfo_def;
@@ -463,6 +531,7 @@ int bcf_hdr_register_hrec(bcf_hdr_t *hdr, bcf_hrec_t *hrec)
     kh_val(d, k).id = idx==-1 ? kh_size(d) - 1 : idx;
 
     if ( idx==-1 ) hrec_add_idx(hrec, kh_val(d, k).id);
+    hdr->dirty |= BCF_HDR_DIRTY(BCF_DT_ID);
 
     return 1;
 }
@@ -496,11 +565,11 @@ int bcf_hdr_add_hrec(bcf_hdr_t *hdr, bcf_hrec_t *hrec)
         }
     }
 
-    // New record, needs to be added
+    // New record, needs to be added. The dictionaries were marked dirty
+    // by bcf_hdr_register_hrec(), generic lines need no syncing
     int n = ++hdr->nhrec;
-    hdr->hrec = (bcf_hrec_t**) realloc(hdr->hrec, n*sizeof(bcf_hrec_t*));
+    bcf_hdr_reserve_hrec(hdr, n);
     hdr->hrec[n-1] = hrec;
-    hdr->dirty = 1;
 
     return hrec->type==BCF_HL_GEN ? 0 : 1;
 }
@@ -565,11 +634,34 @@ void bcf_hdr_check_sanity(bcf_hdr_t *hdr)
     }
 }
 
+// Count the lines of each dictionary and the samples in the header text, so
+// that everything can be sized once rather than grown line by line
+static void bcf_hdr_reserve_text(bcf_hdr_t *hdr, const char *htxt)
+{
+    int nctg = 0, nid = 1, nsmpl = 0;   // nid: PASS
+    const char *p = htxt;
+    while ( p[0]=='#' && p[1]=='#' )
+    {
+        if ( !strncmp(p+2,"contig=",7) ) nctg++;
+        else if ( !strncmp(p+2,"INFO=",5) || !strncmp(p+2,"FORMAT=",7) || !strncmp(p+2,"FILTER=",7) ) nid++;
+        if ( !(p = strchr(p,'\n')) ) break;
+        p++;
+    }
+    if ( p && *p=='#' )
+        for (; *p && *p!='\n'; p++)
+            if ( *p=='\t' ) nsmpl++;
+    bcf_hdr_reserve(hdr, BCF_DT_ID, nid);
+    bcf_hdr_reserve(hdr, BCF_DT_CTG, nctg);
+    if ( nsmpl > 8 ) bcf_hdr_reserve(hdr, BCF_DT_SAMPLE, nsmpl - 8);
+}
+
 int bcf_hdr_parse(bcf_hdr_t *hdr, char *htxt)
 {
     int len, needs_sync = 0;
     char *p = htxt;
 
+    bcf_hdr_reserve_text(hdr, htxt);
+
     // Check sanity: "fileformat" string must come as first
     bcf_hrec_t *hrec = bcf_hdr_parse_line(hdr,p,&len);
     if ( !hrec || !hrec->key || strcasecmp(hrec->key,"fileformat") )
@@ -705,7 +797,8 @@ bcf_hdr_t *bcf_hdr_init(const char *mode)
 {
     int i;
     bcf_hdr_t *h;
-    h = (bcf_hdr_t*)calloc(1, sizeof(bcf_hdr_t));
+    h = (bcf_hdr_t*)calloc(1, sizeof(bcf_hdr_aux_t));
+    BCF_HDR_AUX(h)->gen = bcf_hdr_gen_next();
     for (i = 0; i < 3; ++i)
         h->dict[i] = kh_init(vdict);
     if ( strchr(mode,'w') )
@@ -731,10 +824,11 @@ void bcf_hdr_destroy(bcf_hdr_t *h)
     }
     for (i=0; i<h->nhrec; i++)
         bcf_hrec_destroy(h->hrec[i]);
-    if (h->nhrec) free(h->hrec);
+    free(h->hrec);
     if (h->samples) free(h->samples);
     free(h->keep_samples);
-    free(h->transl[0]); free(h->transl[1]);
+    free(BCF_HDR_AUX(h)->keep_runs);
+    bcf_translate_plan_destroy(BCF_HDR_AUX(h)->transl);
     free(h->mem.s);
     free(h);
 }
@@ -881,6 +975,13 @@ static inline int bcf_read1_core(BGZF *fp, bcf1_t *v)
 #define bit_array_test(a,i)  ((a)[(i)/8] &   (1 << ((i)%8)))
 
 static inline uint8_t *bcf_unpack_fmt_core1(uint8_t *ptr, int n_sample, bcf_fmt_t *fmt);
+
+static inline uint8_t *bcf_skip_typed(uint8_t *ptr)
+{
+    int type, n = bcf_dec_size(ptr, &ptr, &type);
+    return ptr + (n << bcf_type_shift[type]);
+}
+
 int bcf_subset_format(const bcf_hdr_t *hdr, bcf1_t *rec)
 {
     if ( !hdr->keep_samples ) return 0;
@@ -889,8 +990,16 @@ int bcf_subset_format(const bcf_hdr_t *hdr, bcf1_t *rec)
         rec->indiv.l = rec->n_sample = 0;
         return 0;
     }
+    if ( rec->max_unpack && !(rec->max_unpack & BCF_UN_FMT) )
+    {
+        // FORMAT is not wanted: skip the subsetting and drop the sample
+        // columns, as vcf_parse() does when reading VCF
+        rec->indiv.l = rec->n_sample = rec->n_fmt = 0;
+        return 0;
+    }
 
     int i, j;
+    const bcf_hdr_aux_t *aux = BCF_HDR_AUX(hdr);
     uint8_t *ptr = (uint8_t*)rec->indiv.s, *dst = NULL, *src;
     bcf_dec_t *dec = &rec->d;
     hts_expand(bcf_fmt_t, rec->n_fmt, dec->m_fmt, dec->fmt);
@@ -899,19 +1008,20 @@ int bcf_subset_format(const bcf_hdr_t *hdr, bcf1_t *rec)
     for (i=0; i<rec->n_fmt; i++)
     {
         ptr = bcf_unpack_fmt_core1(ptr, rec->n_sample, &dec->fmt[i]);
-        src = dec->fmt[i].p - dec->fmt[i].size;
+        src = dec->fmt[i].p;
         if ( dst )
         {
             memmove(dec->fmt[i-1].p + dec->fmt[i-1].p_len, dec->fmt[i].p - dec->fmt[i].p_off, dec->fmt[i].p_off);
             dec->fmt[i].p = dec->fmt[i-1].p + dec->fmt[i-1].p_len + dec->fmt[i].p_off;
         }
         dst = dec->fmt[i].p;
-        for (j=0; j<hdr->nsamples_ori; j++)
+        size_t size = dec->fmt[i].size;
+        for (j=0; j<aux->nkeep_runs; j++)
         {
-            src += dec->fmt[i].size;
-            if ( !bit_array_test(hdr->keep_samples,j) ) continue;
-            memmove(dst, src, dec->fmt[i].size);
-            dst += dec->fmt[i].size;
+            uint8_t *run = src + (size_t)aux->keep_runs[2*j] * size;
+            size_t len = (size_t)aux->keep_runs[2*j+1] * size;
+            if ( dst!=run ) memmove(dst, run, len);
+            dst += len;
         }
         rec->indiv.l -= dec->fmt[i].p_len - (dst - dec->fmt[i].p);
         dec->fmt[i].p_len = dst - dec->fmt[i].p;
@@ -983,6 +1093,55 @@ static inline void bcf1_sync_info(bcf1_t *line, kstring_t *str)
     if ( irm>=0 ) line->n_info = irm;
 }
 
+/*
+ *  Splice the FORMAT fields back into indiv.s.  Fields still in indiv.s are
+ *  moved as they are, or not at all when nothing before them changed size;
+ *  only fields held in their own buffers (new or grown) are copied in.
+ */
+static int bcf1_sync_indiv(bcf1_t *line)
+{
+    bcf_fmt_t *fmt = line->d.fmt;
+    int64_t old[256], off[256], len[256], new_len = 0;
+    int i, n = 0;
+
+    // Drop the fields marked for removal, keeping the order of the others
+    for (i=0; i<line->n_fmt; i++)
+    {
+        if ( !fmt[i].p ) continue;
+        if ( i!=n ) { bcf_fmt_t tmp = fmt[n]; fmt[n] = fmt[i]; fmt[i] = tmp; }
+        n++;
+    }
+    line->n_fmt = n;
+
+    for (i=0; i<n; i++)
+    {
+        old[i] = fmt[i].p_free ? -1 : fmt[i].p - fmt[i].p_off - (uint8_t*)line->indiv.s;
+        len[i] = fmt[i].p_off + fmt[i].p_len;
+        off[i] = new_len;
+        new_len += len[i];
+    }
+    if ( ks_resize(&line->indiv, new_len) < 0 ) return -1;
+
+    // Fields moving towards the start first, in order, then those moving
+    // towards the end, in reverse order, so that none overwrites another
+    // before it has been moved
+    uint8_t *s = (uint8_t*) line->indiv.s;
+    for (i=0; i<n; i++)
+        if ( old[i] > off[i] ) memmove(s + off[i], s + old[i], len[i]);
+    for (i=n-1; i>=0; i--)
+        if ( old[i]>=0 && old[i] < off[i] ) memmove(s + off[i], s + old[i], len[i]);
+    for (i=0; i<n; i++)
+    {
+        if ( old[i]>=0 ) continue;
+        memcpy(s + off[i], fmt[i].p - fmt[i].p_off, len[i]);
+        free(fmt[i].p - fmt[i].p_off);
+        fmt[i].p_free = 0;
+    }
+    for (i=0; i<n; i++) fmt[i].p = s + off[i] + fmt[i].p_off;
+    line->indiv.l = new_len;
+    return 0;
+}
+
 static int bcf1_sync(bcf1_t *line)
 {
     char *shared_ori = line->shared.s;
@@ -1082,42 +1241,7 @@ static int bcf1_sync(bcf1_t *line)
     if ( line->n_sample && line->n_fmt && (!line->indiv.l || line->d.indiv_dirty) )
     {
         // The genotype fields changed or are not present
-        tmp.l = tmp.m = 0; tmp.s = NULL;
-        int i, irm = -1;
-        for (i=0; i<line->n_fmt; i++)
-        {
-            bcf_fmt_t *fmt = &line->d.fmt[i];
-            if ( !fmt->p )
-            {
-                // marked for removal
-                if ( irm < 0 ) irm = i;
-                continue;
-            }
-            kputsn_(fmt->p - fmt->p_off, fmt->p_len + fmt->p_off, &tmp);
-            if ( irm >=0 )
-            {
-                bcf_fmt_t tfmt = line->d.fmt[irm]; line->d.fmt[irm] = line->d.fmt[i]; line->d.fmt[i] = tfmt;
-                while ( irm<=i && line->d.fmt[irm].p ) irm++;
-            }
-
-        }
-        if ( irm>=0 ) line->n_fmt = irm;
-        free(line->indiv.s);
-        line->indiv = tmp;
-
-        // Reallocated line->indiv.s block invalidated line->d.fmt[].p pointers
-        size_t off_new = 0;
-        for (i=0; i<line->n_fmt; i++)
-        {
-            uint8_t *p_free = line->d.fmt[i].p_free ? line->d.fmt[i].p - line->d.fmt[i].p_off : NULL;
-            line->d.fmt[i].p = (uint8_t*) line->indiv.s + off_new + line->d.fmt[i].p_off;
-            off_new += line->d.fmt[i].p_len + line->d.fmt[i].p_off;
-            if ( p_free )
-            {
-                free(p_free);
-                line->d.fmt[i].p_free = 0;
-            }
-        }
+        if ( bcf1_sync_indiv(line)!=0 ) return -1;
     }
     if ( !line->n_sample ) line->n_fmt = 0;
     line->d.shared_dirty = line->d.indiv_dirty = 0;
@@ -1455,7 +1579,7 @@ void bcf_fmt_array(kstring_t *s, int n, int type, void *data)
             case BCF_BT_INT8:  BRANCH(int8_t,  p[j]==bcf_int8_missing,  p[j]==bcf_int8_vector_end,  kputw(p[j], s)); break;
             case BCF_BT_INT16: BRANCH(int16_t, p[j]==bcf_int16_missing, p[j]==bcf_int16_vector_end, kputw(p[j], s)); break;
             case BCF_BT_INT32: BRANCH(int32_t, p[j]==bcf_int32_missing, p[j]==bcf_int32_vector_end, kputw(p[j], s)); break;
-            case BCF_BT_FLOAT: BRANCH(float,   bcf_float_is_missing(p[j]), bcf_float_is_vector_end(p[j]), ksprintf(s, "%g", p[j])); break;
+            case BCF_BT_FLOAT: BRANCH(float,   bcf_float_is_missing(p[j]), bcf_float_is_vector_end(p[j]), kputd(p[j], s)); break;
             default: fprintf(stderr,"todo: type %d\n", type); exit(1); break;
         }
         #undef BRANCH
@@ -1490,17 +1614,270 @@ static inline void align_mem(kstring_t *s)
     }
 }
 
+// Returned by the parser when it meets a contig or tag missing from the header
+// but has been asked not to modify the header (see vcf_set_threads)
+#define VCF_PARSE_UNDEF -2
+
+typedef struct {
+    kstring_t *mem;     // scratch space for the FORMAT fields
+    int no_hdr_update;  // return VCF_PARSE_UNDEF rather than add missing tags to the header
+    t_pool *pool;       // if set, parse ranges of sample columns on these threads
+    int n_threads;
+} vcf_parse_opt_t;
+
+// Update the maximum vector size, length and number of alleles in fmt with
+// those of the sample starting at r; returns a pointer to the sample's end
+static char *vcf_fmt_sample_stats(const bcf_hdr_t *h, const bcf1_t *v, fmt_aux_t *fmt, char *r, char *end)
+{
+    int j = 0;  // j-th format field
+    int m = 1, l = 1, g = 1;  // m: vector size, l: field len, g: number of alleles
+    for (;;)
+    {
+        if ( *r == '\t' ) *r = 0;
+        if ( *r == ':' || !*r )  // end of field or end of sample
+        {
+            if (fmt[j].max_m < m) fmt[j].max_m = m;
+            if (fmt[j].max_l < l - 1) fmt[j].max_l = l - 1;
+            if (fmt[j].is_gt && fmt[j].max_g < g) fmt[j].max_g = g;
+            l = 0, m = g = 1;
+            if ( *r==':' )
+            {
+                j++;
+                if ( j>=v->n_fmt )
+                {
+                    fprintf(stderr,"Incorrect number of FORMAT fields at %s:%d\n", h->id[BCF_DT_CTG][v->rid].key,v->pos+1);
+                    exit(1);
+                }
+            }
+            else break;
+        }
+        else if ( *r== ',' ) m++;
+        else if ( fmt[j].is_gt && (*r == '|' || *r == '/') ) g++;
+        if ( r>=end ) break;
+        r++; l++;
+    }
+    return r;
+}
+
+// Fill in the values of the m-th sample from the NUL-terminated column
+// starting at t; returns a pointer to the end of the column
+static char *vcf_fmt_sample_fill(const bcf1_t *v, fmt_aux_t *fmt, char *t, int m)
+{
+    int j = 0, l; // j-th format field, m-th sample
+    while ( *t )
+    {
+        fmt_aux_t *z = &fmt[j];
+        if ((z->y>>4&0xf) == BCF_HT_STR) {
+            if (z->is_gt) { // genotypes
+                int32_t is_phased = 0, *x = (int32_t*)(z->buf + z->size * m);
+                for (l = 0;; ++t) {
+                    if (*t == '.') ++t, x[l++] = is_phased;
+                    else x[l++] = (strtol(t, &t, 10) + 1) << 1 | is_phased;
+#if THOROUGH_SANITY_CHECKS
+                    assert( 0 );    // success of strtol,strtod not checked
+#endif
+                    is_phased = (*t == '|');
+                    if (*t == ':' || *t == 0) break;
+                }
+                if ( !l ) x[l++] = 0;   // An empty field, insert missing value
+                for (; l < z->size>>2; ++l) x[l] = bcf_int32_vector_end;
+            } else {
+                char *x = (char*)z->buf + z->size * m;
+                for (l = 0; *t != ':' && *t; ++t) x[l++] = *t;
+                for (; l < z->size; ++l) x[l] = 0;
+            }
+        } else if ((z->y>>4&0xf) == BCF_HT_INT) {
+            int32_t *x = (int32_t*)(z->buf + z->size * m);
+            for (l = 0;; ++t) {
+                if (*t == '.') x[l++] = bcf_int32_missing, ++t; // ++t to skip "."
+                else x[l++] = strtol(t, &t, 10);
+                if (*t == ':' || *t == 0) break;
+            }
+            if ( !l ) x[l++] = bcf_int32_missing;
+            for (; l < z->size>>2; ++l) x[l] = bcf_int32_vector_end;
+        } else if ((z->y>>4&0xf) == BCF_HT_REAL) {
+            float *x = (float*)(z->buf + z->size * m);
+            for (l = 0;; ++t) {
+                if (*t == '.' && !isdigit(t[1])) bcf_float_set_missing(x[l++]), ++t; // ++t to skip "."
+                else x[l++] = strtod(t, &t);
+                if (*t == ':' || *t == 0) break;
+            }
+            if ( !l ) bcf_float_set_missing(x[l++]);    // An empty field, insert missing value
+            for (; l < z->size>>2; ++l) bcf_float_set_vector_end(x[l]);
+        } else abort();
+        if (*t == 0) {
+            for (++j; j < v->n_fmt; ++j) { // fill end-of-vector values
+                z = &fmt[j];
+                if ((z->y>>4&0xf) == BCF_HT_STR) {
+                    if (z->is_gt) {
+                        int32_t *x = (int32_t*)(z->buf + z->size * m);
+                        x[0] = bcf_int32_missing;
+                        for (l = 1; l < z->size>>2; ++l) x[l] = bcf_int32_vector_end;
+                    } else {
+                        char *x = (char*)z->buf + z->size * m;
+                        if ( z->size ) x[0] = '.';
+                        for (l = 1; l < z->size; ++l) x[l] = 0;
+                    }
+                } else if ((z->y>>4&0xf) == BCF_HT_INT) {
+                    int32_t *x = (int32_t*)(z->buf + z->size * m);
+                    x[0] = bcf_int32_missing;
+                    for (l = 1; l < z->size>>2; ++l) x[l] = bcf_int32_vector_end;
+                } else if ((z->y>>4&0xf) == BCF_HT_REAL) {
+                    float *x = (float*)(z->buf + z->size * m);
+                    bcf_float_set_missing(x[0]);
+                    for (l = 1; l < z->size>>2; ++l) bcf_float_set_vector_end(x[l]);
+                }
+            }
+            break;
+        }
+        else
+        {
+            if (*t == ':') ++j;
+            t++;
+        }
+    }
+    return t;
+}
+
+// Size the per-sample arrays from the maxima collected in fmt and lay them out in mem
+static void vcf_fmt_alloc(fmt_aux_t *fmt, int n_fmt, int n_sample, kstring_t *mem)
+{
+    int j;
+    for (j = 0; j < n_fmt; ++j) {
+        fmt_aux_t *f = &fmt[j];
+        if ( !f->max_m ) f->max_m = 1;  // omitted trailing format field
+        if ((f->y>>4&0xf) == BCF_HT_STR) {
+            f->size = f->is_gt? f->max_g << 2 : f->max_l;
+        } else if ((f->y>>4&0xf) == BCF_HT_REAL || (f->y>>4&0xf) == BCF_HT_INT) {
+            f->size = f->max_m << 2;
+        } else
+        {
+            fprintf(stderr, "[E::_vcf_parse_format] the format type %d currently not supported\n", f->y>>4&0xf);
+            abort(); // I do not know how to do with Flag in the genotype fields
+        }
+        align_mem(mem);
+        f->offset = mem->l;
+        ks_resize(mem, mem->l + n_sample * f->size);
+        mem->l += n_sample * f->size;
+    }
+    for (j = 0; j < n_fmt; ++j)
+        fmt[j].buf = (uint8_t*)mem->s + fmt[j].offset;
+}
+
+/*
+ *  Parallel parsing of the sample columns of a single line.  The columns are
+ *  located first, with memchr() scanning for tabs a word or vector at a time,
+ *  and then disjoint ranges of samples are sized and filled on the pool, each
+ *  range writing straight into its own slice of the fmt_aux_t buffers.
+ */
+typedef struct {
+    const bcf_hdr_t *h;
+    const bcf1_t *v;
+    fmt_aux_t *fmt;     // the range's own maxima when sizing, shared when filling
+    char **col, *end;
+    int beg, n;         // first sample and number of samples in the range
+} vcf_fmt_range_t;
+
+static void *vcf_fmt_range_stats(void *arg)
+{
+    vcf_fmt_range_t *a = (vcf_fmt_range_t*)arg;
+    int i;
+    for (i = a->beg; i < a->beg + a->n; ++i)
+        vcf_fmt_sample_stats(a->h, a->v, a->fmt, a->col[i], a->end);
+    return a;
+}
+
+static void *vcf_fmt_range_fill(void *arg)
+{
+    vcf_fmt_range_t *a = (vcf_fmt_range_t*)arg;
+    int i;
+    for (i = a->beg; i < a->beg + a->n; ++i)
+        vcf_fmt_sample_fill(a->v, a->fmt, a->col[i], i);
+    return a;
+}
+
+static int vcf_fmt_run_ranges(t_pool *pool, void *(*func)(void*), vcf_fmt_range_t *rng, int n_rng)
+{
+    t_results_queue *q = t_results_queue_init();
+    int i, n_done = 0;
+    if ( !q ) return -1;
+    for (i = 0; i < n_rng; ++i)
+        if ( t_pool_dispatch(pool, q, func, &rng[i]) < 0 ) break;
+    for (; n_done < i; ++n_done)
+    {
+        t_pool_result *r = t_pool_next_result_wait(q);
+        if ( !r ) break;
+        t_pool_delete_result(r, 0);
+    }
+    t_results_queue_destroy(q);
+    return n_done == n_rng ? 0 : -1;
+}
+
+// Parallel equivalent of the two passes in vcf_parse_format_core(); sets
+// v->n_sample and fills fmt.  Returns 0 on success, -1 on error
+static int vcf_fmt_parse_par(const bcf_hdr_t *h, bcf1_t *v, fmt_aux_t *fmt, char *p, char *end, vcf_parse_opt_t *opt)
+{
+    int nsmpl = bcf_hdr_nsamples(h), n = 0, n_ori = 0, n_rng, i, j, ret = -1;
+    char **col = (char**)malloc(nsmpl * sizeof(char*));
+    vcf_fmt_range_t *rng = NULL;
+    fmt_aux_t *rfmt = NULL;
+    if ( !col ) return -1;
+
+    // locate the columns, terminating each (and each skipped one) with a NUL
+    while ( p < end && n < nsmpl )
+    {
+        char *t = (char*)memchr(p, '\t', end - p);
+        if ( !t ) t = end; else *t = 0;
+        if ( !h->keep_samples || bit_array_test(h->keep_samples, n_ori) ) col[n++] = p;
+        n_ori++;
+        p = t + 1;
+    }
+    v->n_sample = n;
+
+    n_rng = opt->n_threads * 4;
+    if ( n_rng > n ) n_rng = n;
+    if ( n_rng < 1 ) n_rng = 1;
+    rng  = (vcf_fmt_range_t*)calloc(n_rng, sizeof(vcf_fmt_range_t));
+    rfmt = (fmt_aux_t*)malloc(n_rng * v->n_fmt * sizeof(fmt_aux_t));
+    if ( !rng || !rfmt ) goto done;
+    for (i = 0; i < n_rng; ++i)
+    {
+        rng[i].h = h; rng[i].v = v; rng[i].col = col; rng[i].end = end;
+        rng[i].beg = (int64_t)n * i / n_rng;
+        rng[i].n = (int64_t)n * (i + 1) / n_rng - rng[i].beg;
+        rng[i].fmt = rfmt + i * v->n_fmt;
+        memcpy(rng[i].fmt, fmt, v->n_fmt * sizeof(fmt_aux_t));
+    }
+    if ( vcf_fmt_run_ranges(opt->pool, vcf_fmt_range_stats, rng, n_rng) < 0 ) goto done;
+
+    for (i = 0; i < n_rng; ++i)
+        for (j = 0; j < v->n_fmt; ++j)
+        {
+            fmt_aux_t *f = &rng[i].fmt[j];
+            if (fmt[j].max_m < f->max_m) fmt[j].max_m = f->max_m;
+            if (fmt[j].max_l < f->max_l) fmt[j].max_l = f->max_l;
+            if (fmt[j].max_g < f->max_g) fmt[j].max_g = f->max_g;
+        }
+    vcf_fmt_alloc(fmt, v->n_fmt, n, opt->mem);
+    for (i = 0; i < n_rng; ++i) rng[i].fmt = fmt;
+    ret = vcf_fmt_run_ranges(opt->pool, vcf_fmt_range_fill, rng, n_rng);
+
+done:
+    free(col); free(rng); free(rfmt);
+    return ret;
+}
+
 // p,q is the start and the end of the FORMAT field
-int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char *q)
+static int vcf_parse_format_core(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char *q, vcf_parse_opt_t *opt)
 {
     if ( !bcf_hdr_nsamples(h) ) return 0;
 
     char *r, *t;
-    int j, l, m, g;
+    int j, m;
     khint_t k;
     ks_tokaux_t aux1;
     vdict_t *d = (vdict_t*)h->dict[BCF_DT_ID];
-    kstring_t *mem = (kstring_t*)&h->mem;
+    kstring_t *mem = opt->mem;
     mem->l = 0;
 
     // count the number of format fields
@@ -1509,7 +1886,7 @@ int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char
     char *end = s->s + s->l;
     if ( q>=end )
     {
-        fprintf(stderr,"[%s:%d %s] Error: FORMAT column with no sample columns starting at %s:%d\n", __FILE__,__LINE__,__FUNCTION__,s->s,v->pos+1);
+        fprintf(stderr,"[%s:%d %s] Error: FORMAT column with no sample columns starting at %s:%d\n", __FILE__,__LINE__,"_vcf_parse_format",s->s,v->pos+1);
         return -1;
     }
 
@@ -1519,7 +1896,8 @@ int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char
         *(char*)aux1.p = 0;
         k = kh_get(vdict, d, t);
         if (k == kh_end(d) || kh_val(d, k).info[BCF_HL_FMT] == 15) {
-            fprintf(stderr, "[W::%s] FORMAT '%s' is not defined in the header, assuming Type=String\n", __func__, t);
+            if ( opt->no_hdr_update ) return VCF_PARSE_UNDEF;
+            fprintf(stderr, "[W::_vcf_parse_format] FORMAT '%s' is not defined in the header, assuming Type=String\n", t);
             kstring_t tmp = {0,0,0};
             int l;
             ksprintf(&tmp, "##FORMAT=<ID=%s,Number=1,Type=String,Description=\"Dummy\">", t);
@@ -1534,168 +1912,61 @@ int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char
         fmt[j].is_gt = !strcmp(t, "GT");
         fmt[j].y = h->id[0][fmt[j].key].val->info[BCF_HL_FMT];
     }
-    // compute max
-    int n_sample_ori = -1;
-    r = q + 1;  // r: position in the format string
-    m = l = g = 1, v->n_sample = 0;  // m: max vector size, l: max field len, g: max number of alleles
-    while ( r<end )
-    {
-        // can we skip some samples?
-        if ( h->keep_samples )
-        {
-            n_sample_ori++;
-            if ( !bit_array_test(h->keep_samples,n_sample_ori) )
-            {
-                while ( *r!='\t' && r<end ) r++;
-                if ( *r=='\t' ) { *r = 0; r++; }
-                continue;
-            }
-        }
 
-        // collect fmt stats: max vector size, length, number of alleles
-        j = 0;  // j-th format field
-        for (;;)
+    if ( opt->pool && bcf_hdr_nsamples(h) > 1 )
+    {
+        if ( vcf_fmt_parse_par(h, v, fmt, q + 1, end, opt) < 0 ) return -1;
+    }
+    else
+    {
+        // compute max
+        int n_sample_ori = -1;
+        r = q + 1;  // r: position in the format string
+        v->n_sample = 0;
+        while ( r<end )
         {
-            if ( *r == '\t' ) *r = 0;
-            if ( *r == ':' || !*r )  // end of field or end of sample
+            // can we skip some samples?
+            if ( h->keep_samples )
             {
-                if (fmt[j].max_m < m) fmt[j].max_m = m;
-                if (fmt[j].max_l < l - 1) fmt[j].max_l = l - 1;
-                if (fmt[j].is_gt && fmt[j].max_g < g) fmt[j].max_g = g;
-                l = 0, m = g = 1;
-                if ( *r==':' ) 
+                n_sample_ori++;
+                if ( !bit_array_test(h->keep_samples,n_sample_ori) )
                 {
-                    j++;
-                    if ( j>=v->n_fmt ) 
-                    { 
-                        fprintf(stderr,"Incorrect number of FORMAT fields at %s:%d\n", h->id[BCF_DT_CTG][v->rid].key,v->pos+1);
-                        exit(1); 
-                    }
+                    while ( *r!='\t' && r<end ) r++;
+                    if ( *r=='\t' ) { *r = 0; r++; }
+                    continue;
                 }
-                else break;
             }
-            else if ( *r== ',' ) m++;
-            else if ( fmt[j].is_gt && (*r == '|' || *r == '/') ) g++;
-            if ( r>=end ) break;
-            r++; l++;
-        }
-        v->n_sample++;
-        if ( v->n_sample == bcf_hdr_nsamples(h) ) break;
-        r++;
-    }
 
-    // allocate memory for arrays
-    for (j = 0; j < v->n_fmt; ++j) {
-        fmt_aux_t *f = &fmt[j];
-        if ( !f->max_m ) f->max_m = 1;  // omitted trailing format field
-        if ((f->y>>4&0xf) == BCF_HT_STR) {
-            f->size = f->is_gt? f->max_g << 2 : f->max_l;
-        } else if ((f->y>>4&0xf) == BCF_HT_REAL || (f->y>>4&0xf) == BCF_HT_INT) {
-            f->size = f->max_m << 2;
-        } else
-        {
-            fprintf(stderr, "[E::%s] the format type %d currently not supported\n", __func__, f->y>>4&0xf);
-            abort(); // I do not know how to do with Flag in the genotype fields
+            // collect fmt stats: max vector size, length, number of alleles
+            r = vcf_fmt_sample_stats(h, v, fmt, r, end);
+            v->n_sample++;
+            if ( v->n_sample == bcf_hdr_nsamples(h) ) break;
+            r++;
         }
-        align_mem(mem);
-        f->offset = mem->l;
-        ks_resize(mem, mem->l + v->n_sample * f->size);
-        mem->l += v->n_sample * f->size;
-    }
-    for (j = 0; j < v->n_fmt; ++j)
-        fmt[j].buf = (uint8_t*)mem->s + fmt[j].offset;
-    // fill the sample fields; at beginning of the loop, t points to the first char of a format
-    n_sample_ori = -1;
-    t = q + 1; m = 0;   // m: sample id
-    while ( t<end )
-    {
-        // can we skip some samples?
-        if ( h->keep_samples )
-        {
-            n_sample_ori++;
-            if ( !bit_array_test(h->keep_samples,n_sample_ori) )
-            {
-                while ( *t && t<end ) t++;
-                t++;
-                continue;
-            }
-        }
-        if ( m == bcf_hdr_nsamples(h) ) break;
 
-        j = 0; // j-th format field, m-th sample
-        while ( *t )
+        // allocate memory for arrays
+        vcf_fmt_alloc(fmt, v->n_fmt, v->n_sample, mem);
+
+        // fill the sample fields; at beginning of the loop, t points to the first char of a format
+        n_sample_ori = -1;
+        t = q + 1; m = 0;   // m: sample id
+        while ( t<end )
         {
-            fmt_aux_t *z = &fmt[j];
-            if ((z->y>>4&0xf) == BCF_HT_STR) {
-                if (z->is_gt) { // genotypes
-                    int32_t is_phased = 0, *x = (int32_t*)(z->buf + z->size * m);
-                    for (l = 0;; ++t) {
-                        if (*t == '.') ++t, x[l++] = is_phased;
-                        else x[l++] = (strtol(t, &t, 10) + 1) << 1 | is_phased;
-#if THOROUGH_SANITY_CHECKS
-                        assert( 0 );    // success of strtol,strtod not checked
-#endif
-                        is_phased = (*t == '|');
-                        if (*t == ':' || *t == 0) break;
-                    }
-                    if ( !l ) x[l++] = 0;   // An empty field, insert missing value
-                    for (; l < z->size>>2; ++l) x[l] = bcf_int32_vector_end;
-                } else {
-                    char *x = (char*)z->buf + z->size * m;
-                    for (r = t, l = 0; *t != ':' && *t; ++t) x[l++] = *t;
-                    for (; l < z->size; ++l) x[l] = 0;
-                }
-            } else if ((z->y>>4&0xf) == BCF_HT_INT) {
-                int32_t *x = (int32_t*)(z->buf + z->size * m);
-                for (l = 0;; ++t) {
-                    if (*t == '.') x[l++] = bcf_int32_missing, ++t; // ++t to skip "."
-                    else x[l++] = strtol(t, &t, 10);
-                    if (*t == ':' || *t == 0) break;
-                }
-                if ( !l ) x[l++] = bcf_int32_missing;
-                for (; l < z->size>>2; ++l) x[l] = bcf_int32_vector_end;
-            } else if ((z->y>>4&0xf) == BCF_HT_REAL) {
-                float *x = (float*)(z->buf + z->size * m);
-                for (l = 0;; ++t) {
-                    if (*t == '.' && !isdigit(t[1])) bcf_float_set_missing(x[l++]), ++t; // ++t to skip "."
-                    else x[l++] = strtod(t, &t);
-                    if (*t == ':' || *t == 0) break;
-                }
-                if ( !l ) bcf_float_set_missing(x[l++]);    // An empty field, insert missing value
-                for (; l < z->size>>2; ++l) bcf_float_set_vector_end(x[l]);
-            } else abort();
-            if (*t == 0) {
-                for (++j; j < v->n_fmt; ++j) { // fill end-of-vector values
-                    z = &fmt[j];
-                    if ((z->y>>4&0xf) == BCF_HT_STR) {
-                        if (z->is_gt) {
-                            int32_t *x = (int32_t*)(z->buf + z->size * m);
-                            x[0] = bcf_int32_missing;
-                            for (l = 1; l < z->size>>2; ++l) x[l] = bcf_int32_vector_end;
-                        } else {
-                            char *x = (char*)z->buf + z->size * m;
-                            if ( z->size ) x[0] = '.';
-                            for (l = 1; l < z->size; ++l) x[l] = 0;
-                        }
-                    } else if ((z->y>>4&0xf) == BCF_HT_INT) {
-                        int32_t *x = (int32_t*)(z->buf + z->size * m);
-                        x[0] = bcf_int32_missing;
-                        for (l = 1; l < z->size>>2; ++l) x[l] = bcf_int32_vector_end;
-                    } else if ((z->y>>4&0xf) == BCF_HT_REAL) {
-                        float *x = (float*)(z->buf + z->size * m);
-                        bcf_float_set_missing(x[0]);
-                        for (l = 1; l < z->size>>2; ++l) bcf_float_set_vector_end(x[l]);
-                    }
-                }
-                break;
-            }
-            else
+            // can we skip some samples?
+            if ( h->keep_samples )
             {
-                if (*t == ':') ++j;
-                t++;
+                n_sample_ori++;
+                if ( !bit_array_test(h->keep_samples,n_sample_ori) )
+                {
+                    while ( *t && t<end ) t++;
+                    t++;
+                    continue;
+                }
             }
+            if ( m == bcf_hdr_nsamples(h) ) break;
+            t = vcf_fmt_sample_fill(v, fmt, t, m);
+            m++; t++;
         }
-        m++; t++;
     }
 
     // write individual genotype information
@@ -1720,7 +1991,7 @@ int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char
     if ( v->n_sample!=bcf_hdr_nsamples(h) )
     {
         fprintf(stderr,"[%s:%d %s] Number of columns at %s:%d does not match the number of samples (%d vs %d).\n",
-                __FILE__,__LINE__,__FUNCTION__,bcf_seqname(h,v),v->pos+1, v->n_sample,bcf_hdr_nsamples(h));
+                __FILE__,__LINE__,"_vcf_parse_format",bcf_seqname(h,v),v->pos+1, v->n_sample,bcf_hdr_nsamples(h));
         v->errcode |= BCF_ERR_NCOLS;
         return -1;
     }
@@ -1728,7 +1999,13 @@ int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char
     return 0;
 }
 
-int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
+int _vcf_parse_format(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, char *p, char *q)
+{
+    vcf_parse_opt_t opt = { (kstring_t*)&h->mem, 0, NULL, 0 };
+    return vcf_parse_format_core(s, h, v, p, q, &opt);
+}
+
+static int vcf_parse_core(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, vcf_parse_opt_t *opt)
 {
     int i = 0;
     char *p, *q, *r, *t;
@@ -1747,9 +2024,10 @@ int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
             k = kh_get(vdict, d, p);
             if (k == kh_end(d))
             {
+                if ( opt->no_hdr_update ) return VCF_PARSE_UNDEF;
                 // Simple error recovery for chromosomes not defined in the header. It will not help when VCF header has
                 // been already printed, but will enable tools like vcfcheck to proceed.
-                fprintf(stderr, "[W::%s] contig '%s' is not defined in the header. (Quick workaround: index the file with tabix.)\n", __func__, p);
+                fprintf(stderr, "[W::vcf_parse] contig '%s' is not defined in the header. (Quick workaround: index the file with tabix.)\n", p);
                 kstring_t tmp = {0,0,0};
                 int l;
                 ksprintf(&tmp, "##contig=<ID=%s>", p);
@@ -1800,9 +2078,10 @@ int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
                     k = kh_get(vdict, d, t);
                     if (k == kh_end(d))
                     {
+                        if ( opt->no_hdr_update ) return VCF_PARSE_UNDEF;
                         // Simple error recovery for FILTERs not defined in the header. It will not help when VCF header has
                         // been already printed, but will enable tools like vcfcheck to proceed.
-                        fprintf(stderr, "[W::%s] FILTER '%s' is not defined in the header\n", __func__, t);
+                        fprintf(stderr, "[W::vcf_parse] FILTER '%s' is not defined in the header\n", t);
                         kstring_t tmp = {0,0,0};
                         int l;
                         ksprintf(&tmp, "##FILTER=<ID=%s,Description=\"Dummy\">", t);
@@ -1839,7 +2118,8 @@ int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
                     k = kh_get(vdict, d, key);
                     if (k == kh_end(d) || kh_val(d, k).info[BCF_HL_INFO] == 15)
                     {
-                        fprintf(stderr, "[W::%s] INFO '%s' is not defined in the header, assuming Type=String\n", __func__, key);
+                        if ( opt->no_hdr_update ) return VCF_PARSE_UNDEF;
+                        fprintf(stderr, "[W::vcf_parse] INFO '%s' is not defined in the header, assuming Type=String\n", key);
                         kstring_t tmp = {0,0,0};
                         int l;
                         ksprintf(&tmp, "##INFO=<ID=%s,Number=1,Type=String,Description=\"Dummy\">", key);
@@ -1899,14 +2179,211 @@ int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
             }
             if ( v->max_unpack && !(v->max_unpack>>3) ) return 0;
         } else if (i == 8) // FORMAT
-            return _vcf_parse_format(s, h, v, p, q);
+            return vcf_parse_format_core(s, h, v, p, q, opt);
+    }
+    return 0;
+}
+
+int vcf_parse(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v)
+{
+    vcf_parse_opt_t opt = { (kstring_t*)&h->mem, 0, NULL, 0 };
+    return vcf_parse_core(s, h, v, &opt);
+}
+
+int vcf_parse_nohdr(kstring_t *s, const bcf_hdr_t *h, bcf1_t *v, kstring_t *mem)
+{
+    vcf_parse_opt_t opt = { mem, 1, NULL, 0 };
+    return vcf_parse_core(s, h, v, &opt);
+}
+
+/*
+ *  Threaded VCF reading.  The caller's thread reads lines into batches and
+ *  hands them to the thread pool; workers parse each batch into its own
+ *  bcf1_t records using the batch's scratch space in place of h->mem.  The
+ *  batches come back in the order they were dispatched, and vcf_read() hands
+ *  out their records by swapping them with the caller's bcf1_t.
+ *
+ *  Workers parse with the header read-locked and without modifying it.  A
+ *  line that refers to a contig or tag missing from the header is instead
+ *  parsed again by the caller when its turn comes, with the header locked for
+ *  writing, so dummy header lines are added in file order just as when
+ *  reading serially.
+ *
+ *  Lines of VCF_MT_MAX_BYTES or more are not parsed by the workers but left
+ *  to vcf_read(), which spreads their sample columns over the pool instead.
+ */
+#define VCF_MT_MAX_LINES 1000
+#define VCF_MT_MAX_BYTES (1<<20)
+#define VCF_PARSE_DEFER -3
+
+typedef struct vcf_mt_batch_t {
+    struct vcf_mt_t *mt;
+    const bcf_hdr_t *h;
+    int n, m, max_unpack;
+    kstring_t *line;        // the lines as read
+    bcf1_t **rec;
+    int *ret;               // vcf_parse return values, or VCF_PARSE_UNDEF
+    kstring_t tmp, mem;     // worker scratch: copy of the line being parsed, FORMAT buffers
+    struct vcf_mt_batch_t *next;
+} vcf_mt_batch_t;
+
+typedef struct vcf_mt_t {
+    t_pool *pool;
+    t_results_queue *q;
+    int n_threads, n_queued, eof;
+    vcf_mt_batch_t *cur, *free;     // batch being handed out, recycled batches
+    int i_cur;
+    kstring_t tmp, mem;             // scratch for the long lines vcf_read() parses
+    pthread_rwlock_t hdr_lock;
+} vcf_mt_t;
+
+static void *vcf_mt_parse(void *arg)
+{
+    vcf_mt_batch_t *b = (vcf_mt_batch_t*)arg;
+    vcf_parse_opt_t opt = { &b->mem, 1, NULL, 0 };
+    int i;
+    pthread_rwlock_rdlock(&b->mt->hdr_lock);
+    for (i = 0; i < b->n; ++i) {
+        if (b->line[i].l >= VCF_MT_MAX_BYTES) { b->ret[i] = VCF_PARSE_DEFER; continue; }
+        b->tmp.l = 0;
+        kputsn(b->line[i].s, b->line[i].l, &b->tmp);
+        b->rec[i]->max_unpack = b->max_unpack;
+        b->ret[i] = vcf_parse_core(&b->tmp, b->h, b->rec[i], &opt);
     }
+    pthread_rwlock_unlock(&b->mt->hdr_lock);
+    return b;
+}
+
+static void vcf_mt_batch_destroy(vcf_mt_batch_t *b)
+{
+    int i;
+    for (i = 0; i < b->m; ++i) {
+        free(b->line[i].s);
+        bcf_destroy(b->rec[i]);
+    }
+    free(b->line); free(b->rec); free(b->ret);
+    free(b->tmp.s); free(b->mem.s);
+    free(b);
+}
+
+// Read batches and queue them until 2*n_threads are in flight or the input ends
+static int vcf_mt_fill(htsFile *fp, const bcf_hdr_t *h, int max_unpack)
+{
+    vcf_mt_t *mt = (vcf_mt_t*)fp->state;
+    while (!mt->eof && mt->n_queued < 2 * mt->n_threads) {
+        vcf_mt_batch_t *b = mt->free;
+        size_t bytes = 0;
+        if (b) mt->free = b->next;
+        else if ((b = (vcf_mt_batch_t*)calloc(1, sizeof(vcf_mt_batch_t))) == NULL) return -1;
+        b->mt = mt; b->h = h; b->max_unpack = max_unpack;
+        for (b->n = 0; b->n < VCF_MT_MAX_LINES && bytes < VCF_MT_MAX_BYTES; ++b->n) {
+            if (b->n == b->m) {
+                int m = b->m ? b->m * 2 : 16, i;
+                b->line = (kstring_t*)realloc(b->line, m * sizeof(kstring_t));
+                b->rec = (bcf1_t**)realloc(b->rec, m * sizeof(bcf1_t*));
+                b->ret = (int*)realloc(b->ret, m * sizeof(int));
+                for (i = b->m; i < m; ++i) {
+                    b->line[i].l = b->line[i].m = 0; b->line[i].s = NULL;
+                    b->rec[i] = bcf_init();
+                }
+                b->m = m;
+            }
+            if (hts_getline(fp, KS_SEP_LINE, &b->line[b->n]) < 0) { mt->eof = 1; break; }
+            bytes += b->line[b->n].l;
+        }
+        if (b->n == 0) { b->next = mt->free; mt->free = b; break; }
+        if (t_pool_dispatch(mt->pool, mt->q, vcf_mt_parse, b) < 0) return -1;
+        mt->n_queued++;
+    }
+    return 0;
+}
+
+static int vcf_mt_read(htsFile *fp, const bcf_hdr_t *h, bcf1_t *v)
+{
+    vcf_mt_t *mt = (vcf_mt_t*)fp->state;
+    vcf_mt_batch_t *b;
+    bcf1_t tmp;
+    int i, ret;
+
+    while (!mt->cur || mt->i_cur >= mt->cur->n) {
+        t_pool_result *r;
+        if (mt->cur) { mt->cur->next = mt->free; mt->free = mt->cur; mt->cur = NULL; }
+        if (vcf_mt_fill(fp, h, v->max_unpack) < 0) return -1;
+        if (mt->n_queued == 0) return -1;   // end of file
+        if ((r = t_pool_next_result_wait(mt->q)) == NULL) return -1;
+        mt->cur = (vcf_mt_batch_t*)r->data;
+        t_pool_delete_result(r, 0);
+        mt->n_queued--;
+        mt->i_cur = 0;
+    }
+    b = mt->cur;
+    i = mt->i_cur++;
+    if (b->ret[i] == VCF_PARSE_DEFER) {
+        vcf_parse_opt_t opt = { &mt->mem, 1, mt->pool, mt->n_threads };
+        mt->tmp.l = 0;
+        kputsn(b->line[i].s, b->line[i].l, &mt->tmp);
+        pthread_rwlock_rdlock(&mt->hdr_lock);
+        ret = vcf_parse_core(&mt->tmp, h, v, &opt);
+        pthread_rwlock_unlock(&mt->hdr_lock);
+        if (ret != VCF_PARSE_UNDEF) return ret;
+    }
+    if (b->ret[i] == VCF_PARSE_UNDEF || b->ret[i] == VCF_PARSE_DEFER) {
+        pthread_rwlock_wrlock(&mt->hdr_lock);
+        ret = vcf_parse(&b->line[i], h, v);
+        pthread_rwlock_unlock(&mt->hdr_lock);
+        return ret;
+    }
+    tmp = *v; *v = *b->rec[i]; *b->rec[i] = tmp;
+    return b->ret[i];
+}
+
+int vcf_set_threads(htsFile *fp, int n_threads)
+{
+    vcf_mt_t *mt = (vcf_mt_t*)fp->state;
+    if (fp->format.format != vcf || fp->is_write) return -1;
+    if (mt) {
+        // Lines already read ahead are lost
+        while (mt->n_queued > 0) {
+            t_pool_result *r = t_pool_next_result_wait(mt->q);
+            if (!r) break;
+            vcf_mt_batch_destroy((vcf_mt_batch_t*)r->data);
+            t_pool_delete_result(r, 0);
+            mt->n_queued--;
+        }
+        t_pool_destroy(mt->pool, 0);
+        t_results_queue_destroy(mt->q);
+        pthread_rwlock_destroy(&mt->hdr_lock);
+        free(mt->tmp.s); free(mt->mem.s);
+        if (mt->cur) vcf_mt_batch_destroy(mt->cur);
+        while (mt->free) {
+            vcf_mt_batch_t *b = mt->free;
+            mt->free = b->next;
+            vcf_mt_batch_destroy(b);
+        }
+        free(mt);
+        fp->state = NULL;
+    }
+    if (n_threads < 1) return 0;
+
+    mt = (vcf_mt_t*)calloc(1, sizeof(vcf_mt_t));
+    if (!mt) return -1;
+    mt->n_threads = n_threads;
+    mt->pool = t_pool_init(2 * n_threads, n_threads);
+    mt->q = t_results_queue_init();
+    if (!mt->pool || !mt->q || pthread_rwlock_init(&mt->hdr_lock, NULL) != 0) {
+        if (mt->pool) t_pool_destroy(mt->pool, 0);
+        if (mt->q) t_results_queue_destroy(mt->q);
+        free(mt);
+        return -1;
+    }
+    fp->state = mt;
     return 0;
 }
 
 int vcf_read(htsFile *fp, const bcf_hdr_t *h, bcf1_t *v)
 {
     int ret;
+    if (fp->state) return vcf_mt_read(fp, h, v);
     ret = hts_getline(fp, KS_SEP_LINE, &fp->line);
     if (ret < 0) return -1;
     return vcf_parse1(&fp->line, h, v);
@@ -2034,7 +2511,7 @@ int vcf_format(const bcf_hdr_t *h, const bcf1_t *v, kstring_t *s)
     } else kputc('.', s);
     kputc('\t', s); // QUAL
     if ( bcf_float_is_missing(v->qual) ) kputc('.', s); // QUAL
-    else ksprintf(s, "%g", v->qual);
+    else kputd(v->qual, s);
     kputc('\t', s); // FILTER
     if (v->d.n_flt) {
         for (i = 0; i < v->d.n_flt; ++i) {
@@ -2059,7 +2536,7 @@ int vcf_format(const bcf_hdr_t *h, const bcf1_t *v, kstring_t *s)
                     case BCF_BT_INT8:  if ( z->v1.i==bcf_int8_missing ) kputc('.', s); else kputw(z->v1.i, s); break;
                     case BCF_BT_INT16: if ( z->v1.i==bcf_int16_missing ) kputc('.', s); else kputw(z->v1.i, s); break;
                     case BCF_BT_INT32: if ( z->v1.i==bcf_int32_missing ) kputc('.', s); else kputw(z->v1.i, s); break;
-                    case BCF_BT_FLOAT: if ( bcf_float_is_missing(z->v1.f) ) kputc('.', s); else ksprintf(s, "%g", z->v1.f); break;
+                    case BCF_BT_FLOAT: if ( bcf_float_is_missing(z->v1.f) ) kputc('.', s); else kputd(z->v1.f, s); break;
                     case BCF_BT_CHAR:  kputc(z->v1.i, s); break;
                     default: fprintf(stderr,"todo: type %d\n", z->type); exit(1); break;
                 }
@@ -2210,6 +2687,8 @@ int bcf_index_build(const char *fn, int min_shift)
 int bcf_hdr_combine(bcf_hdr_t *dst, const bcf_hdr_t *src)
 {
     int i, ndst_ori = dst->nhrec, need_sync = 0, ret = 0;
+    bcf_hdr_reserve(dst, BCF_DT_ID, kh_size((vdict_t*)src->dict[BCF_DT_ID]));
+    bcf_hdr_reserve(dst, BCF_DT_CTG, kh_size((vdict_t*)src->dict[BCF_DT_CTG]));
     for (i=0; i<src->nhrec; i++)
     {
         if ( src->hrec[i]->type==BCF_HL_GEN && src->hrec[i]->value )
@@ -2267,10 +2746,115 @@ int bcf_hdr_combine(bcf_hdr_t *dst, const bcf_hdr_t *src)
             }
         }
     }
-    if ( need_sync ) bcf_hdr_sync(dst);
+    if ( need_sync || dst->dirty ) bcf_hdr_sync(dst);
     return ret;
 }
-int bcf_translate(const bcf_hdr_t *dst_hdr, bcf_hdr_t *src_hdr, bcf1_t *line)
+struct bcf_translate_plan_t
+{
+    uint64_t src_gen, dst_gen;  // header states the plan was made for
+    int n[2];               // lengths of map, the src dictionary sizes
+    int *map[2];            // BCF_DT_ID and BCF_DT_CTG ids in dst; unchanged if not in dst
+    int ctg, id;            // whether any contig or tag id changes
+    int resize;             // whether some tag id changes its integer width
+};
+
+#define BCF_ID_WIDTH(id) ((id)>>7 ? ((id)>>15 ? BCF_BT_INT32 : BCF_BT_INT16) : BCF_BT_INT8)
+
+bcf_translate_plan_t *bcf_translate_plan_init(const bcf_hdr_t *dst_hdr, const bcf_hdr_t *src_hdr)
+{
+    bcf_translate_plan_t *plan = (bcf_translate_plan_t*) calloc(1, sizeof(bcf_translate_plan_t));
+    if ( !plan ) return NULL;
+    plan->src_gen = BCF_HDR_AUX(src_hdr)->gen;
+    plan->dst_gen = BCF_HDR_AUX(dst_hdr)->gen;
+    int i, dict;
+    for (dict=0; dict<2; dict++)    // BCF_DT_ID and BCF_DT_CTG
+    {
+        plan->n[dict] = src_hdr->n[dict];
+        plan->map[dict] = (int*) malloc((src_hdr->n[dict] ? src_hdr->n[dict] : 1)*sizeof(int));
+        if ( !plan->map[dict] ) { bcf_translate_plan_destroy(plan); return NULL; }
+        for (i=0; i<src_hdr->n[dict]; i++)
+        {
+            int id = i;
+            const char *key = src_hdr->id[dict][i].key;
+            if ( key && (i>=dst_hdr->n[dict] || !dst_hdr->id[dict][i].key || strcmp(key,dst_hdr->id[dict][i].key)) )
+            {
+                id = bcf_hdr_id2int(dst_hdr,dict,key);
+                if ( id<0 ) id = i;     // not in dst, leave as it is
+            }
+            plan->map[dict][i] = id;
+            if ( id==i ) continue;
+            if ( dict==BCF_DT_CTG ) plan->ctg = 1;
+            else
+            {
+                plan->id = 1;
+                if ( BCF_ID_WIDTH(id)!=BCF_ID_WIDTH(i) ) plan->resize = 1;
+            }
+        }
+    }
+    return plan;
+}
+
+void bcf_translate_plan_destroy(bcf_translate_plan_t *plan)
+{
+    if ( !plan ) return;
+    free(plan->map[0]);
+    free(plan->map[1]);
+    free(plan);
+}
+
+// Overwrite the value of the typed integer at p, which must be wide enough
+static inline void bcf_set_typed_int1(uint8_t *p, int32_t x)
+{
+    switch (*p & 0xf)
+    {
+        case BCF_BT_INT8:  p[1] = x; break;
+        case BCF_BT_INT16: { int16_t y = x; memcpy(p+1, &y, 2); break; }
+        default:           memcpy(p+1, &x, 4); break;
+    }
+}
+
+// Translate the ids in the BCF data of a line that has not been unpacked;
+// only possible when no id changes its width
+static void bcf_translate_shared(const bcf_translate_plan_t *plan, bcf1_t *line)
+{
+    uint8_t *ptr = (uint8_t*)line->shared.s;
+    int i, j, n, type;
+    const int *map = plan->map[BCF_DT_ID];
+    for (i = 0; i <= line->n_allele; ++i) ptr = bcf_skip_typed(ptr);  // ID, REF and ALTs
+
+    // FILTER: a typed vector of ids
+    n = bcf_dec_size(ptr, &ptr, &type);
+    for (j=0; j<n; j++)
+    {
+        if ( type==BCF_BT_INT8 ) { if ( ptr[j]!=(uint8_t)bcf_int8_missing ) ptr[j] = map[ptr[j]]; }
+        else if ( type==BCF_BT_INT16 ) { int16_t x; memcpy(&x, ptr+2*j, 2); if ( x>=0 ) { x = map[x]; memcpy(ptr+2*j, &x, 2); } }
+        else if ( type==BCF_BT_INT32 ) { int32_t x; memcpy(&x, ptr+4*j, 4); if ( x>=0 ) { x = map[x]; memcpy(ptr+4*j, &x, 4); } }
+    }
+    ptr += n << bcf_type_shift[type];
+
+    // INFO: pairs of typed id and typed vector
+    for (i=0; i<line->n_info; i++)
+    {
+        uint8_t *key = ptr;
+        bcf_set_typed_int1(key, map[bcf_dec_typed_int1(key, &ptr)]);
+        ptr = bcf_skip_typed(ptr);
+    }
+}
+
+static void bcf_translate_indiv(const bcf_translate_plan_t *plan, bcf1_t *line)
+{
+    uint8_t *ptr = (uint8_t*)line->indiv.s;
+    int i, n, type;
+    for (i=0; i<line->n_fmt; i++)
+    {
+        uint8_t *key = ptr;
+        bcf_set_typed_int1(key, plan->map[BCF_DT_ID][bcf_dec_typed_int1(key, &ptr)]);
+        n = bcf_dec_size(ptr, &ptr, &type);
+        ptr += line->n_sample * (n << bcf_type_shift[type]);
+    }
+}
+
+int bcf_translate_plan_apply(const bcf_translate_plan_t *plan, bcf1_t *line)
 {
     int i;
     if ( line->errcode )
@@ -2278,73 +2862,75 @@ int bcf_translate(const bcf_hdr_t *dst_hdr, bcf_hdr_t *src_hdr, bcf1_t *line)
         fprintf(stderr,"[%s:%d %s] Unchecked error (%d), exiting.\n", __FILE__,__LINE__,__FUNCTION__,line->errcode);
         exit(1);
     }
-    if ( src_hdr->ntransl==-1 ) return 0;    // no need to translate, all tags have the same id
-    if ( !src_hdr->ntransl )  // called for the first time, see what needs translating
+
+    // CHROM
+    if ( plan->ctg && line->rid>=0 && line->rid<plan->n[BCF_DT_CTG] ) line->rid = plan->map[BCF_DT_CTG][line->rid];
+    if ( !plan->id ) return 0;
+
+    const int *map = plan->map[BCF_DT_ID];
+    if ( !plan->resize )
     {
-        int dict;
-        for (dict=0; dict<2; dict++)    // BCF_DT_ID and BCF_DT_CTG
+        // Every id keeps its width: rewrite them where they are, in the
+        // unpacked structures too if the line has been unpacked
+        if ( line->shared.l && !line->d.shared_dirty && !(line->unpacked & (BCF_UN_FLT|BCF_UN_INFO)) )
+            bcf_translate_shared(plan, line);
+        else
         {
-            src_hdr->transl[dict] = (int*) malloc(src_hdr->n[dict]*sizeof(int));
-            for (i=0; i<src_hdr->n[dict]; i++)
+            bcf_unpack(line, BCF_UN_INFO);
+            for (i=0; i<line->d.n_flt; i++) line->d.flt[i] = map[line->d.flt[i]];
+            line->d.shared_dirty |= BCF1_DIRTY_FLT;
+            for (i=0; i<line->n_info; i++)
             {
-                if ( !src_hdr->id[dict][i].key || !dst_hdr->id[dict][i].key )    // gap left after removed BCF header lines
-                    src_hdr->transl[dict][i] = -1;
-                else if ( i>=dst_hdr->n[dict] || strcmp(src_hdr->id[dict][i].key,dst_hdr->id[dict][i].key) )
-                {
-                    src_hdr->transl[dict][i] = bcf_hdr_id2int(dst_hdr,dict,src_hdr->id[dict][i].key);
-                    src_hdr->ntransl++;
-                }
-                else
-                    src_hdr->transl[dict][i] = -1;
+                bcf_info_t *info = &line->d.info[i];
+                if ( !info->vptr ) continue;    // marked for removal
+                info->key = map[info->key];
+                bcf_set_typed_int1(info->vptr - info->vptr_off, info->key);
             }
         }
-        if ( !src_hdr->ntransl )
+        if ( !line->indiv.l && !(line->unpacked & BCF_UN_FMT) ) return 0;
+        if ( line->indiv.l && !line->d.indiv_dirty && !(line->unpacked & BCF_UN_FMT) )
+            bcf_translate_indiv(plan, line);
+        else
         {
-            free(src_hdr->transl[0]); src_hdr->transl[0] = NULL;
-            free(src_hdr->transl[1]); src_hdr->transl[1] = NULL;
-            src_hdr->ntransl = -1;
+            for (i=0; i<line->n_fmt; i++)
+            {
+                bcf_fmt_t *fmt = &line->d.fmt[i];
+                if ( !fmt->p ) continue;        // marked for removal
+                fmt->id = map[fmt->id];
+                bcf_set_typed_int1(fmt->p - fmt->p_off, fmt->id);
+            }
         }
-        if ( src_hdr->ntransl==-1 ) return 0;
+        return 0;
     }
-    bcf_unpack(line,BCF_UN_ALL);
 
-    // CHROM
-    if ( src_hdr->transl[BCF_DT_CTG][line->rid] >=0 ) line->rid = src_hdr->transl[BCF_DT_CTG][line->rid];
+    bcf_unpack(line,BCF_UN_ALL);
 
     // FILTER
     for (i=0; i<line->d.n_flt; i++)
-    {
-        int src_id = line->d.flt[i];
-        if ( src_hdr->transl[BCF_DT_ID][src_id] >=0 )
-            line->d.flt[i] = src_hdr->transl[BCF_DT_ID][src_id];
-        line->d.shared_dirty |= BCF1_DIRTY_FLT;
-    }
+        line->d.flt[i] = map[line->d.flt[i]];
+    line->d.shared_dirty |= BCF1_DIRTY_FLT;
 
     // INFO
     for (i=0; i<line->n_info; i++)
     {
-        int src_id = line->d.info[i].key;
-        int dst_id = src_hdr->transl[BCF_DT_ID][src_id];
-        if ( dst_id<0 ) continue;
-        int src_size = src_id>>7 ? ( src_id>>15 ? BCF_BT_INT32 : BCF_BT_INT16) : BCF_BT_INT8;
-        int dst_size = dst_id>>7 ? ( dst_id>>15 ? BCF_BT_INT32 : BCF_BT_INT16) : BCF_BT_INT8;
-        if ( src_size==dst_size )   // can overwrite
+        bcf_info_t *info = &line->d.info[i];
+        if ( !info->vptr ) continue;
+        int src_id = info->key, dst_id = map[src_id];
+        if ( dst_id==src_id ) continue;
+        if ( BCF_ID_WIDTH(src_id)==BCF_ID_WIDTH(dst_id) )   // can overwrite
         {
-            line->d.info[i].key = dst_id;
-            uint8_t *vptr = line->d.info[i].vptr - line->d.info[i].vptr_off;
-            if ( dst_size==BCF_BT_INT8 ) { vptr[1] = (uint8_t)dst_id; }
-            else if ( dst_size==BCF_BT_INT16 ) { *(uint16_t*)vptr = (uint16_t)dst_id; }
-            else { *(uint32_t*)vptr = (uint32_t)dst_id; }
+            info->key = dst_id;
+            bcf_set_typed_int1(info->vptr - info->vptr_off, dst_id);
         }
         else    // must realloc
         {
-            bcf_info_t *info = &line->d.info[i];
-            assert( !info->vptr_free );
             kstring_t str = {0,0,0};
             bcf_enc_int1(&str, dst_id);
             bcf_enc_size(&str, info->len,info->type);
-            info->vptr_off = str.l;
+            int vptr_off = str.l;
             kputsn((char*)info->vptr, info->vptr_len, &str);
+            if ( info->vptr_free ) free(info->vptr - info->vptr_off);
+            info->vptr_off = vptr_off;
             info->vptr = (uint8_t*)str.s + info->vptr_off;
             info->vptr_free = 1;
             info->key = dst_id;
@@ -2355,28 +2941,24 @@ int bcf_translate(const bcf_hdr_t *dst_hdr, bcf_hdr_t *src_hdr, bcf1_t *line)
     // FORMAT
     for (i=0; i<line->n_fmt; i++)
     {
-        int src_id = line->d.fmt[i].id;
-        int dst_id = src_hdr->transl[BCF_DT_ID][src_id];
-        if ( dst_id<0 ) continue;
-        int src_size = src_id>>7 ? ( src_id>>15 ? BCF_BT_INT32 : BCF_BT_INT16) : BCF_BT_INT8;
-        int dst_size = dst_id>>7 ? ( dst_id>>15 ? BCF_BT_INT32 : BCF_BT_INT16) : BCF_BT_INT8;
-        if ( src_size==dst_size )   // can overwrite
+        bcf_fmt_t *fmt = &line->d.fmt[i];
+        if ( !fmt->p ) continue;
+        int src_id = fmt->id, dst_id = map[src_id];
+        if ( dst_id==src_id ) continue;
+        if ( BCF_ID_WIDTH(src_id)==BCF_ID_WIDTH(dst_id) )   // can overwrite
         {
-            line->d.fmt[i].id = dst_id;
-            uint8_t *p = line->d.fmt[i].p - line->d.fmt[i].p_off;    // pointer to the vector size (4bits) and BT type (4bits)
-            if ( dst_size==BCF_BT_INT8 ) { p[1] = dst_id; }
-            else if ( dst_size==BCF_BT_INT16 ) { uint8_t *x = (uint8_t*) &dst_id; p[1] = x[0]; p[2] = x[1]; }
-            else { uint8_t *x = (uint8_t*) &dst_id; p[1] = x[0]; p[2] = x[1]; p[3] = x[2]; p[4] = x[3]; }
+            fmt->id = dst_id;
+            bcf_set_typed_int1(fmt->p - fmt->p_off, dst_id);
         }
         else    // must realloc
         {
-            bcf_fmt_t *fmt = &line->d.fmt[i];
-            assert( !fmt->p_free );
             kstring_t str = {0,0,0};
             bcf_enc_int1(&str, dst_id);
             bcf_enc_size(&str, fmt->n, fmt->type);
-            fmt->p_off = str.l;
+            int p_off = str.l;
             kputsn((char*)fmt->p, fmt->p_len, &str);
+            if ( fmt->p_free ) free(fmt->p - fmt->p_off);
+            fmt->p_off = p_off;
             fmt->p = (uint8_t*)str.s + fmt->p_off;
             fmt->p_free = 1;
             fmt->id = dst_id;
@@ -2385,61 +2967,98 @@ int bcf_translate(const bcf_hdr_t *dst_hdr, bcf_hdr_t *src_hdr, bcf1_t *line)
     }
     return 0;
 }
+#undef BCF_ID_WIDTH
+
+int bcf_translate(const bcf_hdr_t *dst_hdr, bcf_hdr_t *src_hdr, bcf1_t *line)
+{
+    bcf_hdr_aux_t *aux = BCF_HDR_AUX(src_hdr);
+    bcf_translate_plan_t *plan = aux->transl;
+    if ( !plan || plan->src_gen!=aux->gen || plan->dst_gen!=BCF_HDR_AUX(dst_hdr)->gen )
+    {
+        // first call, or one of the headers has been synced since
+        bcf_translate_plan_destroy(plan);
+        if ( !(aux->transl = plan = bcf_translate_plan_init(dst_hdr, src_hdr)) ) return -1;
+    }
+    return bcf_translate_plan_apply(plan, line);
+}
+
+// Copy the header lines and dictionaries of src, keeping the numeric IDs, and
+// the samples too if with_samples is set. Lines removed from src are not in its
+// hrec list, so their dictionary entries are dropped as a re-parse would.
+static bcf_hdr_t *bcf_hdr_copy(const bcf_hdr_t *src, int with_samples)
+{
+    bcf_hdr_t *dst = bcf_hdr_init("r");
+    vdict_t *sd[2], *dd[2];
+    int i, j, ret;
+    for (i=0; i<2; i++)
+    {
+        sd[i] = (vdict_t*)src->dict[i];
+        dd[i] = (vdict_t*)dst->dict[i];
+        bcf_hdr_reserve(dst, i, kh_size(sd[i]));
+    }
+    bcf_hdr_reserve_hrec(dst, src->nhrec);
+    for (i=0; i<src->nhrec; i++)
+    {
+        bcf_hrec_t *hrec = hrec_dup(src->hrec[i], 1);
+        dst->hrec[dst->nhrec++] = hrec;
+        if ( hrec->type==BCF_HL_GEN || hrec->type==BCF_HL_STR ) continue;
+        if ( (j = bcf_hrec_find_key(hrec,"ID"))<0 ) continue;
+
+        int type = hrec->type==BCF_HL_CTG ? BCF_DT_CTG : BCF_DT_ID;
+        int slot = hrec->type==BCF_HL_CTG ? 0 : hrec->type;
+        khint_t ks = kh_get(vdict, sd[type], hrec->vals[j]);
+        if ( ks==kh_end(sd[type]) ) continue;
+
+        char *key = strdup(hrec->vals[j]);
+        khint_t kd = kh_put(vdict, dd[type], key, &ret);
+        if ( !ret ) free(key);
+        else
+        {
+            kh_val(dd[type], kd) = bcf_idinfo_def;
+            kh_val(dd[type], kd).id = kh_val(sd[type], ks).id;
+        }
+        kh_val(dd[type], kd).info[slot] = kh_val(sd[type], ks).info[slot];
+        kh_val(dd[type], kd).hrec[slot] = hrec;
+    }
+    if ( with_samples )
+    {
+        bcf_hdr_reserve(dst, BCF_DT_SAMPLE, bcf_hdr_nsamples(src));
+        for (i=0; i<bcf_hdr_nsamples(src); i++)
+            bcf_hdr_add_sample(dst, src->samples[i]);
+    }
+    dst->dirty = 1;
+    bcf_hdr_sync(dst);
+    return dst;
+}
 
 bcf_hdr_t *bcf_hdr_dup(const bcf_hdr_t *hdr)
 {
-    bcf_hdr_t *hout = bcf_hdr_init("r");
-    char *htxt = bcf_hdr_fmt_text(hdr, 1, NULL);
-    bcf_hdr_parse(hout, htxt);
-    free(htxt);
-    return hout;
+    return bcf_hdr_copy(hdr, 1);
 }
 
 bcf_hdr_t *bcf_hdr_subset(const bcf_hdr_t *h0, int n, char *const* samples, int *imap)
 {
-    int hlen;
     void *names_hash = khash_str2int_init();
-    char *htxt = bcf_hdr_fmt_text(h0, 1, &hlen);
-    kstring_t str;
-    bcf_hdr_t *h;
-    str.l = str.m = 0; str.s = 0;
-    h = bcf_hdr_init("w");
-    bcf_hdr_set_version(h,bcf_hdr_get_version(h0));
-    int j;
-    for (j=0; j<n; j++) imap[j] = -1;
+    bcf_hdr_t *h = bcf_hdr_copy(h0, 0);
+    int i;
+    for (i=0; i<n; i++) imap[i] = -1;
     if ( bcf_hdr_nsamples(h0) > 0) {
-        char *p;
-        int i = 0, end = n? 8 : 7;
-        while ((p = strstr(htxt, "#CHROM\t")) != 0)
-            if (p > htxt && *(p-1) == '\n') break;
-        while ((p = strchr(p, '\t')) != 0 && i < end) ++i, ++p;
-        if (i != end) {
-            free(h); free(str.s);
-            return 0; // malformated header
-        }
-        kputsn(htxt, p - htxt, &str);
+        bcf_hdr_reserve(h, BCF_DT_SAMPLE, n);
         for (i = 0; i < n; ++i) {
             if ( khash_str2int_has_key(names_hash,samples[i]) )
             {
                 fprintf(stderr,"[E::bcf_hdr_subset] Duplicate sample name \"%s\".\n", samples[i]);
-                free(str.s);
-                free(htxt);
                 khash_str2int_destroy(names_hash);
                 bcf_hdr_destroy(h);
                 return NULL;
             }
             imap[i] = bcf_hdr_id2int(h0, BCF_DT_SAMPLE, samples[i]);
             if (imap[i] < 0) continue;
-            kputc('\t', &str);
-            kputs(samples[i], &str);
+            bcf_hdr_add_sample(h, samples[i]);
             khash_str2int_inc(names_hash,samples[i]);
         }
-    } else kputsn(htxt, hlen, &str);
-    while (str.l && (!str.s[str.l-1] || str.s[str.l-1]=='\n') ) str.l--; // kill trailing zeros and newlines
-    kputc('\n',&str);
-    bcf_hdr_parse(h, str.s);
-    free(str.s);
-    free(htxt);
+        bcf_hdr_sync(h);
+    }
     khash_str2int_destroy(names_hash);
     return h;
 }
@@ -2482,12 +3101,33 @@ int bcf_hdr_set_samples(bcf_hdr_t *hdr, const char *samples, int is_file)
     if ( !bcf_hdr_nsamples(hdr) ) { free(hdr->keep_samples); hdr->keep_samples=NULL; }
     else
     {
+        // runs of adjacent kept samples, copied as one block by bcf_subset_format()
+        bcf_hdr_aux_t *aux = BCF_HDR_AUX(hdr);
+        free(aux->keep_runs);
+        aux->keep_runs = NULL;
+        aux->nkeep_runs = 0;
+        int mruns = 0;
+        for (i=0; i<hdr->nsamples_ori; i++)
+        {
+            if ( !bit_array_test(hdr->keep_samples,i) ) continue;
+            if ( aux->nkeep_runs && aux->keep_runs[2*aux->nkeep_runs-2] + aux->keep_runs[2*aux->nkeep_runs-1]==i )
+            {
+                aux->keep_runs[2*aux->nkeep_runs-1]++;
+                continue;
+            }
+            hts_expand(int, 2*aux->nkeep_runs+2, mruns, aux->keep_runs);
+            aux->keep_runs[2*aux->nkeep_runs] = i;
+            aux->keep_runs[2*aux->nkeep_runs+1] = 1;
+            aux->nkeep_runs++;
+        }
+
         char **samples = (char**) malloc(sizeof(char*)*bcf_hdr_nsamples(hdr));
         idx = 0;
         for (i=0; i<hdr->nsamples_ori; i++)
             if ( bit_array_test(hdr->keep_samples,i) ) samples[idx++] = strdup(hdr->samples[i]);
         free(hdr->samples);
         hdr->samples = samples;
+        aux->msamples = bcf_hdr_nsamples(hdr);
 
         // delete original samples from the dictionary
         vdict_t *d = (vdict_t*)hdr->dict[BCF_DT_SAMPLE];
@@ -2504,6 +3144,7 @@ int bcf_hdr_set_samples(bcf_hdr_t *hdr, const char *samples, int is_file)
             kh_val(d, k) = bcf_idinfo_def;
             kh_val(d, k).id = kh_size(d) - 1;
         }
+        hdr->dirty |= BCF_HDR_DIRTY(BCF_DT_SAMPLE);
         bcf_hdr_sync(hdr);
     }
 
@@ -2706,7 +3347,7 @@ int bcf_update_info(const bcf_hdr_t *hdr, bcf1_t *line, const char *key, const v
         }
         else
         {
-            assert( !inf->vptr_free );  // fix the caller or improve here: this has been modified before
+            if ( inf->vptr_free ) free(inf->vptr - inf->vptr_off);  // grown before, replace that block
             bcf_unpack_info_core1((uint8_t*)str.s, inf);
             inf->vptr_free = 1;
             line->d.shared_dirty |= BCF1_DIRTY_INF;
@@ -2752,6 +3393,64 @@ int bcf_update_format_string(const bcf_hdr_t *hdr, bcf1_t *line, const char *key
     return ret;
 }
 
+/*
+ *  Overwrite the values of a FORMAT field in place, when the new values are
+ *  of the same type, as many per sample, and fit the field's integer width.
+ *  Returns 1 if done, 0 if the field must be encoded anew.
+ */
+static int bcf_fmt_overwrite(bcf_fmt_t *fmt, const void *values, int n, int type)
+{
+    int i;
+    if ( type==BCF_HT_REAL )
+    {
+        if ( fmt->type!=BCF_BT_FLOAT ) return 0;
+        memcpy(fmt->p, values, n*sizeof(float));
+        return 1;
+    }
+    if ( type==BCF_HT_STR )
+    {
+        if ( fmt->type!=BCF_BT_CHAR ) return 0;
+        memcpy(fmt->p, values, n);
+        return 1;
+    }
+    if ( type!=BCF_HT_INT ) return 0;
+
+    const int32_t *a = (const int32_t*) values;
+    int32_t max = INT32_MIN + 1, min = INT32_MAX;
+    for (i=0; i<n; i++)
+    {
+        if ( a[i]==bcf_int32_missing || a[i]==bcf_int32_vector_end ) continue;
+        if ( max < a[i] ) max = a[i];
+        if ( min > a[i] ) min = a[i];
+    }
+    #define BRANCH(type_t, missing, vector_end) { \
+        type_t *p = (type_t*) fmt->p; \
+        for (i=0; i<n; i++) \
+        { \
+            if ( a[i]==bcf_int32_vector_end ) p[i] = vector_end; \
+            else if ( a[i]==bcf_int32_missing ) p[i] = missing; \
+            else p[i] = a[i]; \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:
+            if ( max > INT8_MAX || min <= bcf_int8_vector_end ) return 0;
+            BRANCH(int8_t, bcf_int8_missing, bcf_int8_vector_end);
+            break;
+        case BCF_BT_INT16:
+            if ( max > INT16_MAX || min <= bcf_int16_vector_end ) return 0;
+            BRANCH(int16_t, bcf_int16_missing, bcf_int16_vector_end);
+            break;
+        case BCF_BT_INT32:
+            memcpy(fmt->p, a, n*sizeof(int32_t));
+            break;
+        default: return 0;
+    }
+    #undef BRANCH
+    return 1;
+}
+
 int bcf_update_format(const bcf_hdr_t *hdr, bcf1_t *line, const char *key, const void *values, int n, int type)
 {
     // Is the field already present?
@@ -2788,6 +3487,13 @@ int bcf_update_format(const bcf_hdr_t *hdr, bcf1_t *line, const char *key, const
     int nps = n / line->n_sample;  // number of values per sample
     assert( nps && nps*line->n_sample==n );     // must be divisible by n_sample
 
+    // Same shape as before: no need to encode and splice a new block
+    if ( fmt && fmt->p && fmt->n==nps && bcf_fmt_overwrite(fmt, values, n, type) )
+    {
+        line->unpacked |= BCF_UN_FMT;
+        return 0;
+    }
+
     // Encode the values and determine the size required to accommodate the values
     kstring_t str = {0,0,0};
     bcf_enc_int1(&str, fmt_id);
@@ -2844,7 +3550,7 @@ int bcf_update_format(const bcf_hdr_t *hdr, bcf1_t *line, const char *key, const
         }
         else
         {
-            assert( !fmt->p_free );  // fix the caller or improve here: this has been modified before
+            if ( fmt->p_free ) free(fmt->p - fmt->p_off);   // grown before, replace that block
             bcf_unpack_fmt_core1((uint8_t*)str.s, line->n_sample, fmt);
             fmt->p_free = 1;
             line->d.indiv_dirty = 1;
@@ -3026,6 +3732,65 @@ bcf_info_t *bcf_get_info_id(bcf1_t *line, const int id)
     return NULL;
 }
 
+/*
+ *  Lazy lookups for the bcf_get_*_values() functions.  When a record read
+ *  from a BCF has not been unpacked (or modified) yet, a single tag can be
+ *  found by skipping over the typed values that precede it, decoding only
+ *  the field's own header and leaving ID, alleles and all other fields
+ *  untouched.  Return 1 and fill @info/@fmt if the tag is found, 0 if it is
+ *  not present, or -1 if the record must be unpacked the usual way.
+ */
+static int bcf_find_info_lazy(bcf1_t *line, int id, bcf_info_t *info)
+{
+    if ( !line->shared.l || (line->unpacked & BCF_UN_INFO) || line->d.shared_dirty ) return -1;
+    uint8_t *ptr = (uint8_t*)line->shared.s, *p;
+    int i;
+    if ( line->unpacked & BCF_UN_FLT )
+        ptr += line->unpack_size[0] + line->unpack_size[1] + line->unpack_size[2];
+    else
+    {
+        for (i = 0; i <= line->n_allele; ++i) ptr = bcf_skip_typed(ptr);  // ID, REF and ALTs
+        ptr = bcf_skip_typed(ptr);  // FILTER
+    }
+    for (i = 0; i < line->n_info; ++i)
+    {
+        p = ptr;
+        if ( bcf_dec_typed_int1(p, &ptr) == id )
+        {
+            bcf_unpack_info_core1(p, info);
+            return 1;
+        }
+        ptr = bcf_skip_typed(ptr);
+    }
+    return 0;
+}
+
+static int bcf_find_fmt_lazy(bcf1_t *line, int id, bcf_fmt_t *fmt)
+{
+    if ( !line->indiv.l || (line->unpacked & BCF_UN_FMT) || line->d.indiv_dirty ) return -1;
+    uint8_t *ptr = (uint8_t*)line->indiv.s, *p;
+    int i, n, type;
+    for (i = 0; i < line->n_fmt; ++i)
+    {
+        p = ptr;
+        if ( bcf_dec_typed_int1(p, &ptr) == id )
+        {
+            bcf_unpack_fmt_core1(p, line->n_sample, fmt);
+            return 1;
+        }
+        n = bcf_dec_size(ptr, &ptr, &type);
+        ptr += line->n_sample * (n << bcf_type_shift[type]);
+    }
+    return 0;
+}
+
+// The FORMAT field with the given id, found lazily into @lazy when possible
+static bcf_fmt_t *bcf_get_fmt_lazy(bcf1_t *line, int id, bcf_fmt_t *lazy)
+{
+    int found = bcf_find_fmt_lazy(line, id, lazy);
+    if ( found >= 0 ) return found ? lazy : NULL;
+    return bcf_get_fmt_id(line, id);
+}
 
 int bcf_get_info_values(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, void **dst, int *ndst, int type)
 {
@@ -3033,14 +3798,20 @@ int bcf_get_info_values(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, voi
     if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_INFO,tag_id) ) return -1;    // no such INFO field in the header
     if ( bcf_hdr_id2type(hdr,BCF_HL_INFO,tag_id)!=type ) return -2;     // expected different type
 
-    if ( !(line->unpacked & BCF_UN_INFO) ) bcf_unpack(line, BCF_UN_INFO);
-
-    for (i=0; i<line->n_info; i++)
-        if ( line->d.info[i].key==tag_id ) break;
-    if ( i==line->n_info ) return ( type==BCF_HT_FLAG ) ? 0 : -3;       // the tag is not present in this record
+    bcf_info_t lazy, *info;
+    int found = bcf_find_info_lazy(line, tag_id, &lazy);
+    if ( found < 0 )
+    {
+        if ( !(line->unpacked & BCF_UN_INFO) ) bcf_unpack(line, BCF_UN_INFO);
+        for (i=0; i<line->n_info; i++)
+            if ( line->d.info[i].key==tag_id ) break;
+        found = i < line->n_info;
+        info = &line->d.info[i];
+    }
+    else info = &lazy;
+    if ( !found ) return ( type==BCF_HT_FLAG ) ? 0 : -3;       // the tag is not present in this record
     if ( type==BCF_HT_FLAG ) return 1;
 
-    bcf_info_t *info = &line->d.info[i];
     if ( type==BCF_HT_STR )
     {
         if ( *ndst < info->len+1 )
@@ -3110,12 +3881,8 @@ int bcf_get_format_string(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, c
     if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,tag_id) ) return -1;    // no such FORMAT field in the header
     if ( bcf_hdr_id2type(hdr,BCF_HL_FMT,tag_id)!=BCF_HT_STR ) return -2;     // expected different type
 
-    if ( !(line->unpacked & BCF_UN_FMT) ) bcf_unpack(line, BCF_UN_FMT);
-
-    for (i=0; i<line->n_fmt; i++)
-        if ( line->d.fmt[i].id==tag_id ) break;
-    if ( i==line->n_fmt ) return -3;                               // the tag is not present in this record
-    bcf_fmt_t *fmt = &line->d.fmt[i];
+    bcf_fmt_t lazy, *fmt = bcf_get_fmt_lazy(line, tag_id, &lazy);
+    if ( !fmt ) return -3;                                         // the tag is not present in this record
 
     int nsmpl = bcf_hdr_nsamples(hdr);
     if ( !*dst )
@@ -3142,6 +3909,22 @@ int bcf_get_format_string(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, c
     return n;
 }
 
+int bcf_get_format_view(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, bcf_fmt_view_t *view)
+{
+    int tag_id = bcf_hdr_id2int(hdr, BCF_DT_ID, tag);
+    if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,tag_id) ) return -1;    // no such FORMAT field in the header
+
+    bcf_fmt_t lazy, *fmt = bcf_get_fmt_lazy(line, tag_id, &lazy);
+    if ( !fmt ) return -3;                                         // the tag is not present in this record
+
+    view->type = fmt->type;
+    view->n    = fmt->n;
+    view->size = fmt->size;
+    view->n_sample = bcf_hdr_nsamples(hdr);
+    view->p    = fmt->p;
+    return view->n_sample;
+}
+
 int bcf_get_format_values(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, void **dst, int *ndst, int type)
 {
     int i,j, tag_id = bcf_hdr_id2int(hdr, BCF_DT_ID, tag);
@@ -3153,12 +3936,8 @@ int bcf_get_format_values(const bcf_hdr_t *hdr, bcf1_t *line, const char *tag, v
     }
     else if ( bcf_hdr_id2type(hdr,BCF_HL_FMT,tag_id)!=type ) return -2;     // expected different type
 
-    if ( !(line->unpacked & BCF_UN_FMT) ) bcf_unpack(line, BCF_UN_FMT);
-
-    for (i=0; i<line->n_fmt; i++)
-        if ( line->d.fmt[i].id==tag_id ) break;
-    if ( i==line->n_fmt ) return -3;                               // the tag is not present in this record
-    bcf_fmt_t *fmt = &line->d.fmt[i];
+    bcf_fmt_t lazy, *fmt = bcf_get_fmt_lazy(line, tag_id, &lazy);
+    if ( !fmt ) return -3;                                         // the tag is not present in this record
 
     if ( type==BCF_HT_STR )
     {
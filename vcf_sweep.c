@@ -22,60 +22,68 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
 FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 DEALINGS IN THE SOFTWARE.  */
 
+#include <assert.h>
 #include "htslib/vcf_sweep.h"
 #include "htslib/bgzf.h"
 
+/*
+    The first forward sweep reads the whole file and records the position of
+    a record roughly every block_size bytes of uncompressed data, splitting
+    the file into chunks of about one BGZF block each.  Backward sweeps then
+    read one chunk at a time, from the last to the first, and hand out its
+    records in reverse order.
+
+    In BGZF-compressed files the positions are virtual offsets, which point to
+    the start of a BGZF block directly, so a chunk is reached by inflating only
+    the blocks it spans.  Its end is found by comparing offsets with the start
+    of the next chunk rather than by re-reading and comparing records.  The
+    block a chunk ends in is the one the following chunk started in, so while
+    sweeping backwards the last few inflated blocks are kept in the BGZF cache.
+    Uncompressed files use plain file offsets.  VCF lines are read straight
+    from the BGZF handle so that the offsets are exact.
+*/
+
 #define SW_FWD 0
 #define SW_BWD 1
+#define SW_CACHE_SIZE (4*BGZF_MAX_BLOCK_SIZE)
 
 struct _bcf_sweep_t
 {
     htsFile *file;
     bcf_hdr_t *hdr;
     BGZF *fp;
+    kstring_t str;          // VCF line buffer
 
     int direction;          // to tell if the direction has changed
     int block_size;         // the size of uncompressed data to hold in memory
     bcf1_t *rec;            // bcf buffer
     int nrec, mrec;         // number of used records; total size of the buffer
-    int lrid, lpos, lnals, lals_len, mlals;   // to check uniqueness of a record
-    char *lals;
 
-    uint64_t *idx;          // uncompressed offsets of VCF/BCF records
+    uint64_t *idx;          // offsets of the first record of each chunk
     int iidx, nidx, midx;   // i: current offset; n: used; m: allocated
     int idx_done;           // the index is built during the first pass
+    int64_t ulast;          // uncompressed offset of the last chunk
 };
 
 BGZF *hts_get_bgzfp(htsFile *fp);
-int hts_useek(htsFile *file, long uoffset, int where);
 long hts_utell(htsFile *file);
 
-static inline int sw_rec_equal(bcf_sweep_t *sw, bcf1_t *rec)
+static inline uint64_t sw_tell(bcf_sweep_t *sw)
+{
+    return sw->fp->is_compressed ? bgzf_tell(sw->fp) : bgzf_utell(sw->fp);
+}
+
+static inline int sw_seek_to(bcf_sweep_t *sw, uint64_t offset)
 {
-    if ( sw->lrid!=rec->rid ) return 0;
-    if ( sw->lpos!=rec->pos ) return 0;
-    if ( sw->lnals!=rec->n_allele ) return 0;
-
-    char *t = rec->d.allele[sw->lnals-1];
-    int len = t - rec->d.allele[0] + 1;
-    while ( *t ) { t++; len++; }
-    if ( sw->lals_len!=len ) return 0;
-    if ( memcmp(sw->lals,rec->d.allele[0],len) ) return 0;
-    return 1;
+    if ( sw->fp->is_compressed ) return bgzf_seek(sw->fp, offset, SEEK_SET) < 0 ? -1 : 0;
+    return bgzf_useek(sw->fp, offset, SEEK_SET);
 }
 
-static void sw_rec_save(bcf_sweep_t *sw, bcf1_t *rec)
+static inline int sw_read(bcf_sweep_t *sw, bcf1_t *rec)
 {
-    sw->lrid  = rec->rid;
-    sw->lpos  = rec->pos;
-    sw->lnals = rec->n_allele;
-
-    char *t = rec->d.allele[sw->lnals-1];
-    int len = t - rec->d.allele[0] + 1;
-    while ( *t ) { t++; len++; }
-    sw->lals_len = len;
-    hts_expand(char, len, sw->mlals, sw->lals);
-    memcpy(sw->lals, rec->d.allele[0], len);
+    if ( sw->file->format.format!=vcf ) return bcf_read1(sw->file, sw->hdr, rec);
+    if ( bgzf_getline(sw->fp, '\n', &sw->str) < 0 ) return -1;
+    return vcf_parse1(&sw->str, sw->hdr, rec);
 }
 
 static void sw_fill_buffer(bcf_sweep_t *sw)
@@ -83,23 +91,17 @@ static void sw_fill_buffer(bcf_sweep_t *sw)
     if ( !sw->iidx ) return;
     sw->iidx--;
 
-    int ret = hts_useek(sw->file, sw->idx[sw->iidx], 0);
+    int ret = sw_seek_to(sw, sw->idx[sw->iidx]);
     assert( ret==0 );
 
+    // the chunk ends where the next one starts
+    uint64_t end = sw->iidx+1 < sw->nidx ? sw->idx[sw->iidx+1] : UINT64_MAX;
     sw->nrec = 0;
-    bcf1_t *rec = &sw->rec[sw->nrec];
-    while ( (ret=bcf_read1(sw->file, sw->hdr, rec))==0 )
+    while ( sw_tell(sw) < end && sw_read(sw, &sw->rec[sw->nrec])==0 )
     {
-        bcf_unpack(rec, BCF_UN_STR);
-
-        // if not in the last block, stop at the saved record
-        if ( sw->iidx+1 < sw->nidx && sw_rec_equal(sw,rec) ) break;
-
         sw->nrec++;
         hts_expand0(bcf1_t, sw->nrec+1, sw->mrec, sw->rec);
-        rec = &sw->rec[sw->nrec];
     }
-    sw_rec_save(sw, &sw->rec[0]);
 }
 
 bcf_sweep_t *bcf_sweep_init(const char *fname)
@@ -107,11 +109,21 @@ bcf_sweep_t *bcf_sweep_init(const char *fname)
     bcf_sweep_t *sw = (bcf_sweep_t*) calloc(1,sizeof(bcf_sweep_t));
     sw->file = hts_open(fname, "r");
     sw->fp   = hts_get_bgzfp(sw->file);
-    bgzf_index_build_init(sw->fp);
-    sw->hdr  = bcf_hdr_read(sw->file);
+    if ( sw->file->format.format==vcf )
+    {
+        // The header is read through the text stream, which reads ahead;
+        // the blocks it spans are indexed so that the records can be
+        // continued from the BGZF handle where the header ends.
+        bgzf_index_build_init(sw->fp);
+        sw->hdr = bcf_hdr_read(sw->file);
+        bgzf_useek(sw->fp, hts_utell(sw->file), SEEK_SET);
+        sw->fp->idx_build_otf = 0;
+    }
+    else
+        sw->hdr = bcf_hdr_read(sw->file);
     sw->mrec = 1;
     sw->rec  = (bcf1_t*) calloc(sw->mrec,(sizeof(bcf1_t)));
-    sw->block_size = 1024*1024*3;
+    sw->block_size = BGZF_MAX_BLOCK_SIZE;
     sw->direction = SW_FWD;
     return sw;
 }
@@ -123,7 +135,7 @@ void bcf_sweep_destroy(bcf_sweep_t *sw)
     for (i=0; i<sw->mrec; i++) bcf_empty1(&sw->rec[i]);
     free(sw->idx);
     free(sw->rec);
-    free(sw->lals);
+    free(sw->str.s);
     bcf_hdr_destroy(sw->hdr);
     hts_close(sw->file);
     free(sw);
@@ -132,8 +144,11 @@ void bcf_sweep_destroy(bcf_sweep_t *sw)
 static void sw_seek(bcf_sweep_t *sw, int direction)
 {
     sw->direction = direction;
+    bgzf_set_cache_size(sw->fp, direction==SW_BWD ? SW_CACHE_SIZE : 0);
     if ( direction==SW_FWD )
-        hts_useek(sw->file, sw->idx[0], 0);
+    {
+        if ( sw->nidx ) sw_seek_to(sw, sw->idx[0]);
+    }
     else
     {
         sw->iidx = sw->nidx;
@@ -145,26 +160,27 @@ bcf1_t *bcf_sweep_fwd(bcf_sweep_t *sw)
 {
     if ( sw->direction==SW_BWD ) sw_seek(sw, SW_FWD);
 
-    long pos = hts_utell(sw->file);
+    uint64_t pos = sw_tell(sw);
+    int64_t upos = bgzf_utell(sw->fp);
 
     bcf1_t *rec = &sw->rec[0];
-    int ret = bcf_read1(sw->file, sw->hdr, rec);
+    int ret = sw_read(sw, rec);
 
     if ( ret!=0 )   // last record, get ready for sweeping backwards
     {
         sw->idx_done = 1;
-        sw->fp->idx_build_otf = 0;
         sw_seek(sw, SW_BWD);
         return NULL;
     }
 
     if ( !sw->idx_done )
     {
-        if ( !sw->nidx || pos - sw->idx[sw->nidx-1] > sw->block_size )
+        if ( !sw->nidx || upos - sw->ulast > (int64_t) sw->block_size )
         {
             sw->nidx++;
             hts_expand(uint64_t, sw->nidx, sw->midx, sw->idx);
             sw->idx[sw->nidx-1] = pos;
+            sw->ulast = upos;
         }
     }
     return rec;
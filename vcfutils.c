@@ -22,7 +22,15 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
 FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 DEALINGS IN THE SOFTWARE.  */
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include "htslib/vcfutils.h"
+#include "htslib/tbx.h"
 
 int bcf_calc_ac(const bcf_hdr_t *header, bcf1_t *line, int *ac, int which)
 {
@@ -673,3 +681,479 @@ void bcf_remove_alleles(const bcf_hdr_t *header, bcf1_t *line, int rm_mask)
     free(map);
 }
 
+
+/*
+ *  Reductions over FORMAT views.  The values of all samples form a single
+ *  contiguous array of n*n_sample elements, so the loops run straight over
+ *  it.  Int8 data, by far the most common (GT and small integers such as
+ *  GQ), is processed sixteen values at a time with SSE2 where available.
+ */
+
+#define VIEW_SKIP(type_t, x, missing, vector_end) ((x)==(type_t)(missing) || (x)==(type_t)(vector_end))
+
+int bcf_fmt_view_count_missing(const bcf_fmt_view_t *view)
+{
+    int i = 0, n = view->n * view->n_sample, nmiss = 0;
+    switch (view->type)
+    {
+        case BCF_BT_INT8:
+        {
+            const int8_t *p = (const int8_t*) view->p;
+#ifdef __SSE2__
+            const __m128i miss = _mm_set1_epi8(bcf_int8_missing);
+            for (; i+16<=n; i+=16)
+            {
+                __m128i x = _mm_loadu_si128((const __m128i*)(p+i));
+                nmiss += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(x, miss)));
+            }
+#endif
+            for (; i<n; i++) nmiss += p[i]==bcf_int8_missing;
+            return nmiss;
+        }
+        case BCF_BT_INT16:
+        {
+            const int16_t *p = (const int16_t*) view->p;
+            for (; i<n; i++) nmiss += p[i]==bcf_int16_missing;
+            return nmiss;
+        }
+        case BCF_BT_INT32:
+        {
+            const int32_t *p = (const int32_t*) view->p;
+            for (; i<n; i++) nmiss += p[i]==bcf_int32_missing;
+            return nmiss;
+        }
+        case BCF_BT_FLOAT:
+        {
+            const uint32_t *p = (const uint32_t*) view->p;
+            for (; i<n; i++) nmiss += p[i]==bcf_float_missing;
+            return nmiss;
+        }
+    }
+    return -1;
+}
+
+#define BRANCH(type_t, missing, vector_end) { \
+    const type_t *p = (const type_t*) view->p; \
+    for (; i<n; i++) \
+    { \
+        if ( VIEW_SKIP(type_t, p[i], missing, vector_end) ) continue; \
+        if ( nval++ == 0 ) imin = imax = p[i]; \
+        else if ( p[i] < imin ) imin = p[i]; \
+        else if ( p[i] > imax ) imax = p[i]; \
+    } \
+}
+int bcf_fmt_view_minmax(const bcf_fmt_view_t *view, double *min, double *max)
+{
+    int i = 0, n = view->n * view->n_sample, nval = 0;
+    int32_t imin = 0, imax = 0;
+    switch (view->type)
+    {
+        case BCF_BT_INT8:
+#ifdef __SSE2__
+            if ( n>=16 )
+            {
+                // Flip the sign bit so that the values compare as unsigned
+                // bytes: missing becomes 0 and vector_end 1
+                const __m128i bias = _mm_set1_epi8((char)0x80), zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+                __m128i vmin = _mm_set1_epi8((char)0xff), vmax = zero;
+                uint8_t bmin[16], bmax[16];
+                int j;
+                for (; i+16<=n; i+=16)
+                {
+                    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(view->p+i)), bias);
+                    __m128i skip = _mm_or_si128(_mm_cmpeq_epi8(x, zero), _mm_cmpeq_epi8(x, one));
+                    vmin = _mm_min_epu8(vmin, _mm_or_si128(x, skip));
+                    vmax = _mm_max_epu8(vmax, _mm_andnot_si128(skip, x));
+                    nval += 16 - __builtin_popcount(_mm_movemask_epi8(skip));
+                }
+                _mm_storeu_si128((__m128i*)bmin, vmin);
+                _mm_storeu_si128((__m128i*)bmax, vmax);
+                imin = 255, imax = 0;
+                for (j=0; j<16; j++)
+                {
+                    if ( bmin[j] < imin ) imin = bmin[j];
+                    if ( bmax[j] > imax ) imax = bmax[j];
+                }
+                imin -= 128, imax -= 128;
+            }
+#endif
+            BRANCH(int8_t, bcf_int8_missing, bcf_int8_vector_end);
+            break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_missing, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_missing, bcf_int32_vector_end); break;
+        case BCF_BT_FLOAT:
+        {
+            const float *p = (const float*) view->p;
+            float fmin = 0, fmax = 0;
+            for (; i<n; i++)
+            {
+                if ( bcf_float_is_missing(p[i]) || bcf_float_is_vector_end(p[i]) ) continue;
+                if ( nval++ == 0 ) fmin = fmax = p[i];
+                else if ( p[i] < fmin ) fmin = p[i];
+                else if ( p[i] > fmax ) fmax = p[i];
+            }
+            *min = fmin, *max = fmax;
+            return nval;
+        }
+        default: return -1;
+    }
+    *min = imin, *max = imax;
+    return nval;
+}
+#undef BRANCH
+
+#define BRANCH(type_t, missing, vector_end) { \
+    const type_t *p = (const type_t*) view->p; \
+    for (; i<n; i++) \
+        if ( !VIEW_SKIP(type_t, p[i], missing, vector_end) ) isum += p[i], nval++; \
+}
+int bcf_fmt_view_sum(const bcf_fmt_view_t *view, double *sum)
+{
+    int i = 0, n = view->n * view->n_sample, nval = 0;
+    int64_t isum = 0;
+    switch (view->type)
+    {
+        case BCF_BT_INT8:
+#ifdef __SSE2__
+            {
+                // Sum the values biased by +128, with missing and
+                // vector_end zeroed, eight bytes at a time with psadbw
+                const __m128i bias = _mm_set1_epi8((char)0x80), zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+                __m128i acc = zero;
+                int64_t lanes[2];
+                int nsimd = 0;
+                for (; i+16<=n; i+=16)
+                {
+                    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(view->p+i)), bias);
+                    __m128i skip = _mm_or_si128(_mm_cmpeq_epi8(x, zero), _mm_cmpeq_epi8(x, one));
+                    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_andnot_si128(skip, x), zero));
+                    nsimd += 16 - __builtin_popcount(_mm_movemask_epi8(skip));
+                }
+                _mm_storeu_si128((__m128i*)lanes, acc);
+                isum = lanes[0] + lanes[1] - 128 * (int64_t)nsimd;
+                nval = nsimd;
+            }
+#endif
+            BRANCH(int8_t, bcf_int8_missing, bcf_int8_vector_end);
+            break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_missing, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_missing, bcf_int32_vector_end); break;
+        case BCF_BT_FLOAT:
+        {
+            const float *p = (const float*) view->p;
+            double fsum = 0;
+            for (; i<n; i++)
+                if ( !bcf_float_is_missing(p[i]) && !bcf_float_is_vector_end(p[i]) ) fsum += p[i], nval++;
+            *sum = fsum;
+            return nval;
+        }
+        default: return -1;
+    }
+    *sum = isum;
+    return nval;
+}
+#undef BRANCH
+
+#define BRANCH(type_t, vector_end) { \
+    const type_t *p = (const type_t*) view->p + (int64_t)s*view->n; \
+    for (; s<view->n_sample; s++, p+=view->n) \
+    { \
+        int j, d = 0; \
+        for (j=0; j<view->n; j++) \
+        { \
+            if ( p[j]==(type_t)(vector_end) ) break; \
+            if ( (p[j]>>1) <= 0 ) { d = -1; break; } /* missing allele */ \
+            if ( p[j]>>1 > 1 ) d++;                 /* non-reference allele */ \
+        } \
+        dosage[s] = d; \
+    } \
+}
+int bcf_fmt_view_dosage(const bcf_fmt_view_t *view, int8_t *dosage)
+{
+    int s = 0;
+    switch (view->type)
+    {
+        case BCF_BT_INT8:
+#ifdef __SSE2__
+            if ( view->n==2 )
+            {
+                // Diploid genotypes, eight samples at a time; the allele
+                // index of each byte is (x>>1)-1, negative values other
+                // than vector_end count as missing
+                const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+                const __m128i vend = _mm_set1_epi8(bcf_int8_vector_end), low7 = _mm_set1_epi8(0x7f), lo = _mm_set1_epi16(0xff);
+                for (; s+8<=view->n_sample; s+=8)
+                {
+                    __m128i x = _mm_loadu_si128((const __m128i*)(view->p+2*s));
+                    __m128i is_end = _mm_cmpeq_epi8(x, vend);
+                    __m128i neg = _mm_cmpgt_epi8(zero, x);
+                    __m128i a = _mm_and_si128(_mm_srli_epi16(x, 1), low7);
+                    __m128i miss = _mm_andnot_si128(is_end, _mm_or_si128(neg, _mm_cmpeq_epi8(a, zero)));
+                    __m128i alt  = _mm_and_si128(_mm_andnot_si128(neg, _mm_cmpgt_epi8(a, one)), one);
+                    __m128i d = _mm_add_epi16(_mm_and_si128(alt, lo), _mm_srli_epi16(alt, 8));
+                    __m128i m = _mm_cmpgt_epi16(_mm_and_si128(_mm_or_si128(miss, _mm_srli_epi16(miss, 8)), lo), _mm_setzero_si128());
+                    _mm_storel_epi64((__m128i*)(dosage+s), _mm_packs_epi16(_mm_or_si128(d, m), zero));
+                }
+            }
+#endif
+            BRANCH(int8_t, bcf_int8_vector_end);
+            break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_vector_end); break;
+        default: return -1;
+    }
+    return view->n_sample;
+}
+#undef BRANCH
+#undef VIEW_SKIP
+
+#define GT_ROUNDUP64(x) (((size_t)(x) + 63) & ~(size_t)63)
+
+static void gt_matrix_strides(int n_sample, int bits, size_t *dosage_stride, size_t *mask_stride)
+{
+    *dosage_stride = GT_ROUNDUP64(bits==BCF_GT_2BIT ? (n_sample+3)/4 : n_sample);
+    *mask_stride   = GT_ROUNDUP64((n_sample+7)/8);
+}
+
+size_t bcf_gt_matrix_size(int n_sample, int m_variant, int bits)
+{
+    size_t dstride, mstride;
+    gt_matrix_strides(n_sample, bits, &dstride, &mstride);
+    return (size_t)m_variant * (dstride + 2*mstride)
+        + 2 * GT_ROUNDUP64((size_t)m_variant * sizeof(int32_t))
+        + (bits==BCF_GT_2BIT ? GT_ROUNDUP64(n_sample) : 0);
+}
+
+int bcf_gt_matrix_init(bcf_gt_matrix_t *mat, int n_sample, int m_variant, int bits, void *buf)
+{
+    memset(mat, 0, sizeof(*mat));
+    if ( n_sample<0 || m_variant<=0 || (bits!=BCF_GT_2BIT && bits!=BCF_GT_INT8) ) return -1;
+    if ( (uintptr_t)buf & 63 ) return -1;
+    size_t size = bcf_gt_matrix_size(n_sample, m_variant, bits);
+    if ( !buf )
+    {
+        if ( posix_memalign(&mat->mem, 64, size ? size : 64) ) return -1;
+        buf = mat->mem;
+    }
+    memset(buf, 0, size);
+
+    uint8_t *p = (uint8_t*) buf;
+    mat->n_sample = n_sample;
+    mat->m_variant = m_variant;
+    mat->bits = bits;
+    gt_matrix_strides(n_sample, bits, &mat->dosage_stride, &mat->mask_stride);
+    mat->dosage  = p; p += m_variant * mat->dosage_stride;
+    mat->phased  = p; p += m_variant * mat->mask_stride;
+    mat->missing = p; p += m_variant * mat->mask_stride;
+    mat->rid = (int32_t*) p; p += GT_ROUNDUP64((size_t)m_variant * sizeof(int32_t));
+    mat->pos = (int32_t*) p; p += GT_ROUNDUP64((size_t)m_variant * sizeof(int32_t));
+    if ( bits==BCF_GT_2BIT ) mat->tmp = (int8_t*) p;
+    return 0;
+}
+
+void bcf_gt_matrix_destroy(bcf_gt_matrix_t *mat)
+{
+    free(mat->mem);
+    memset(mat, 0, sizeof(*mat));
+}
+
+#define BRANCH(type_t, vector_end) { \
+    const type_t *p = (const type_t*) view->p + (int64_t)s*view->n; \
+    for (; s<view->n_sample; s++, p+=view->n) \
+    { \
+        int j; \
+        if ( view->n<2 || p[1]==(type_t)(vector_end) ) continue; /* haploid */ \
+        for (j=1; j<view->n && p[j]!=(type_t)(vector_end); j++) \
+            if ( !(p[j]&1) ) break; \
+        if ( j==view->n || p[j]==(type_t)(vector_end) ) phased[s>>3] |= 1<<(s&7); \
+    } \
+}
+static void gt_view_phased(const bcf_fmt_view_t *view, uint8_t *phased)
+{
+    int s = 0;
+    switch (view->type)
+    {
+        case BCF_BT_INT8:
+#ifdef __SSE2__
+            if ( view->n==2 )
+            {
+                // Sixteen diploid samples at a time: the phase bit of the
+                // second allele, unless it is vector_end
+                const __m128i one = _mm_set1_epi8(1), vend = _mm_set1_epi8(bcf_int8_vector_end);
+                for (; s+16<=view->n_sample; s+=16)
+                {
+                    __m128i x0 = _mm_loadu_si128((const __m128i*)(view->p+2*s));
+                    __m128i x1 = _mm_loadu_si128((const __m128i*)(view->p+2*s+16));
+                    __m128i p0 = _mm_andnot_si128(_mm_cmpeq_epi8(x0, vend), _mm_and_si128(x0, one));
+                    __m128i p1 = _mm_andnot_si128(_mm_cmpeq_epi8(x1, vend), _mm_and_si128(x1, one));
+                    p0 = _mm_cmpgt_epi16(_mm_srli_epi16(p0, 8), _mm_setzero_si128());
+                    p1 = _mm_cmpgt_epi16(_mm_srli_epi16(p1, 8), _mm_setzero_si128());
+                    int mask = _mm_movemask_epi8(_mm_packs_epi16(p0, p1));
+                    phased[s>>3] = mask & 0xff;
+                    phased[(s>>3)+1] = mask >> 8;
+                }
+            }
+#endif
+            BRANCH(int8_t, bcf_int8_vector_end);
+            break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_vector_end); break;
+    }
+}
+#undef BRANCH
+
+// Set the bits of the samples with a negative dosage
+static void gt_dosage_missing(const int8_t *dosage, int n, uint8_t *missing)
+{
+    int s = 0;
+#ifdef __SSE2__
+    for (; s+16<=n; s+=16)
+    {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(dosage+s)));
+        missing[s>>3] = mask & 0xff;
+        missing[(s>>3)+1] = mask >> 8;
+    }
+#endif
+    for (; s<n; s++)
+        if ( dosage[s]<0 ) missing[s>>3] |= 1<<(s&7);
+}
+
+// Pack the dosages into two bits per sample: capped at 2, 3 for missing
+static void gt_dosage_pack2(const int8_t *dosage, int n, uint8_t *out)
+{
+    int s = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi8(2), three = _mm_set1_epi8(3);
+    const __m128i lo = _mm_set1_epi32(0xff);
+    for (; s+16<=n; s+=16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(dosage+s));
+        __m128i v = _mm_or_si128(_mm_min_epu8(x, two), _mm_and_si128(_mm_cmpgt_epi8(zero, x), three));
+        // gather the four two-bit values of each 32-bit lane into its low byte
+        v = _mm_or_si128(_mm_or_si128(v, _mm_srli_epi32(v, 6)), _mm_or_si128(_mm_srli_epi32(v, 12), _mm_srli_epi32(v, 18)));
+        v = _mm_and_si128(v, lo);
+        v = _mm_packus_epi16(_mm_packs_epi32(v, zero), zero);
+        int32_t packed = _mm_cvtsi128_si32(v);
+        memcpy(out + s/4, &packed, 4);
+    }
+#endif
+    for (; s<n; s++)
+    {
+        int d = dosage[s]<0 ? 3 : (dosage[s]>2 ? 2 : dosage[s]);
+        out[s>>2] |= d << 2*(s&3);
+    }
+}
+
+int bcf_gt_matrix_add(bcf_gt_matrix_t *mat, const bcf_hdr_t *hdr, bcf1_t *rec)
+{
+    if ( mat->n_variant >= mat->m_variant || bcf_hdr_nsamples(hdr)!=mat->n_sample ) return -1;
+
+    int i = mat->n_variant, n = mat->n_sample;
+    uint8_t *dosage  = mat->dosage  + i*mat->dosage_stride;
+    uint8_t *phased  = mat->phased  + i*mat->mask_stride;
+    uint8_t *missing = mat->missing + i*mat->mask_stride;
+    int8_t *d8 = mat->bits==BCF_GT_INT8 ? (int8_t*)dosage : mat->tmp;
+    memset(dosage, 0, mat->dosage_stride);
+    memset(phased, 0, mat->mask_stride);
+    memset(missing, 0, mat->mask_stride);
+
+    bcf_fmt_view_t gt;
+    if ( bcf_get_format_view(hdr, rec, "GT", &gt)==n && bcf_fmt_view_dosage(&gt, d8)==n )
+        gt_view_phased(&gt, phased);
+    else
+        memset(d8, -1, n);
+    gt_dosage_missing(d8, n, missing);
+    if ( mat->bits==BCF_GT_2BIT ) gt_dosage_pack2(d8, n, dosage);
+
+    mat->rid[i] = rec->rid;
+    mat->pos[i] = rec->pos;
+    return mat->n_variant++;
+}
+
+struct _bcf_gt_reader_t
+{
+    htsFile *fp;
+    bcf_hdr_t *hdr;
+    bcf1_t *rec;
+    hts_idx_t *idx;     // BCF index, for regions
+    tbx_t *tbx;         // VCF index, for regions
+    hts_itr_t *itr;
+    kstring_t str;
+};
+
+bcf_gt_reader_t *bcf_gt_reader_open(const char *fname, const char *region, const char *samples, int n_threads)
+{
+    bcf_gt_reader_t *r = (bcf_gt_reader_t*) calloc(1, sizeof(bcf_gt_reader_t));
+    if ( !r ) return NULL;
+    if ( !(r->fp = hts_open(fname, "r")) ) goto fail;
+    if ( !(r->hdr = bcf_hdr_read(r->fp)) ) goto fail;
+    if ( samples && bcf_hdr_set_samples(r->hdr, samples, 0)!=0 )
+    {
+        fprintf(stderr, "[%s] could not select the samples \"%s\" of %s\n", __func__, samples, fname);
+        goto fail;
+    }
+    r->rec = bcf_init1();
+    if ( region )
+    {
+        if ( r->fp->format.format==bcf )
+        {
+            if ( (r->idx = bcf_index_load(fname)) ) r->itr = bcf_itr_querys(r->idx, r->hdr, region);
+        }
+        else if ( (r->tbx = tbx_index_load(fname)) ) r->itr = tbx_itr_querys(r->tbx, region);
+        if ( !r->itr )
+        {
+            fprintf(stderr, "[%s] could not query the region \"%s\" of %s\n", __func__, region, fname);
+            goto fail;
+        }
+    }
+    else if ( n_threads>1 && r->fp->format.format==vcf && hts_set_threads(r->fp, n_threads)!=0 ) goto fail;
+    return r;
+
+fail:
+    bcf_gt_reader_close(r);
+    return NULL;
+}
+
+const bcf_hdr_t *bcf_gt_reader_header(bcf_gt_reader_t *r)
+{
+    return r->hdr;
+}
+
+static int gt_reader_read(bcf_gt_reader_t *r)
+{
+    int ret;
+    if ( !r->itr ) return bcf_read(r->fp, r->hdr, r->rec);
+    if ( r->tbx )
+    {
+        if ( (ret = tbx_itr_next(r->fp, r->tbx, r->itr, &r->str)) < 0 ) return ret;
+        return vcf_parse(&r->str, r->hdr, r->rec) < 0 ? -2 : 0;
+    }
+    if ( (ret = bcf_itr_next(r->fp, r->itr, r->rec)) < 0 ) return ret;
+    return bcf_subset_format(r->hdr, r->rec);
+}
+
+int bcf_gt_reader_next(bcf_gt_reader_t *r, bcf_gt_matrix_t *mat)
+{
+    if ( mat->n_sample!=bcf_hdr_nsamples(r->hdr) ) return -1;
+    mat->n_variant = 0;
+    while ( mat->n_variant < mat->m_variant )
+    {
+        int ret = gt_reader_read(r);
+        if ( ret==-1 ) break;
+        if ( ret<0 ) return -1;
+        if ( bcf_gt_matrix_add(mat, r->hdr, r->rec)<0 ) return -1;
+    }
+    return mat->n_variant;
+}
+
+void bcf_gt_reader_close(bcf_gt_reader_t *r)
+{
+    if ( r->itr ) hts_itr_destroy(r->itr);
+    if ( r->idx ) hts_idx_destroy(r->idx);
+    if ( r->tbx ) tbx_destroy(r->tbx);
+    if ( r->rec ) bcf_destroy1(r->rec);
+    if ( r->hdr ) bcf_hdr_destroy(r->hdr);
+    if ( r->fp ) hts_close(r->fp);
+    free(r->str.s);
+    free(r);
+}
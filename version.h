@@ -0,0 +1 @@
+#define HTS_VERSION "09e1041-dirty"